@@ -6,6 +6,10 @@
 #include <FEHServo.h>
 #include <FEHSD.h>
 #include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
 #include <FEHBattery.h>
 
 
@@ -48,12 +52,306 @@ float bumpY;
 float ambient;
 float redDiff;
 
+/*
+ * Hand-tuned constants of the course, gathered into one named parameter vector so they can be retuned
+ * (by hand or by an offline optimizer) from PARAMS_FILE on the SD card without reflashing.
+ * Each line of the file is "<name> <value>", unknown names are ignored. The defaults below are the values
+ * the course was tuned with, and the vector used for every run is written to the run history.
+ */
+#define PARAMS_FILE "params.txt"
+#define MAX_PARAM_NAME 32
+
+enum ParamId {
+    P_HEADING_KP,
+    P_HEADING_KD,
+    P_HEADING_TOLERANCE,
+    P_AXIS_TOLERANCE,
+    P_Y_TOLERANCE,
+    P_DDR_RED_PRESS,
+    P_DDR_BLUE_TURN,
+    P_DDR_BLUE_PRESS,
+    P_RPS_BUTTON_X,
+    P_RPS_BUTTON_HOLD,
+    P_RAMP_PERCENT,
+    P_RAMP_DISTANCE,
+    P_FOOSBALL_PERCENT,
+    P_FOOSBALL_DISTANCE,
+    P_FOOSBALL_GRIP,
+    P_FOOSBALL_PULL,
+    P_FOOSBALL_PULL2,
+    P_LEVER_HEADING,
+    P_TOKEN_TURN,
+    P_TOKEN_PUSH,
+    P_TOKEN_X,
+    P_HOLD_KP,
+    P_HOLD_KI,
+    PARAM_COUNT
+};
+
+/*
+ * A tuned constant: its name in PARAMS_FILE and its current value.
+ */
+struct Param {
+    const char *name;
+    float value;
+};
+
+Param params[PARAM_COUNT] = {
+    { "headingKp", 0.8 },           // Turn power, in percent per degree of heading error
+    { "headingKd", 0.06 },          // Turn power, in percent per degree/second of error rate
+    { "headingTolerance", 1.0 },    // Degrees
+    { "axisTolerance", 0.2 },       // Inches, for the RPS position corrections
+    { "yTolerance", 0.1 },          // Inches, for RPS_Y_inc_abs (was 0.2 before 4/3)
+    { "ddrRedPress", 5700 },        // ms
+    { "ddrBlueTurn", 90.0 },        // Degrees, 0 to 270 (was 106 before the turn model)
+    { "ddrBluePress", 6000 },       // ms
+    { "rpsButtonX", 30.5 },
+    { "rpsButtonHold", 5500 },      // ms
+    { "rampPercent", 80 },
+    { "rampDistance", 25.0 },
+    { "foosballPercent", 90 },      // Was 70% power before 4/4
+    { "foosballDistance", 12.5 },
+    { "foosballGrip", 168.0 },      // Lever servo degrees
+    { "foosballPull", 6.0 },        // Was 30
+    { "foosballPull2", 5.0 },       // Was 50 and 6.5
+    { "leverHeading", 306.1 },      // Originally 315.0 and 308.0
+    { "tokenTurn", 90.0 },          // 270 to 180 (was 100 before the turn model)
+    { "tokenPush", 1600 },          // ms (was 2000)
+    { "tokenX", 8.8 },
+    { "holdKp", 1.5 },              // Steering power of straight drives, in percent per degree off the start heading
+    { "holdKi", 4.0 }               // and in percent per degree-second, to take out a steady pull to one side
+};
+
+// Number of parameters PARAMS_FILE changed.
+int paramsLoaded;
+
+/*
+ * Given a parameter (@param index), returns its current value.
+ * @Returns [parameter value]
+ */
+float param(int index) {
+    return params[index].value;
+}
+
+/*
+ * Reads PARAMS_FILE from the SD card and overrides the matching parameters. If the file is missing
+ * every parameter keeps its default.
+ */
+void loadParams() {
+    paramsLoaded = 0;
+
+    FEHFile *file = SD.FOpen(PARAMS_FILE, "r");
+    if (file == 0) {
+        return;
+    }
+
+    char name[MAX_PARAM_NAME];
+    float value;
+    while (!SD.FEof(file) && SD.FScanf(file, "%31s %f", name, &value) == 2) {
+        for (int i = 0; i < PARAM_COUNT; i++) {
+            if (strcmp(name, params[i].name) == 0) {
+                params[i].value = value;
+                paramsLoaded++;
+            }
+        }
+    }
+
+    SD.FClose(file);
+}
+
+// Q16.16 fixed point numbers for the control hot paths. The MK60DZ10 has no FPU, so every float/double
+// operation is emulated in software, while these only need integer multiplies and shifts.
+typedef int32_t fixed;
+#define FIXED_ONE 65536
+// Converts a constant to fixed point at compile time.
+#define FIXED(x) ((fixed)((x) * 65536.0 + ((x) < 0 ? -0.5 : 0.5)))
+
+// Robot geometry. These start at the nominal WHEEL_RADIUS and ROBOT_RADIUS and are replaced by the
+// values measured with calibrateGeometry when GEOMETRY_FILE is on the SD card.
+float leftWheelRadius = WHEEL_RADIUS;
+float rightWheelRadius = WHEEL_RADIUS;
+// Half the effective distance between the wheels, which is what a turn pivots about.
+float turnRadius = ROBOT_RADIUS;
+
+// Unit conversions for the geometry above, recomputed by setGeometry.
+fixed leftInchesPerCount = FIXED(2 * PI * WHEEL_RADIUS / COUNTS_PER_REV);
+fixed rightInchesPerCount = FIXED(2 * PI * WHEEL_RADIUS / COUNTS_PER_REV);
+// Averaged over the two wheels, for the distances that are counted on both encoders.
+fixed inchesPerCount = FIXED(2 * PI * WHEEL_RADIUS / COUNTS_PER_REV);
+fixed countsPerInch = FIXED(COUNTS_PER_REV / (2 * PI * WHEEL_RADIUS));
+fixed countsPerDegree = FIXED(ROBOT_RADIUS * PI / 180 * COUNTS_PER_REV / (2 * PI * WHEEL_RADIUS));
+// Heading change (in degrees) per inch of difference between the right and left wheel travel.
+fixed degreesPerInch = FIXED(180 / (PI * 2 * ROBOT_RADIUS));
+
+// sin of 0 to 90 degrees in 1 degree steps, in fixed point.
+const fixed sinTable[91] = {
+    0, 1144, 2287, 3430, 4572, 5712, 6850, 7987,
+    9121, 10252, 11380, 12505, 13626, 14742, 15855, 16962,
+    18064, 19161, 20252, 21336, 22415, 23486, 24550, 25607,
+    26656, 27697, 28729, 29753, 30767, 31772, 32768, 33754,
+    34729, 35693, 36647, 37590, 38521, 39441, 40348, 41243,
+    42126, 42995, 43852, 44695, 45525, 46341, 47143, 47930,
+    48703, 49461, 50203, 50931, 51643, 52339, 53020, 53684,
+    54332, 54963, 55578, 56175, 56756, 57319, 57865, 58393,
+    58903, 59396, 59870, 60326, 60764, 61183, 61584, 61966,
+    62328, 62672, 62997, 63303, 63589, 63856, 64104, 64332,
+    64540, 64729, 64898, 65048, 65177, 65287, 65376, 65446,
+    65496, 65526, 65536
+};
+
+// atan of i/32 for i = 0 to 32, in fixed point degrees.
+const fixed atanTable[33] = {
+    0, 117304, 234379, 350999, 466945, 582003, 695970, 808654,
+    919879, 1029481, 1137313, 1243245, 1347161, 1448965, 1548575, 1645926,
+    1740967, 1833663, 1923990, 2011937, 2097505, 2180703, 2261551, 2340074,
+    2416306, 2490285, 2562055, 2631664, 2699161, 2764600, 2828035, 2889523,
+    2949120
+};
+
+/*
+ * Given two fixed point numbers (@param a, @param b), multiplies them.
+ * @Returns [a * b in fixed point]
+ */
+inline fixed fixedMul(fixed a, fixed b) {
+    return (fixed)(((int64_t)a * b) >> 16);
+}
+
+/*
+ * Given two fixed point numbers (@param a, @param b), divides them.
+ * @Returns [a / b in fixed point]
+ */
+inline fixed fixedDiv(fixed a, fixed b) {
+    return (fixed)(((int64_t)a << 16) / b);
+}
+
+/*
+ * Given a float (@param value), converts it to fixed point.
+ * @Returns [value in fixed point]
+ */
+inline fixed toFixed(float value) {
+    return (fixed)(value * 65536.0f);
+}
+
+/*
+ * Given a fixed point number (@param value), converts it to a float.
+ * @Returns [value as a float]
+ */
+inline float fromFixed(fixed value) {
+    return value / 65536.0f;
+}
+
+/*
+ * Given an angle in fixed point degrees (@param degrees), wraps it into the range (-180, 180].
+ * @Returns [equivalent fixed point angle between -180 and 180 degrees]
+ */
+fixed wrapFixed(fixed degrees) {
+    while (degrees > FIXED(180)) {
+        degrees -= FIXED(360);
+    }
+    while (degrees <= FIXED(-180)) {
+        degrees += FIXED(360);
+    }
+    return degrees;
+}
+
+/*
+ * Given an angle in fixed point degrees (@param degrees), returns its sine from the lookup table with linear interpolation.
+ * @Returns [sine of the angle in fixed point]
+ */
+fixed fixedSin(fixed degrees) {
+    while (degrees < 0) {
+        degrees += FIXED(360);
+    }
+    while (degrees >= FIXED(360)) {
+        degrees -= FIXED(360);
+    }
+
+    bool negative = degrees >= FIXED(180);
+    if (negative) {
+        degrees -= FIXED(180);
+    }
+    if (degrees > FIXED(90)) {
+        degrees = FIXED(180) - degrees;
+    }
+
+    int index = degrees >> 16;
+    fixed fraction = degrees & 0xFFFF;
+    fixed value = sinTable[index];
+    if (index < 90) {
+        value += fixedMul(sinTable[index + 1] - sinTable[index], fraction);
+    }
+    return negative ? -value : value;
+}
+
+/*
+ * Given an angle in fixed point degrees (@param degrees), returns its cosine.
+ * @Returns [cosine of the angle in fixed point]
+ */
+fixed fixedCos(fixed degrees) {
+    return fixedSin(degrees + FIXED(90));
+}
+
+/*
+ * Given a fixed point y and x (@param y, @param x), returns the angle of the vector in degrees,
+ * using the atan lookup table for the first octant and symmetry for the rest.
+ * @Returns [fixed point angle between -180 and 180 degrees]
+ */
+fixed fixedAtan2(fixed y, fixed x) {
+    if (x == 0 && y == 0) {
+        return 0;
+    }
+
+    fixed ax = x < 0 ? -x : x;
+    fixed ay = y < 0 ? -y : y;
+    bool swapped = ay > ax;
+    fixed ratio = swapped ? fixedDiv(ax, ay) : fixedDiv(ay, ax);
+
+    // ratio is between 0 and 1, look it up in 1/32 steps
+    int index = ratio >> 11;
+    fixed fraction = (ratio & 0x7FF) << 5;
+    fixed angle = atanTable[index];
+    if (index < 32) {
+        angle += fixedMul(atanTable[index + 1] - atanTable[index], fraction);
+    }
+
+    if (swapped) {
+        angle = FIXED(90) - angle;
+    }
+    if (x < 0) {
+        angle = FIXED(180) - angle;
+    }
+    return y < 0 ? -angle : angle;
+}
+
+/*
+ * Given two fixed point numbers (@param x, @param y), returns the length of the vector using an integer square root.
+ * @Returns [sqrt(x * x + y * y) in fixed point]
+ */
+fixed fixedHypot(fixed x, fixed y) {
+    uint64_t square = (uint64_t)((int64_t)x * x) + (uint64_t)((int64_t)y * y);
+    uint64_t root = 0;
+    uint64_t bit = (uint64_t)1 << 62;
+    while (bit > square) {
+        bit >>= 2;
+    }
+    while (bit != 0) {
+        if (square >= root + bit) {
+            square -= root + bit;
+            root = (root >> 1) + bit;
+        } else {
+            root >>= 1;
+        }
+        bit >>= 2;
+    }
+    return (fixed)root;
+}
+
 /*
  * Given a distance in inches (@param inches), returns the theoretical counts.
  * @Returns [theoretical counts for a desired distance]
  */
 int theoreticalCounts(float inches) {
-    int counts = (inches * COUNTS_PER_REV) / (2 * PI * WHEEL_RADIUS);
+    int counts = fixedMul(toFixed(inches), countsPerInch) >> 16;
     return counts;
 }
 
@@ -62,862 +360,3308 @@ int theoreticalCounts(float inches) {
  * @Returns [theoretical counts for a desired angle]
  */
 int theoreticalDegree(float degrees) {
-    float radians = degrees * PI / 180;
-    float arclength = ROBOT_RADIUS * radians;
-    return theoreticalCounts(arclength);
+    int counts = fixedMul(toFixed(degrees), countsPerDegree) >> 16;
+    return counts;
+}
+
+// Geometry measured by calibrateGeometry, as "<left wheel radius> <right wheel radius> <turn radius>" in inches.
+#define GEOMETRY_FILE "geometry.txt"
+// Whether the geometry was loaded from GEOMETRY_FILE, shown before the run.
+bool geometryLoaded = false;
+
+/*
+ * Sets the wheel radii (@param left, @param right) and the turn radius (@param turn), all in inches,
+ * and recomputes the unit conversions from them.
+ */
+void setGeometry(float left, float right, float turn) {
+    leftWheelRadius = left;
+    rightWheelRadius = right;
+    turnRadius = turn;
+    float leftInches = 2 * PI * left / COUNTS_PER_REV;
+    float rightInches = 2 * PI * right / COUNTS_PER_REV;
+    leftInchesPerCount = toFixed(leftInches);
+    rightInchesPerCount = toFixed(rightInches);
+    inchesPerCount = toFixed((leftInches + rightInches) / 2);
+    float counts = (1 / leftInches + 1 / rightInches) / 2;
+    countsPerInch = toFixed(counts);
+    countsPerDegree = toFixed(turn * PI / 180 * counts);
+    degreesPerInch = toFixed(180 / (PI * 2 * turn));
+}
+
+/*
+ * Loads the geometry from GEOMETRY_FILE, keeping the nominal geometry if there is no file or
+ * the values in it are implausible.
+ */
+void loadGeometry() {
+    FEHFile *file = SD.FOpen(GEOMETRY_FILE, "r");
+    if (file == 0) {
+        return;
+    }
+    float left, right, turn;
+    if (SD.FScanf(file, "%f %f %f", &left, &right, &turn) == 3
+            && left > WHEEL_RADIUS * 0.7 && left < WHEEL_RADIUS * 1.3
+            && right > WHEEL_RADIUS * 0.7 && right < WHEEL_RADIUS * 1.3
+            && turn > ROBOT_RADIUS * 0.6 && turn < ROBOT_RADIUS * 1.5) {
+        setGeometry(left, right, turn);
+        geometryLoaded = true;
+    }
+    SD.FClose(file);
+}
+
+/*
+ * Saves the current geometry to GEOMETRY_FILE.
+ */
+void saveGeometry() {
+    FEHFile *file = SD.FOpen(GEOMETRY_FILE, "w");
+    if (file == 0) {
+        return;
+    }
+    SD.FPrintf(file, "%f %f %f\n", leftWheelRadius, rightWheelRadius, turnRadius);
+    SD.FClose(file);
+}
+
+// Scheduler tick and periods of the periodic jobs, in milliseconds.
+#define SCHEDULER_TICK 2
+#define SAMPLE_PERIOD 2
+#define CONTROL_PERIOD 5
+#define LOG_PERIOD 20
+#define MAX_JOBS 10
+
+/*
+ * A periodic job run by the cooperative scheduler, with its measured timing statistics.
+ * Jitter is how late (in ms) the job started compared to when it was due. An overrun is a period that was skipped entirely.
+ */
+struct Job {
+    const char *name;
+    void (*run)();
+    unsigned int period;
+    unsigned int nextRun;
+    unsigned int maxJitter;
+    int overruns;
+    int runs;
+};
+
+Job jobs[MAX_JOBS];
+int jobCount;
+unsigned int nextTick;
+
+// Total time (in ms) spent waiting in waitMs, used to split a primitive's time into working and idle.
+unsigned int idleTime;
+
+/*
+ * Reads the hardware millisecond clock.
+ * @Returns [milliseconds since the robot was turned on]
+ */
+unsigned int hardwareClock() {
+    return TimeNowMSec();
+}
+
+// Clock used by the scheduler. Can be pointed at a simulated clock so timing can be stepped on a host.
+unsigned int (*schedulerClock)() = hardwareClock;
+
+/*
+ * Given a name (@param name), a job function (@param run) and its period in ms (@param period), adds a periodic job.
+ */
+void addJob(const char *name, void (*run)(), unsigned int period) {
+    if (jobCount >= MAX_JOBS) {
+        return;
+    }
+    Job *job = &jobs[jobCount++];
+    job->name = name;
+    job->run = run;
+    job->period = period;
+    job->nextRun = schedulerClock();
+    job->maxJitter = 0;
+    job->overruns = 0;
+    job->runs = 0;
+}
+
+/*
+ * Waits for the next scheduler tick, then runs every job that is due. Jobs that fell more than a period behind
+ * count an overrun and are rescheduled from now instead of running several times to catch up.
+ */
+void schedulerTick() {
+    while ((int)(schedulerClock() - nextTick) < 0);
+    unsigned int now = schedulerClock();
+    nextTick = now + SCHEDULER_TICK;
+
+    for (int i = 0; i < jobCount; i++) {
+        Job *job = &jobs[i];
+        if ((int)(now - job->nextRun) < 0) {
+            continue;
+        }
+
+        unsigned int jitter = now - job->nextRun;
+        if (jitter > job->maxJitter) {
+            job->maxJitter = jitter;
+        }
+
+        job->run();
+        job->runs++;
+
+        job->nextRun += job->period;
+        if ((int)(now - job->nextRun) >= 0) {
+            job->overruns++;
+            job->nextRun = now + job->period;
+        }
+    }
+}
+
+/*
+ * Scoped profiler. PROFILE_SCOPE(name, category) at the top of a function times every call of it until it returns,
+ * and adds the call to the statistics of that call site: count, total, min and max time in ms.
+ * Each site also keeps its self time (total minus the time of profiled scopes nested inside it), and the self time
+ * is summed per task and category, so a task's time splits into driving, RPS correction, waiting and everything else.
+ * Setting PROFILING to 0 (here or with -DPROFILING=0) removes every scope and the reports at compile time.
+ */
+#ifndef PROFILING
+#define PROFILING 1
+#endif
+#define PROFILE_TASKS 5
+#define PROFILE_FILE "profile.txt"
+
+enum ProfileCategory {
+    PROFILE_TASK,
+    PROFILE_DRIVE,
+    PROFILE_CORRECT,
+    PROFILE_WAIT,
+    PROFILE_CATEGORIES
+};
+
+/*
+ * Timing statistics of one PROFILE_SCOPE. Sites are statically initialized and linked into profileSites on first use.
+ */
+struct ProfileSite {
+    const char *name;
+    unsigned char category;
+    bool registered;
+    int calls;
+    unsigned int total;
+    unsigned int self;
+    unsigned int min;
+    unsigned int max;
+    ProfileSite *next;
+};
+
+ProfileSite *profileSites;
+
+// Task and primitive the robot is in, used by the profiler and recorded with every flight recorder sample.
+int currentTask = -1;
+int currentStep;
+
+// Self time (in ms) of every category in each task. The last row is time outside the tasks.
+unsigned int profileTime[PROFILE_TASKS + 1][PROFILE_CATEGORIES];
+
+/*
+ * Times one call of a profiled scope, from its construction to the end of the enclosing block.
+ */
+class ProfileScope {
+public:
+    ProfileScope(ProfileSite *scopeSite);
+    ~ProfileScope();
+
+private:
+    ProfileSite *site;
+    ProfileScope *parent;
+    unsigned int start;
+    unsigned int children;
+};
+
+// Innermost scope being timed.
+ProfileScope *profileTop;
+
+/*
+ * Given the site of the scope (@param scopeSite), starts timing a call.
+ */
+ProfileScope::ProfileScope(ProfileSite *scopeSite) : site(scopeSite), parent(profileTop), children(0) {
+    if (!site->registered) {
+        site->registered = true;
+        site->next = profileSites;
+        profileSites = site;
+    }
+    profileTop = this;
+    start = schedulerClock();
+}
+
+/*
+ * Stops timing the call and adds it to the site, its parent and the task/category totals.
+ */
+ProfileScope::~ProfileScope() {
+    unsigned int time = schedulerClock() - start;
+    unsigned int self = time - children;
+    profileTop = parent;
+    if (parent != 0) {
+        parent->children += time;
+    }
+
+    site->calls++;
+    site->total += time;
+    site->self += self;
+    if (time < site->min) {
+        site->min = time;
+    }
+    if (time > site->max) {
+        site->max = time;
+    }
+
+    int task = currentTask >= 0 && currentTask < PROFILE_TASKS ? currentTask : PROFILE_TASKS;
+    profileTime[task][site->category] += self;
+}
+
+#if PROFILING
+#define PROFILE_SCOPE(name, category) \
+    static ProfileSite profileSite = { name, category, false, 0, 0, 0, 0xFFFFFFFF, 0, 0 }; \
+    ProfileScope profileScope(&profileSite)
+#else
+#define PROFILE_SCOPE(name, category)
+#endif
+
+/*
+ * Given a time in milliseconds (@param ms), waits that long while keeping the scheduler running.
+ * Used instead of Sleep() so sensing, telemetry and logging keep their rates during pauses.
+ */
+void waitMs(int ms) {
+    PROFILE_SCOPE("waitMs", PROFILE_WAIT);
+    unsigned int start = schedulerClock();
+    while (schedulerClock() - start < (unsigned int)ms) {
+        schedulerTick();
+    }
+    idleTime += schedulerClock() - start;
+}
+
+// RPS sampling period in ms. RPS packets arrive much slower than this, so no packet is missed.
+#define POSE_PERIOD 10
+// Largest jump (in inches and degrees) accepted between two RPS packets before a second packet has to confirm it.
+#define POSE_GATE_DISTANCE 3.0
+#define POSE_GATE_HEADING 25.0
+// A pose older than this (in ms) is not used for control.
+#define POSE_STALE_TIME 500
+// Time (in ms) after which the same values again are a new packet. RPS packets come about every 100 ms, and a
+// little later or sooner, so the values of one packet are never read this long after it arrived.
+#define POSE_REPEAT_TIME 150
+
+/*
+ * One coherent RPS reading. X, Y and heading always come from the same packet.
+ * Sequence counts the packets accepted and timestamp is when this one arrived (in ms).
+ * Valid is false while RPS reports the negative lost/dead zone values; the last good position is kept.
+ */
+struct PoseSample {
+    float x;
+    float y;
+    float heading;
+    unsigned int timestamp;
+    unsigned int sequence;
+    bool valid;
+};
+
+/*
+ * Latest sensor values, refreshed by the sampling jobs. Controllers read these instead of the hardware.
+ */
+struct Sensors {
+    unsigned int time;
+    int flCounts;
+    int brCounts;
+    float cds;
+    PoseSample pose;
+};
+
+Sensors sensors;
+
+// Last raw RPS values, used to tell when a new packet has arrived, and the last three accepted packets for the median filter.
+float rawX = -1;
+float rawY = -1;
+float rawHeading = -1;
+unsigned int rawTime;
+PoseSample poseHistory[3];
+int poseHistoryCount;
+
+// Number of RPS reads and rejected outlier packets, to see how often the RPS is polled.
+unsigned long rpsReads;
+int poseRejects;
+
+/*
+ * Given an angle in degrees (@param degrees), wraps it into the range (-180, 180].
+ * @Returns [equivalent angle between -180 and 180 degrees]
+ */
+float wrapAngle(float degrees) {
+    while (degrees > 180.0) {
+        degrees -= 360.0;
+    }
+    while (degrees <= -180.0) {
+        degrees += 360.0;
+    }
+    return degrees;
+}
+
+/*
+ * Given three values (@param a, @param b, @param c), returns the middle one.
+ * @Returns [median of the three values]
+ */
+float median3(float a, float b, float c) {
+    if (a > b) {
+        float temp = a;
+        a = b;
+        b = temp;
+    }
+    if (b > c) {
+        b = c;
+    }
+    return a > b ? a : b;
+}
+
+/*
+ * Given three headings in degrees (@param a, @param b, @param c), returns their median, handling the wrap at 0/360.
+ * @Returns [median heading between 0 and 360 degrees]
+ */
+float medianHeading(float a, float b, float c) {
+    float heading = c + median3(wrapAngle(a - c), wrapAngle(b - c), 0);
+    if (heading < 0) {
+        heading += 360.0;
+    } else if (heading >= 360.0) {
+        heading -= 360.0;
+    }
+    return heading;
+}
+
+/*
+ * Pose sampling job: reads the RPS once and, if a new packet arrived, updates the pose snapshot.
+ * The RPS library only gives the values of the last packet, so a packet is new when the values change, or when they
+ * have stayed the same for POSE_REPEAT_TIME: packets keep coming while the robot stands still, with the same values.
+ * A packet that jumps further than the gate from the current pose is only accepted through the median
+ * of the last three packets, so a single bad packet is rejected but a real jump is confirmed by the next one.
+ * The timestamp is when the last accepted packet arrived; rejected and lost packets leave it as it was.
+ */
+void samplePose() {
+    float x = RPS.X();
+    float y = RPS.Y();
+    float heading = RPS.Heading();
+    rpsReads++;
+
+    // Same values as last time, too soon for another packet: the same packet read again
+    unsigned int now = schedulerClock();
+    if (x == rawX && y == rawY && heading == rawHeading && now - rawTime < POSE_REPEAT_TIME) {
+        return;
+    }
+    rawX = x;
+    rawY = y;
+    rawHeading = heading;
+    rawTime = now;
+
+    // RPS reports negative values when lost or in a dead zone
+    PoseSample *pose = &sensors.pose;
+    if (x < 0 || y < 0 || heading < 0) {
+        pose->valid = false;
+        poseHistoryCount = 0;
+        return;
+    }
+
+    poseHistory[0] = poseHistory[1];
+    poseHistory[1] = poseHistory[2];
+    poseHistory[2].x = x;
+    poseHistory[2].y = y;
+    poseHistory[2].heading = heading;
+    if (poseHistoryCount < 3) {
+        poseHistoryCount++;
+    }
+
+    bool jump = fabs(x - pose->x) > POSE_GATE_DISTANCE || fabs(y - pose->y) > POSE_GATE_DISTANCE
+            || fabs(wrapAngle(heading - pose->heading)) > POSE_GATE_HEADING;
+
+    if (!pose->valid || !jump) {
+        pose->x = x;
+        pose->y = y;
+        pose->heading = heading;
+    } else if (poseHistoryCount == 3) {
+        pose->x = median3(poseHistory[0].x, poseHistory[1].x, x);
+        pose->y = median3(poseHistory[0].y, poseHistory[1].y, y);
+        pose->heading = medianHeading(poseHistory[0].heading, poseHistory[1].heading, heading);
+        poseRejects++;
+    } else {
+        poseRejects++;
+        return;
+    }
+    pose->timestamp = now;
+    pose->sequence++;
+    pose->valid = true;
+}
+
+/*
+ * @Returns [the pose snapshot is valid and was received within POSE_STALE_TIME]
+ */
+bool poseFresh() {
+    return sensors.pose.valid && schedulerClock() - sensors.pose.timestamp < POSE_STALE_TIME;
+}
+
+/*
+ * Sampling job: reads the encoders and CdS cell into the sensor snapshot.
+ */
+void sampleSensors() {
+    sensors.time = schedulerClock();
+    sensors.flCounts = fl_encoder.Counts();
+    sensors.brCounts = br_encoder.Counts();
+    sensors.cds = cds.Value();
+}
+
+// Milliseconds between telemetry repaints (10 Hz). Control loops only store values, the screen is redrawn at this rate.
+#define TELEMETRY_PERIOD 100
+#define TELEMETRY_ROWS 9
+#define TELEMETRY_WIDTH 14
+#define TELEMETRY_COL 12
+
+/*
+ * Latest values shown on the telemetry screen. Control loops fill these in and call telemetryUpdate().
+ */
+struct Telemetry {
+    const char *status;
+    float target;
+    int targetCounts;
+    int flCounts;
+    int brCounts;
+    float x;
+    float y;
+    float heading;
+    int loopRate;
+};
+
+Telemetry telemetry;
+
+// Text currently on screen for each telemetry row, so only changed fields are redrawn.
+char telemetryShown[TELEMETRY_ROWS][TELEMETRY_WIDTH + 1];
+unsigned int telemetryLastPaint;
+int telemetryIterations;
+
+/*
+ * Given a buffer (@param buffer), a value (@param value) and the digits after the decimal point (@param decimals),
+ * formats the value using integer math only, padded with spaces to TELEMETRY_WIDTH characters.
+ */
+void formatFixed(char *buffer, float value, int decimals) {
+    int scale = 1;
+    for (int i = 0; i < decimals; i++) {
+        scale *= 10;
+    }
+
+    long scaled = (long)(value * scale + (value < 0 ? -0.5 : 0.5));
+    bool negative = scaled < 0;
+    if (negative) {
+        scaled = -scaled;
+    }
+
+    // Build the digits backwards, then reverse them into the buffer
+    char digits[TELEMETRY_WIDTH];
+    int n = 0;
+    do {
+        if (n == decimals && decimals > 0) {
+            digits[n++] = '.';
+        }
+        digits[n++] = '0' + scaled % 10;
+        scaled /= 10;
+    } while ((scaled > 0 || n <= decimals) && n < TELEMETRY_WIDTH - 1);
+
+    int length = 0;
+    if (negative) {
+        buffer[length++] = '-';
+    }
+    while (n > 0) {
+        buffer[length++] = digits[--n];
+    }
+    while (length < TELEMETRY_WIDTH) {
+        buffer[length++] = ' ';
+    }
+    buffer[length] = '\0';
+}
+
+/*
+ * Given a telemetry row (@param row) and its new text (@param text), writes the text only if it differs from what is shown.
+ */
+void telemetryField(int row, const char *text) {
+    bool changed = false;
+    for (int i = 0; i <= TELEMETRY_WIDTH; i++) {
+        if (telemetryShown[row][i] != text[i]) {
+            changed = true;
+            telemetryShown[row][i] = text[i];
+        }
+    }
+    if (changed) {
+        LCD.WriteRC(text, row, TELEMETRY_COL);
+    }
+}
+
+/*
+ * Given a status line (@param status), clears the screen once and draws the static telemetry labels.
+ * Called at the start of each primitive instead of clearing the screen every loop iteration.
+ */
+void telemetryBegin(const char *status) {
+    telemetry.status = status;
+
+    LCD.Clear();
+    LCD.WriteRC(status, 0, 0);
+    LCD.WriteRC("Target:", 1, 0);
+    LCD.WriteRC("Theo counts:", 2, 0);
+    LCD.WriteRC("FLE counts:", 3, 0);
+    LCD.WriteRC("BRE counts:", 4, 0);
+    LCD.WriteRC("RPS X:", 5, 0);
+    LCD.WriteRC("RPS Y:", 6, 0);
+    LCD.WriteRC("Heading:", 7, 0);
+    LCD.WriteRC("Loop Hz:", 8, 0);
+
+    // Force every field to be redrawn on the next paint
+    for (int row = 0; row < TELEMETRY_ROWS; row++) {
+        telemetryShown[row][0] = '\0';
+    }
+}
+
+/*
+ * Counts one control loop iteration for the loop rate shown on screen.
+ */
+void telemetryUpdate() {
+    telemetryIterations++;
+}
+
+/*
+ * Telemetry job: repaints the telemetry fields that changed since the last paint.
+ */
+void telemetryPaint() {
+    unsigned int now = schedulerClock();
+    unsigned int elapsed = now - telemetryLastPaint;
+    if (elapsed > 0 && telemetryLastPaint != 0) {
+        telemetry.loopRate = telemetryIterations * 1000 / elapsed;
+    }
+    telemetryIterations = 0;
+    telemetryLastPaint = now;
+
+    if (telemetry.status == 0) {
+        return;
+    }
+
+    char buffer[TELEMETRY_WIDTH + 1];
+    formatFixed(buffer, telemetry.target, 1);
+    telemetryField(1, buffer);
+    formatFixed(buffer, telemetry.targetCounts, 0);
+    telemetryField(2, buffer);
+    formatFixed(buffer, telemetry.flCounts, 0);
+    telemetryField(3, buffer);
+    formatFixed(buffer, telemetry.brCounts, 0);
+    telemetryField(4, buffer);
+    formatFixed(buffer, telemetry.x, 2);
+    telemetryField(5, buffer);
+    formatFixed(buffer, telemetry.y, 2);
+    telemetryField(6, buffer);
+    formatFixed(buffer, telemetry.heading, 1);
+    telemetryField(7, buffer);
+    formatFixed(buffer, telemetry.loopRate, 0);
+    telemetryField(8, buffer);
 }
 
 /* NOTE: Here 'move_forward' means positive movement. Our coordinate system for this program is a top-down view of the course,
  * with the starting point as the origin. DDR is in positive X and lever is in positive Y. */
 
+// Trapezoidal profile used by encoder distance drives. Power ramps up from DRIVE_MIN_PERCENT over DRIVE_ACCEL_COUNTS,
+// cruises at the commanded percent, then ramps back down over DRIVE_DECEL_COUNTS (scaled by cruise speed) before the target.
+#define DRIVE_MIN_PERCENT 20
+#define DRIVE_ACCEL_COUNTS 6.0
+#define DRIVE_DECEL_COUNTS 14.0
+// Time (in seconds) the robot keeps rolling after the motors are stopped. Used to cut power early based on measured speed.
+#define DRIVE_COAST_TIME 0.04
+// Most power (in percent) the heading hold of a straight drive moves between the sides. The gains are the holdKp
+// and holdKi parameters.
+#define HOLD_MAX_STEER 10.0
+
+// PD heading controller power limits for RPS_Angle. The gains and tolerance are the headingKp, headingKd
+// and headingTolerance parameters, and the turn power is clamped between these percents.
+#define HEADING_MIN_PERCENT 15
+#define HEADING_MAX_PERCENT 45
+// Time (in ms) the heading has to stay inside the tolerance before RPS_Angle returns.
+#define HEADING_SETTLE_TIME 150
+// Time (in ms) between updates of the heading error rate used by the D term.
+#define HEADING_RATE_PERIOD 50
+// Time (in seconds) the robot keeps turning after the motors are stopped.
+#define HEADING_COAST_TIME 0.08
+
+// RPS position corrections. Drive power falls from AXIS_MAX_PERCENT to AXIS_MIN_PERCENT over the last AXIS_SLOW_DISTANCE
+// inches. A correction starts once the error is outside the axisTolerance (or yTolerance) parameter and stops once the
+// coast is expected to bring it inside AXIS_STOP_FRACTION of it, so it does not chatter around the edge of the band.
+#define AXIS_MIN_PERCENT 15
+#define AXIS_MAX_PERCENT 40
+#define AXIS_SLOW_DISTANCE 3.0
+#define AXIS_STOP_FRACTION 0.5
+// Time (in ms) the position has to stay inside the tolerance before a correction returns.
+#define AXIS_SETTLE_TIME 200
+// Time (in seconds) the robot keeps rolling after the motors are stopped at correction speeds.
+#define AXIS_COAST_TIME 0.1
+// Changes of drive direction after which a correction gives up on getting any closer.
+#define AXIS_MAX_REVERSALS 2
+
+// goToPose turns in place first if the bearing to the target is more than this many degrees off, at this percent,
+// then drives to it at POSE_PERCENT.
+#define POSE_TURN_ANGLE 20.0
+#define POSE_TURN_PERCENT 60
+#define POSE_PERCENT 60
+
+// Axes of the RPS frame.
+#define AXIS_X 0
+#define AXIS_Y 1
+
+// Settle time statistics for RPS_Angle (in ms), used to compare heading controllers.
+unsigned int angleSettleTime;
+unsigned int angleSettleTotal;
+int angleCalls;
+// Heading controller steps over the run, and RPS_Angle calls that found the heading already within tolerance.
+int angleIterations;
+int angleSkips;
+
+// Direction (1 or -1) each side was last driven in. Used to give the encoder counts a sign.
+int driveLeftSign = 1;
+int driveRightSign = 1;
+
+// Last commanded power (in percent) of each side and servo angles, kept for the flight recorder.
+float driveLeftPercent;
+float driveRightPercent;
+float leverDegree;
+float tokenDegree;
+
+// Time (in ms) of the first drive command since it was last cleared, used to time the reaction off the start line.
+unsigned int firstDriveTime;
+// Time (in ms) the drive motors were last cut, so headings taken at rest can be told from ones taken while coasting.
+unsigned int driveStopTime;
+
 /*
- * Given a motor speed (@param percent) and a desired distance (@param inches),
- * drives the robot forward in the direction it is facing.
+ * Battery compensation. Motor speed follows the pack voltage, so percents tuned on one battery are off on the next.
+ * setDrive scales every drive command by BATTERY_NOMINAL over the filtered pack voltage, so a tuned percent gives
+ * the same speed on a fresh pack and a tired one. The voltage is read every BATTERY_PERIOD ms and smoothed with
+ * a slow EMA, so the sag while the motors start up does not make the compensation jump.
  */
-void move_forward(int percent, float inches) {
-    //Reset all encoder counts
-    fl_encoder.ResetCounts();
-    br_encoder.ResetCounts();
+#define BATTERY_NOMINAL 11.5
+#define BATTERY_PERIOD 100
+#define BATTERY_FILTER 0.05
+// Limits of the compensation, so a bad reading cannot double or halve every command.
+#define BATTERY_MIN_SCALE 0.8
+#define BATTERY_MAX_SCALE 1.3
+
+// Filtered pack voltage, the drive command scale it gives, the first voltage of the run and the scale range used.
+float batteryVoltage;
+float batteryScale = 1.0;
+float batteryStartVoltage;
+float batteryMinScale = 1.0;
+float batteryMaxScale = 1.0;
 
-    int counts = theoreticalCounts(inches);
-
-    //Set motors to desired percent. Some motors have to turn backwards, so make percent negative.
-    bl_motor.SetPercent(percent);
-    fr_motor.SetPercent(-1 * percent);
-    fl_motor.SetPercent(percent);
-    br_motor.SetPercent(-1 * percent);
+/*
+ * Battery job: filters the pack voltage and updates the drive command scale.
+ */
+void sampleBattery() {
+    float voltage = Battery.Voltage();
+    if (batteryVoltage == 0) {
+        batteryVoltage = voltage;
+        batteryStartVoltage = voltage;
+    } else {
+        batteryVoltage += BATTERY_FILTER * (voltage - batteryVoltage);
+    }
+    if (batteryVoltage <= 0) {
+        return;
+    }
 
-    //While the average of the left or right encoders is less than theoretical counts,
-    //keep running motors
-    while(fl_encoder.Counts() < counts || br_encoder.Counts() < counts) {
-        LCD.Clear();
-        LCD.Write("Moving forward ");
-        LCD.Write(inches);
-        LCD.WriteLine(" inches");
-        LCD.Write("THEORETICAL COUNTS: ");
-        LCD.WriteLine(counts);
-        LCD.Write("Actual BRE Counts: ");
-        LCD.WriteLine(br_encoder.Counts());
-        LCD.Write("Actual FLE Counts: ");
-        LCD.WriteLine(fl_encoder.Counts());
-    }
-
-    //Turn off motors
-    bl_motor.Stop();
-    fr_motor.Stop();
-    fl_motor.Stop();
-    br_motor.Stop();
+    batteryScale = BATTERY_NOMINAL / batteryVoltage;
+    if (batteryScale < BATTERY_MIN_SCALE) {
+        batteryScale = BATTERY_MIN_SCALE;
+    } else if (batteryScale > BATTERY_MAX_SCALE) {
+        batteryScale = BATTERY_MAX_SCALE;
+    }
+    if (batteryScale < batteryMinScale) {
+        batteryMinScale = batteryScale;
+    }
+    if (batteryScale > batteryMaxScale) {
+        batteryMaxScale = batteryScale;
+    }
 }
 
 /*
- * Given a motor speed (@param percent) and a desired distance (@param inches),
- * drives the robot in the opposite direction from move_forward.
+ * Given a commanded percent (@param percent), returns the motor percent after battery compensation.
+ * @Returns [compensated percent, within -100 to 100]
  */
-void move_backward(int percent, float inches) {
-    //Reset all encoder counts
+float compensatePercent(float percent) {
+    percent *= batteryScale;
+    if (percent > 100) {
+        return 100;
+    }
+    if (percent < -100) {
+        return -100;
+    }
+    return percent;
+}
+
+/*
+ * Given a left and right side power (@param left, @param right), sets all four drive motors.
+ * The motors get the battery compensated power; driveLeftPercent and driveRightPercent keep the commanded one.
+ * Positive values drive that side of the robot in the move_forward direction.
+ */
+void setDrive(float left, float right) {
+    //Right side motors are mounted backwards, so make their percent negative.
+    bl_motor.SetPercent(compensatePercent(left));
+    fr_motor.SetPercent(-1 * compensatePercent(right));
+    fl_motor.SetPercent(compensatePercent(left));
+    br_motor.SetPercent(-1 * compensatePercent(right));
+    driveLeftPercent = left;
+    driveRightPercent = right;
+    if (firstDriveTime == 0 && (left != 0 || right != 0)) {
+        firstDriveTime = schedulerClock();
+    }
+
+    if (left != 0) {
+        driveLeftSign = left > 0 ? 1 : -1;
+    }
+    if (right != 0) {
+        driveRightSign = right > 0 ? 1 : -1;
+    }
+}
+
+/*
+ * Stops all four drive motors.
+ */
+void stopDrive() {
+    bl_motor.Stop();
+    fr_motor.Stop();
+    fl_motor.Stop();
+    br_motor.Stop();
+    if (driveLeftPercent != 0 || driveRightPercent != 0) {
+        driveStopTime = schedulerClock();
+    }
+    driveLeftPercent = 0;
+    driveRightPercent = 0;
+}
+
+/*
+ * Given an angle (@param degree), moves the lever servo.
+ */
+void setLever(float degree) {
+    lever_servo.SetDegree(degree);
+    leverDegree = degree;
+}
+
+/*
+ * Given an angle (@param degree), moves the token servo.
+ */
+void setToken(float degree) {
+    token_servo.SetDegree(degree);
+    tokenDegree = degree;
+}
+
+/*
+ * Flight recorder: an always-on log of the sensors and commands, sampled every LOG_PERIOD ms.
+ * Samples are delta-encoded into a preallocated RAM ring, and a separate job writes the ring to RECORDER_FILE
+ * one RECORDER_BLOCK at a time. That job runs in the same cooperative scheduler, so a block write does hold up the
+ * control jobs for as long as it takes (the longest is shown as the flush time). Blocks are a whole SD sector of
+ * records, so that cost comes about once a second instead of every flush period, and the ring holds several seconds
+ * of records so a slow write never drops any. Every RECORDER_SYNC_BLOCKS blocks the file is closed and reopened for
+ * appending, because FatFs only updates the file size on the card when a file is closed: a run that hangs or loses
+ * power loses at most those last blocks instead of the whole log.
+ * FEHSD only has formatted output, so each block is written as one line of hex bytes. Records (little endian):
+ *   'K' keyframe, 25 bytes: time u32, fl u16, br u16, x s16, y s16, heading s16, cds u8, battery u16 (mV),
+ *                           left s8, right s8, lever u8, token u8, task u8, step u8, flags u8
+ *   'D' delta, 10 bytes:    dt u8, dfl s8, dbr s8, dx s8, dy s8, dheading s8, cds u8, left s8, right s8
+ * Positions are in 1/32 inch, headings in 1/8 degree, CdS in 1/64 volt and flags bit 0 is a valid RPS pose.
+ * A keyframe is written every RECORDER_KEYFRAME records, after a dropped record, and whenever a change
+ * does not fit in a delta record.
+ */
+#define RECORDER_FILE "flight.txt"
+#define RECORDER_SIZE 4096
+#define RECORDER_BLOCK 512
+#define RECORDER_SYNC_BLOCKS 4
+#define RECORDER_KEYFRAME 50
+#define RECORDER_MAX_RECORD 32
+#define FLUSH_PERIOD 50
+// Number of records encoded by recorderBenchmark. Their total time in ms is the time per record in microseconds.
+#define RECORDER_BENCHMARK 1000
+
+/*
+ * One recorder sample, in the units it is stored in.
+ */
+struct RecordFrame {
+    unsigned int time;
+    unsigned short flCounts;
+    unsigned short brCounts;
+    short x;
+    short y;
+    short heading;
+    unsigned char cds;
+    signed char left;
+    signed char right;
+    unsigned char lever;
+    unsigned char token;
+    unsigned char task;
+    unsigned char step;
+    unsigned char flags;
+};
+
+unsigned char recorderRing[RECORDER_SIZE];
+// Bytes written into and read out of the ring since the start. Their difference is the number of buffered bytes.
+unsigned int recorderHead;
+unsigned int recorderTail;
+
+FEHFile *recorderFile;
+int recorderUnsyncedBlocks;
+RecordFrame recorderLast;
+int recorderSinceKeyframe;
+bool recorderForceKeyframe;
+
+// Recorder statistics.
+int recorderRecords;
+int recorderKeyframes;
+int recorderDropped;
+unsigned int recorderBytes;
+unsigned int recorderMaxFlush;
+
+/*
+ * Given a frame to fill in (@param frame), takes the current sensor snapshot and commands.
+ */
+void captureFrame(RecordFrame *frame) {
+    frame->time = sensors.time;
+    frame->flCounts = sensors.flCounts;
+    frame->brCounts = sensors.brCounts;
+    frame->x = (short)(sensors.pose.x * 32);
+    frame->y = (short)(sensors.pose.y * 32);
+    frame->heading = (short)(sensors.pose.heading * 8);
+    frame->cds = (unsigned char)(sensors.cds * 64);
+    frame->left = (signed char)driveLeftPercent;
+    frame->right = (signed char)driveRightPercent;
+    frame->lever = (unsigned char)leverDegree;
+    frame->token = (unsigned char)tokenDegree;
+    frame->task = (unsigned char)currentTask;
+    frame->step = (unsigned char)currentStep;
+    frame->flags = sensors.pose.valid ? 1 : 0;
+}
+
+/*
+ * Given a value (@param value), a byte array (@param out) and a position in it (@param length),
+ * stores the value as little endian bytes.
+ * @Returns [position after the value]
+ */
+int putBytes(unsigned int value, int bytes, unsigned char *out, int length) {
+    for (int i = 0; i < bytes; i++) {
+        out[length++] = (value >> (8 * i)) & 0xFF;
+    }
+    return length;
+}
+
+/*
+ * @Returns [difference fits in a signed byte]
+ */
+bool fitsDelta(int difference) {
+    return difference >= -128 && difference <= 127;
+}
+
+/*
+ * Given a frame (@param frame), the last recorded frame (@param last), whether a keyframe is required
+ * (@param keyframe) and a buffer (@param out) of RECORDER_MAX_RECORD bytes, encodes the frame as a record
+ * and makes it the last recorded frame.
+ * @Returns [length of the record in bytes]
+ */
+int encodeRecord(const RecordFrame &frame, RecordFrame *last, bool keyframe, unsigned char *out) {
+    int dt = frame.time - last->time;
+    int dfl = (short)(frame.flCounts - last->flCounts);
+    int dbr = (short)(frame.brCounts - last->brCounts);
+    int dx = frame.x - last->x;
+    int dy = frame.y - last->y;
+    int dheading = frame.heading - last->heading;
+    if (dheading > 1440) {
+        dheading -= 2880;
+    } else if (dheading < -1440) {
+        dheading += 2880;
+    }
+
+    // Anything that changes rarely only goes in keyframes
+    bool delta = !keyframe && dt >= 0 && dt <= 255 && fitsDelta(dfl) && fitsDelta(dbr) && fitsDelta(dx)
+            && fitsDelta(dy) && fitsDelta(dheading) && frame.lever == last->lever && frame.token == last->token
+            && frame.task == last->task && frame.step == last->step && frame.flags == last->flags;
+
+    int length = 0;
+    if (delta) {
+        out[length++] = 'D';
+        out[length++] = dt;
+        out[length++] = dfl;
+        out[length++] = dbr;
+        out[length++] = dx;
+        out[length++] = dy;
+        out[length++] = dheading;
+        out[length++] = frame.cds;
+        out[length++] = frame.left;
+        out[length++] = frame.right;
+    } else {
+        out[length++] = 'K';
+        length = putBytes(frame.time, 4, out, length);
+        length = putBytes(frame.flCounts, 2, out, length);
+        length = putBytes(frame.brCounts, 2, out, length);
+        length = putBytes(frame.x, 2, out, length);
+        length = putBytes(frame.y, 2, out, length);
+        length = putBytes(frame.heading, 2, out, length);
+        out[length++] = frame.cds;
+        length = putBytes((unsigned int)(batteryVoltage * 1000), 2, out, length);
+        out[length++] = frame.left;
+        out[length++] = frame.right;
+        out[length++] = frame.lever;
+        out[length++] = frame.token;
+        out[length++] = frame.task;
+        out[length++] = frame.step;
+        out[length++] = frame.flags;
+    }
+
+    // Keep the reconstructed values, so rounding in the deltas never adds up
+    *last = frame;
+    return length;
+}
+
+/*
+ * Given a record (@param record) of some length (@param length), copies it into the ring.
+ * If the ring is too full the record is dropped, and the next record is forced to be a keyframe.
+ */
+void pushRecord(const unsigned char *record, int length) {
+    if (RECORDER_SIZE - (recorderHead - recorderTail) < (unsigned int)length) {
+        recorderDropped++;
+        recorderForceKeyframe = true;
+        return;
+    }
+    for (int i = 0; i < length; i++) {
+        recorderRing[recorderHead++ % RECORDER_SIZE] = record[i];
+    }
+    recorderRecords++;
+}
+
+/*
+ * Recording job: encodes the current sensor snapshot and commands into the ring.
+ */
+void recordSample() {
+    if (recorderFile == 0) {
+        return;
+    }
+
+    RecordFrame frame;
+    captureFrame(&frame);
+
+    bool keyframe = recorderForceKeyframe || recorderSinceKeyframe >= RECORDER_KEYFRAME;
+    unsigned char record[RECORDER_MAX_RECORD];
+    int length = encodeRecord(frame, &recorderLast, keyframe, record);
+
+    if (record[0] == 'K') {
+        recorderKeyframes++;
+        recorderSinceKeyframe = 0;
+    } else {
+        recorderSinceKeyframe++;
+    }
+    recorderForceKeyframe = false;
+    pushRecord(record, length);
+}
+
+/*
+ * Given the most bytes to write (@param limit), writes buffered bytes from the ring as one line of hex.
+ */
+void writeRecorderBlock(unsigned int limit) {
+    static const char hex[] = "0123456789ABCDEF";
+    static char line[2 * RECORDER_BLOCK + 1];
+
+    unsigned int count = recorderHead - recorderTail;
+    if (count > limit) {
+        count = limit;
+    }
+    for (unsigned int i = 0; i < count; i++) {
+        unsigned char value = recorderRing[recorderTail++ % RECORDER_SIZE];
+        line[2 * i] = hex[value >> 4];
+        line[2 * i + 1] = hex[value & 0xF];
+    }
+    line[2 * count] = '\0';
+
+    SD.FPrintf(recorderFile, "%s\n", line);
+    recorderBytes += count;
+}
+
+/*
+ * Closes RECORDER_FILE so the card has everything written so far, then reopens it for appending.
+ * If it cannot be reopened the recorder stops.
+ */
+void syncRecorder() {
+    SD.FClose(recorderFile);
+    recorderFile = SD.FOpen(RECORDER_FILE, "a");
+    recorderUnsyncedBlocks = 0;
+}
+
+/*
+ * Flushing job: once a full block is buffered, writes it to the SD card, syncs the file every RECORDER_SYNC_BLOCKS
+ * blocks and measures how long that took.
+ */
+void flushRecorder() {
+    if (recorderFile == 0 || recorderHead - recorderTail < RECORDER_BLOCK) {
+        return;
+    }
+
+    unsigned int start = schedulerClock();
+    writeRecorderBlock(RECORDER_BLOCK);
+    if (++recorderUnsyncedBlocks >= RECORDER_SYNC_BLOCKS) {
+        syncRecorder();
+    }
+    unsigned int time = schedulerClock() - start;
+    if (time > recorderMaxFlush) {
+        recorderMaxFlush = time;
+    }
+}
+
+/*
+ * Opens RECORDER_FILE and starts recording. Without an SD card the recorder stays off.
+ */
+void recorderStart() {
+    recorderHead = 0;
+    recorderTail = 0;
+    recorderRecords = 0;
+    recorderKeyframes = 0;
+    recorderDropped = 0;
+    recorderBytes = 0;
+    recorderMaxFlush = 0;
+    recorderSinceKeyframe = 0;
+    recorderForceKeyframe = true;
+    recorderUnsyncedBlocks = 0;
+    recorderFile = SD.FOpen(RECORDER_FILE, "w");
+}
+
+/*
+ * Writes everything still in the ring to the SD card and closes RECORDER_FILE.
+ */
+void recorderStop() {
+    if (recorderFile == 0) {
+        return;
+    }
+    while (recorderHead != recorderTail) {
+        writeRecorderBlock(RECORDER_BLOCK);
+    }
+    SD.FClose(recorderFile);
+    recorderFile = 0;
+}
+
+/*
+ * Measures the cost of recording by encoding RECORDER_BENCHMARK samples into a scratch buffer.
+ * @Returns [time per recorded sample in microseconds]
+ */
+unsigned int recorderBenchmark() {
+    RecordFrame last = recorderLast;
+    unsigned char record[RECORDER_MAX_RECORD];
+
+    unsigned int start = schedulerClock();
+    for (int i = 0; i < RECORDER_BENCHMARK; i++) {
+        RecordFrame frame;
+        captureFrame(&frame);
+        encodeRecord(frame, &last, i % RECORDER_KEYFRAME == 0, record);
+    }
+    return (schedulerClock() - start) * 1000 / RECORDER_BENCHMARK;
+}
+
+/*
+ * Primitive timeline: every motion primitive and RPS correction writes a begin record to the flight recorder
+ * when it starts and an end record when it returns, so a run log can be split into calls. Records (little endian):
+ *   'B' begin, 8 bytes: primitive u8, time u32, target s16
+ *   'E' end, 11 bytes:  primitive u8, duration u16 (ms), final error s16, iterations u16, idle u16 (ms), status u8
+ * Targets and errors are in 1/32 inch or degree (the DDR light check records its power, and its confidence
+ * signed positive for red, instead). Iterations are control steps or correction loop passes, and idle
+ * is the time spent in waitMs during the call. Time between two calls is the waiting done by the task itself.
+ */
+#define MAX_EVENT_DEPTH 4
+
+enum Primitive {
+    PRIM_FORWARD,
+    PRIM_BACKWARD,
+    PRIM_LEFT,
+    PRIM_RIGHT,
+    PRIM_HEADING,
+    PRIM_PATH,
+    PRIM_XINC,
+    PRIM_XINC_REV,
+    PRIM_XDEC,
+    PRIM_YINC,
+    PRIM_YDEC,
+    PRIM_X_INC_ABS,
+    PRIM_X_DEC_ABS,
+    PRIM_Y_INC_ABS,
+    PRIM_Y_DEC_ABS,
+    PRIM_DDR_LIGHT,
+    PRIM_POSE,
+    PRIM_COUNT
+};
+
+// How a primitive ended. MOTION_OSCILLATING is an RPS correction that gave up after reversing too often,
+// still outside its tolerance, and MOTION_NO_POSE a primitive that needed a pose estimate and had none.
+enum MotionStatus {
+    MOTION_OK,
+    MOTION_STALLED,
+    MOTION_TIMEOUT,
+    MOTION_OSCILLATING,
+    MOTION_NO_POSE
+};
+
+// Number of calls of each primitive that ended stalled, out of time or oscillating.
+int stallEvents[PRIM_COUNT];
+int timeoutEvents[PRIM_COUNT];
+int oscillationEvents[PRIM_COUNT];
+
+/*
+ * A primitive call in progress.
+ */
+struct Event {
+    unsigned char primitive;
+    unsigned int start;
+    unsigned int idleStart;
+    unsigned int iterations;
+};
+
+Event events[MAX_EVENT_DEPTH];
+int eventDepth;
+
+/*
+ * Given a value (@param value) in inches or degrees, converts it to 1/32 units clamped to a signed 16 bit field.
+ * @Returns [value to record]
+ */
+int eventValue(float value) {
+    float scaled = value * 32;
+    if (scaled > 32767) {
+        return 32767;
+    } else if (scaled < -32767) {
+        return -32767;
+    }
+    return (int)scaled;
+}
+
+/*
+ * Given a primitive (@param primitive) and its target (@param target), marks the start of a call.
+ */
+void beginEvent(int primitive, float target) {
+    if (eventDepth >= MAX_EVENT_DEPTH) {
+        eventDepth++;
+        return;
+    }
+    Event *event = &events[eventDepth++];
+    event->primitive = primitive;
+    event->start = schedulerClock();
+    event->idleStart = idleTime;
+    event->iterations = 0;
+
+    if (recorderFile != 0) {
+        unsigned char record[RECORDER_MAX_RECORD];
+        int length = 0;
+        record[length++] = 'B';
+        record[length++] = primitive;
+        length = putBytes(event->start, 4, record, length);
+        length = putBytes(eventValue(target), 2, record, length);
+        pushRecord(record, length);
+    }
+}
+
+/*
+ * Counts one control step or correction loop pass of the innermost call.
+ */
+void countIteration() {
+    if (eventDepth > 0 && eventDepth <= MAX_EVENT_DEPTH) {
+        events[eventDepth - 1].iterations++;
+    }
+}
+
+/*
+ * Given the error left when the call returned (@param error) and how it ended (@param status),
+ * marks the end of the innermost call.
+ */
+void endEvent(float error, MotionStatus status) {
+    if (eventDepth == 0) {
+        return;
+    }
+    eventDepth--;
+    if (eventDepth >= MAX_EVENT_DEPTH) {
+        return;
+    }
+
+    Event *event = &events[eventDepth];
+    if (status == MOTION_STALLED) {
+        stallEvents[event->primitive]++;
+    } else if (status == MOTION_TIMEOUT) {
+        timeoutEvents[event->primitive]++;
+    } else if (status == MOTION_OSCILLATING) {
+        oscillationEvents[event->primitive]++;
+    }
+    if (recorderFile == 0) {
+        return;
+    }
+
+    unsigned int duration = schedulerClock() - event->start;
+    unsigned int idle = idleTime - event->idleStart;
+    unsigned int iterations = event->iterations;
+
+    unsigned char record[RECORDER_MAX_RECORD];
+    int length = 0;
+    record[length++] = 'E';
+    record[length++] = event->primitive;
+    length = putBytes(duration < 65535 ? duration : 65535, 2, record, length);
+    length = putBytes(eventValue(error), 2, record, length);
+    length = putBytes(iterations < 65535 ? iterations : 65535, 2, record, length);
+    length = putBytes(idle < 65535 ? idle : 65535, 2, record, length);
+    record[length++] = status;
+    pushRecord(record, length);
+}
+
+/*
+ * Stall monitor. Every primitive gets a time budget from primitiveBudgets, and while the motors are driven its
+ * encoder progress is checked every STALL_WINDOW ms against the progress expected at the commanded power. A primitive that runs out of time or stops making progress ends
+ * with a status other than MOTION_OK, so the task code can recover instead of burning the rest of the run.
+ */
+#define STALL_WINDOW 300
+// Time (in ms) after a primitive starts before stalls are checked, so the motors can spin up.
+#define STALL_GRACE 300
+// Encoder counts per second of one side at 100% power, and the fraction of that expected progress a stall is below.
+#define FULL_SPEED_COUNTS 110
+#define STALL_FRACTION 0.25
+// Distance (in inches) the robot backs off the ramp before retrying after a stall.
+#define RAMP_BACKOFF 3.0
+
+/*
+ * Time budget of a primitive: a fixed part plus a part per inch or degree of its target (both in ms),
+ * for 100% power. The per-unit part grows as the power goes down.
+ */
+struct Budget {
+    unsigned int base;
+    float perUnit;
+};
+
+// Budgets in Primitive order.
+Budget primitiveBudgets[PRIM_COUNT] = {
+    { 1500, 150 },  // Forward
+    { 1500, 150 },  // Backward
+    { 1500, 20 },   // Left
+    { 1500, 20 },   // Right
+    { 4000, 0 },    // Heading
+    { 15000, 0 },   // Path
+    { 3000, 500 },  // RPS corrections, at AXIS_MAX_PERCENT
+    { 3000, 500 },
+    { 3000, 500 },
+    { 3000, 500 },
+    { 3000, 500 },
+    { 3000, 500 },
+    { 3000, 500 },
+    { 3000, 500 },
+    { 3000, 500 },
+    { 1500, 0 },    // DDR light, after which it goes with the more likely colour
+    { 0, 0 }        // Go to pose, whose turn, path and heading correction have their own budgets
+};
+
+/*
+ * Progress of a running primitive, checked once per window.
+ */
+struct StallMonitor {
+    unsigned int start;
+    unsigned int budget;
+    unsigned int windowStart;
+    float windowProgress;
+};
+
+/*
+ * Given a primitive (@param primitive), the size of its target (@param target) and its power (@param percent),
+ * returns its time budget.
+ * @Returns [time budget in ms]
+ */
+unsigned int primitiveBudget(int primitive, float target, int percent) {
+    const Budget &budget = primitiveBudgets[primitive];
+    if (percent <= 0) {
+        percent = 100;
+    }
+    return budget.base + (unsigned int)(budget.perUnit * fabs(target) * 100 / percent);
+}
+
+/*
+ * Given a monitor (@param monitor), a time budget (@param budget) and the current progress (@param progress),
+ * starts watching a primitive.
+ */
+void stallStart(StallMonitor *monitor, unsigned int budget, float progress) {
+    monitor->start = schedulerClock();
+    monitor->budget = budget;
+    monitor->windowStart = monitor->start;
+    monitor->windowProgress = progress;
+}
+
+/*
+ * Given a monitor (@param monitor), the current progress (@param progress), the least progress expected per window
+ * (@param minProgress) and whether the motors are being driven (@param driving), checks the primitive.
+ * Progress is only checked while driving and after STALL_GRACE, so a controller that is waiting, coasting
+ * or spinning up does not stall.
+ * @Returns [MOTION_OK, MOTION_STALLED or MOTION_TIMEOUT]
+ */
+MotionStatus stallCheck(StallMonitor *monitor, float progress, float minProgress, bool driving) {
+    unsigned int now = schedulerClock();
+    if (now - monitor->start >= monitor->budget) {
+        return MOTION_TIMEOUT;
+    }
+
+    // Windows start after the spin-up grace, so slow first counts are not held against the primitive
+    if (!driving || now - monitor->start < STALL_GRACE) {
+        monitor->windowStart = now;
+        monitor->windowProgress = progress;
+        return MOTION_OK;
+    }
+
+    if (now - monitor->windowStart >= STALL_WINDOW) {
+        bool stalled = progress - monitor->windowProgress < minProgress;
+        monitor->windowStart = now;
+        monitor->windowProgress = progress;
+        if (stalled) {
+            return MOTION_STALLED;
+        }
+    }
+    return MOTION_OK;
+}
+
+// Period of the pose estimator job in ms.
+#define ESTIMATE_PERIOD 5
+// Fraction of the difference between an RPS packet and the estimate that is corrected when the packet arrives.
+#define FUSE_GAIN_POSITION 0.3
+#define FUSE_GAIN_HEADING 0.3
+// The estimate is only trusted for this long (in ms) without an RPS correction.
+#define ESTIMATE_STALE_TIME 2000
+
+/*
+ * Encoder odometry fused with RPS. The robot center is integrated from the encoders and pulled toward each new
+ * RPS packet. All of this runs in fixed point; x, y and heading are published as floats in the RPS frame
+ * (at the QR code), so they compare directly with RPS targets.
+ * The QR code is assumed to sit QR_OFFSET inches in front of the robot center, along the move_forward direction.
+ */
+struct Estimate {
+    fixed centerX;
+    fixed centerY;
+    fixed headingFixed;
+    float x;
+    float y;
+    float heading;
+    bool valid;
+    unsigned int lastCorrection;
+    unsigned int rpsSequence;
+    int lastFlCounts;
+    int lastBrCounts;
+
+    // Difference between RPS and the estimate when each packet arrived, before correcting
+    float positionError;
+    float headingError;
+    float maxPositionError;
+    float maxHeadingError;
+};
+
+Estimate estimate;
+
+/*
+ * Given a fixed point heading (@param heading), wraps it into the range [0, 360).
+ * @Returns [fixed point heading between 0 and 360 degrees]
+ */
+fixed normalizeHeading(fixed heading) {
+    if (heading < 0) {
+        heading += FIXED(360);
+    } else if (heading >= FIXED(360)) {
+        heading -= FIXED(360);
+    }
+    return heading;
+}
+
+/*
+ * Updates the published RPS frame position from the estimated robot center.
+ */
+void publishEstimate() {
+    estimate.x = fromFixed(estimate.centerX + fixedMul(FIXED(QR_OFFSET), fixedCos(estimate.headingFixed)));
+    estimate.y = fromFixed(estimate.centerY + fixedMul(FIXED(QR_OFFSET), fixedSin(estimate.headingFixed)));
+    estimate.heading = fromFixed(estimate.headingFixed);
+}
+
+/*
+ * Estimator job: integrates the encoder counts since the last update, then folds in the RPS pose if a new packet arrived.
+ * Encoders only count up, so the direction of each side comes from the last power commanded to it.
+ */
+void updateEstimate() {
+    int flCounts = fl_encoder.Counts();
+    int brCounts = br_encoder.Counts();
+    int flDelta = flCounts - estimate.lastFlCounts;
+    int brDelta = brCounts - estimate.lastBrCounts;
+    estimate.lastFlCounts = flCounts;
+    estimate.lastBrCounts = brCounts;
+
+    if (estimate.valid && (flDelta != 0 || brDelta != 0)) {
+        fixed left = driveLeftSign * flDelta * leftInchesPerCount;
+        fixed right = driveRightSign * brDelta * rightInchesPerCount;
+
+        fixed distance = (left + right) / 2;
+        fixed turn = fixedMul(right - left, degreesPerInch);
+        fixed angle = estimate.headingFixed + turn / 2;
+
+        estimate.centerX += fixedMul(distance, fixedCos(angle));
+        estimate.centerY += fixedMul(distance, fixedSin(angle));
+        estimate.headingFixed = normalizeHeading(estimate.headingFixed + turn);
+    }
+
+    PoseSample *pose = &sensors.pose;
+    if (pose->valid && pose->sequence != estimate.rpsSequence) {
+        estimate.rpsSequence = pose->sequence;
+
+        // Move the RPS position from the QR code back to the robot center
+        fixed heading = toFixed(pose->heading);
+        fixed measuredX = toFixed(pose->x) - fixedMul(FIXED(QR_OFFSET), fixedCos(heading));
+        fixed measuredY = toFixed(pose->y) - fixedMul(FIXED(QR_OFFSET), fixedSin(heading));
+
+        if (!estimate.valid) {
+            estimate.centerX = measuredX;
+            estimate.centerY = measuredY;
+            estimate.headingFixed = heading;
+            estimate.valid = true;
+        } else {
+            fixed errorX = measuredX - estimate.centerX;
+            fixed errorY = measuredY - estimate.centerY;
+            fixed errorHeading = wrapFixed(heading - estimate.headingFixed);
+
+            estimate.positionError = fromFixed(fixedHypot(errorX, errorY));
+            estimate.headingError = fromFixed(errorHeading < 0 ? -errorHeading : errorHeading);
+            if (estimate.positionError > estimate.maxPositionError) {
+                estimate.maxPositionError = estimate.positionError;
+            }
+            if (estimate.headingError > estimate.maxHeadingError) {
+                estimate.maxHeadingError = estimate.headingError;
+            }
+
+            estimate.centerX += fixedMul(FIXED(FUSE_GAIN_POSITION), errorX);
+            estimate.centerY += fixedMul(FIXED(FUSE_GAIN_POSITION), errorY);
+            estimate.headingFixed = normalizeHeading(estimate.headingFixed + fixedMul(FIXED(FUSE_GAIN_HEADING), errorHeading));
+        }
+        estimate.lastCorrection = schedulerClock();
+    }
+
+    if (estimate.valid && schedulerClock() - estimate.lastCorrection >= ESTIMATE_STALE_TIME) {
+        estimate.valid = false;
+    }
+
+    publishEstimate();
+}
+
+/*
+ * Resets both encoder counts and refreshes the sensor snapshot so controllers never see the old counts.
+ * Counts since the last estimator update are integrated first so no odometry is lost.
+ */
+void resetEncoders() {
+    updateEstimate();
     fl_encoder.ResetCounts();
     br_encoder.ResetCounts();
+    estimate.lastFlCounts = 0;
+    estimate.lastBrCounts = 0;
+    sampleSensors();
+}
+
+/*
+ * Given the counts already traveled (@param traveled), the counts left (@param remaining) and the cruise speed (@param percent),
+ * returns the motor percent of the trapezoidal accelerate/cruise/decelerate profile at that point of the drive.
+ * @Returns [motor percent for this point of the profile]
+ */
+float profilePercent(float traveled, float remaining, int percent) {
+    if (percent <= DRIVE_MIN_PERCENT) {
+        return percent;
+    }
+
+    float span = percent - DRIVE_MIN_PERCENT;
+    float decelCounts = DRIVE_DECEL_COUNTS * percent / 100.0;
+
+    float power = percent;
+    float accelPower = DRIVE_MIN_PERCENT + span * traveled / DRIVE_ACCEL_COUNTS;
+    float decelPower = DRIVE_MIN_PERCENT + span * remaining / decelCounts;
+
+    if (accelPower < power) {
+        power = accelPower;
+    }
+    if (decelPower < power) {
+        power = decelPower;
+    }
+    if (power < DRIVE_MIN_PERCENT) {
+        power = DRIVE_MIN_PERCENT;
+    }
+    return power;
+}
+
+/*
+ * Learned turn model. theoreticalDegree assumes a pivot about turnRadius, but the real robot scrubs and coasts,
+ * so the heading change RPS reports after each open-loop turn is fitted, per direction and speed bin, as
+ *   turned = gain * commanded + overshoot
+ * where gain is turnRadius over the effective turning radius. Turns then command (degrees - overshoot) / gain.
+ * The fit is a least squares one with older turns fading out by TURN_FORGET, plus two ideal turns (30 and 90 degrees)
+ * of weight TURN_PRIOR_WEIGHT, so an empty model is the ideal pivot. The sums are kept in TURN_MODEL_FILE across runs.
+ */
+#define TURN_MODEL_FILE "turns.txt"
+#define TURN_BINS 3
+#define TURN_FORGET 0.9
+#define TURN_PRIOR_WEIGHT 0.5
+// Time (in ms) after the motors are cut before an RPS packet is taken as the robot's resting heading,
+// and the most time to wait for one after a turn.
+#define TURN_COAST_TIME 100
+#define TURN_MEASURE_TIMEOUT 400
+// Turns whose measured heading change is this far (in degrees) from the target are not learned from.
+#define TURN_MAX_MISS 45.0
+
+/*
+ * Weighted sums of the (commanded, turned) pairs of one direction and speed bin.
+ */
+struct TurnModel {
+    float weight;
+    float sumCommand;
+    float sumTurned;
+    float sumCommandSquared;
+    float sumProduct;
+};
+
+// Models of left (0) and right (1) turns, by speed bin.
+TurnModel turnModels[2][TURN_BINS];
+int turnsLearned;
+
+/*
+ * Given a turn power (@param percent), returns its speed bin.
+ * @Returns [speed bin index]
+ */
+int turnBin(int percent) {
+    if (percent < 45) {
+        return 0;
+    } else if (percent < 65) {
+        return 1;
+    }
+    return TURN_BINS - 1;
+}
+
+/*
+ * Given a model (@param model) and the gain and overshoot to fill in (@param gain, @param overshoot), solves the fit.
+ */
+void solveTurnModel(const TurnModel &model, float *gain, float *overshoot) {
+    // Two ideal turns keep the fit well posed when every learned turn had the same size
+    float weight = model.weight + 2 * TURN_PRIOR_WEIGHT;
+    float sumCommand = model.sumCommand + TURN_PRIOR_WEIGHT * (30 + 90);
+    float sumTurned = model.sumTurned + TURN_PRIOR_WEIGHT * (30 + 90);
+    float sumSquared = model.sumCommandSquared + TURN_PRIOR_WEIGHT * (30 * 30 + 90 * 90);
+    float sumProduct = model.sumProduct + TURN_PRIOR_WEIGHT * (30 * 30 + 90 * 90);
+
+    float determinant = sumSquared * weight - sumCommand * sumCommand;
+    *gain = (sumProduct * weight - sumCommand * sumTurned) / determinant;
+    if (*gain < 0.5) {
+        *gain = 0.5;
+    } else if (*gain > 2.0) {
+        *gain = 2.0;
+    }
+    *overshoot = (sumTurned - *gain * sumCommand) / weight;
+}
+
+/*
+ * Given a model (@param model), the degrees commanded (@param command) and the degrees RPS saw (@param turned),
+ * adds the turn to the model.
+ */
+void learnTurn(TurnModel *model, float command, float turned) {
+    model->weight = model->weight * TURN_FORGET + 1;
+    model->sumCommand = model->sumCommand * TURN_FORGET + command;
+    model->sumTurned = model->sumTurned * TURN_FORGET + turned;
+    model->sumCommandSquared = model->sumCommandSquared * TURN_FORGET + command * command;
+    model->sumProduct = model->sumProduct * TURN_FORGET + command * turned;
+    turnsLearned++;
+}
+
+/*
+ * @Returns [the robot is stopped and the last RPS packet was taken after it stopped coasting]
+ */
+bool poseAtRest() {
+    return poseFresh() && driveLeftPercent == 0 && driveRightPercent == 0
+            && (int)(sensors.pose.timestamp - driveStopTime) >= TURN_COAST_TIME;
+}
+
+/*
+ * Waits until poseAtRest, or until TURN_MEASURE_TIMEOUT has passed.
+ * @Returns [a resting pose is available]
+ */
+bool waitForRestingPose() {
+    unsigned int start = schedulerClock();
+    while (!poseAtRest() && schedulerClock() - start < TURN_MEASURE_TIMEOUT) {
+        schedulerTick();
+    }
+    return poseAtRest();
+}
+
+/*
+ * A turn waiting for a resting RPS heading to learn from: its model, command, target, the heading it started from
+ * and when its motors were cut. It is learned from once a resting pose arrives before the robot drives again.
+ */
+struct PendingTurn {
+    TurnModel *model;
+    float command;
+    float degrees;
+    int direction;
+    float before;
+    unsigned int stopTime;
+    bool waiting;
+};
+
+PendingTurn pendingTurn;
+
+/*
+ * Learns from the pending turn if the robot has not driven since and a resting heading has arrived.
+ * Called before anything moves the robot again, so a turn is only learned from while the robot sits where it ended.
+ */
+void resolvePendingTurn() {
+    if (!pendingTurn.waiting || pendingTurn.stopTime != driveStopTime || !poseAtRest()) {
+        pendingTurn.waiting = false;
+        return;
+    }
+    pendingTurn.waiting = false;
+
+    float turned = pendingTurn.direction * wrapAngle(sensors.pose.heading - pendingTurn.before);
+    if (fabs(turned - pendingTurn.degrees) < TURN_MAX_MISS) {
+        learnTurn(pendingTurn.model, pendingTurn.command, turned);
+    }
+}
+
+// Kinds of motion the control job can run.
+enum MotionType {
+    MOTION_NONE,
+    MOTION_DRIVE,
+    MOTION_TURN,
+    MOTION_HEADING,
+    MOTION_PATH,
+    MOTION_AXIS
+};
+
+/*
+ * The motion currently run by the control job. Mission code submits a motion and waits for the type to go back to MOTION_NONE.
+ */
+struct Motion {
+    MotionType type;
+    int direction;
+    int percent;
+    float target;
+    int counts;
+    unsigned int startTime;
+
+    // Drive speed estimate
+    unsigned int lastTime;
+    float lastTraveled;
+    float speed;
+
+    // Heading a straight drive holds, and whether RPS was valid when it started
+    float holdHeading;
+    bool holdRps;
+    float holdIntegral;
+
+    // Heading controller state
+    unsigned int settleStart;
+    bool settling;
+    float lastHeading;
+    float lastError;
+    float errorRate;
+
+    // Position correction state: the axis, its tolerance, whether the robot is driving toward the target,
+    // the sign of the last drive and how many times it changed
+    int axis;
+    float tolerance;
+    bool correcting;
+    int driveSign;
+    int reversals;
+
+    // Stall monitor and how the motion ended
+    StallMonitor stall;
+    MotionStatus status;
+};
+
+Motion motion;
+
+/*
+ * Given how it ended (@param status), ends the active motion and stops the motors.
+ */
+void endMotion(MotionStatus status) {
+    stopDrive();
+    motion.status = status;
+    motion.type = MOTION_NONE;
+}
+
+/*
+ * One control step of a distance drive. Follows the trapezoidal profile, steering to hold the heading the drive
+ * started with, and ends the motion once the average of the encoders plus the distance the robot is expected
+ * to coast at its measured speed reaches the target counts.
+ */
+void driveStep() {
+    float traveled = (sensors.flCounts + sensors.brCounts) / 2.0;
+    float remaining = motion.counts - traveled;
+
+    unsigned int elapsed = sensors.time - motion.lastTime;
+    if (elapsed >= 20) {
+        motion.speed = (traveled - motion.lastTraveled) * 1000.0 / elapsed;
+        motion.lastTraveled = traveled;
+        motion.lastTime = sensors.time;
+    }
+
+    telemetry.flCounts = sensors.flCounts;
+    telemetry.brCounts = sensors.brCounts;
+    telemetryUpdate();
+
+    if (remaining <= motion.speed * DRIVE_COAST_TIME) {
+        endMotion(MOTION_OK);
+        return;
+    }
+
+    // Heading hold: the fused heading while RPS is valid, otherwise the turn the encoder difference alone shows.
+    // Encoders only count up, so backward the difference turns the other way
+    float heading;
+    if (motion.holdRps && estimate.valid) {
+        heading = estimate.heading;
+    } else {
+        heading = motion.holdHeading
+                + motion.direction * (sensors.brCounts * fromFixed(rightInchesPerCount)
+                - sensors.flCounts * fromFixed(leftInchesPerCount)) * fromFixed(degreesPerInch);
+    }
+    float error = wrapAngle(motion.holdHeading - heading);
+    float steer = param(P_HOLD_KP) * error + param(P_HOLD_KI) * motion.holdIntegral;
+    if (fabs(steer) < HOLD_MAX_STEER) {
+        motion.holdIntegral += error * CONTROL_PERIOD / 1000.0;
+    }
+    if (steer > HOLD_MAX_STEER) {
+        steer = HOLD_MAX_STEER;
+    } else if (steer < -HOLD_MAX_STEER) {
+        steer = -HOLD_MAX_STEER;
+    }
+
+    // Positive steer turns the robot counterclockwise, whichever way it drives
+    float power = motion.direction * profilePercent(traveled, remaining, motion.percent);
+    setDrive(power - steer, power + steer);
+}
+
+/*
+ * One control step of an encoder turn. Ends the motion once both encoders reach the target counts.
+ */
+void turnStep() {
+    telemetry.flCounts = sensors.flCounts;
+    telemetry.brCounts = sensors.brCounts;
+    telemetryUpdate();
+
+    if (sensors.flCounts >= motion.counts && sensors.brCounts >= motion.counts) {
+        endMotion(MOTION_OK);
+    }
+}
+
+/*
+ * One control step of the PD heading controller. Turn power is scaled with the wrapped heading error, so the robot
+ * always takes the shortest path to the desired heading and eases off as it gets close. Ends the motion once
+ * the heading has stayed within tolerance for HEADING_SETTLE_TIME.
+ */
+void headingStep() {
+    // Use the fused heading from one estimator update for every decision in this step
+    float heading = estimate.heading;
+    unsigned int now = sensors.time;
+    angleIterations++;
+
+    telemetry.heading = heading;
+    telemetryUpdate();
+
+    // No RPS correction for too long, wait for a valid heading
+    if (!estimate.valid) {
+        stopDrive();
+        return;
+    }
+
+    float error = wrapAngle(motion.target - heading);
+
+    // Update the error rate every HEADING_RATE_PERIOD so single encoder counts do not make it jump
+    if (now - motion.lastTime >= HEADING_RATE_PERIOD) {
+        if (motion.lastHeading >= 0) {
+            motion.errorRate = (error - motion.lastError) * 1000.0 / (now - motion.lastTime);
+        }
+        motion.lastHeading = heading;
+        motion.lastError = error;
+        motion.lastTime = now;
+    }
+
+    // Error the robot would end up with if the motors were cut now and it coasted
+    float coastError = error + motion.errorRate * HEADING_COAST_TIME;
+
+    if (fabs(error) <= param(P_HEADING_TOLERANCE)) {
+        stopDrive();
+        if (!motion.settling) {
+            motion.settling = true;
+            motion.settleStart = now;
+        } else if (now - motion.settleStart >= HEADING_SETTLE_TIME) {
+            endMotion(MOTION_OK);
+        }
+        return;
+    }
+    motion.settling = false;
+
+    // Coasting will carry the robot to (or past) the target, so let it
+    if (fabs(coastError) <= param(P_HEADING_TOLERANCE) || coastError * error < 0) {
+        stopDrive();
+        return;
+    }
+
+    float power = param(P_HEADING_KP) * error + param(P_HEADING_KD) * motion.errorRate;
+    if (fabs(power) < HEADING_MIN_PERCENT) {
+        power = error > 0 ? HEADING_MIN_PERCENT : -HEADING_MIN_PERCENT;
+    } else if (fabs(power) > HEADING_MAX_PERCENT) {
+        power = power > 0 ? HEADING_MAX_PERCENT : -HEADING_MAX_PERCENT;
+    }
+
+    // Positive power turns the robot counterclockwise
+    setDrive(-1 * power, power);
+}
+
+/*
+ * One control step of an RPS position correction along one axis. motion.direction is +1 if driving forward increases
+ * the coordinate and -1 if it decreases it. Power scales with the remaining distance, and the band the robot stops in
+ * is narrower than the one that starts a correction, so it cannot chatter around the tolerance. Ends the motion once
+ * the position has stayed inside the tolerance for AXIS_SETTLE_TIME, or with MOTION_OSCILLATING once it would have to
+ * reverse the drive for the AXIS_MAX_REVERSALS time. Whether to reverse is decided on a resting RPS position.
+ */
+void axisStep() {
+    float position = motion.axis == AXIS_X ? estimate.x : estimate.y;
+    unsigned int now = sensors.time;
+
+    telemetry.x = estimate.x;
+    telemetry.y = estimate.y;
+    telemetryUpdate();
+
+    // No RPS correction for too long, wait for a valid position
+    if (!estimate.valid) {
+        stopDrive();
+        motion.correcting = false;
+        motion.settleStart = now;
+        return;
+    }
+
+    float error = motion.target - position;
+    if (now - motion.lastTime >= HEADING_RATE_PERIOD) {
+        motion.errorRate = (error - motion.lastError) * 1000.0 / (now - motion.lastTime);
+        motion.lastError = error;
+        motion.lastTime = now;
+    }
+
+    // Error the robot would end up with if the motors were cut now and it coasted
+    float coastError = error + motion.errorRate * AXIS_COAST_TIME;
+
+    if (motion.correcting) {
+        if (fabs(coastError) <= motion.tolerance * AXIS_STOP_FRACTION || coastError * motion.driveSign < 0) {
+            stopDrive();
+            motion.correcting = false;
+            motion.settleStart = now;
+        }
+    } else if (fabs(error) > motion.tolerance) {
+        int sign = error > 0 ? 1 : -1;
+        if (motion.driveSign != 0 && sign != motion.driveSign) {
+            // Odometry moves in whole encoder counts, coarser than a tight tolerance, so only reverse on an RPS
+            // position taken at rest
+            if (!poseAtRest()) {
+                motion.settleStart = now;
+                return;
+            }
+            float restError = motion.target - (motion.axis == AXIS_X ? sensors.pose.x : sensors.pose.y);
+            if (fabs(restError) <= motion.tolerance) {
+                if (now - motion.settleStart >= AXIS_SETTLE_TIME) {
+                    endMotion(MOTION_OK);
+                }
+                return;
+            }
+            motion.reversals++;
+        }
+        if (motion.reversals >= AXIS_MAX_REVERSALS) {
+            endMotion(MOTION_OSCILLATING);
+            return;
+        }
+        motion.driveSign = sign;
+        motion.correcting = true;
+    }
+
+    if (!motion.correcting) {
+        if (now - motion.settleStart >= AXIS_SETTLE_TIME) {
+            endMotion(MOTION_OK);
+        }
+        return;
+    }
+
+    float power = AXIS_MAX_PERCENT;
+    if (fabs(error) < AXIS_SLOW_DISTANCE) {
+        power = AXIS_MIN_PERCENT + (AXIS_MAX_PERCENT - AXIS_MIN_PERCENT) * fabs(error) / AXIS_SLOW_DISTANCE;
+    }
+    power *= motion.driveSign * motion.direction;
+    setDrive(power, power);
+}
+
+// Pure pursuit path following. The robot steers toward the point PATH_LOOKAHEAD inches ahead on the path.
+#define PATH_LOOKAHEAD 3.0
+#define MAX_PATH_POINTS 8
+// Distance (in inches) at which a waypoint counts as reached, and the end tolerance when stopping at the last one.
+#define PATH_WAYPOINT_RADIUS 1.5
+#define PATH_END_TOLERANCE 0.3
+// Distance (in inches) over which the robot slows down before a stop at the end of the path.
+#define PATH_SLOW_DISTANCE 4.0
+// Heading error (in degrees) above which the robot pivots toward the path before driving.
+#define PATH_PIVOT_ANGLE 60.0
+
+/*
+ * A point on a path, in the RPS frame.
+ */
+struct Waypoint {
+    float x;
+    float y;
+};
+
+/*
+ * The path followed by a MOTION_PATH motion.
+ */
+struct Path {
+    Waypoint points[MAX_PATH_POINTS];
+    int count;
+    int next;
+    bool stopAtEnd;
+};
+
+Path path;
+
+/*
+ * One control step of pure pursuit path following. Picks the lookahead point on the path, turns the angle to it into
+ * a curvature, and sets the left and right wheel speeds to drive that arc. Intermediate waypoints are passed without stopping.
+ * If the path does not end with a stop, the motors are left running so the next motion blends in.
+ */
+void pathStep() {
+    telemetry.flCounts = sensors.flCounts;
+    telemetry.brCounts = sensors.brCounts;
+    telemetry.x = estimate.x;
+    telemetry.y = estimate.y;
+    telemetry.heading = estimate.heading;
+    telemetryUpdate();
+
+    if (!estimate.valid) {
+        stopDrive();
+        return;
+    }
+
+    // The point that follows the path. Driving backward the QR code trails the robot and steering it would be
+    // unstable, so the robot center follows the path instead
+    float trackX = motion.direction > 0 ? estimate.x : fromFixed(estimate.centerX);
+    float trackY = motion.direction > 0 ? estimate.y : fromFixed(estimate.centerY);
+
+    // Skip past every waypoint that is already within reach
+    Waypoint *last = &path.points[path.count - 1];
+    while (path.next < path.count - 1) {
+        fixed dx = toFixed(path.points[path.next].x - trackX);
+        fixed dy = toFixed(path.points[path.next].y - trackY);
+        if (fixedHypot(dx, dy) > FIXED(PATH_WAYPOINT_RADIUS)) {
+            break;
+        }
+        path.next++;
+    }
+
+    fixed endX = toFixed(last->x - trackX);
+    fixed endY = toFixed(last->y - trackY);
+    float endDistance = fromFixed(fixedHypot(endX, endY));
+
+    // Done once within tolerance of the end, or once the end is behind the robot on the last segment
+    fixed along = motion.direction * (fixedMul(endX, fixedCos(estimate.headingFixed)) + fixedMul(endY, fixedSin(estimate.headingFixed)));
+    if (path.next == path.count - 1 && (endDistance < PATH_END_TOLERANCE || along < 0)) {
+        if (path.stopAtEnd) {
+            endMotion(MOTION_OK);
+        } else {
+            motion.status = MOTION_OK;
+            motion.type = MOTION_NONE;
+        }
+        return;
+    }
+
+    // Lookahead point: the next waypoint, pulled in to PATH_LOOKAHEAD if it is further away
+    fixed dx = toFixed(path.points[path.next].x - trackX);
+    fixed dy = toFixed(path.points[path.next].y - trackY);
+    fixed distance = fixedHypot(dx, dy);
+    if (distance == 0) {
+        return;
+    }
+    if (distance > FIXED(PATH_LOOKAHEAD)) {
+        distance = FIXED(PATH_LOOKAHEAD);
+    }
+
+    // Angle to the lookahead point; when driving backward the back of the robot is the front
+    fixed bearing = fixedAtan2(dy, dx);
+    fixed facing = motion.direction > 0 ? estimate.headingFixed : estimate.headingFixed + FIXED(180);
+    fixed alpha = wrapFixed(bearing - facing);
+
+    if (alpha > FIXED(PATH_PIVOT_ANGLE) || alpha < FIXED(-PATH_PIVOT_ANGLE)) {
+        float pivot = alpha > 0 ? HEADING_MAX_PERCENT : -HEADING_MAX_PERCENT;
+        setDrive(-1 * pivot, pivot);
+        return;
+    }
+
+    float speed = motion.percent;
+    if (path.stopAtEnd && path.next == path.count - 1 && endDistance < PATH_SLOW_DISTANCE) {
+        speed = DRIVE_MIN_PERCENT + (motion.percent - DRIVE_MIN_PERCENT) * endDistance / PATH_SLOW_DISTANCE;
+    }
+
+    // Curvature of the arc through the lookahead point, then wheel speeds for that arc
+    float curvature = fromFixed(fixedDiv(2 * fixedSin(alpha), distance));
+    float left = speed * (1 - curvature * turnRadius);
+    float right = speed * (1 + curvature * turnRadius);
+
+    float largest = fabs(left) > fabs(right) ? fabs(left) : fabs(right);
+    if (largest > 100) {
+        left *= 100 / largest;
+        right *= 100 / largest;
+    }
+
+    // Driving backward mirrors the arc: both sides reverse and swap
+    if (motion.direction > 0) {
+        setDrive(left, right);
+    } else {
+        setDrive(-1 * right, -1 * left);
+    }
+}
+
+/*
+ * Control job: runs one step of the active motion.
+ */
+void controlMotion() {
+    if (motion.type != MOTION_NONE) {
+        countIteration();
+
+        // Least encoder progress of both sides together in a stall window, at the commanded power
+        float power = fabs(driveLeftPercent) + fabs(driveRightPercent);
+        float expected = power / 100 * FULL_SPEED_COUNTS * STALL_WINDOW / 1000;
+        float counts = (float)sensors.flCounts + sensors.brCounts;
+        MotionStatus status = stallCheck(&motion.stall, counts, expected * STALL_FRACTION, power > 0);
+        if (status != MOTION_OK) {
+            endMotion(status);
+            return;
+        }
+    }
+
+    switch (motion.type) {
+    case MOTION_DRIVE:
+        driveStep();
+        break;
+    case MOTION_TURN:
+        turnStep();
+        break;
+    case MOTION_HEADING:
+        headingStep();
+        break;
+    case MOTION_PATH:
+        pathStep();
+        break;
+    case MOTION_AXIS:
+        axisStep();
+        break;
+    default:
+        break;
+    }
+}
+
+/*
+ * Given a motion type (@param type), a direction (@param direction), a speed (@param percent), a target (@param target)
+ * and a time budget in ms (@param budget), resets the motion state so the control job starts running it on its next step.
+ */
+void startMotion(MotionType type, int direction, int percent, float target, unsigned int budget) {
+    // Time the motion from a fresh sample so every step compares times from the same clock reading order
+    sampleSensors();
+    resolvePendingTurn();
+
+    motion.direction = direction;
+    motion.percent = percent;
+    motion.target = target;
+    motion.counts = 0;
+    motion.startTime = sensors.time;
+    motion.lastTime = motion.startTime;
+    motion.lastTraveled = 0;
+    motion.speed = 0;
+    motion.settling = false;
+    motion.lastHeading = -1;
+    motion.lastError = 0;
+    motion.errorRate = 0;
+    motion.status = MOTION_OK;
+    stallStart(&motion.stall, budget, (float)sensors.flCounts + sensors.brCounts);
+    motion.type = type;
+    currentStep++;
+}
+
+/*
+ * Given a direction (@param direction, 1 for move_forward and -1 for move_backward), a cruise speed (@param percent)
+ * and a desired distance (@param inches), submits a profiled encoder drive to the control job.
+ */
+void submitDrive(int direction, int percent, float inches) {
+    resetEncoders();
+
+    telemetryBegin(direction > 0 ? "Moving forward" : "Moving backward");
+    telemetry.target = inches;
+
+    startMotion(MOTION_DRIVE, direction, percent, inches,
+            primitiveBudget(direction > 0 ? PRIM_FORWARD : PRIM_BACKWARD, inches, percent));
+    motion.counts = theoreticalCounts(inches);
+    motion.holdHeading = estimate.heading;
+    motion.holdRps = estimate.valid;
+    motion.holdIntegral = 0;
+    telemetry.targetCounts = motion.counts;
+}
+
+/*
+ * Given a direction (@param direction, 1 for left and -1 for right), a motor speed (@param percent)
+ * and a desired degree (@param degrees), submits an encoder turn about the centerpoint of the robot to the control job.
+ */
+void submitTurn(int direction, int percent, float degrees) {
+    resetEncoders();
+
+    telemetryBegin(direction > 0 ? "Turning left" : "Turning right");
+    telemetry.target = degrees;
+
+    startMotion(MOTION_TURN, direction, percent, degrees,
+            primitiveBudget(direction > 0 ? PRIM_LEFT : PRIM_RIGHT, degrees, percent));
+    motion.counts = theoreticalDegree(degrees);
+    telemetry.targetCounts = motion.counts;
+
+    // Positive direction turns the robot counterclockwise
+    setDrive(-1 * direction * percent, direction * percent);
+}
+
+/*
+ * Given a desired angle (@param desiredDeg), submits a PD heading correction to the control job.
+ */
+void submitHeading(float desiredDeg) {
+    telemetryBegin("Turning to heading");
+    telemetry.target = desiredDeg;
+
+    startMotion(MOTION_HEADING, 0, 0, desiredDeg, primitiveBudget(PRIM_HEADING, 0, 0));
+}
+
+/*
+ * Given the primitive it runs as (@param primitive), an axis (@param axis, AXIS_X or AXIS_Y), which way driving forward
+ * moves along it (@param facing, 1 if it increases the coordinate, -1 if it decreases it), an absolute target coordinate
+ * (@param target) and a tolerance in inches (@param tolerance), submits an RPS position correction to the control job.
+ */
+void submitAxis(int primitive, int axis, int facing, float target, float tolerance) {
+    telemetryBegin(axis == AXIS_X ? "Correcting X" : "Correcting Y");
+    telemetry.target = target;
+
+    float position = axis == AXIS_X ? estimate.x : estimate.y;
+    startMotion(MOTION_AXIS, facing, AXIS_MAX_PERCENT, target, primitiveBudget(primitive, target - position, AXIS_MAX_PERCENT));
+    motion.axis = axis;
+    motion.tolerance = tolerance;
+    motion.correcting = false;
+    motion.driveSign = 0;
+    motion.reversals = 0;
+    motion.lastError = target - position;
+    motion.settleStart = motion.startTime;
+}
+
+/*
+ * Runs the scheduler until the submitted motion has finished.
+ * @Returns [how the motion ended]
+ */
+MotionStatus waitForMotion() {
+    while (motion.type != MOTION_NONE) {
+        schedulerTick();
+    }
+    return motion.status;
+}
+
+/*
+ * @Returns [encoder counts the last drive or turn fell short of its target, negative if it went past]
+ */
+float countsRemaining() {
+    return motion.counts - (sensors.flCounts + sensors.brCounts) / 2.0;
+}
+
+/*
+ * Given the waypoints (@param points, @param count) in the RPS frame, a direction (@param direction, 1 forward, -1 backward),
+ * a speed (@param percent) and whether to stop at the last waypoint (@param stopAtEnd), follows the path without stopping
+ * at the intermediate waypoints. If stopAtEnd is false the robot is still moving when this returns.
+ * Driving forward the QR code follows the waypoints, driving backward the robot center does.
+ * @Returns [how the path ended]
+ */
+MotionStatus followPath(const Waypoint *points, int count, int direction, int percent, bool stopAtEnd) {
+    PROFILE_SCOPE("followPath", PROFILE_DRIVE);
+    if (count > MAX_PATH_POINTS) {
+        count = MAX_PATH_POINTS;
+    }
+    for (int i = 0; i < count; i++) {
+        path.points[i] = points[i];
+    }
+    path.count = count;
+    path.next = 0;
+    path.stopAtEnd = stopAtEnd;
+
+    telemetryBegin("Following path");
+    telemetry.target = count;
+
+    beginEvent(PRIM_PATH, count);
+    startMotion(MOTION_PATH, direction, percent, 0, primitiveBudget(PRIM_PATH, 0, percent));
+    MotionStatus status = waitForMotion();
+    if (count > 0) {
+        const Waypoint &end = path.points[count - 1];
+        endEvent(hypot(end.x - estimate.x, end.y - estimate.y), status);
+    } else {
+        endEvent(0, status);
+    }
+    return status;
+}
+
+/*
+ * Given a direction (@param direction, 1 left, -1 right), a speed (@param percent) and the desired degrees
+ * (@param degrees), turns with the command from the learned model. The heading change is learned from later,
+ * by resolvePendingTurn, so the turn itself never waits for RPS.
+ * @Returns [how the turn ended]
+ */
+MotionStatus modelTurn(int direction, int percent, float degrees) {
+    TurnModel *model = &turnModels[direction > 0 ? 0 : 1][turnBin(percent)];
+    float gain, overshoot;
+    solveTurnModel(*model, &gain, &overshoot);
+    float command = (degrees - overshoot) / gain;
+    if (command < 0) {
+        command = 0;
+    }
+
+    // Heading the turn starts from: the RPS heading if the robot has been resting, otherwise the fused estimate
+    bool known = poseAtRest() || estimate.valid;
+    float before = poseAtRest() ? sensors.pose.heading : estimate.heading;
+
+    submitTurn(direction, percent, command);
+    MotionStatus status = waitForMotion();
+
+    pendingTurn.model = model;
+    pendingTurn.command = command;
+    pendingTurn.degrees = degrees;
+    pendingTurn.direction = direction;
+    pendingTurn.before = before;
+    pendingTurn.stopTime = driveStopTime;
+    pendingTurn.waiting = status == MOTION_OK && known;
+    return status;
+}
+
+/*
+ * Loads the turn model sums from TURN_MODEL_FILE. Without the file every model is the ideal pivot.
+ */
+void loadTurnModel() {
+    FEHFile *file = SD.FOpen(TURN_MODEL_FILE, "r");
+    if (file == 0) {
+        return;
+    }
+    int direction, bin;
+    TurnModel model;
+    while (!SD.FEof(file) && SD.FScanf(file, "%d %d %f %f %f %f %f", &direction, &bin, &model.weight, &model.sumCommand,
+            &model.sumTurned, &model.sumCommandSquared, &model.sumProduct) == 7) {
+        if (direction >= 0 && direction < 2 && bin >= 0 && bin < TURN_BINS) {
+            turnModels[direction][bin] = model;
+        }
+    }
+    SD.FClose(file);
+}
+
+/*
+ * Saves the turn model sums to TURN_MODEL_FILE.
+ */
+void saveTurnModel() {
+    FEHFile *file = SD.FOpen(TURN_MODEL_FILE, "w");
+    if (file == 0) {
+        return;
+    }
+    for (int direction = 0; direction < 2; direction++) {
+        for (int bin = 0; bin < TURN_BINS; bin++) {
+            const TurnModel &model = turnModels[direction][bin];
+            SD.FPrintf(file, "%d %d %f %f %f %f %f\n", direction, bin, model.weight, model.sumCommand,
+                    model.sumTurned, model.sumCommandSquared, model.sumProduct);
+        }
+    }
+    SD.FClose(file);
+}
+
+/*
+ * Geometry calibration. Turn GEOMETRY_CALIBRATION on and the robot runs CALIBRATION_ROUNDS of a forward drive,
+ * a left spin, a right spin and a backward drive instead of the course, taking a resting RPS pose around each.
+ * A straight move of D inches that turned by dtheta radians moved the left wheel D - T * dtheta and the right wheel
+ * D + T * dtheta, and a spin by dtheta moved both wheels T * |dtheta|, where T is the turn radius. With the counts
+ * that gives the inches per count of each wheel from the straight moves and T from the spins, which are solved for
+ * in turns (least squares each) until they settle. The result goes to GEOMETRY_FILE and is used from the next boot.
+ */
+#ifndef GEOMETRY_CALIBRATION
+#define GEOMETRY_CALIBRATION 0
+#endif
+#if GEOMETRY_CALIBRATION
+#define CALIBRATION_ROUNDS 3
+#define CALIBRATION_DISTANCE 12.0
+#define CALIBRATION_DEGREES 120.0
+#define CALIBRATION_PERCENT 35
+#define CALIBRATION_ITERATIONS 10
+
+/*
+ * One calibration move: whether it was a spin, the counts on each encoder, the distance the center moved
+ * (in inches) and the heading change (in radians), positive for a spin the way it was commanded and for a drive
+ * the way the right wheel going further would turn it.
+ */
+struct CalibrationMove {
+    bool spin;
+    int left;
+    int right;
+    float distance;
+    float turned;
+};
+
+/*
+ * Waits for a resting RPS pose and gives the robot center (@param x, @param y) and heading (@param heading) from it.
+ * @Returns [a resting pose was available]
+ */
+bool restingCenter(float *x, float *y, float *heading) {
+    if (!waitForRestingPose()) {
+        return false;
+    }
+    fixed angle = toFixed(sensors.pose.heading);
+    *x = sensors.pose.x - QR_OFFSET * fromFixed(fixedCos(angle));
+    *y = sensors.pose.y - QR_OFFSET * fromFixed(fixedSin(angle));
+    *heading = sensors.pose.heading;
+    return true;
+}
+
+/*
+ * Runs the calibration moves, solves for the geometry and saves it if it is plausible.
+ */
+void calibrateGeometry() {
+    CalibrationMove moves[CALIBRATION_ROUNDS * 4];
+    int count = 0;
+
+    LCD.Clear();
+    LCD.WriteLine("Calibrating geometry");
+    for (int round = 0; round < CALIBRATION_ROUNDS; round++) {
+        for (int step = 0; step < 4; step++) {
+            float startX, startY, startHeading;
+            bool started = restingCenter(&startX, &startY, &startHeading);
+
+            // Forward, left, right, backward, so each round ends about where it started
+            int direction = step == 0 || step == 1 ? 1 : -1;
+            bool spin = step == 1 || step == 2;
+            if (spin) {
+                submitTurn(direction, CALIBRATION_PERCENT, CALIBRATION_DEGREES);
+            } else {
+                submitDrive(direction, CALIBRATION_PERCENT, CALIBRATION_DISTANCE);
+            }
+            MotionStatus status = waitForMotion();
+
+            float endX, endY, endHeading;
+            if (!restingCenter(&endX, &endY, &endHeading) || !started || status != MOTION_OK) {
+                continue;
+            }
+            CalibrationMove &move = moves[count++];
+            move.spin = spin;
+            move.left = sensors.flCounts;
+            move.right = sensors.brCounts;
+            move.distance = sqrt((endX - startX) * (endX - startX) + (endY - startY) * (endY - startY));
+            // Backward the wheel difference turns the robot the other way, and a right spin turns it clockwise
+            move.turned = wrapAngle(endHeading - startHeading) * PI / 180 * direction;
+        }
+    }
+
+    float left = 2 * PI * leftWheelRadius / COUNTS_PER_REV;
+    float right = 2 * PI * rightWheelRadius / COUNTS_PER_REV;
+    float turn = turnRadius;
+    int drives = 0, spins = 0;
+    for (int i = 0; i < count; i++) {
+        if (moves[i].spin) {
+            spins++;
+        } else {
+            drives++;
+        }
+    }
+    if (drives > 0 && spins > 0) {
+        for (int iteration = 0; iteration < CALIBRATION_ITERATIONS; iteration++) {
+            float leftSum = 0, leftSquares = 0, rightSum = 0, rightSquares = 0;
+            for (int i = 0; i < count; i++) {
+                const CalibrationMove &move = moves[i];
+                if (!move.spin) {
+                    leftSum += move.left * (move.distance - turn * move.turned);
+                    leftSquares += (float)move.left * move.left;
+                    rightSum += move.right * (move.distance + turn * move.turned);
+                    rightSquares += (float)move.right * move.right;
+                }
+            }
+            if (leftSquares > 0 && rightSquares > 0) {
+                left = leftSum / leftSquares;
+                right = rightSum / rightSquares;
+            }
+
+            float turnSum = 0, turnSquares = 0;
+            for (int i = 0; i < count; i++) {
+                const CalibrationMove &move = moves[i];
+                if (move.spin) {
+                    turnSum += move.turned * (left * move.left + right * move.right) / 2;
+                    turnSquares += move.turned * move.turned;
+                }
+            }
+            if (turnSquares > 0) {
+                turn = turnSum / turnSquares;
+            }
+        }
+    }
+
+    float leftRadius = left * COUNTS_PER_REV / (2 * PI);
+    float rightRadius = right * COUNTS_PER_REV / (2 * PI);
+    LCD.Clear();
+    LCD.Write("Moves: ");
+    LCD.WriteLine(count);
+    LCD.Write("Left wheel: ");
+    LCD.WriteLine(leftRadius);
+    LCD.Write("Right wheel: ");
+    LCD.WriteLine(rightRadius);
+    LCD.Write("Turn radius: ");
+    LCD.WriteLine(turn);
+    if (drives > 0 && spins > 0
+            && leftRadius > WHEEL_RADIUS * 0.7 && leftRadius < WHEEL_RADIUS * 1.3
+            && rightRadius > WHEEL_RADIUS * 0.7 && rightRadius < WHEEL_RADIUS * 1.3
+            && turn > ROBOT_RADIUS * 0.6 && turn < ROBOT_RADIUS * 1.5) {
+        setGeometry(leftRadius, rightRadius, turn);
+        saveGeometry();
+        LCD.WriteLine("Saved to SD");
+    } else {
+        LCD.WriteLine("Implausible, not saved");
+    }
+}
+#endif
+
+/*
+ * Given a motor speed (@param percent) and a desired distance (@param inches),
+ * drives the robot forward in the direction it is facing.
+ * @Returns [how the motion ended]
+ */
+MotionStatus move_forward(int percent, float inches) {
+    PROFILE_SCOPE("move_forward", PROFILE_DRIVE);
+    beginEvent(PRIM_FORWARD, inches);
+    submitDrive(1, percent, inches);
+    MotionStatus status = waitForMotion();
+    endEvent(countsRemaining() * fromFixed(inchesPerCount), status);
+    return status;
+}
+
+/*
+ * Given a motor speed (@param percent) and a desired distance (@param inches),
+ * drives the robot in the opposite direction from move_forward.
+ * @Returns [how the motion ended]
+ */
+MotionStatus move_backward(int percent, float inches) {
+    PROFILE_SCOPE("move_backward", PROFILE_DRIVE);
+    beginEvent(PRIM_BACKWARD, inches);
+    submitDrive(-1, percent, inches);
+    MotionStatus status = waitForMotion();
+    endEvent(countsRemaining() * fromFixed(inchesPerCount), status);
+    return status;
+}
+
+/*
+ * Given a motor speed (@param percent) and a desired degree (@param degrees),
+ * turns the robot to the left about the centerpoint of the robot, corrected by the learned turn model.
+ * @Returns [how the motion ended]
+ */
+MotionStatus turnLeft(int percent, float degrees) {
+    PROFILE_SCOPE("turnLeft", PROFILE_DRIVE);
+    beginEvent(PRIM_LEFT, degrees);
+    MotionStatus status = modelTurn(1, percent, degrees);
+    endEvent(countsRemaining() / fromFixed(countsPerDegree), status);
+    return status;
+}
+
+/*
+ * Given a motor speed (@param percent) and a desired degree (@param degrees),
+ * turns the robot to the right about the centerpoint of the robot, corrected by the learned turn model.
+ * @Returns [how the motion ended]
+ */
+MotionStatus turnRight(int percent, float degrees) {
+    PROFILE_SCOPE("turnRight", PROFILE_DRIVE);
+    beginEvent(PRIM_RIGHT, degrees);
+    MotionStatus status = modelTurn(-1, percent, degrees);
+    endEvent(countsRemaining() / fromFixed(countsPerDegree), status);
+    return status;
+}
+
+/*
+ * Start light detector. The CdS cell is sampled every START_PERIOD ms in a tight loop that never touches the screen.
+ * A slow baseline follows the ambient light and a fast filter follows the cell. The start triggers once the filtered
+ * drop below the baseline is past START_LEVEL, or past START_SLOPE_LEVEL while falling faster than START_SLOPE,
+ * for START_DEBOUNCE samples in a row. Both levels are above the 0.2 V a passing shadow causes. Reaction latency is
+ * measured from the first sample that left the noise band.
+ */
+#define START_PERIOD 1
+#define START_TIMEOUT 30000
+#define START_LEVEL 0.4
+#define START_SLOPE_LEVEL 0.25
+// Drop (in volts) over START_SLOPE_TIME ms that counts as the light coming on.
+#define START_SLOPE 0.1
+#define START_SLOPE_TIME 8
+#define START_DEBOUNCE 3
+#define START_ONSET 0.05
+#define START_BASELINE_GAIN 0.002
+#define START_FILTER_GAIN 0.3
+// Time (in ms) after the start during which redDiff keeps following the deepest drop, while the light settles.
+#define START_LIGHT_WINDOW 200
+
+// Times (in ms) the light started to come on and the start triggered.
+unsigned int startOnsetTime;
+unsigned int startTriggerTime;
+bool startTimedOut;
+// Filtered CdS value, kept by the start light job after the start.
+float startLevel;
+
+/*
+ * Start light job: for START_LIGHT_WINDOW after the start, keeps redDiff at the deepest CdS drop seen,
+ * since the cell is still settling when the start triggers.
+ */
+void trackStartLight() {
+    if (sensors.time - startTriggerTime >= START_LIGHT_WINDOW) {
+        return;
+    }
+    startLevel += START_FILTER_GAIN * (sensors.cds - startLevel);
+    if (ambient - startLevel > redDiff) {
+        redDiff = ambient - startLevel;
+    }
+}
+
+/*
+ * Function called at the beginning to start off based on a light difference,
+ * or if 30 seconds has passed. Also stores the general difference between ambient and red light.
+ */
+void waitForLight() {
+    LCD.Clear();
+    LCD.WriteLine("Looking for Red Light...");
+
+    float baseline = ambient;
+    float filtered = ambient;
+    float history[START_SLOPE_TIME];
+    for (int i = 0; i < START_SLOPE_TIME; i++) {
+        history[i] = ambient;
+    }
+
+    unsigned int start = schedulerClock();
+    unsigned int next = start;
+    int samples = 0;
+    int held = 0;
+    startOnsetTime = 0;
+    startTimedOut = false;
+
+    // If 30 seconds pass and no light is read, just start
+    while (held < START_DEBOUNCE) {
+        while ((int)(schedulerClock() - next) < 0);
+        unsigned int now = schedulerClock();
+        next += START_PERIOD;
+        if (now - start >= START_TIMEOUT) {
+            startTimedOut = true;
+            break;
+        }
 
-    int counts = theoreticalCounts(inches);
+        float value = cds.Value();
+        filtered += START_FILTER_GAIN * (value - filtered);
+        float drop = baseline - filtered;
+        float slope = history[samples % START_SLOPE_TIME] - filtered;
+        history[samples % START_SLOPE_TIME] = filtered;
+        samples++;
+
+        bool triggered = drop >= START_LEVEL || (drop >= START_SLOPE_LEVEL && slope >= START_SLOPE);
+        if (triggered) {
+            held++;
+        } else {
+            held = 0;
+        }
 
-    //Set motors to desired percent. Some motors have to turn backwards, so make percent negative.
-    bl_motor.SetPercent(-1 * percent);
-    fr_motor.SetPercent(percent);
-    fl_motor.SetPercent(-1 * percent);
-    br_motor.SetPercent(percent);
+        if (drop < START_ONSET) {
+            // Only follow the ambient light while nothing is happening
+            baseline += START_BASELINE_GAIN * (filtered - baseline);
+            startOnsetTime = 0;
+        } else if (startOnsetTime == 0) {
+            startOnsetTime = now;
+        }
+    }
 
-    //While the average of the left or right encoders is less than theoretical counts,
-    //keep running motors
-    while(fl_encoder.Counts() < counts || br_encoder.Counts() < counts) {
-        LCD.Clear();
-        LCD.Write("Moving forward ");
-        LCD.Write(inches);
-        LCD.WriteLine(" inches");
-        LCD.Write("THEORETICAL COUNTS: ");
-        LCD.WriteLine(counts);
-        LCD.Write("Actual BRE Counts: ");
-        LCD.WriteLine(br_encoder.Counts());
-        LCD.Write("Actual FLE Counts: ");
-        LCD.WriteLine(fl_encoder.Counts());
-    }
-
-    //Turn off motors
-    bl_motor.Stop();
-    fr_motor.Stop();
-    fl_motor.Stop();
-    br_motor.Stop();
+    startTriggerTime = schedulerClock();
+    if (startOnsetTime == 0) {
+        startOnsetTime = startTriggerTime;
+    }
+    firstDriveTime = 0;
+
+    ambient = baseline;
+    redDiff = ambient - filtered;
+    startLevel = filtered;
 }
 
 /*
- * Given a motor speed (@param percent) and a desired degree (@param degrees),
- * turns the robot to the left about the centerpoint of the robot.
+ * Adds the sampling, control, telemetry and logging jobs to the scheduler.
  */
-void turnLeft(int percent, float degrees) {
-    //Reset all encoder counts
-    fl_encoder.ResetCounts();
-    br_encoder.ResetCounts();
-
-    int counts = theoreticalDegree(degrees);
-
-    //Set motors to desired percent. Some motors have to turn backwards, so make percent negative.
-    bl_motor.SetPercent(-1 * percent);
-    fr_motor.SetPercent(-1 * percent);
-    fl_motor.SetPercent(-1 * percent);
-    br_motor.SetPercent(-1 * percent);
-
-    //While the average of the left and right encoders is less than theoretical counts,
-    //keep running motors
-    while(fl_encoder.Counts() < counts || br_encoder.Counts() < counts) {
-        LCD.Clear();
-        LCD.Write("Turning left ");
-        LCD.Write(degrees);
-        LCD.WriteLine(" degrees");
-        LCD.Write("THEORETICAL COUNTS: ");
-        LCD.WriteLine(counts);
-        LCD.Write("Actual BRE Counts: ");
-        LCD.WriteLine(br_encoder.Counts());
-        LCD.Write("Actual FLE Counts: ");
-        LCD.WriteLine(fl_encoder.Counts());
-    }
-
-    //Turn off motors
-    bl_motor.Stop();
-    fr_motor.Stop();
-    fl_motor.Stop();
-    br_motor.Stop();
+void startScheduler() {
+    jobCount = 0;
+    addJob("Sample", sampleSensors, SAMPLE_PERIOD);
+    addJob("RPS", samplePose, POSE_PERIOD);
+    addJob("Estimate", updateEstimate, ESTIMATE_PERIOD);
+    addJob("Control", controlMotion, CONTROL_PERIOD);
+    addJob("Display", telemetryPaint, TELEMETRY_PERIOD);
+    addJob("Log", recordSample, LOG_PERIOD);
+    addJob("Flush", flushRecorder, FLUSH_PERIOD);
+    addJob("Start", trackStartLight, SAMPLE_PERIOD);
+    addJob("Battery", sampleBattery, BATTERY_PERIOD);
+    nextTick = schedulerClock();
+    sampleSensors();
+    sampleBattery();
 }
 
 /*
- * Given a motor speed (@param percent) and a desired degree (@param degrees),
- * turns the robot to the right about the centerpoint of the robot.
+ * Shows the run count, worst jitter and overrun count of every scheduler job, then the RPS, estimator and recorder counters.
  */
-void turnRight(int percent, float degrees) {
-    //Reset all encoder counts
-    fl_encoder.ResetCounts();
-    br_encoder.ResetCounts();
+void schedulerReport() {
+    LCD.Clear();
+    LCD.WriteLine("Job  Runs  Jitter  Overruns");
+    for (int i = 0; i < jobCount; i++) {
+        LCD.Write(jobs[i].name);
+        LCD.Write(" ");
+        LCD.Write(jobs[i].runs);
+        LCD.Write(" ");
+        LCD.Write((int)jobs[i].maxJitter);
+        LCD.Write(" ");
+        LCD.WriteLine(jobs[i].overruns);
+    }
 
-    int counts = theoreticalDegree(degrees);
+    // How often the RPS was polled and how many packets the gate rejected
+    LCD.Write("RPS reads: ");
+    LCD.Write((int)rpsReads);
+    LCD.Write(" rejects: ");
+    LCD.WriteLine(poseRejects);
+
+    // How far the odometry had drifted from RPS when packets arrived
+    LCD.Write("Max err: ");
+    LCD.Write(estimate.maxPositionError);
+    LCD.Write(" in ");
+    LCD.Write(estimate.maxHeadingError);
+    LCD.WriteLine(" deg");
+
+    // Flight recorder cost and losses
+    LCD.Write("Rec: ");
+    LCD.Write(recorderRecords);
+    LCD.Write(" key ");
+    LCD.Write(recorderKeyframes);
+    LCD.Write(" drop ");
+    LCD.WriteLine(recorderDropped);
+    LCD.Write("Rec us/sample: ");
+    LCD.Write((int)recorderBenchmark());
+    LCD.Write(" flush ms: ");
+    LCD.WriteLine((int)recorderMaxFlush);
+}
 
-    //Set motors to desired percent. Some motors have to turn backwards, so make percent negative.
-    bl_motor.SetPercent(percent);
-    fr_motor.SetPercent(percent);
-    fl_motor.SetPercent(percent);
-    br_motor.SetPercent(percent);
+/*
+ * How an RPS position correction ended: its status, the error left (target minus position, in inches)
+ * and how long it took (in ms).
+ */
+struct AxisResult {
+    MotionStatus status;
+    float error;
+    unsigned int elapsed;
+};
 
-    //While the average of the left and right encoders is less than theoretical counts,
-    //keep running motors
-    while(fl_encoder.Counts() < counts || br_encoder.Counts() < counts) {
-        LCD.Clear();
-        LCD.Write("Turning right ");
-        LCD.Write(degrees);
-        LCD.WriteLine(" degrees");
-        LCD.Write("THEORETICAL COUNTS: ");
-        LCD.WriteLine(counts);
-        LCD.Write("Actual BRE Counts: ");
-        LCD.WriteLine(br_encoder.Counts());
-        LCD.Write("Actual FLE Counts: ");
-        LCD.WriteLine(fl_encoder.Counts());
-    }
-
-    //Turn off motors
-    bl_motor.Stop();
-    fr_motor.Stop();
-    fl_motor.Stop();
-    br_motor.Stop();
+/*
+ * Given the primitive it runs as (@param primitive), an axis (@param axis, AXIS_X or AXIS_Y), which way driving forward
+ * moves along it (@param facing, 1 if it increases the coordinate, -1 if it decreases it), an absolute target coordinate
+ * (@param target) and a tolerance in inches (@param tolerance), drives straight forward or backward until the robot
+ * is at the target coordinate. The RPS_X and RPS_Y corrections below are all this with their own axis and facing.
+ * @Returns [how the correction ended]
+ */
+AxisResult RPS_Axis(int primitive, int axis, int facing, float target, float tolerance) {
+    beginEvent(primitive, target);
+    submitAxis(primitive, axis, facing, target, tolerance);
+
+    AxisResult result;
+    result.status = waitForMotion();
+    result.error = target - (axis == AXIS_X ? estimate.x : estimate.y);
+    result.elapsed = schedulerClock() - motion.startTime;
+    endEvent(result.error, result.status);
+    return result;
 }
 
 /*
  * If robot move_forward direction faces positive X:
  * Given a reference point (@param startX) and the desired displacement (@param inches),
  * moves robot in positive X direction to the location relative to the starting point.
+ * @Returns [how the correction ended]
  */
-void RPS_Xinc(float startX, float inches) {
-    Sleep(100);
-    if (RPS.X() < startX + (inches - 0.2)) {
-        LCD.Clear();
-        LCD.WriteLine("Too short!");
-        bl_motor.SetPercent(30);
-        fr_motor.SetPercent(-30);
-        fl_motor.SetPercent(30);
-        br_motor.SetPercent(-30);
-        while (RPS.X() < startX + inches) {
-            LCD.WriteRC(RPS.X(),2,12);
-            LCD.WriteRC(RPS.Y(),3,12);
-            LCD.WriteRC(RPS.Heading(),4,12);
-        }
-        bl_motor.Stop();
-        fr_motor.Stop();
-        fl_motor.Stop();
-        br_motor.Stop();
-    } else if (RPS.X() > startX + (inches + 0.2)) {
-        LCD.Clear();
-        LCD.WriteLine("Too far!");
-        bl_motor.SetPercent(-30);
-        fr_motor.SetPercent(30);
-        fl_motor.SetPercent(-30);
-        br_motor.SetPercent(30);
-        while (RPS.X() > startX + inches) {
-            LCD.WriteRC(RPS.X(),2,12);
-            LCD.WriteRC(RPS.Y(),3,12);
-            LCD.WriteRC(RPS.Heading(),4,12);
-        }
-        bl_motor.Stop();
-        fr_motor.Stop();
-        fl_motor.Stop();
-        br_motor.Stop();
-    }
-    Sleep(100);
+AxisResult RPS_Xinc(float startX, float inches) {
+    PROFILE_SCOPE("RPS_Xinc", PROFILE_CORRECT);
+    return RPS_Axis(PRIM_XINC, AXIS_X, 1, startX + inches, param(P_AXIS_TOLERANCE));
 }
 
 /*
  * If robot move_forward direction faces negative X:
  * Given a reference point (@param startX) and the desired displacement (@param inches),
  * moves robot in positive X direction to the location relative to the starting point.
+ * @Returns [how the correction ended]
  */
-void RPS_Xinc_rev(float startX, float inches) {
-    Sleep(100);
-    if (RPS.X() < startX + (inches - 0.2)) {
-        LCD.Clear();
-        LCD.WriteLine("Too short!");
-        bl_motor.SetPercent(-30);
-        fr_motor.SetPercent(30);
-        fl_motor.SetPercent(-30);
-        br_motor.SetPercent(30);
-        while (RPS.X() < startX + inches) {
-            LCD.WriteRC(RPS.X(),2,12);
-            LCD.WriteRC(RPS.Y(),3,12);
-            LCD.WriteRC(RPS.Heading(),4,12);
-        }
-        bl_motor.Stop();
-        fr_motor.Stop();
-        fl_motor.Stop();
-        br_motor.Stop();
-    } else if (RPS.X() > startX + (inches + 0.2)) {
-        LCD.Clear();
-        LCD.WriteLine("Too far!");
-        bl_motor.SetPercent(30);
-        fr_motor.SetPercent(-30);
-        fl_motor.SetPercent(30);
-        br_motor.SetPercent(-30);
-        while (RPS.X() > startX + inches) {
-            LCD.WriteRC(RPS.X(),2,12);
-            LCD.WriteRC(RPS.Y(),3,12);
-            LCD.WriteRC(RPS.Heading(),4,12);
-        }
-        bl_motor.Stop();
-        fr_motor.Stop();
-        fl_motor.Stop();
-        br_motor.Stop();
-    }
-    Sleep(100);
+AxisResult RPS_Xinc_rev(float startX, float inches) {
+    PROFILE_SCOPE("RPS_Xinc_rev", PROFILE_CORRECT);
+    return RPS_Axis(PRIM_XINC_REV, AXIS_X, -1, startX + inches, param(P_AXIS_TOLERANCE));
 }
 
 /*
  * Given a reference point (@param startX) and the desired displacement (@param inches),
  * moves robot in negative X direction to the location relative to the starting point.
  * (if robot move_forward direction faces negative X)
+ * @Returns [how the correction ended]
  */
-void RPS_Xdec(float startX, float inches) { /* NOTE: UNUSED FUNCTION */
-    Sleep(100);
-    if (RPS.X() > startX + (inches - 0.2)) {
-        LCD.Clear();
-        LCD.WriteLine("Too short!");
-        bl_motor.SetPercent(30);
-        fr_motor.SetPercent(-30);
-        fl_motor.SetPercent(30);
-        br_motor.SetPercent(-30);
-        while (RPS.X() > startX + inches) {
-            LCD.WriteRC(RPS.X(),2,12);
-            LCD.WriteRC(RPS.Y(),3,12);
-            LCD.WriteRC(RPS.Heading(),4,12);
-        }
-        bl_motor.Stop();
-        fr_motor.Stop();
-        fl_motor.Stop();
-        br_motor.Stop();
-    } else if (RPS.X() < startX + (inches + 0.2)) {
-        LCD.Clear();
-        LCD.WriteLine("Too far!");
-        bl_motor.SetPercent(-30);
-        fr_motor.SetPercent(30);
-        fl_motor.SetPercent(-30);
-        br_motor.SetPercent(30);
-        while (RPS.X() < startX + inches) {
-            LCD.WriteRC(RPS.X(),2,12);
-            LCD.WriteRC(RPS.Y(),3,12);
-            LCD.WriteRC(RPS.Heading(),4,12);
-        }
-        bl_motor.Stop();
-        fr_motor.Stop();
-        fl_motor.Stop();
-        br_motor.Stop();
-    }
-    Sleep(100);
+AxisResult RPS_Xdec(float startX, float inches) { /* NOTE: UNUSED FUNCTION */
+    PROFILE_SCOPE("RPS_Xdec", PROFILE_CORRECT);
+    return RPS_Axis(PRIM_XDEC, AXIS_X, -1, startX - inches, param(P_AXIS_TOLERANCE));
 }
 
 /*
  * If robot move_forward direction faces positive Y:
  * Given a reference point (@param startY) and the desired displacement (@param inches),
  * moves robot in positive Y direction to the location relative to the starting point.
+ * @Returns [how the correction ended]
  */
-void RPS_Yinc(float startY, float inches) {
-    Sleep(100);
-    if (RPS.Y() < startY + (inches - 0.2)) {
-        LCD.Clear();
-        LCD.WriteLine("Too short!");
-        bl_motor.SetPercent(30);
-        fr_motor.SetPercent(-30);
-        fl_motor.SetPercent(30);
-        br_motor.SetPercent(-30);
-        while (RPS.Y() < startY + inches) {
-            LCD.WriteRC(RPS.X(),2,12);
-            LCD.WriteRC(RPS.Y(),3,12);
-            LCD.WriteRC(RPS.Heading(),4,12);
-        }
-        bl_motor.Stop();
-        fr_motor.Stop();
-        fl_motor.Stop();
-        br_motor.Stop();
-    } else if (RPS.Y() > startY + (inches + 0.2)) {
-        LCD.Clear();
-        LCD.WriteLine("Too far!");
-        bl_motor.SetPercent(-30);
-        fr_motor.SetPercent(30);
-        fl_motor.SetPercent(-30);
-        br_motor.SetPercent(30);
-        while (RPS.Y() > startY + inches) {
-            LCD.WriteRC(RPS.X(),2,12);
-            LCD.WriteRC(RPS.Y(),3,12);
-            LCD.WriteRC(RPS.Heading(),4,12);
-        }
-        bl_motor.Stop();
-        fr_motor.Stop();
-        fl_motor.Stop();
-        br_motor.Stop();
-    }
-    Sleep(100);
+AxisResult RPS_Yinc(float startY, float inches) {
+    PROFILE_SCOPE("RPS_Yinc", PROFILE_CORRECT);
+    return RPS_Axis(PRIM_YINC, AXIS_Y, 1, startY + inches, param(P_AXIS_TOLERANCE));
 }
 
 /*
  * If robot move_forward direction faces negative Y:
  * Given a reference point (@param startY) and the desired displacement (@param inches),
  * moves robot in negative Y direction to the location relative to the starting point.
+ * @Returns [how the correction ended]
  */
-void RPS_Ydec(float startY, float inches) {
-    Sleep(100);
-    if (RPS.Y() > startY - (inches + 0.2)) {
-        LCD.Clear();
-        LCD.WriteLine("Too short!");
-        bl_motor.SetPercent(30);
-        fr_motor.SetPercent(-30);
-        fl_motor.SetPercent(30);
-        br_motor.SetPercent(-30);
-        while (RPS.Y() > startY + inches) {
-            LCD.WriteRC(RPS.X(),2,12);
-            LCD.WriteRC(RPS.Y(),3,12);
-            LCD.WriteRC(RPS.Heading(),4,12);
-        }
-        bl_motor.Stop();
-        fr_motor.Stop();
-        fl_motor.Stop();
-        br_motor.Stop();
-    } else if (RPS.Y() < startY - (inches - 0.2)) {
-        LCD.Clear();
-        LCD.WriteLine("Too far!");
-        bl_motor.SetPercent(-30);
-        fr_motor.SetPercent(30);
-        fl_motor.SetPercent(-30);
-        br_motor.SetPercent(30);
-        while (RPS.Y() < startY + inches) {
-            LCD.WriteRC(RPS.X(),2,12);
-            LCD.WriteRC(RPS.Y(),3,12);
-            LCD.WriteRC(RPS.Heading(),4,12);
-        }
-        bl_motor.Stop();
-        fr_motor.Stop();
-        fl_motor.Stop();
-        br_motor.Stop();
-    }
-    Sleep(100);
+AxisResult RPS_Ydec(float startY, float inches) {
+    PROFILE_SCOPE("RPS_Ydec", PROFILE_CORRECT);
+    return RPS_Axis(PRIM_YDEC, AXIS_Y, -1, startY - inches, param(P_AXIS_TOLERANCE));
 }
 
 /*
  * Given a desired angle (@param desiredDeg), rotates the robot until desired angle is achieved.
- * This program aims to ensure the robot will always take the shortest path to the desired heading
- */
-void RPS_Angle(float desiredDeg){
-    Sleep(200);
-    while(abs(desiredDeg - RPS.Heading()) > 1.0){
-        if(desiredDeg - RPS.Heading() > 180.0){ // Example: Robot going from Q1 to Q4
-            LCD.Clear();
-            LCD.WriteLine("Turning CW");
-            LCD.Write("Angle: ");
-            LCD.Write(RPS.Heading());
-
-            // turn the robot clockwise
-            bl_motor.SetPercent(30);
-            fr_motor.SetPercent(30);
-            fl_motor.SetPercent(30);
-            br_motor.SetPercent(30);
-
-            Sleep(75);
-
-            // Stop motors
-            bl_motor.Stop();
-            fr_motor.Stop();
-            fl_motor.Stop();
-            br_motor.Stop();
-        }
-        else if(desiredDeg - RPS.Heading() < -180.0){ // Example: Robot going from Q3 to Q1
-            LCD.Clear();
-            LCD.WriteLine("Turning CCW");
-            LCD.Write("Angle: ");
-            LCD.Write(RPS.Heading());
-
-            // turn the robot counterclockwise
-            bl_motor.SetPercent(-30);
-            fr_motor.SetPercent(-30);
-            fl_motor.SetPercent(-30);
-            br_motor.SetPercent(-30);
-
-            Sleep(75);
-
-            // Stop motors
-            bl_motor.Stop();
-            fr_motor.Stop();
-            fl_motor.Stop();
-            br_motor.Stop();
-        }
-        else if(desiredDeg - RPS.Heading() > -180.0 && desiredDeg - RPS.Heading() < 0.0){ // Example: Robot going from Q3 to Q2
-            LCD.Clear();
-            LCD.WriteLine("Turning CW");
-            LCD.Write("Angle: ");
-            LCD.Write(RPS.Heading());
-
-            // turn the robot clockwise
-            bl_motor.SetPercent(30);
-            fr_motor.SetPercent(30);
-            fl_motor.SetPercent(30);
-            br_motor.SetPercent(30);
-
-            Sleep(75);
-
-            // Stop motors
-            bl_motor.Stop();
-            fr_motor.Stop();
-            fl_motor.Stop();
-            br_motor.Stop();
-        }
-        else if(desiredDeg - RPS.Heading() > 0 && desiredDeg - RPS.Heading() < 180.0){ // Example: Robot going from Q1 to Q2
-            LCD.Clear();
-            LCD.WriteLine("Turning CCW");
-            LCD.Write("Angle: ");
-            LCD.Write(RPS.Heading());
-
-            // turn the robot counterclockwise
-            bl_motor.SetPercent(-30);
-            fr_motor.SetPercent(-30);
-            fl_motor.SetPercent(-30);
-            br_motor.SetPercent(-30);
-
-            Sleep(75);
-
-            // Stop motors
-            bl_motor.Stop();
-            fr_motor.Stop();
-            fl_motor.Stop();
-            br_motor.Stop();
-        }
-        else{   // Just in case the difference is exactly 180.0 degrees
-            // turn the robot counterclockwise
-            bl_motor.SetPercent(-30);
-            fr_motor.SetPercent(-30);
-            fl_motor.SetPercent(-30);
-            br_motor.SetPercent(-30);
-
-            Sleep(75);
-
-            // Stop motors
-            bl_motor.Stop();
-            fr_motor.Stop();
-            fl_motor.Stop();
-            br_motor.Stop();
-        }
-    }
-    // Stop motors
-    bl_motor.Stop();
-    fr_motor.Stop();
-    fl_motor.Stop();
-    br_motor.Stop();
+ * The PD heading controller always takes the shortest path to the desired heading.
+ * @Returns [how the turn ended]
+ */
+MotionStatus RPS_Angle(float desiredDeg){
+    PROFILE_SCOPE("RPS_Angle", PROFILE_CORRECT);
+    beginEvent(PRIM_HEADING, desiredDeg);
+
+    // Wait for a heading taken at rest. If the turn before already landed within tolerance, nothing is left to correct
+    MotionStatus status = MOTION_OK;
+    bool resting = waitForRestingPose();
+    resolvePendingTurn();
+    if (resting && fabs(wrapAngle(desiredDeg - sensors.pose.heading)) <= param(P_HEADING_TOLERANCE)) {
+        angleSkips++;
+        angleSettleTime = 0;
+    } else {
+        submitHeading(desiredDeg);
+        status = waitForMotion();
+        angleSettleTime = schedulerClock() - motion.startTime;
+    }
 
-    Sleep(200);
+    angleSettleTotal += angleSettleTime;
+    angleCalls++;
+    endEvent(wrapAngle(desiredDeg - estimate.heading), status);
+    return status;
 }
 
 /*
  * If robot move_forward direction faces negative X:
  * Given an absolute desired X position (@param inches),
  * moves robot in X direction to that X position.
+ * @Returns [how the correction ended]
  */
-void RPS_X_dec_abs(float inches) { /* NOTE: UNUSED FUNCTION */
-    Sleep(100);
-    if (RPS.X() > (inches - 0.2)) {
-        LCD.Clear();
-        LCD.WriteLine("Too short!");
-        bl_motor.SetPercent(30);
-        fr_motor.SetPercent(-30);
-        fl_motor.SetPercent(30);
-        br_motor.SetPercent(-30);
-        while (RPS.X() > inches) {
-            LCD.WriteRC(RPS.X(),2,12);
-            LCD.WriteRC(RPS.Y(),3,12);
-            LCD.WriteRC(RPS.Heading(),4,12);
-        }
-        bl_motor.Stop();
-        fr_motor.Stop();
-        fl_motor.Stop();
-        br_motor.Stop();
-    } else if (RPS.X() < (inches + 0.2)) {
-        LCD.Clear();
-        LCD.WriteLine("Too far!");
-        bl_motor.SetPercent(-30);
-        fr_motor.SetPercent(30);
-        fl_motor.SetPercent(-30);
-        br_motor.SetPercent(30);
-        while (RPS.X() < inches) {
-            LCD.WriteRC(RPS.X(),2,12);
-            LCD.WriteRC(RPS.Y(),3,12);
-            LCD.WriteRC(RPS.Heading(),4,12);
-        }
-        bl_motor.Stop();
-        fr_motor.Stop();
-        fl_motor.Stop();
-        br_motor.Stop();
-    }
-    Sleep(100);
+AxisResult RPS_X_dec_abs(float inches) { /* NOTE: UNUSED FUNCTION */
+    PROFILE_SCOPE("RPS_X_dec_abs", PROFILE_CORRECT);
+    return RPS_Axis(PRIM_X_DEC_ABS, AXIS_X, -1, inches, param(P_AXIS_TOLERANCE));
 }
 
 /*
  * If robot move_forward direction faces positive X:
  * Given an absolute desired X position (@param inches),
  * moves robot in X direction to that X position.
+ * @Returns [how the correction ended]
  */
-void RPS_X_inc_abs(float inches) {
-    Sleep(100);
-    if (RPS.X() < (inches - 0.2)) {
-        LCD.Clear();
-        LCD.WriteLine("Too short!");
-        bl_motor.SetPercent(30);
-        fr_motor.SetPercent(-30);
-        fl_motor.SetPercent(30);
-        br_motor.SetPercent(-30);
-        while (RPS.X() < inches) {
-            LCD.WriteRC(RPS.X(),2,12);
-            LCD.WriteRC(RPS.Y(),3,12);
-            LCD.WriteRC(RPS.Heading(),4,12);
-        }
-        bl_motor.Stop();
-        fr_motor.Stop();
-        fl_motor.Stop();
-        br_motor.Stop();
-    } else if (RPS.X() > (inches + 0.2)) {
-        LCD.Clear();
-        LCD.WriteLine("Too far!");
-        bl_motor.SetPercent(-30);
-        fr_motor.SetPercent(30);
-        fl_motor.SetPercent(-30);
-        br_motor.SetPercent(30);
-        while (RPS.X() > inches) {
-            LCD.WriteRC(RPS.X(),2,12);
-            LCD.WriteRC(RPS.Y(),3,12);
-            LCD.WriteRC(RPS.Heading(),4,12);
-        }
-        bl_motor.Stop();
-        fr_motor.Stop();
-        fl_motor.Stop();
-        br_motor.Stop();
-    }
-    Sleep(100);
+AxisResult RPS_X_inc_abs(float inches) {
+    PROFILE_SCOPE("RPS_X_inc_abs", PROFILE_CORRECT);
+    return RPS_Axis(PRIM_X_INC_ABS, AXIS_X, 1, inches, param(P_AXIS_TOLERANCE));
 }
 
 /*
  * If robot move_forward direction faces positive Y:
  * Given an absolute desired Y position (@param inches),
  * moves robot in Y direction to that Y position.
+ * @Returns [how the correction ended]
  */
-void RPS_Y_inc_abs(float inches) {
-    Sleep(100);
-    if (RPS.Y() < (inches - 0.1)) { //Was 0.2 tolerance before 4/3
-        LCD.Clear();
-        LCD.WriteLine("Too short!");
-        bl_motor.SetPercent(30);
-        fr_motor.SetPercent(-30);
-        fl_motor.SetPercent(30);
-        br_motor.SetPercent(-30);
-        while (RPS.Y() < inches) {
-            LCD.WriteRC(RPS.X(),2,12);
-            LCD.WriteRC(RPS.Y(),3,12);
-            LCD.WriteRC(RPS.Heading(),4,12);
-        }
-        bl_motor.Stop();
-        fr_motor.Stop();
-        fl_motor.Stop();
-        br_motor.Stop();
-    } else if (RPS.Y() > (inches + 0.1)) {
-        LCD.Clear();
-        LCD.WriteLine("Too far!");
-        bl_motor.SetPercent(-30);
-        fr_motor.SetPercent(30);
-        fl_motor.SetPercent(-30);
-        br_motor.SetPercent(30);
-        while (RPS.Y() > inches) {
-            LCD.WriteRC(RPS.X(),2,12);
-            LCD.WriteRC(RPS.Y(),3,12);
-            LCD.WriteRC(RPS.Heading(),4,12);
-        }
-        bl_motor.Stop();
-        fr_motor.Stop();
-        fl_motor.Stop();
-        br_motor.Stop();
-    }
-    Sleep(100);
+AxisResult RPS_Y_inc_abs(float inches) {
+    PROFILE_SCOPE("RPS_Y_inc_abs", PROFILE_CORRECT);
+    return RPS_Axis(PRIM_Y_INC_ABS, AXIS_Y, 1, inches, param(P_Y_TOLERANCE));
 }
 
 /*
  * If robot move_forward direction faces negative Y:
  * Given an absolute desired Y position (@param inches),
  * moves robot in Y direction to that Y position.
+ * @Returns [how the correction ended]
  */
-void RPS_Y_dec_abs(float inches) {
-    Sleep(100);
-    if (RPS.Y() > (inches - 0.2)) {
-        LCD.Clear();
-        LCD.WriteLine("Too short!");
-        bl_motor.SetPercent(30);
-        fr_motor.SetPercent(-30);
-        fl_motor.SetPercent(30);
-        br_motor.SetPercent(-30);
-        while (RPS.Y() > inches) {
-            LCD.WriteRC(RPS.X(),2,12);
-            LCD.WriteRC(RPS.Y(),3,12);
-            LCD.WriteRC(RPS.Heading(),4,12);
-        }
-        bl_motor.Stop();
-        fr_motor.Stop();
-        fl_motor.Stop();
-        br_motor.Stop();
-    } else if (RPS.Y() < (inches + 0.2)) {
-        LCD.Clear();
-        LCD.WriteLine("Too far!");
-        bl_motor.SetPercent(-30);
-        fr_motor.SetPercent(30);
-        fl_motor.SetPercent(-30);
-        br_motor.SetPercent(30);
-        while (RPS.Y() < inches) {
-            LCD.WriteRC(RPS.X(),2,12);
-            LCD.WriteRC(RPS.Y(),3,12);
-            LCD.WriteRC(RPS.Heading(),4,12);
+AxisResult RPS_Y_dec_abs(float inches) {
+    PROFILE_SCOPE("RPS_Y_dec_abs", PROFILE_CORRECT);
+    return RPS_Axis(PRIM_Y_DEC_ABS, AXIS_Y, -1, inches, param(P_AXIS_TOLERANCE));
+}
+
+/*
+ * Given a position (@param x, @param y) and a heading (@param heading) in the RPS frame, drives to the position and
+ * turns to the heading in one go: one model turn toward the target, one path drive that keeps steering at it,
+ * and one RPS_Angle at the end. The robot drives forward or backward, whichever needs less turning in total.
+ * @Returns [how the move ended, MOTION_NO_POSE without moving if there is no pose estimate]
+ */
+MotionStatus goToPose(float x, float y, float heading) {
+    PROFILE_SCOPE("goToPose", PROFILE_DRIVE);
+    if (!estimate.valid && waitForRestingPose()) {
+        updateEstimate();
+    }
+    if (!estimate.valid) {
+        // Nothing to drive from, and pathStep would sit out its whole budget waiting for a pose
+        beginEvent(PRIM_POSE, 0);
+        endEvent(0, MOTION_NO_POSE);
+        return MOTION_NO_POSE;
+    }
+    beginEvent(PRIM_POSE, hypot(x - estimate.x, y - estimate.y));
+
+    // Where the robot center has to stop for the QR code to be at the target once the robot faces the heading
+    float endX = x - QR_OFFSET * fromFixed(fixedCos(toFixed(heading)));
+    float endY = y - QR_OFFSET * fromFixed(fixedSin(toFixed(heading)));
+    float centerX = fromFixed(estimate.centerX);
+    float centerY = fromFixed(estimate.centerY);
+
+    MotionStatus status = MOTION_OK;
+    if (hypot(endX - centerX, endY - centerY) > PATH_END_TOLERANCE) {
+        float bearing = fromFixed(fixedAtan2(toFixed(endY - centerY), toFixed(endX - centerX)));
+
+        // Turning before the drive plus turning after it, driving forward and driving backward
+        float forwardTurn = wrapAngle(bearing - estimate.heading);
+        float reverseTurn = wrapAngle(bearing + 180 - estimate.heading);
+        float forwardTotal = fabs(forwardTurn) + fabs(wrapAngle(heading - bearing));
+        float reverseTotal = fabs(reverseTurn) + fabs(wrapAngle(heading - bearing - 180));
+        int direction = forwardTotal <= reverseTotal ? 1 : -1;
+        float turn = direction > 0 ? forwardTurn : reverseTurn;
+
+        if (turn > POSE_TURN_ANGLE) {
+            status = turnLeft(POSE_TURN_PERCENT, turn);
+        } else if (turn < -POSE_TURN_ANGLE) {
+            status = turnRight(POSE_TURN_PERCENT, -turn);
+        }
+        if (status == MOTION_OK) {
+            // Backward the center follows the path. Forward the QR code does, QR_OFFSET ahead of the center along the drive
+            Waypoint end = { endX, endY };
+            if (direction > 0) {
+                end.x += QR_OFFSET * fromFixed(fixedCos(toFixed(bearing)));
+                end.y += QR_OFFSET * fromFixed(fixedSin(toFixed(bearing)));
+            }
+            status = followPath(&end, 1, direction, POSE_PERCENT, true);
         }
-        bl_motor.Stop();
-        fr_motor.Stop();
-        fl_motor.Stop();
-        br_motor.Stop();
     }
-    Sleep(100);
+    if (status == MOTION_OK) {
+        status = RPS_Angle(heading);
+    }
+
+    endEvent(hypot(x - estimate.x, y - estimate.y), status);
+    return status;
 }
 
 /*
- * Function called at the beginning to start off based on a light difference,
- * or if 30 seconds has passed. Also stores the general difference between ambient and red light.
+ * Course map, in the RPS frame. Besides the outer walls, the obstacles are boxes the robot center has to keep a
+ * clearance from: the DDR machine, which the body must clear, and the step between the two ramps, which leaves the
+ * wide right ramp and the narrow left one as the only ways between the levels. The body can hang over the step's edge,
+ * so there only the wheels have to stay clear. The box outlines are those of the host simulator's course
+ * (sim/world.cpp). The locations were measured in the nominal simulated run of the hand-written legs: where the QR
+ * code was and which way the robot faced after the foosball task, before squaring up for the token, after the token
+ * drop and before the final button. The hand-written lever approach pressed the lever with the arm tip 0.8 inches
+ * off it, so LOC_LEVER puts the arm tip on the simulator's lever instead.
  */
-void waitForLight() {
+#define COURSE_WIDTH 36.0
+#define COURSE_LENGTH 72.0
+#define WALL_CLEARANCE 5.0
+#define OBSTACLE_COUNT 2
 
-    float time = TimeNow();
+/*
+ * An axis-aligned box on the course and how far (in inches) the robot center has to stay from it.
+ */
+struct CourseBox {
+    const char *name;
+    float left;
+    float bottom;
+    float right;
+    float top;
+    float clearance;
+};
+
+const CourseBox courseObstacles[OBSTACLE_COUNT] = {
+    { "DDR machine", 16.0, 0.0, 34.0, 2.0, 5.0 },
+    { "Ramp step", 12.0, 16.0, 24.0, 34.0, 4.0 }
+};
+
+// Task locations routes go between.
+enum CourseLocation {
+    LOC_FOOSBALL,
+    LOC_LEVER,
+    LOC_TOKEN_SQUARE,
+    LOC_TOKEN,
+    LOC_FINISH,
+    LOCATION_COUNT
+};
 
-    // If 30 seconds pass and no light is read, just start
-    while(cds.Value() > ambient - 0.4 && TimeNow() - time < 30) {
-        LCD.Clear();
-        LCD.WriteLine("Looking for Red Light...");
-        LCD.WriteLine(cds.Value());
+/*
+ * Where the QR code is and which way the robot faces at a task location.
+ */
+struct CoursePose {
+    const char *name;
+    float x;
+    float y;
+    float heading;
+};
+
+const CoursePose courseLocations[LOCATION_COUNT] = {
+    { "LOC_FOOSBALL", 25.19, 58.44, 358.3 },
+    { "LOC_LEVER", 14.11, 61.91, 306.1 },
+    { "LOC_TOKEN_SQUARE", 5.78, 36.33, 270.0 },
+    { "LOC_TOKEN", 11.96, 38.38, 180.5 },
+    { "LOC_FINISH", 4.99, 16.92, 270.0 }
+};
+
+/*
+ * A planned route: the corners the robot center passes between two locations, without stopping. A route with no
+ * corners is a straight drive.
+ */
+#define MAX_ROUTE_CORNERS 4
+#define ROUTE_COUNT 3
+// Drive power along a route.
+#define ROUTE_PERCENT 70
+
+struct Route {
+    int from;
+    int to;
+    int count;
+    Waypoint corners[MAX_ROUTE_CORNERS];
+};
+
+// Planned offline by sim/routes, which prints this table. The table is const, so it stays in flash.
+const Route courseRoutes[ROUTE_COUNT] = {
+    { LOC_FOOSBALL, LOC_LEVER, 0, { } },
+    { LOC_LEVER, LOC_TOKEN_SQUARE, 0, { } },
+    { LOC_TOKEN, LOC_FINISH, 1, { { 7.90, 38.10 } } }
+};
+
+/*
+ * Given the locations a route goes between (@param from, @param to) and where it has to end (@param x, @param y,
+ * @param heading: the QR code and heading, which can differ from the location's by calibration), drives the planned
+ * route: one model turn toward the first corner, one path through the corners without stopping, then goToPose to
+ * the end. Forward the QR code follows the path, so each corner is moved QR_OFFSET along the way into it.
+ * @Returns [how the route ended; without a route or a pose estimate, how goToPose ended]
+ */
+MotionStatus followRoute(int from, int to, float x, float y, float heading) {
+    PROFILE_SCOPE("followRoute", PROFILE_DRIVE);
+    const Route *route = 0;
+    for (int i = 0; i < ROUTE_COUNT; i++) {
+        if (courseRoutes[i].from == from && courseRoutes[i].to == to) {
+            route = &courseRoutes[i];
+        }
+    }
+    if (!estimate.valid && waitForRestingPose()) {
+        updateEstimate();
+    }
+    if (route == 0 || route->count == 0 || !estimate.valid) {
+        return goToPose(x, y, heading);
     }
 
-    Sleep(50);
+    Waypoint points[MAX_ROUTE_CORNERS];
+    float lastX = fromFixed(estimate.centerX);
+    float lastY = fromFixed(estimate.centerY);
+    float firstBearing = 0;
+    for (int i = 0; i < route->count; i++) {
+        const Waypoint &corner = route->corners[i];
+        float bearing = fromFixed(fixedAtan2(toFixed(corner.y - lastY), toFixed(corner.x - lastX)));
+        if (i == 0) {
+            firstBearing = bearing;
+        }
+        points[i].x = corner.x + QR_OFFSET * fromFixed(fixedCos(toFixed(bearing)));
+        points[i].y = corner.y + QR_OFFSET * fromFixed(fixedSin(toFixed(bearing)));
+        lastX = corner.x;
+        lastY = corner.y;
+    }
 
-    redDiff = ambient - cds.Value();
+    MotionStatus status = MOTION_OK;
+    float turn = wrapAngle(firstBearing - estimate.heading);
+    if (turn > POSE_TURN_ANGLE) {
+        status = turnLeft(POSE_TURN_PERCENT, turn);
+    } else if (turn < -POSE_TURN_ANGLE) {
+        status = turnRight(POSE_TURN_PERCENT, -turn);
+    }
+    if (status == MOTION_OK) {
+        status = followPath(points, route->count, 1, ROUTE_PERCENT, false);
+    }
+    if (status == MOTION_OK) {
+        status = goToPose(x, y, heading);
+    }
+    return status;
 }
 
 /*
- * Given a desired motor speed (@param percent), moves robot forward at that speed,
- * toward the closest DDR light. The CdS cell should go over this light.
- * @Returns [red light was detected]
+ * DDR light classifier. Every decision sample is the median of DDR_OVERSAMPLE back-to-back CdS reads, smoothed
+ * by an EMA. The expected CdS drop below ambient is redDiff for the red light (measured off the start light) and
+ * DDR_BLUE_SEPARATION less for the blue one, and a sequential probability ratio test adds up the evidence of each
+ * sample until one colour reaches DDR_CONFIDENCE. Each sample's evidence is capped, so a single glitch cannot decide.
+ * The filter and test only work on the values they are given, so they can be run on recorded or synthetic traces.
  */
-bool checkDDRLight(int percent) {
-    Sleep(100);
-
-    //Set motors to desired percent. Some motors have to turn backwards, so make percent negative.
-    bl_motor.SetPercent(percent);
-    fr_motor.SetPercent(-1 * percent);
-    fl_motor.SetPercent(percent);
-    br_motor.SetPercent(-1 * percent);
+#define DDR_OVERSAMPLE 5
+#define DDR_EMA_GAIN 0.5
+#define DDR_BLUE_SEPARATION 0.64
+// Standard deviation (in volts) of the filtered CdS value, and the most log-likelihood a single sample can add.
+#define DDR_NOISE 0.08
+#define DDR_MAX_EVIDENCE 2.0
+#define DDR_CONFIDENCE 0.99
+
+enum LightColor {
+    LIGHT_UNDECIDED,
+    LIGHT_RED,
+    LIGHT_BLUE
+};
 
-    bool lightFound = false;
-    bool redLight;
+/*
+ * State of the sequential test. Evidence is the log-likelihood ratio of red over blue.
+ */
+struct LightClassifier {
+    float redLevel;
+    float blueLevel;
+    float filtered;
+    float evidence;
+    bool primed;
+    int samples;
+};
 
-    int failsafe = 0;
+/*
+ * Outcome of a DDR light check: the colour, the probability that it is right, the number of
+ * decision samples used, how long it took (in ms) and whether it ran out of time.
+ */
+struct LightResult {
+    bool red;
+    float confidence;
+    int samples;
+    unsigned int time;
+    bool timedOut;
+};
 
-    while (!lightFound && failsafe < 10) {
-        if (ambient - cds.Value() >= redDiff - 0.32) { //Was 0.2 before, made more generous
-            bl_motor.Stop();
-            fr_motor.Stop();
-            fl_motor.Stop();
-            br_motor.Stop();
-            lightFound = true;
-            redLight = true;
-        } else if (ambient - cds.Value() <= redDiff - 0.325) {
-            bl_motor.Stop();
-            fr_motor.Stop();
-            fl_motor.Stop();
-            br_motor.Stop();
-            lightFound = true;
-            redLight = false;
-        }
-        else{
-            failsafe++;
+/*
+ * Given some values (@param values, @param count), sorts them in place and returns the middle one.
+ * @Returns [median of the values]
+ */
+float medianOf(float *values, int count) {
+    for (int i = 1; i < count; i++) {
+        float value = values[i];
+        int j = i - 1;
+        while (j >= 0 && values[j] > value) {
+            values[j + 1] = values[j];
+            j--;
         }
-   }
-   if(failsafe == 10){
-       redLight = false;
-   }
-
-   return redLight;
+        values[j + 1] = value;
+    }
+    return values[count / 2];
 }
 
 /*
- * TODO: Fill in all the functions with appropriate movements. As of 3/6/19, all functions will do their respective task starting from the start.
- * Later on, only one of the functions (doDDR()) will have the waitForLight() function. The others will have to go off the previous task function called.
+ * Given a classifier (@param classifier), the ambient CdS value (@param ambientLevel) and the drop the red
+ * start light caused (@param redDrop), sets the expected levels of both colours and clears the evidence.
  */
+void classifierInit(LightClassifier *classifier, float ambientLevel, float redDrop) {
+    classifier->redLevel = ambientLevel - redDrop;
+    classifier->blueLevel = ambientLevel - redDrop + DDR_BLUE_SEPARATION;
+    classifier->evidence = 0;
+    classifier->primed = false;
+    classifier->samples = 0;
+}
 
 /*
- * Does everything from starting off to the end of DDR, facing towards the ramp.
+ * Given a classifier (@param classifier) and a burst of raw CdS reads (@param reads, @param count), adds one decision
+ * sample to the test. The reads are reordered.
+ * @Returns [LIGHT_RED or LIGHT_BLUE once the confidence is reached, LIGHT_UNDECIDED before that]
  */
-void doDDR() {
-    // Adjust heading
-    RPS_Angle(45.0);
+int classifierStep(LightClassifier *classifier, float *reads, int count) {
+    float value = medianOf(reads, count);
+    if (!classifier->primed) {
+        classifier->filtered = value;
+        classifier->primed = true;
+    } else {
+        classifier->filtered += DDR_EMA_GAIN * (value - classifier->filtered);
+    }
+    classifier->samples++;
+
+    // Log-likelihood ratio of one Gaussian sample between the two levels
+    float separation = classifier->blueLevel - classifier->redLevel;
+    float middle = (classifier->blueLevel + classifier->redLevel) / 2;
+    float evidence = separation * (middle - classifier->filtered) / (DDR_NOISE * DDR_NOISE);
+    if (evidence > DDR_MAX_EVIDENCE) {
+        evidence = DDR_MAX_EVIDENCE;
+    } else if (evidence < -DDR_MAX_EVIDENCE) {
+        evidence = -DDR_MAX_EVIDENCE;
+    }
+    classifier->evidence += evidence;
 
-    // Adjust y-position
-    RPS_Y_inc_abs(startingPointY);
+    float threshold = log(DDR_CONFIDENCE / (1 - DDR_CONFIDENCE));
+    if (classifier->evidence >= threshold) {
+        return LIGHT_RED;
+    } else if (classifier->evidence <= -threshold) {
+        return LIGHT_BLUE;
+    }
+    return LIGHT_UNDECIDED;
+}
 
-    // Turn right
-    turnRight(60, 40.0);
+/*
+ * Given a classifier (@param classifier), returns the probability that the more likely colour is the right one.
+ * @Returns [confidence between 0.5 and 1]
+ */
+float classifierConfidence(const LightClassifier &classifier) {
+    return 1 / (1 + exp(-fabs(classifier.evidence)));
+}
 
-    // Adjust heading
-    RPS_Angle(0.0);
+/*
+ * Given a desired motor speed (@param percent), moves robot forward at that speed,
+ * toward the closest DDR light, until the classifier has decided on its colour or the time budget has run out.
+ * The CdS cell should go over this light.
+ * @Returns [colour and confidence of the light]
+ */
+LightResult classifyDDRLight(int percent) {
+    PROFILE_SCOPE("classifyDDRLight", PROFILE_DRIVE);
+    beginEvent(PRIM_DDR_LIGHT, percent);
+    waitMs(100);
+
+    LightClassifier classifier;
+    classifierInit(&classifier, ambient, redDiff);
+
+    //Set motors to desired percent
+    setDrive(percent, percent);
+
+    unsigned int start = schedulerClock();
+    unsigned int budget = primitiveBudget(PRIM_DDR_LIGHT, 0, 0);
+    int color = LIGHT_UNDECIDED;
+    while (color == LIGHT_UNDECIDED && schedulerClock() - start < budget) {
+        schedulerTick();
+        float reads[DDR_OVERSAMPLE];
+        for (int i = 0; i < DDR_OVERSAMPLE; i++) {
+            reads[i] = cds.Value();
+        }
+        color = classifierStep(&classifier, reads, DDR_OVERSAMPLE);
+        countIteration();
+    }
+    stopDrive();
 
-    // Go straight
-    move_forward(70, 3);
+    LightResult result;
+    result.red = color == LIGHT_RED || (color == LIGHT_UNDECIDED && classifier.evidence > 0);
+    result.confidence = classifierConfidence(classifier);
+    result.samples = classifier.samples;
+    result.time = schedulerClock() - start;
+    result.timedOut = color == LIGHT_UNDECIDED;
 
-    // Adjust heading
-    RPS_Angle(356.0);
+    endEvent(result.red ? result.confidence : -result.confidence, result.timedOut ? MOTION_TIMEOUT : MOTION_OK);
+    return result;
+}
 
-    // Go straight
-    move_forward(70, 3.5);
+/*
+ * Given a desired motor speed (@param percent), checks the colour of the closest DDR light.
+ * @Returns [red light was detected]
+ */
+bool checkDDRLight(int percent) {
+    return classifyDDRLight(percent).red;
+}
 
-    // Adjust heading
-    RPS_Angle(351.0);
 
-    // Go to specific x-location
-    RPS_X_inc_abs(ddrLightX);
+/*
+ * TODO: Fill in all the functions with appropriate movements. As of 3/6/19, all functions will do their respective task starting from the start.
+ * Later on, only one of the functions (doDDR()) will have the waitForLight() function. The others will have to go off the previous task function called.
+ */
+
+/*
+ * Does everything from starting off to the end of DDR, facing towards the ramp.
+ */
+void doDDR() {
+    PROFILE_SCOPE("doDDR", PROFILE_TASK);
+    // Go to the DDR light x-location, facing 351 degrees. The old chain ended about a quarter inch below the
+    // starting y (3.5 inches at 356 degrees), so aim there
+    if (goToPose(ddrLightX, startingPointY - 0.25, 351.0) == MOTION_NO_POSE) {
+        // No RPS fix: dead reckon the old chain from the 45 degree start heading instead
+        turnRight(60, 45.0);
+        move_forward(70, 3.0);
+        turnRight(60, 4.0);
+        move_forward(70, 3.5);
+        turnRight(60, 5.0);
+    }
 
     // Go straight and check for DDR light color (new as of 3/26)
-    bool redLight = checkDDRLight(20);
+    LightResult light = classifyDDRLight(20);
+    bool redLight = light.red;
 
     if (redLight) {
         LCD.SetBackgroundColor(RED);
         LCD.Clear();
-        LCD.Write(cds.Value());
+        LCD.Write(light.confidence);
 
-        Sleep(1000);
+        waitMs(1000);
 
-        turnRight(40, 20);
+        // 351 to 270 in three steps (were 20, 30 and 40 before the turn model)
+        turnRight(40, 18.0);
 
         move_backward(70, 1.0);
 
-        turnRight(40, 30);
+        turnRight(40, 27.0);
 
         move_forward(70, 1.5);
 
-        turnRight(40, 40.0);
+        turnRight(40, 36.0);
 
         RPS_Angle(270.0);
 
         move_forward(70, 3.0);
 
-        bl_motor.SetPercent(50);
-        fl_motor.SetPercent(50);
+        setDrive(50, 0);
 
-        Sleep(5700);
+        waitMs(param(P_DDR_RED_PRESS));
 
-        bl_motor.Stop();
-        fl_motor.Stop();
+        stopDrive();
 
         move_backward(70, 2.1);
 
-        turnLeft(40, 80.0);
+        // 270 to 358 (was 80 before the turn model)
+        turnLeft(40, 88.0);
 
-        Sleep(100);
+        waitMs(100);
 
         RPS_Angle(358.0);
 
-        RPS_X_inc_abs(30.5);
+        RPS_X_inc_abs(param(P_RPS_BUTTON_X));
 
     }
     else {
         LCD.SetBackgroundColor(BLUE);
         LCD.Clear();
-        LCD.Write(cds.Value());
+        LCD.Write(light.confidence);
 
-        Sleep(1000);
+        waitMs(1000);
 
         RPS_Angle(0.0);
 
         move_forward(90, 6.5);
 
-        turnRight(70, 106.0);
+        turnRight(70, param(P_DDR_BLUE_TURN));
 
         RPS_Angle(270.0);
 
-        bl_motor.SetPercent(50);
-        fr_motor.SetPercent(-1 * 50);
-        fl_motor.SetPercent(50);
-        br_motor.SetPercent(-1 * 50);
+        setDrive(50, 50);
 
-        Sleep(6000);
+        waitMs(param(P_DDR_BLUE_PRESS));
 
-        bl_motor.Stop();
-        fr_motor.Stop();
-        fl_motor.Stop();
-        br_motor.Stop();
+        stopDrive();
 
         move_backward(65, 2.0); // 4/3
 
-        turnLeft(60, 80.0); //Was 40
+        // 270 to 358 (was 80 before the turn model, 40 before that)
+        turnLeft(60, 88.0);
 
-        Sleep(100);
+        waitMs(100);
 
         RPS_Angle(358.0);
 
         move_backward(70, 2.5); // 4/3
-        Sleep(200);
+        waitMs(200);
 
-        RPS_X_inc_abs(30.5);
+        RPS_X_inc_abs(param(P_RPS_BUTTON_X));
     }
 
     // Adjust heading
     RPS_Angle(0.0);
 
     // Press RPS button
-    lever_servo.SetDegree(0.0);
-    Sleep(5500);
-    lever_servo.SetDegree(90.0);
+    setLever(0.0);
+    waitMs(param(P_RPS_BUTTON_HOLD));
+    setLever(90.0);
 
     // Move backward
     move_backward(50, 1.0);
@@ -931,8 +3675,8 @@ void doDDR() {
     // Go straight
     move_forward(50, 1.5);
 
-    // Turn left
-    turnLeft(60, 65.0);
+    // Turn left, 20 to 88 (was 65 before the turn model)
+    turnLeft(60, 68.0);
 
     // Face towards acrylic ramp
     RPS_Angle(88.0);
@@ -942,61 +3686,69 @@ void doDDR() {
  * Does everything from going up the ramp to immediately before turning to face towards the lever.
  */
 void doFoosball() {
+    PROFILE_SCOPE("doFoosball", PROFILE_TASK);
 
     // Store current location
-    X_coord = RPS.X();
-    Y_coord = RPS.Y();
+    X_coord = sensors.pose.x;
+    Y_coord = sensors.pose.y;
 
-    // Move forward to top of course
-    move_forward(80, 25.0);
+    // Move forward to top of course. If the robot stalls on the ramp lip, back off, square up and go again at full power
+    if (move_forward(param(P_RAMP_PERCENT), param(P_RAMP_DISTANCE)) != MOTION_OK) {
+        float remaining = countsRemaining() * fromFixed(inchesPerCount);
+        move_backward(60, RAMP_BACKOFF);
+        RPS_Angle(90.0);
+        move_forward(100, remaining + RAMP_BACKOFF);
+    }
 
     // Adjust heading on top of the ramp
     RPS_Angle(90.0);
 
     // Go straight off ramp
     move_forward(70, 12.0);
-    Sleep(100);
+    waitMs(100);
 
     // Adjust if robot is too close or far to wall
-    if (RPS.X() < 30.3) {
+    float wallX = sensors.pose.x;
+    if (wallX < 30.3) {
         RPS_Angle(89.0); 
-    } else if (RPS.X() > 31.5) {
+    } else if (wallX > 31.5) {
         RPS_Angle(93.0);
-    } else if (RPS.X() > 30.7) {
+    } else if (wallX > 30.7) {
         RPS_Angle(91.4);
     } else {
         RPS_Angle(90.0);
     }
 
     // Go straight towards foosball
-    move_forward(90, 12.5); //Was 70% power before 4/4
+    move_forward(param(P_FOOSBALL_PERCENT), param(P_FOOSBALL_DISTANCE));
 
     RPS_Angle(90.0);
 
-    Sleep(250); //Sleep functions added as of 4/3
+    waitMs(250); //Sleep functions added as of 4/3
 
     // Adjust y-location
     RPS_Y_inc_abs(foosballDistY);
 
-    Sleep(100);
+    waitMs(100);
 
     // Adjust heading
     RPS_Angle(90.0);
 
-    // Turn right
+    // Turn right, 90 to 0 in four steps, the push squaring the robot up at the end. The middle two were 24 and 15,
+    // which the old open-loop turns coasted on to 26 and 18
     turnRight(70, 38.0);
 
     // Go straight
     move_backward(50, 2.3);
 
     // Turn right
-    turnRight(70, 24.0);
+    turnRight(70, 26.0);
 
     // Go straight
     move_forward(60, 1.5);
 
     // Turn right
-    turnRight(70, 15.0);
+    turnRight(70, 18.0);
 
     // Go straight
     move_forward(70, 1.5);
@@ -1005,204 +3757,951 @@ void doFoosball() {
     turnRight(70, 10.0);
 
     // Go straight 1500 ms
-    bl_motor.SetPercent(50);
-    fr_motor.SetPercent(-1 * 50);
-    fl_motor.SetPercent(50);
-    br_motor.SetPercent(-1 * 50);
-    Sleep(1500);
-    bl_motor.Stop();
-    fr_motor.Stop();
-    fl_motor.Stop();
-    br_motor.Stop();
+    setDrive(50, 50);
+    waitMs(1500);
+    stopDrive();
+
+    // Go straight
+    move_backward(50, 0.5);
+
+    // Grab foosball rings
+    setLever(param(P_FOOSBALL_GRIP));
+    waitMs(200);
+
+    // Store current location
+    X_coord = sensors.pose.x;
+    Y_coord = sensors.pose.y;
+
+    // Go straight
+    move_backward(80, param(P_FOOSBALL_PULL));
+
+    // Raise lever arm
+    setLever(90.0);
+    waitMs(100);
+
+    // Adjust heading
+    RPS_Angle(358.0);
+
+    // Go straight
+    move_forward(80, 3.0); //Was 60
+
+    // Grab foosball rings
+    setLever(param(P_FOOSBALL_GRIP));
+    waitMs(200);
+
+    // Go straight
+    move_backward(80, param(P_FOOSBALL_PULL2));
+
+    // Raise lever arm a little
+    setLever(150.0);
+
+    waitMs(100); // Was 200 before 4/4
+
+    // Go straight
+    move_forward(60, 1.0);
+
+    waitMs(100); //Reduced sleep
+
+    // Raise lever arm
+    setLever(90.0);
+
+    // Adjust heading
+    RPS_Angle(358.0); //Used to be 0.0
+
+    // Go straight
+    move_backward(60, 1.0);
+}
+
+/*
+ * Does everything from end of foosball task to immediately before turning to square-up against the left wall.
+ */
+void doLever() {
+    PROFILE_SCOPE("doLever", PROFILE_TASK);
+    // Back up to the lever with the arm over it
+    const CoursePose &lever = courseLocations[LOC_LEVER];
+    followRoute(LOC_FOOSBALL, LOC_LEVER, lever.x, lever.y, param(P_LEVER_HEADING));
+
+    // Push down lever
+    setLever(5.0);
+
+    waitMs(500);
+
+    // Raise lever arm
+    setLever(90.0);
+
+    waitMs(500);
+
+    // Drive to the bump, facing the left wall
+    const CoursePose &square = courseLocations[LOC_TOKEN_SQUARE];
+    followRoute(LOC_LEVER, LOC_TOKEN_SQUARE, square.x, bumpY + 0.5, square.heading);
+}
+
+/*
+ * Does the squaring up, leading to the token task.
+ */
+void doToken() {
+    PROFILE_SCOPE("doToken", PROFILE_TASK);
+    // Go straight
+    move_backward(70, 1.0);
+
+    // Turn right
+    turnRight(70, param(P_TOKEN_TURN));
+
+    // Adjust heading
+    RPS_Angle(180.0);
+
+    // Go straight for tokenPush ms
+    setDrive(50, 50);
+    waitMs(param(P_TOKEN_PUSH));
+    stopDrive();
+
+    // Store current position
+    X_coord = sensors.pose.x;
+    Y_coord = sensors.pose.y;
+
+    // Go to token slot
+    move_backward(50, 2.0);
+
+    // Turn right a little
+    turnRight(50, 25.0);
+
+    // Go straight
+    move_backward(40, 2.5);
+
+    // Turn left a little
+    turnLeft(50, 10.0);
+
+    // Adjust heading
+    RPS_Angle(180.0);
 
     // Go straight
-    move_backward(50, 0.5);
+    move_backward(80, 2.5);
 
-    // Grab foosball rings
-    lever_servo.SetDegree(168.0);
-    Sleep(200);
+    // Adjust x position
+    RPS_Xinc_rev(X_coord, param(P_TOKEN_X));
 
-    // Store current location
-    X_coord = RPS.X();
-    Y_coord = RPS.Y();
+    // Drop token
+    setToken(170.0);
+    waitMs(2000);
+    setToken(90.0);
+    waitMs(500);
+}
 
-    // Go straight
-    move_backward(80, 6.0); //Was 30
+/*
+ * Final function. From after completing the token task to pressing the final button.
+ */
+void finish() {
+    PROFILE_SCOPE("finish", PROFILE_TASK);
 
-    // Raise lever arm
-    lever_servo.SetDegree(90.0);
-    Sleep(100);
+    // Down the left ramp
+    const CoursePose &end = courseLocations[LOC_FINISH];
+    followRoute(LOC_TOKEN, LOC_FINISH, end.x, end.y, end.heading);
 
-    // Adjust heading
-    RPS_Angle(358.0);
+    // Hit final red button
+    move_forward(100, 8.0);
+    setDrive(100, 15);
+}
 
-    // Go straight
-    move_forward(80, 3.0); //Was 60
+/*
+ * Mission scripts let the task sequences be retuned from the SD card without reflashing.
+ * MISSION_FILE holds one command per line, '#' starts a comment. "TASK <name>" starts a section that replaces
+ * the built-in task function of that name (ddr, foosball, lever, token or finish). Commands:
+ *   FWD/BACK <percent> <inches>      LEFT/RIGHT <percent> <degrees>     HEADING <degrees>
+ *   XINC/XDEC/YINC/YDEC <position>   LEVER/TOKEN <degrees>              WAIT <ms>
+ *   DRIVE <left> <right> <ms>        STORE                              LIGHT <percent>
+ *   IFRED ... ENDIF                  IFBLUE ... ENDIF                   SET <variable> <value>
+ *   POSE <x> <y> <degrees>
+ * Any number can also be a variable name plus an optional offset, such as "bumpY+0.5".
+ * The file is parsed once at startup into a preallocated step array, so nothing is parsed during the run.
+ */
+#define MISSION_FILE "mission.txt"
+#define MAX_MISSION_STEPS 200
+#define MAX_MISSION_LINE 64
+#define MAX_MISSION_DEPTH 4
+#define MISSION_VARS 6
+
+// Task sections a mission script can replace, in run order.
+enum MissionTask {
+    TASK_DDR,
+    TASK_FOOSBALL,
+    TASK_LEVER,
+    TASK_TOKEN,
+    TASK_FINISH,
+    MISSION_TASKS
+};
+
+enum MissionOp {
+    OP_FWD,
+    OP_BACK,
+    OP_LEFT,
+    OP_RIGHT,
+    OP_HEADING,
+    OP_XINC,
+    OP_XDEC,
+    OP_YINC,
+    OP_YDEC,
+    OP_LEVER,
+    OP_TOKEN,
+    OP_WAIT,
+    OP_DRIVE,
+    OP_STORE,
+    OP_LIGHT,
+    OP_IFRED,
+    OP_IFBLUE,
+    OP_ENDIF,
+    OP_SET,
+    OP_TASK,
+    OP_POSE,
+    OP_COUNT
+};
+
+// Keyword and number of arguments of every mission command, in MissionOp order.
+const char *missionKeywords[OP_COUNT] = {
+    "FWD", "BACK", "LEFT", "RIGHT", "HEADING", "XINC", "XDEC", "YINC", "YDEC", "LEVER",
+    "TOKEN", "WAIT", "DRIVE", "STORE", "LIGHT", "IFRED", "IFBLUE", "ENDIF", "SET", "TASK",
+    "POSE"
+};
+const int missionArgCounts[OP_COUNT] = {
+    2, 2, 2, 2, 1, 1, 1, 1, 1, 1,
+    1, 1, 3, 0, 1, 0, 0, 0, 2, 1,
+    3
+};
+
+const char *missionTaskNames[MISSION_TASKS] = { "ddr", "foosball", "lever", "token", "finish" };
+
+// Variables a script can read, and fill in with SET.
+const char *missionVarNames[MISSION_VARS] = { "startingPointY", "ddrLightX", "foosballDistY", "bumpY", "X_coord", "Y_coord" };
+float *missionVars[MISSION_VARS] = { &startingPointY, &ddrLightX, &foosballDistY, &bumpY, &X_coord, &Y_coord };
 
-    // Grab foosball rings
-    lever_servo.SetDegree(168.0);
-    Sleep(200);
+/*
+ * A mission command argument: a constant, or a variable (var >= 0) plus a constant offset.
+ */
+struct MissionValue {
+    signed char var;
+    float offset;
+};
 
-    // Go straight
-    move_backward(80, 5.0); //Was 50 and 6.5
+/*
+ * One parsed mission command. For IFRED/IFBLUE, jump is the index of the matching ENDIF.
+ */
+struct MissionStep {
+    unsigned char op;
+    MissionValue args[3];
+    short jump;
+};
 
-    // Raise lever arm a little
-    lever_servo.SetDegree(150.0);
+MissionStep missionSteps[MAX_MISSION_STEPS];
+int missionStepCount;
 
-    Sleep(100); // Was 200 before 4/4
+// First and one-past-last step of each task section, start is -1 if the script does not replace that task.
+int missionTaskStart[MISSION_TASKS];
+int missionTaskEnd[MISSION_TASKS];
 
-    // Go straight
-    move_forward(60, 1.0);
+// Values from SET commands, applied after the touch calibration.
+bool missionSetUsed[MISSION_VARS];
+float missionSetValues[MISSION_VARS];
 
-    Sleep(100); //Reduced sleep
+// Number of lines that failed to parse, and the first one.
+int missionErrors;
+int missionErrorLine;
 
-    // Raise lever arm
-    lever_servo.SetDegree(90.0);
+/*
+ * Given a token (@param token) and a value to fill in (@param value), parses a number or "variable+offset".
+ * @Returns [token was a valid value]
+ */
+bool parseMissionValue(const char *token, MissionValue *value) {
+    value->var = -1;
+    value->offset = 0;
+
+    for (int i = 0; i < MISSION_VARS; i++) {
+        int length = strlen(missionVarNames[i]);
+        if (strncmp(token, missionVarNames[i], length) == 0) {
+            value->var = i;
+            token += length;
+            if (*token == '\0') {
+                return true;
+            }
+            break;
+        }
+    }
 
-    // Adjust heading
-    RPS_Angle(358.0); //Used to be 0.0
+    char *end;
+    value->offset = strtod(token, &end);
+    return end != token && *end == '\0';
+}
 
-    // Go straight
-    move_backward(60, 1.0);
+/*
+ * Given a task name (@param name), finds its index in missionTaskNames.
+ * @Returns [task index, or -1 if there is no such task]
+ */
+int findMissionTask(const char *name) {
+    for (int i = 0; i < MISSION_TASKS; i++) {
+        if (strcmp(name, missionTaskNames[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
 }
 
 /*
- * Does everything from end of foosball task to immediately before turning to square-up against the left wall.
+ * Given a line of the script (@param line), the open IF stack (@param ifStack, @param depth)
+ * and the current task (@param task), parses it into the next mission step.
+ * @Returns [line was blank, a comment or a valid command]
  */
-void doLever() {
-    // Go straight
-    move_backward(60, 6.8);
+bool parseMissionLine(char *line, int *ifStack, int *depth, int *task) {
+    // Cut off comments, then split into tokens
+    char *comment = strchr(line, '#');
+    if (comment != 0) {
+        *comment = '\0';
+    }
 
-    // Turn right
-    turnRight(40, 20.0);
-    Sleep(100); //Break into two turns as of 4/3
+    char *tokens[5];
+    int count = 0;
+    char *token = strtok(line, " \t\r");
+    while (token != 0 && count < 5) {
+        tokens[count++] = token;
+        token = strtok(0, " \t\r");
+    }
+    if (count == 0) {
+        return true;
+    }
 
-    move_backward(40, 1.2);
-    Sleep(100);
+    int op = -1;
+    for (int i = 0; i < OP_COUNT; i++) {
+        if (strcmp(tokens[0], missionKeywords[i]) == 0) {
+            op = i;
+        }
+    }
+    if (op < 0 || count - 1 != missionArgCounts[op]) {
+        return false;
+    }
 
-    // Turn right
-    turnRight(60, 45.0);
+    if (op == OP_TASK) {
+        int index = findMissionTask(tokens[1]);
+        if (index < 0 || *depth != 0) {
+            return false;
+        }
+        if (*task >= 0) {
+            missionTaskEnd[*task] = missionStepCount;
+        }
+        *task = index;
+        missionTaskStart[index] = missionStepCount;
+        missionTaskEnd[index] = missionStepCount;
+        return true;
+    }
 
-    // Adjust heading
-    RPS_Angle(306.1); //Originally 315.0 and 308.0
+    if (op == OP_SET) {
+        MissionValue value;
+        for (int i = 0; i < MISSION_VARS; i++) {
+            if (strcmp(tokens[1], missionVarNames[i]) == 0 && parseMissionValue(tokens[2], &value) && value.var < 0) {
+                missionSetUsed[i] = true;
+                missionSetValues[i] = value.offset;
+                return true;
+            }
+        }
+        return false;
+    }
 
-    // Go straight
-    move_backward(80, 5.5);
+    // Every other command has to be inside a task section
+    if (*task < 0 || missionStepCount >= MAX_MISSION_STEPS) {
+        return false;
+    }
 
-    // Push down lever
-    lever_servo.SetDegree(5.0);
+    MissionStep *step = &missionSteps[missionStepCount];
+    step->op = op;
+    step->jump = -1;
+    for (int i = 0; i < missionArgCounts[op]; i++) {
+        if (!parseMissionValue(tokens[i + 1], &step->args[i])) {
+            return false;
+        }
+    }
 
-    Sleep(500);
+    if (op == OP_IFRED || op == OP_IFBLUE) {
+        if (*depth >= MAX_MISSION_DEPTH) {
+            return false;
+        }
+        ifStack[(*depth)++] = missionStepCount;
+    } else if (op == OP_ENDIF) {
+        if (*depth == 0) {
+            return false;
+        }
+        missionSteps[ifStack[--(*depth)]].jump = missionStepCount;
+    }
 
-    // Raise lever arm
-    lever_servo.SetDegree(90.0);
+    missionStepCount++;
+    return true;
+}
 
-    Sleep(500);
+/*
+ * Loads and parses MISSION_FILE from the SD card. If the file is missing every task keeps its built-in sequence.
+ * Parse errors (including lines longer than MAX_MISSION_LINE - 1 characters) are counted and the first bad line
+ * is remembered so it can be shown on the screen.
+ */
+void loadMission() {
+    missionStepCount = 0;
+    missionErrors = 0;
+    missionErrorLine = 0;
+    for (int i = 0; i < MISSION_TASKS; i++) {
+        missionTaskStart[i] = -1;
+        missionTaskEnd[i] = -1;
+    }
+    for (int i = 0; i < MISSION_VARS; i++) {
+        missionSetUsed[i] = false;
+    }
 
-    // Go straight
-    move_forward(50, 3.7);
+    FEHFile *file = SD.FOpen(MISSION_FILE, "r");
+    if (file == 0) {
+        return;
+    }
 
-    // Turn right
-    turnRight(70, 123.0);
+    char line[MAX_MISSION_LINE];
+    char extra[2];
+    int ifStack[MAX_MISSION_DEPTH];
+    int depth = 0;
+    int task = -1;
+    int lineNumber = 0;
+
+    int fields;
+    while (!SD.FEof(file) && (fields = SD.FScanf(file, " %63[^\n]%1[^\n]", line, extra)) >= 1) {
+        lineNumber++;
+        // A line too long for the buffer is an error, and the rest of it is skipped instead of read as another line
+        bool tooLong = fields == 2;
+        if (tooLong) {
+            SD.FScanf(file, "%*[^\n]");
+        }
+        if (tooLong || !parseMissionLine(line, ifStack, &depth, &task)) {
+            if (missionErrors == 0) {
+                missionErrorLine = lineNumber;
+            }
+            missionErrors++;
+        }
+    }
+    if (task >= 0) {
+        missionTaskEnd[task] = missionStepCount;
+    }
+    if (depth != 0) {
+        missionErrors++;
+    }
 
-    Sleep(50);
-    // Adjust heading
-    RPS_Angle(230.0);
+    SD.FClose(file);
 
-    // Go straight
-    move_forward(90, 13.0); //was 70
+    // A script with errors is not run and its SET values are not applied, the built-in sequences are used instead
+    if (missionErrors > 0) {
+        for (int i = 0; i < MISSION_TASKS; i++) {
+            missionTaskStart[i] = -1;
+        }
+        for (int i = 0; i < MISSION_VARS; i++) {
+            missionSetUsed[i] = false;
+        }
+    }
+}
 
-    // Turn left
-    turnLeft(70, 28.0);
+/*
+ * Fills in the calibration variables from the SET commands of the mission script.
+ */
+void applyMissionSets() {
+    for (int i = 0; i < MISSION_VARS; i++) {
+        if (missionSetUsed[i]) {
+            *missionVars[i] = missionSetValues[i];
+        }
+    }
+}
 
-    // Adjust heading
-    RPS_Angle(270.0);
+/*
+ * Given a mission command argument (@param value), returns its current value.
+ * @Returns [variable value plus offset]
+ */
+float missionValue(const MissionValue &value) {
+    if (value.var >= 0) {
+        return *missionVars[value.var] + value.offset;
+    }
+    return value.offset;
+}
 
-    // Go straight
-    move_forward(90, 8.8); //was 70
+/*
+ * Given a task index (@param task), runs its section of the mission script.
+ */
+void runMissionTask(int task) {
+    PROFILE_SCOPE("script", PROFILE_TASK);
+    bool redLight = false;
+
+    for (int i = missionTaskStart[task]; i < missionTaskEnd[task]; i++) {
+        const MissionStep &step = missionSteps[i];
+        float a = missionValue(step.args[0]);
+        float b = missionValue(step.args[1]);
+
+        switch (step.op) {
+        case OP_FWD:
+            move_forward(a, b);
+            break;
+        case OP_BACK:
+            move_backward(a, b);
+            break;
+        case OP_LEFT:
+            turnLeft(a, b);
+            break;
+        case OP_RIGHT:
+            turnRight(a, b);
+            break;
+        case OP_HEADING:
+            RPS_Angle(a);
+            break;
+        case OP_XINC:
+            RPS_X_inc_abs(a);
+            break;
+        case OP_XDEC:
+            RPS_X_dec_abs(a);
+            break;
+        case OP_YINC:
+            RPS_Y_inc_abs(a);
+            break;
+        case OP_YDEC:
+            RPS_Y_dec_abs(a);
+            break;
+        case OP_LEVER:
+            setLever(a);
+            break;
+        case OP_TOKEN:
+            setToken(a);
+            break;
+        case OP_WAIT:
+            waitMs(a);
+            break;
+        case OP_DRIVE:
+            setDrive(a, b);
+            waitMs(missionValue(step.args[2]));
+            stopDrive();
+            break;
+        case OP_POSE:
+            goToPose(a, b, missionValue(step.args[2]));
+            break;
+        case OP_STORE:
+            X_coord = estimate.x;
+            Y_coord = estimate.y;
+            break;
+        case OP_LIGHT:
+            redLight = checkDDRLight(a);
+            break;
+        case OP_IFRED:
+            if (!redLight) {
+                i = step.jump;
+            }
+            break;
+        case OP_IFBLUE:
+            if (redLight) {
+                i = step.jump;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+}
 
-    // Adjust heading
-    RPS_Angle(270.0);
+// Time (in ms) the run started and how long each task took, for the end of run report.
+unsigned int missionStartTime;
+unsigned int taskTimes[MISSION_TASKS];
+
+/*
+ * Given a task index (@param task) and its built-in sequence (@param builtIn),
+ * runs the mission script section for that task if there is one, otherwise the built-in sequence.
+ */
+void runTask(int task, void (*builtIn)()) {
+    unsigned int start = schedulerClock();
+    currentTask = task;
+    currentStep = 0;
 
-    // Adjust y position
-    RPS_Y_dec_abs(bumpY + 0.5);
+    if (missionTaskStart[task] >= 0) {
+        runMissionTask(task);
+    } else {
+        builtIn();
+    }
+
+    taskTimes[task] = schedulerClock() - start;
 }
 
 /*
- * Does the squaring up, leading to the token task.
+ * Shows the total mission time, the time each task took, the final pose and the time RPS_Angle spent settling.
  */
-void doToken() {
-    // Go straight
-    move_backward(70, 1.0);
+void runReport() {
+    LCD.Clear();
+    LCD.Write("Total time: ");
+    LCD.WriteLine((schedulerClock() - missionStartTime) / 1000.0);
+    for (int i = 0; i < MISSION_TASKS; i++) {
+        LCD.Write(missionTaskNames[i]);
+        LCD.Write(": ");
+        LCD.WriteLine(taskTimes[i] / 1000.0);
+    }
+    int stalls = 0;
+    int timeouts = 0;
+    int oscillations = 0;
+    for (int i = 0; i < PRIM_COUNT; i++) {
+        stalls += stallEvents[i];
+        timeouts += timeoutEvents[i];
+        oscillations += oscillationEvents[i];
+    }
+    LCD.Write("Stalls: ");
+    LCD.Write(stalls);
+    LCD.Write(" timeouts: ");
+    LCD.Write(timeouts);
+    LCD.Write(" osc: ");
+    LCD.WriteLine(oscillations);
+    LCD.Write("Start latency: ");
+    LCD.Write((int)(startTriggerTime - startOnsetTime));
+    LCD.Write(startTimedOut ? " timeout, go " : " ms, go ");
+    LCD.WriteLine((int)(firstDriveTime - startTriggerTime));
+    LCD.Write("Battery: ");
+    LCD.Write(batteryStartVoltage);
+    LCD.Write(" to ");
+    LCD.WriteLine(batteryVoltage);
+    LCD.Write("Motor scale: ");
+    LCD.Write(batteryMinScale);
+    LCD.Write(" to ");
+    LCD.WriteLine(batteryMaxScale);
+    LCD.Write("X: ");
+    LCD.WriteLine(estimate.x);
+    LCD.Write("Y: ");
+    LCD.WriteLine(estimate.y);
+    LCD.Write("Heading: ");
+    LCD.WriteLine(estimate.heading);
+    LCD.Write("RPS_Angle: ");
+    LCD.Write(angleCalls);
+    LCD.Write(" calls, settle ");
+    LCD.WriteLine(angleSettleTotal / 1000.0);
+}
+#if PROFILING
+// Number of call sites listed on the profile screen, by self time.
+#define PROFILE_TOP_SITES 5
 
-    // Turn right
-    turnRight(70, 100.0);
+/*
+ * Shows where the time of the run went: the self time of driving, RPS correction, waiting and everything else
+ * in every task (in seconds), then the call sites that took the most self time.
+ */
+void profileReport() {
+    LCD.Clear();
+    LCD.WriteLine("Task  Drive RPS Wait Other");
+    for (int i = 0; i < PROFILE_TASKS; i++) {
+        LCD.Write(missionTaskNames[i]);
+        for (int c = PROFILE_DRIVE; c < PROFILE_CATEGORIES; c++) {
+            LCD.Write(" ");
+            LCD.Write(profileTime[i][c] / 1000.0);
+        }
+        LCD.Write(" ");
+        LCD.WriteLine(profileTime[i][PROFILE_TASK] / 1000.0);
+    }
 
-    // Adjust heading
-    RPS_Angle(180.0);
+    ProfileSite *shown[PROFILE_TOP_SITES];
+    for (int n = 0; n < PROFILE_TOP_SITES; n++) {
+        shown[n] = 0;
+        for (ProfileSite *site = profileSites; site != 0; site = site->next) {
+            bool used = false;
+            for (int k = 0; k < n; k++) {
+                used = used || shown[k] == site;
+            }
+            if (!used && (shown[n] == 0 || site->self > shown[n]->self)) {
+                shown[n] = site;
+            }
+        }
+        if (shown[n] == 0) {
+            break;
+        }
+        LCD.Write(shown[n]->name);
+        LCD.Write(" x");
+        LCD.Write(shown[n]->calls);
+        LCD.Write(" ");
+        LCD.WriteLine(shown[n]->self / 1000.0);
+    }
+}
 
-    // Go straight 1600 ms (was 2000)
-    bl_motor.SetPercent(50);
-    fr_motor.SetPercent(-1 * 50);
-    fl_motor.SetPercent(50);
-    br_motor.SetPercent(-1 * 50);
-    Sleep(1600);
-    bl_motor.Stop();
-    fr_motor.Stop();
-    fl_motor.Stop();
-    br_motor.Stop();
+/*
+ * Writes every call site and the task/category table to PROFILE_FILE on the SD card, times in ms.
+ */
+void exportProfile() {
+    FEHFile *file = SD.FOpen(PROFILE_FILE, "w");
+    if (file == 0) {
+        return;
+    }
 
-    // Store current position
-    X_coord = RPS.X();
-    Y_coord = RPS.Y();
+    SD.FPrintf(file, "site calls total self min max\n");
+    for (ProfileSite *site = profileSites; site != 0; site = site->next) {
+        SD.FPrintf(file, "%s %d %u %u %u %u\n", site->name, site->calls, site->total, site->self, site->min, site->max);
+    }
 
-    // Go to token slot
-    move_backward(50, 2.0);
+    SD.FPrintf(file, "task drive correct wait other\n");
+    for (int i = 0; i <= PROFILE_TASKS; i++) {
+        SD.FPrintf(file, "%s %u %u %u %u\n", i < PROFILE_TASKS ? missionTaskNames[i] : "none",
+                profileTime[i][PROFILE_DRIVE], profileTime[i][PROFILE_CORRECT], profileTime[i][PROFILE_WAIT],
+                profileTime[i][PROFILE_TASK]);
+    }
+    SD.FClose(file);
+}
+#endif
 
-    // Turn right a little
-    turnRight(50, 25.0);
 
-    // Go straight
-    move_backward(40, 2.5);
+/*
+ * Shows how many tuned parameters and mission steps were loaded, and the first mission line with an error.
+ */
+void showMission() {
+    LCD.Write("Params from SD: ");
+    LCD.WriteLine(paramsLoaded);
+    LCD.Write("Geometry from SD: ");
+    LCD.WriteLine(geometryLoaded ? "yes" : "no");
+    LCD.Write("Mission steps: ");
+    LCD.WriteLine(missionStepCount);
+    for (int i = 0; i < MISSION_TASKS; i++) {
+        LCD.Write(missionTaskNames[i]);
+        LCD.WriteLine(missionTaskStart[i] >= 0 ? ": script" : ": built-in");
+    }
+    if (missionErrors > 0) {
+        LCD.Write("Errors: ");
+        LCD.Write(missionErrors);
+        LCD.Write(" line ");
+        LCD.WriteLine(missionErrorLine);
+    }
+}
 
-    // Turn left a little
-    turnLeft(50, 10.0);
+/*
+ * Run history on the SD card, so the distribution of course times builds up across real runs.
+ * RUN_HISTORY_FILE gets "S <build>" and "P <build> <parameters...>" when a run starts and
+ * "R <build> <total> <task times...> <start latency> <first drive>" (in ms) plus the heading controller steps
+ * and skipped heading corrections and the battery voltage (in mV) at the start and end when it ends,
+ * so a start without a result is a run that never finished. Runs are grouped by a hash of the build time,
+ * which lets the current build be compared side by side with the earlier ones.
+ */
+#define RUN_HISTORY_FILE "runs.txt"
+#define MAX_RUN_HISTORY 200
+// Longest S or R line, terminator included. P lines are longer and are written and skipped without a buffer.
+#define MAX_RUN_LINE 96
+// Number of most recent runs whose heading controller steps are shown, to see the turn model paying off.
+#define RECENT_RUNS 6
+
+// Distribution of the total time of one group of runs.
+struct RunStats {
+    int runs;
+    int failures;
+    unsigned int p50;
+    unsigned int p95;
+    unsigned int p99;
+    unsigned int taskP50[MISSION_TASKS];
+};
+
+RunStats currentBuildStats;
+RunStats otherBuildStats;
+
+// Heading controller steps of the most recent runs (of any build), oldest first.
+int recentAngleSteps[RECENT_RUNS];
+int recentRuns;
 
-    // Adjust heading
-    RPS_Angle(180.0);
+/*
+ * @Returns [hash of the date and time this program was built]
+ */
+unsigned int buildHash() {
+    const char *text = __DATE__ " " __TIME__;
+    unsigned int hash = 5381;
+    while (*text != '\0') {
+        hash = hash * 33 + *text++;
+    }
+    return hash;
+}
 
-    // Go straight
-    move_backward(80, 2.5);
+/*
+ * Given a line (@param line) to append, adds it to the run history file.
+ */
+void appendRunHistory(const char *line) {
+    FEHFile *file = SD.FOpen(RUN_HISTORY_FILE, "a");
+    if (file == 0) {
+        return;
+    }
+    SD.FPrintf(file, "%s\n", line);
+    SD.FClose(file);
+}
 
-    // Adjust x position
-    RPS_Xinc_rev(X_coord, 8.8);
+/*
+ * Given sorted times (@param times, @param count) and a percentile (@param percent), returns that percentile.
+ * @Returns [time at the percentile, 0 if there are no times]
+ */
+unsigned int percentile(const unsigned int *times, int count, int percent) {
+    if (count == 0) {
+        return 0;
+    }
+    int index = (count * percent + 99) / 100 - 1;
+    if (index < 0) {
+        index = 0;
+    }
+    return times[index];
+}
 
-    // Drop token
-    token_servo.SetDegree(170.0);
-    Sleep(2000);
-    token_servo.SetDegree(90.0);
-    Sleep(500);
+/*
+ * Given times (@param times, @param count), sorts them in place. Insertion sort, the history is short.
+ */
+void sortTimes(unsigned int *times, int count) {
+    for (int i = 1; i < count; i++) {
+        unsigned int value = times[i];
+        int j = i - 1;
+        while (j >= 0 && times[j] > value) {
+            times[j + 1] = times[j];
+            j--;
+        }
+        times[j + 1] = value;
+    }
 }
 
+// Buffers for computing the run statistics, kept out of the stack.
+unsigned int historyTotals[2][MAX_RUN_HISTORY];
+unsigned int historyTasks[2][MISSION_TASKS][MAX_RUN_HISTORY];
+
 /*
- * Final function. From after completing the token task to pressing the final button.
+ * Reads the run history file and fills in the statistics of the current build and of all other builds.
  */
-void finish() {
+void loadRunStats() {
+    RunStats *stats[2] = { &currentBuildStats, &otherBuildStats };
+    int starts[2] = { 0, 0 };
+    int results[2] = { 0, 0 };
+    recentRuns = 0;
+
+    FEHFile *file = SD.FOpen(RUN_HISTORY_FILE, "r");
+    if (file != 0) {
+        unsigned int build = buildHash();
+        char line[MAX_RUN_LINE];
+        char extra[2];
+        int fields;
+        while (!SD.FEof(file) && (fields = SD.FScanf(file, " %95[^\n]%1[^\n]", line, extra)) >= 1) {
+            // Only the S and R lines are read here. The rest of a longer line (a P line has every parameter) is
+            // skipped instead of read as more lines
+            if (fields == 2) {
+                SD.FScanf(file, "%*[^\n]");
+            }
+            char *end;
+            unsigned int lineBuild = strtoul(line + 1, &end, 10);
+            int group = lineBuild == build ? 0 : 1;
+
+            if (line[0] == 'S') {
+                starts[group]++;
+            } else if (line[0] == 'R' && results[group] < MAX_RUN_HISTORY) {
+                int n = results[group]++;
+                historyTotals[group][n] = strtoul(end, &end, 10);
+                for (int i = 0; i < MISSION_TASKS; i++) {
+                    historyTasks[group][i][n] = strtoul(end, &end, 10);
+                }
+
+                // Skip the start latencies, then keep the heading controller steps
+                strtoul(end, &end, 10);
+                strtoul(end, &end, 10);
+                if (recentRuns == RECENT_RUNS) {
+                    for (int i = 1; i < RECENT_RUNS; i++) {
+                        recentAngleSteps[i - 1] = recentAngleSteps[i];
+                    }
+                    recentRuns--;
+                }
+                recentAngleSteps[recentRuns++] = strtol(end, &end, 10);
+            }
+        }
+        SD.FClose(file);
+    }
+
+    for (int group = 0; group < 2; group++) {
+        RunStats *s = stats[group];
+        s->runs = starts[group] > results[group] ? starts[group] : results[group];
+        s->failures = s->runs - results[group];
+
+        sortTimes(historyTotals[group], results[group]);
+        s->p50 = percentile(historyTotals[group], results[group], 50);
+        s->p95 = percentile(historyTotals[group], results[group], 95);
+        s->p99 = percentile(historyTotals[group], results[group], 99);
+        for (int i = 0; i < MISSION_TASKS; i++) {
+            sortTimes(historyTasks[group][i], results[group]);
+            s->taskP50[i] = percentile(historyTasks[group][i], results[group], 50);
+        }
+    }
+}
 
-    move_forward(70, 10.0);
+/*
+ * Records in the run history that a run is starting. Called before waiting for the start light,
+ * so the SD writes are not part of the time from the light to the first drive.
+ */
+void recordRunStart() {
+    char line[MAX_RUN_LINE];
+    sprintf(line, "S %u", buildHash());
+    appendRunHistory(line);
+
+    // The parameter vector goes on its own line, so times can be matched to the parameters they were run with
+    FEHFile *file = SD.FOpen(RUN_HISTORY_FILE, "a");
+    if (file == 0) {
+        return;
+    }
+    SD.FPrintf(file, "P %u", buildHash());
+    for (int i = 0; i < PARAM_COUNT; i++) {
+        SD.FPrintf(file, " %.3f", params[i].value);
+    }
+    SD.FPrintf(file, "\n");
+    SD.FClose(file);
+}
 
-    turnLeft(60, 92.0);
+/*
+ * Records the total and per-task times of the finished run in the run history.
+ */
+void recordRunResult() {
+    char line[MAX_RUN_LINE];
+    int length = sprintf(line, "R %u %u", buildHash(), schedulerClock() - missionStartTime);
+    for (int i = 0; i < MISSION_TASKS; i++) {
+        length += sprintf(line + length, " %u", taskTimes[i]);
+    }
+    sprintf(line + length, " %u %u %d %d %d %d", startTriggerTime - startOnsetTime, firstDriveTime - startTriggerTime,
+            angleIterations, angleSkips, (int)(batteryStartVoltage * 1000), (int)(batteryVoltage * 1000));
+    appendRunHistory(line);
+}
 
-    move_forward(80, 20.0);
+/*
+ * Given a label (@param label) and run statistics (@param stats), shows the run count, failure rate and time percentiles.
+ */
+void showRunStats(const char *label, const RunStats &stats) {
+    LCD.Write(label);
+    LCD.Write(" runs: ");
+    LCD.Write(stats.runs);
+    LCD.Write(" fail: ");
+    LCD.WriteLine(stats.failures);
+    LCD.Write(" p50/95/99: ");
+    LCD.Write(stats.p50 / 1000.0);
+    LCD.Write(" ");
+    LCD.Write(stats.p95 / 1000.0);
+    LCD.Write(" ");
+    LCD.WriteLine(stats.p99 / 1000.0);
+}
 
-    RPS_Angle(270.0);
+/*
+ * Shows the course time distribution of this build next to the earlier builds, with the median time of each task,
+ * then the heading controller steps of the most recent runs and the learned turn model (effective radius / overshoot).
+ */
+void runHistoryReport() {
+    LCD.Clear();
+    showRunStats("This build", currentBuildStats);
+    for (int i = 0; i < MISSION_TASKS; i++) {
+        LCD.Write(" ");
+        LCD.Write(missionTaskNames[i]);
+        LCD.Write(" p50: ");
+        LCD.WriteLine(currentBuildStats.taskP50[i] / 1000.0);
+    }
+    showRunStats("Older builds", otherBuildStats);
 
-    // Hit final red button
-    move_forward(100, 8.0);
-    bl_motor.SetPercent(100);
-    fr_motor.SetPercent(-15);
-    fl_motor.SetPercent(100);
-    br_motor.SetPercent(-15);
+    // Heading corrections should shrink as the turn model learns
+    LCD.Write("Angle steps:");
+    for (int i = 0; i < recentRuns; i++) {
+        LCD.Write(" ");
+        LCD.Write(recentAngleSteps[i]);
+    }
+    LCD.WriteLine("");
+    for (int direction = 0; direction < 2; direction++) {
+        LCD.Write(direction == 0 ? "L r/o:" : "R r/o:");
+        for (int bin = 0; bin < TURN_BINS; bin++) {
+            float gain, overshoot;
+            solveTurnModel(turnModels[direction][bin], &gain, &overshoot);
+            LCD.Write(" ");
+            LCD.Write(turnRadius / gain);
+            LCD.Write("/");
+            LCD.Write((int)overshoot);
+        }
+        LCD.WriteLine("");
+    }
 }
 
 /*
@@ -1224,12 +4723,13 @@ void calibrate(){
             LCD.WriteAt("Store POS1", 100, 126);
 
             // Print RPS values
+            samplePose();
             LCD.WriteAt("RPS X: ", 0, 210);
-            LCD.WriteAt(RPS.X(), 75, 210);
+            LCD.WriteAt(sensors.pose.x, 75, 210);
             LCD.WriteAt("RPS Y: ", 130, 210);
-            LCD.WriteAt(RPS.Y(), 195, 210);
+            LCD.WriteAt(sensors.pose.y, 195, 210);
 
-            if(RPS.X() < 0){
+            if(!sensors.pose.valid){
                 LCD.SetBackgroundColor(RED);
                 LCD.Clear();
             }
@@ -1240,7 +4740,7 @@ void calibrate(){
         }
         Sleep(500);
         if(y_position > 45 && y_position < 195 && x_position > 55 && x_position < 255){
-            startingPointY = RPS.Y();
+            startingPointY = sensors.pose.y;
             i++;
         }
     }
@@ -1256,12 +4756,13 @@ void calibrate(){
             LCD.WriteAt("Store POS2", 100, 126);
 
             // Print RPS values
+            samplePose();
             LCD.WriteAt("RPS X: ", 0, 210);
-            LCD.WriteAt(RPS.X(), 75, 210);
+            LCD.WriteAt(sensors.pose.x, 75, 210);
             LCD.WriteAt("RPS Y: ", 130, 210);
-            LCD.WriteAt(RPS.Y(), 195, 210);
+            LCD.WriteAt(sensors.pose.y, 195, 210);
 
-            if(RPS.X() < 0){
+            if(!sensors.pose.valid){
                 LCD.SetBackgroundColor(RED);
                 LCD.Clear();
             }
@@ -1272,7 +4773,7 @@ void calibrate(){
         }
         Sleep(500);
         if(y_position > 45 && y_position < 195 && x_position > 55 && x_position < 255){
-            ddrLightX = RPS.X();
+            ddrLightX = sensors.pose.x;
             i++;
         }
     }
@@ -1288,12 +4789,13 @@ void calibrate(){
             LCD.WriteAt("Store POS3", 100, 126);
 
             // Print RPS values
+            samplePose();
             LCD.WriteAt("RPS X: ", 0, 210);
-            LCD.WriteAt(RPS.X(), 75, 210);
+            LCD.WriteAt(sensors.pose.x, 75, 210);
             LCD.WriteAt("RPS Y: ", 130, 210);
-            LCD.WriteAt(RPS.Y(), 195, 210);
+            LCD.WriteAt(sensors.pose.y, 195, 210);
 
-            if(RPS.X() < 0){
+            if(!sensors.pose.valid){
                 LCD.SetBackgroundColor(RED);
                 LCD.Clear();
             }
@@ -1304,7 +4806,7 @@ void calibrate(){
         }
         Sleep(500);
         if(y_position > 45 && y_position < 195 && x_position > 55 && x_position < 255){
-            foosballDistY = RPS.Y();
+            foosballDistY = sensors.pose.y;
             i++;
         }
     }
@@ -1320,12 +4822,13 @@ void calibrate(){
             LCD.WriteAt("Store POS4", 100, 126);
 
             // Print RPS values
+            samplePose();
             LCD.WriteAt("RPS X: ", 0, 210);
-            LCD.WriteAt(RPS.X(), 75, 210);
+            LCD.WriteAt(sensors.pose.x, 75, 210);
             LCD.WriteAt("RPS Y: ", 130, 210);
-            LCD.WriteAt(RPS.Y(), 195, 210);
+            LCD.WriteAt(sensors.pose.y, 195, 210);
 
-            if(RPS.X() < 0){
+            if(!sensors.pose.valid){
                 LCD.SetBackgroundColor(RED);
                 LCD.Clear();
             }
@@ -1336,7 +4839,7 @@ void calibrate(){
         }
         Sleep(500);
         if(y_position > 45 && y_position < 195 && x_position > 55 && x_position < 255){
-            bumpY = RPS.Y();
+            bumpY = sensors.pose.y;
             i++;
         }
     }
@@ -1390,8 +4893,8 @@ void initialize(){
     token_servo.SetMax(2430);
     Sleep(500);
 
-    lever_servo.SetDegree(90);
-    token_servo.SetDegree(85);
+    setLever(90);
+    setToken(85);
     Sleep(1000);
 
     LCD.Clear();
@@ -1399,10 +4902,18 @@ void initialize(){
 
     calibrate();
 
+    // Load the tuned parameters, then the mission script and let it override the calibrated positions
+    loadParams();
+    loadGeometry();
+    loadTurnModel();
+    loadMission();
+    applyMissionSets();
+
     Sleep(500);
     // Wait for final action
     LCD.Clear();
-    LCD.Write("Touch anywhere to begin");
+    LCD.WriteLine("Touch anywhere to begin");
+    showMission();
     while(!LCD.Touch(&x_position, &y_position));
 
     // Store ambient light condition
@@ -1414,10 +4925,42 @@ void initialize(){
  */
 int main() {
     initialize();
+#if GEOMETRY_CALIBRATION
+    startScheduler();
+    calibrateGeometry();
+    return 0;
+#endif
+    recorderStart();
+    recordRunStart();
     waitForLight();
-    doDDR();
-    doFoosball();
-    doLever();
-    doToken();
-    finish();
+    startScheduler();
+    missionStartTime = schedulerClock();
+    runTask(TASK_DDR, doDDR);
+    runTask(TASK_FOOSBALL, doFoosball);
+    runTask(TASK_LEVER, doLever);
+    runTask(TASK_TOKEN, doToken);
+    runTask(TASK_FINISH, finish);
+    recordRunResult();
+    saveTurnModel();
+    recorderStop();
+#if PROFILING
+    exportProfile();
+#endif
+    loadRunStats();
+
+    // Show the run report, then the run history, the profile and the scheduler timing after a touch each
+    float x_position, y_position;
+    runReport();
+    while(!LCD.Touch(&x_position, &y_position));
+    Sleep(500);
+    runHistoryReport();
+    while(!LCD.Touch(&x_position, &y_position));
+    Sleep(500);
+#if PROFILING
+    profileReport();
+    while(!LCD.Touch(&x_position, &y_position));
+    Sleep(500);
+#endif
+    schedulerReport();
+    return 0;
 }
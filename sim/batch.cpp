@@ -0,0 +1,103 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "world.h"
+
+/*
+ * Batches of randomized runs across worker processes. See world.h.
+ */
+
+// Shared between the batch and its workers: the next run to take, then a result for every run.
+struct BatchState {
+    unsigned int next;
+    SimResult results[1];
+};
+
+uint64_t simRunSeed(uint64_t seed, int run) {
+    SimRandom random;
+    simSeed(&random, seed ^ ((uint64_t)run * 0x9E3779B97F4A7C15ULL));
+    return simNext(&random);
+}
+
+/*
+ * Given a batch (@param batch) and a run of it (@param run), runs it in this process and stores its result.
+ */
+static void runOne(const SimBatch &batch, int run, SimResult *result) {
+    if (batch.params != 0) {
+        simSdWrite("params.txt", batch.params);
+    }
+    SimVariation variation;
+    uint64_t seed = simRunSeed(batch.seed, run);
+    simRandomize(&variation, seed);
+    simRun(variation, seed, result);
+}
+
+/*
+ * Worker: takes runs from the shared counter until there are none left, each in a child process of its own.
+ */
+static void work(const SimBatch &batch, BatchState *state) {
+    for (;;) {
+        unsigned int run = __sync_fetch_and_add(&state->next, 1);
+        if (run >= (unsigned int)batch.runs) {
+            return;
+        }
+        pid_t child = fork();
+        if (child == 0) {
+            SimResult result;
+            runOne(batch, run, &result);
+            state->results[run] = result;
+            _exit(0);
+        }
+        if (child > 0) {
+            int status;
+            waitpid(child, &status, 0);
+        }
+    }
+}
+
+void simBatch(const SimBatch &batch, SimResult *results) {
+    size_t size = sizeof(BatchState) + batch.runs * sizeof(SimResult);
+    BatchState *state = (BatchState *)mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    state->next = 0;
+    // A run whose child never stores a result reads as one that did not finish or score
+    for (int i = 0; i < batch.runs; i++) {
+        memset(&state->results[i], 0, sizeof(SimResult));
+        state->results[i].courseTime = -1;
+    }
+
+    int jobs = batch.jobs > 0 ? batch.jobs : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (jobs > batch.runs) {
+        jobs = batch.runs;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    for (int i = 0; i < jobs; i++) {
+        if (fork() == 0) {
+            work(batch, state);
+            _exit(0);
+        }
+    }
+    while (wait(0) > 0) {
+    }
+
+    memcpy(results, state->results, batch.runs * sizeof(SimResult));
+    munmap(state, size);
+}
+
+float simPercentile(const float *values, int count, float fraction) {
+    if (count == 0) {
+        return 0;
+    }
+    int rank = (int)ceil(fraction * count);
+    if (rank < 1) {
+        rank = 1;
+    }
+    if (rank > count) {
+        rank = count;
+    }
+    return values[rank - 1];
+}
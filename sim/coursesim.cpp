@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "world.h"
+
+/*
+ * Runs main.cpp once on the simulated course and reports the course time, main.cpp's time for each task, what was
+ * scored and the final pose.
+ *
+ *   coursesim [--seed N] [--red | --blue] [--sd DIR] [--save DIR] [--lcd] [--events] [--trace FILE]
+ *
+ * Without --seed the robot is the nominal one (simNominal); with it, the robot, pack, RPS noise, placements and
+ * the DDR light are drawn from the seed (simRandomize). --sd loads the SD card files (params.txt, mission.txt,
+ * turns.txt, runs.txt...) from a directory and --save writes the card back after the run, flight.txt included.
+ * The exit status is 0 if every task was scored within the time limit.
+ */
+
+/*
+ * Given a result (@param result), prints the run report.
+ */
+static void printResult(const SimResult &result) {
+    printf("light: %s\n", result.red ? "red" : "blue");
+    if (result.courseTime >= 0) {
+        printf("course time: %.3f s\n", result.courseTime);
+    } else {
+        printf("course time: none, final button not pressed\n");
+    }
+    printf("mission time: %.3f s%s\n", result.missionTime / 1000.0, result.finished ? "" : " (main did not return)");
+    for (int i = 0; i < SIM_TASKS; i++) {
+        printf("  %-9s %8.3f s%s\n", simTaskNames[i], result.taskTimes[i] / 1000.0, i < result.tasksRun ? "" : " (not run)");
+    }
+    printf("scored:");
+    for (int i = 0; i < SIM_FEATURES; i++) {
+        if (result.scored[i]) {
+            printf(" %s@%.1f", simFeatureNames[i], result.scoreTime[i]);
+        } else {
+            printf(" %s:missed", simFeatureNames[i]);
+        }
+    }
+    printf("\n");
+    printf("final pose: x %.2f y %.2f heading %.1f\n", result.x, result.y, result.heading);
+    printf("wall contact: %.2f s\n", result.contactTime);
+    printf("result: %s\n", simSucceeded(result) ? "ok" : "failed");
+}
+
+int main(int argc, char **argv) {
+    SimVariation variation;
+    simNominal(&variation);
+    uint64_t seed = 1;
+    int light = 0;
+    const char *sdDirectory = 0;
+    const char *saveDirectory = 0;
+    const char *tracePath = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = strtoull(argv[++i], 0, 10);
+            simRandomize(&variation, seed);
+        } else if (strcmp(argv[i], "--red") == 0) {
+            light = 1;
+        } else if (strcmp(argv[i], "--blue") == 0) {
+            light = -1;
+        } else if (strcmp(argv[i], "--sd") == 0 && i + 1 < argc) {
+            sdDirectory = argv[++i];
+        } else if (strcmp(argv[i], "--save") == 0 && i + 1 < argc) {
+            saveDirectory = argv[++i];
+        } else if (strcmp(argv[i], "--lcd") == 0) {
+            simLcdOut = stderr;
+        } else if (strcmp(argv[i], "--events") == 0) {
+            simEventOut = stdout;
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            tracePath = argv[++i];
+        } else {
+            fprintf(stderr, "usage: %s [--seed N] [--red | --blue] [--sd DIR] [--save DIR] [--lcd] [--events] "
+                    "[--trace FILE]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (light != 0) {
+        variation.red = light > 0;
+    }
+
+    if (sdDirectory != 0 && !simSdLoad(sdDirectory)) {
+        fprintf(stderr, "cannot read %s\n", sdDirectory);
+        return 1;
+    }
+    if (tracePath != 0) {
+        simTraceOut = fopen(tracePath, "w");
+        if (simTraceOut == 0) {
+            fprintf(stderr, "cannot write %s\n", tracePath);
+            return 1;
+        }
+    }
+
+    SimResult result;
+    simRun(variation, seed, &result);
+    printResult(result);
+
+    if (simTraceOut != 0) {
+        fclose(simTraceOut);
+    }
+    if (saveDirectory != 0 && !simSdSave(saveDirectory)) {
+        fprintf(stderr, "cannot write %s\n", saveDirectory);
+        return 1;
+    }
+    return simSucceeded(result) ? 0 : 2;
+}
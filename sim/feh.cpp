@@ -0,0 +1,404 @@
+#include <FEHLCD.h>
+#include <FEHIO.h>
+#include <FEHUtility.h>
+#include <FEHMotor.h>
+#include <FEHRPS.h>
+#include <FEHServo.h>
+#include <FEHSD.h>
+#include <FEHBattery.h>
+
+#include <dirent.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include <string>
+
+#include "world.h"
+
+/*
+ * The FEH libraries main.cpp uses, on the simulator. Every call costs virtual time; see world.h.
+ */
+
+FEHLCD LCD;
+FEHRPS RPS;
+FEHSD SD;
+FEHBattery Battery;
+
+void Sleep(int msec) {
+    if (msec > 0) {
+        simSpend(msec * 1000);
+    }
+}
+
+void Sleep(float sec) {
+    Sleep((int)(sec * 1000));
+}
+
+void Sleep(double sec) {
+    Sleep((int)(sec * 1000));
+}
+
+float TimeNow() {
+    return TimeNowMSec() / 1000.0;
+}
+
+unsigned int TimeNowMSec() {
+    simCountClockRead();
+    simSpend(SIM_COST_CLOCK);
+    return (unsigned int)(simMicros() / 1000);
+}
+
+void ResetTime() {
+}
+
+DigitalEncoder::DigitalEncoder(FEHIO::FEHIOPin pin, FEHIO::FEHIOInterruptTrigger) : pin(pin) {
+}
+
+int DigitalEncoder::Counts() {
+    return simEncoderCounts(pin);
+}
+
+void DigitalEncoder::ResetCounts() {
+    simResetEncoder(pin);
+}
+
+AnalogInputPin::AnalogInputPin(FEHIO::FEHIOPin pin) : pin(pin) {
+}
+
+float AnalogInputPin::Value() {
+    return simAnalog(pin);
+}
+
+DigitalInputPin::DigitalInputPin(FEHIO::FEHIOPin pin) : pin(pin) {
+}
+
+bool DigitalInputPin::Value() {
+    simSpend(SIM_COST_ENCODER);
+    return true;
+}
+
+FEHMotor::FEHMotor(FEHMotorPort port, float maxVoltage) : port(port), maxVoltage(maxVoltage) {
+}
+
+void FEHMotor::SetPercent(float percent) {
+    simSetMotor(port, percent);
+}
+
+void FEHMotor::Stop() {
+    simSetMotor(port, 0);
+}
+
+FEHServo::FEHServo(FEHServoPort port) : port(port) {
+}
+
+void FEHServo::SetMin(int) {
+    simSpend(SIM_COST_SERVO);
+}
+
+void FEHServo::SetMax(int) {
+    simSpend(SIM_COST_SERVO);
+}
+
+void FEHServo::SetDegree(float degree) {
+    simSetServo(port, degree);
+}
+
+void FEHServo::TouchCalibrate() {
+}
+
+void FEHServo::Off() {
+    simSpend(SIM_COST_SERVO);
+}
+
+void FEHRPS::InitializeTouchMenu() {
+    simSpend(SIM_COST_LCD_CLEAR);
+}
+
+int FEHRPS::CurrentRegion() {
+    return 0;
+}
+
+char FEHRPS::CurrentRegionLetter() {
+    return 'A';
+}
+
+float FEHRPS::X() {
+    return simRpsX();
+}
+
+float FEHRPS::Y() {
+    return simRpsY();
+}
+
+float FEHRPS::Heading() {
+    return simRpsHeading();
+}
+
+float FEHBattery::Voltage() {
+    return simBattery();
+}
+
+void FEHLCD::Clear() {
+    simLcdClear();
+}
+
+void FEHLCD::Clear(unsigned int) {
+    simLcdClear();
+}
+
+void FEHLCD::SetFontColor(unsigned int) {
+    simSpend(SIM_COST_ENCODER);
+}
+
+void FEHLCD::SetBackgroundColor(unsigned int) {
+    simSpend(SIM_COST_ENCODER);
+}
+
+void FEHLCD::Write(const char *text) {
+    simLcdText(text, false);
+}
+
+/*
+ * Given a number (@param value) and whether it ends the line (@param newline), writes it the way the Proteus does.
+ */
+static void writeNumber(double value, bool decimals, bool newline) {
+    char text[32];
+    if (decimals) {
+        snprintf(text, sizeof(text), "%.3f", value);
+    } else {
+        snprintf(text, sizeof(text), "%.0f", value);
+    }
+    simLcdText(text, newline);
+}
+
+void FEHLCD::Write(int value) {
+    writeNumber(value, false, false);
+}
+
+void FEHLCD::Write(unsigned int value) {
+    writeNumber(value, false, false);
+}
+
+void FEHLCD::Write(float value) {
+    writeNumber(value, true, false);
+}
+
+void FEHLCD::Write(double value) {
+    writeNumber(value, true, false);
+}
+
+void FEHLCD::WriteLine(const char *text) {
+    simLcdText(text, true);
+}
+
+void FEHLCD::WriteLine(int value) {
+    writeNumber(value, false, true);
+}
+
+void FEHLCD::WriteLine(unsigned int value) {
+    writeNumber(value, false, true);
+}
+
+void FEHLCD::WriteLine(float value) {
+    writeNumber(value, true, true);
+}
+
+void FEHLCD::WriteLine(double value) {
+    writeNumber(value, true, true);
+}
+
+void FEHLCD::WriteAt(const char *text, int, int) {
+    simLcdText(text, true);
+}
+
+void FEHLCD::WriteAt(int value, int, int) {
+    writeNumber(value, false, true);
+}
+
+void FEHLCD::WriteAt(float value, int, int) {
+    writeNumber(value, true, true);
+}
+
+void FEHLCD::WriteAt(double value, int, int) {
+    writeNumber(value, true, true);
+}
+
+void FEHLCD::WriteRC(const char *text, int, int) {
+    simLcdText(text, true);
+}
+
+void FEHLCD::WriteRC(int value, int, int) {
+    writeNumber(value, false, true);
+}
+
+void FEHLCD::WriteRC(float value, int, int) {
+    writeNumber(value, true, true);
+}
+
+void FEHLCD::DrawPixel(int, int) {
+    simSpend(SIM_COST_ENCODER);
+}
+
+void FEHLCD::DrawLine(int, int, int, int) {
+    simSpend(SIM_COST_LCD_SHAPE);
+}
+
+void FEHLCD::DrawRectangle(int, int, int, int) {
+    simSpend(SIM_COST_LCD_SHAPE);
+}
+
+void FEHLCD::FillRectangle(int, int, int, int) {
+    simSpend(SIM_COST_LCD_SHAPE);
+}
+
+void FEHLCD::DrawCircle(int, int, int) {
+    simSpend(SIM_COST_LCD_SHAPE);
+}
+
+void FEHLCD::FillCircle(int, int, int) {
+    simSpend(SIM_COST_LCD_SHAPE);
+}
+
+bool FEHLCD::Touch(float *x, float *y) {
+    return simTouch(x, y);
+}
+
+/*
+ * SD card. Each open file is a host stream: reads come from a copy of the file's contents, writes go to a memory
+ * stream that replaces (or, for "a", extends) the file when it is closed.
+ */
+struct FEHFile {
+    FILE *stream;
+    char *buffer;
+    size_t size;
+    std::string name;
+    bool writing;
+};
+
+static std::map<std::string, std::string> sdFiles;
+
+FEHFile *FEHSD::FOpen(const char *name, const char *mode) {
+    simSpend(SIM_COST_SD_OPEN);
+    FEHFile *file = new FEHFile();
+    file->name = name;
+    file->buffer = 0;
+    file->size = 0;
+    file->writing = mode[0] == 'w' || mode[0] == 'a';
+
+    std::map<std::string, std::string>::iterator existing = sdFiles.find(name);
+    if (file->writing) {
+        file->stream = open_memstream(&file->buffer, &file->size);
+        if (mode[0] == 'a' && existing != sdFiles.end()) {
+            fwrite(existing->second.data(), 1, existing->second.size(), file->stream);
+        }
+    } else {
+        if (existing == sdFiles.end()) {
+            delete file;
+            return 0;
+        }
+        file->size = existing->second.size();
+        file->buffer = (char *)malloc(file->size + 1);
+        memcpy(file->buffer, existing->second.data(), file->size);
+        file->stream = fmemopen(file->buffer, file->size, "r");
+        if (file->size == 0) {
+            // fmemopen cannot open an empty buffer for reading
+            fclose(file->stream);
+            file->stream = fopen("/dev/null", "r");
+        }
+    }
+    return file;
+}
+
+int FEHSD::FClose(FEHFile *file) {
+    simSpend(SIM_COST_SD_CLOSE);
+    if (file == 0) {
+        return -1;
+    }
+    fclose(file->stream);
+    if (file->writing) {
+        sdFiles[file->name] = std::string(file->buffer, file->size);
+    }
+    free(file->buffer);
+    delete file;
+    return 0;
+}
+
+int FEHSD::FCloseAll() {
+    return 0;
+}
+
+int FEHSD::FPrintf(FEHFile *file, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int length = vfprintf(file->stream, format, args);
+    va_end(args);
+    simSpend(SIM_COST_SD_CALL + SIM_COST_SD_CHAR * (length > 0 ? length : 0));
+    return length;
+}
+
+int FEHSD::FScanf(FEHFile *file, const char *format, ...) {
+    long before = ftell(file->stream);
+    va_list args;
+    va_start(args, format);
+    int count = vfscanf(file->stream, format, args);
+    va_end(args);
+    long after = ftell(file->stream);
+    simSpend(SIM_COST_SD_CALL + SIM_COST_SD_CHAR * (after > before ? after - before : 0));
+    return count;
+}
+
+int FEHSD::FEof(FEHFile *file) {
+    simSpend(SIM_COST_ENCODER);
+    return feof(file->stream);
+}
+
+bool simSdLoad(const char *directory) {
+    DIR *dir = opendir(directory);
+    if (dir == 0) {
+        return false;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != 0) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        std::string path = std::string(directory) + "/" + entry->d_name;
+        FILE *file = fopen(path.c_str(), "rb");
+        if (file == 0) {
+            continue;
+        }
+        std::string contents;
+        char block[4096];
+        size_t count;
+        while ((count = fread(block, 1, sizeof(block), file)) > 0) {
+            contents.append(block, count);
+        }
+        fclose(file);
+        sdFiles[entry->d_name] = contents;
+    }
+    closedir(dir);
+    return true;
+}
+
+bool simSdSave(const char *directory) {
+    for (std::map<std::string, std::string>::iterator i = sdFiles.begin(); i != sdFiles.end(); ++i) {
+        std::string path = std::string(directory) + "/" + i->first;
+        FILE *file = fopen(path.c_str(), "wb");
+        if (file == 0) {
+            return false;
+        }
+        fwrite(i->second.data(), 1, i->second.size(), file);
+        fclose(file);
+    }
+    return true;
+}
+
+const char *simSdFile(const char *name) {
+    std::map<std::string, std::string>::iterator i = sdFiles.find(name);
+    return i == sdFiles.end() ? 0 : i->second.c_str();
+}
+
+void simSdWrite(const char *name, const char *contents) {
+    sdFiles[name] = contents;
+}
@@ -0,0 +1,52 @@
+#ifndef FEHLCD_H
+#define FEHLCD_H
+
+// Host stand-in for the Proteus screen. Drawing only costs time; text can be echoed by the simulator,
+// and touches come from the simulated operator.
+
+#define BLACK 0x000000u
+#define WHITE 0xFFFFFFu
+#define RED 0xFF0000u
+#define GREEN 0x00FF00u
+#define BLUE 0x0000FFu
+#define SCARLET 0x990000u
+#define GRAY 0x808080u
+
+class FEHLCD {
+public:
+    void Clear();
+    void Clear(unsigned int color);
+    void SetFontColor(unsigned int color);
+    void SetBackgroundColor(unsigned int color);
+
+    void Write(const char *text);
+    void Write(int value);
+    void Write(unsigned int value);
+    void Write(float value);
+    void Write(double value);
+    void WriteLine(const char *text);
+    void WriteLine(int value);
+    void WriteLine(unsigned int value);
+    void WriteLine(float value);
+    void WriteLine(double value);
+    void WriteAt(const char *text, int x, int y);
+    void WriteAt(int value, int x, int y);
+    void WriteAt(float value, int x, int y);
+    void WriteAt(double value, int x, int y);
+    void WriteRC(const char *text, int row, int col);
+    void WriteRC(int value, int row, int col);
+    void WriteRC(float value, int row, int col);
+
+    void DrawPixel(int x, int y);
+    void DrawLine(int x1, int y1, int x2, int y2);
+    void DrawRectangle(int x, int y, int width, int height);
+    void FillRectangle(int x, int y, int width, int height);
+    void DrawCircle(int x, int y, int r);
+    void FillCircle(int x, int y, int r);
+
+    bool Touch(float *x, float *y);
+};
+
+extern FEHLCD LCD;
+
+#endif // FEHLCD_H
@@ -0,0 +1,24 @@
+#ifndef FEHMOTOR_H
+#define FEHMOTOR_H
+
+// Host stand-in for the FEH motor ports. Each port drives the simulated robot through its wiring in sim/world.cpp.
+
+class FEHMotor {
+public:
+    typedef enum {
+        Motor0 = 0,
+        Motor1,
+        Motor2,
+        Motor3
+    } FEHMotorPort;
+
+    FEHMotor(FEHMotorPort port, float maxVoltage);
+    void SetPercent(float percent);
+    void Stop();
+
+private:
+    FEHMotorPort port;
+    float maxVoltage;
+};
+
+#endif // FEHMOTOR_H
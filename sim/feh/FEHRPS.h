@@ -0,0 +1,18 @@
+#ifndef FEHRPS_H
+#define FEHRPS_H
+
+// Host stand-in for the RPS. Values are the last packet the simulated RPS sent: -1 while lost.
+
+class FEHRPS {
+public:
+    void InitializeTouchMenu();
+    int CurrentRegion();
+    char CurrentRegionLetter();
+    float X();
+    float Y();
+    float Heading();
+};
+
+extern FEHRPS RPS;
+
+#endif // FEHRPS_H
@@ -0,0 +1,23 @@
+#ifndef FEHSD_H
+#define FEHSD_H
+
+#include <stdio.h>
+
+// Host stand-in for the SD card. Files live in memory for the run and are loaded from and saved to a directory
+// by the simulator, so a run can read params.txt or mission.txt and leave runs.txt and flight.txt behind.
+
+struct FEHFile;
+
+class FEHSD {
+public:
+    FEHFile *FOpen(const char *name, const char *mode);
+    int FClose(FEHFile *file);
+    int FCloseAll();
+    int FPrintf(FEHFile *file, const char *format, ...);
+    int FScanf(FEHFile *file, const char *format, ...);
+    int FEof(FEHFile *file);
+};
+
+extern FEHSD SD;
+
+#endif // FEHSD_H
@@ -0,0 +1,13 @@
+#ifndef FEHUTILITY_H
+#define FEHUTILITY_H
+
+// Host stand-in for the FEH utility functions. Time is the simulator's virtual clock.
+
+void Sleep(int msec);
+void Sleep(float sec);
+void Sleep(double sec);
+float TimeNow();
+unsigned int TimeNowMSec();
+void ResetTime();
+
+#endif // FEHUTILITY_H
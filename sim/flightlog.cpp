@@ -0,0 +1,1051 @@
+// main.cpp is compiled into this file so recorded runs can be replayed through its controllers.
+#include "../main.cpp"
+
+#include <string.h>
+#include <sys/time.h>
+#include <vector>
+
+#include "world.h"
+
+/*
+ * Flight log analyzer: reads the flight recorder's flight.txt from the robot's SD card, rebuilds the timeline of
+ * primitive calls from its begin and end records and shows where the time went: each call's duration, final error,
+ * control iterations and time idle in waitMs, totalled per primitive.
+ *
+ *   flightlog FILE [--csv FILE] [--svg FILE] [--replay] [--sd DIR]
+ *
+ * The log is decoded a chunk at a time as it is read, so memory only grows with the number of calls. --csv writes
+ * one line per call. --svg draws the RPS path, one colour per task, with a dot where each call started.
+ *
+ * --replay runs the closed-loop calls (move_forward, move_backward, RPS_Angle and the RPS corrections) again through
+ * this build's controllers. The recorded samples are fed to the estimator as the sensor snapshot they were, with the
+ * encoder counts interpolated between samples so the control step runs every CONTROL_PERIOD as on the robot, and the
+ * commands this build gives are compared with the recorded ones. Replay is open loop: the recorded sensors do not
+ * follow the replayed commands, so a change to a controller shows in its commands, while when a call ends is mostly
+ * decided by the recorded sensors. Counts logged every LOG_PERIOD also change later than the real ones did, so a drive
+ * can run on past its recorded end, where the robot's speed estimate was higher. Turns, paths and goToPose
+ * are not replayed, since they depend on the turn model learned during the run and on waypoints the log does not
+ * hold. --sd loads params.txt and geometry.txt from the card the log came from. The report is the same on every
+ * run, so the replays of two builds can be diffed; only the read time goes to stderr.
+ */
+
+// Bytes of the log read at a time.
+#define READ_CHUNK 65536
+// Longest record, the keyframe.
+#define MAX_RECORD 25
+// Pixels per inch of the path plot, and the blank border around the path (in inches).
+#define SVG_SCALE 10
+#define SVG_MARGIN 3.0
+// Least distance (in inches) between two points of the plotted path.
+#define SVG_STEP 0.1
+
+static const char *primitiveNames[PRIM_COUNT] = {
+    "move_forward", "move_backward", "turnLeft", "turnRight", "RPS_Angle", "followPath", "RPS_Xinc", "RPS_Xinc_rev",
+    "RPS_Xdec", "RPS_Yinc", "RPS_Ydec", "RPS_X_inc_abs", "RPS_X_dec_abs", "RPS_Y_inc_abs", "RPS_Y_dec_abs",
+    "DDR light", "goToPose"
+};
+static const char *statusNames[] = { "OK", "STALLED", "TIMEOUT", "OSCILLATING", "NO_POSE" };
+static const char *taskColours[SIM_TASKS + 1] = { "#d62728", "#1f77b4", "#2ca02c", "#9467bd", "#ff7f0e", "#7f7f7f" };
+
+/*
+ * One recorder sample, decoded: time in ms, counts, the filtered RPS pose (inches, degrees), CdS and pack volts,
+ * commanded side powers (percent) and servo angles.
+ */
+struct Frame {
+    unsigned int time;
+    int fl;
+    int br;
+    float x;
+    float y;
+    float heading;
+    float cds;
+    float battery;
+    int left;
+    int right;
+    int lever;
+    int token;
+    int task;
+    int step;
+    bool valid;
+};
+
+/*
+ * One primitive call. Replay fields are only filled in for calls that were replayed.
+ */
+struct Call {
+    int primitive;
+    int depth;
+    int task;
+    unsigned int start;
+    float target;
+    float x;                // Last valid RPS position when the call started, for the plot
+    float y;
+    bool located;
+
+    bool ended;
+    unsigned int duration;
+    float error;
+    unsigned int iterations;
+    unsigned int idle;
+    int status;
+
+    bool replayed;
+    bool replayEnded;
+    int replayStatus;
+    unsigned int replayDuration;
+    unsigned int replayIterations;
+    int compared;           // Samples whose commands were compared, their mean and largest difference (percent)
+    float commandTotal;
+    float commandMax;
+};
+
+/*
+ * Hex text of the log, read a chunk at a time and handed out a byte at a time.
+ */
+struct LogReader {
+    FILE *file;
+    char chunk[READ_CHUNK];
+    size_t length;
+    size_t position;
+    int high;                   // First digit of a byte still waiting for its second, -1 if none
+    unsigned long characters;
+    unsigned long bad;          // Characters that are not hex digits, and half bytes cut off by a line end
+};
+
+/*
+ * What the decoder ran into.
+ */
+struct LogStats {
+    unsigned long records[4];   // Keyframes, deltas, begins and ends
+    unsigned long skipped;      // Bytes that did not start a record
+    unsigned long orphanDeltas; // Deltas before the first keyframe
+    unsigned long unmatchedEnds;
+    bool truncated;
+    unsigned int firstTime;
+    unsigned int lastTime;
+};
+
+/*
+ * A point of the plotted path, and the task it was recorded in. A point that is not joined starts a new line.
+ */
+struct PathPoint {
+    float x;
+    float y;
+    int task;
+    bool joined;
+};
+
+static std::vector<Call> calls;
+static std::vector<size_t> openCalls;
+static std::vector<PathPoint> plotted;
+static LogStats stats;
+static Frame lastFrame;
+static bool haveFrame;
+static bool pathBroken = true;
+
+// Replay: the log's clock, whether a call is being buffered until its end record, which one and its samples, and
+// the last sample fed to the controllers
+static bool replaying;
+static unsigned int replayNow;
+static bool buffering;
+static size_t bufferedCall;
+static std::vector<Frame> buffered;
+static Frame lastFed;
+
+/*
+ * Replay clock: main.cpp's schedulerClock while replaying.
+ * @Returns [time of the sample being replayed, in ms]
+ */
+static unsigned int replayClock() {
+    return replayNow;
+}
+
+/*
+ * Given a character (@param c), returns its value as a hex digit.
+ * @Returns [0 to 15, -1 if it is not a hex digit]
+ */
+static int hexDigit(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    } else if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    } else if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+/*
+ * Given a reader (@param reader), decodes the next byte of the log. Line ends are skipped: records run across them.
+ * @Returns [the byte, -1 at the end of the file]
+ */
+static int readByte(LogReader *reader) {
+    while (true) {
+        if (reader->position == reader->length) {
+            reader->length = fread(reader->chunk, 1, READ_CHUNK, reader->file);
+            reader->position = 0;
+            if (reader->length == 0) {
+                return -1;
+            }
+        }
+        char c = reader->chunk[reader->position++];
+        reader->characters++;
+        if (c == '\n' || c == '\r') {
+            // Every line is whole bytes; half of one means the line was cut short
+            if (reader->high >= 0) {
+                reader->bad++;
+                reader->high = -1;
+            }
+            continue;
+        }
+
+        int digit = hexDigit(c);
+        if (digit < 0) {
+            reader->bad++;
+        } else if (reader->high < 0) {
+            reader->high = digit;
+        } else {
+            int value = reader->high << 4 | digit;
+            reader->high = -1;
+            return value;
+        }
+    }
+}
+
+/*
+ * Given a record type byte (@param type), returns the length of its records.
+ * @Returns [record length in bytes, type byte included, 0 if it is not a record type]
+ */
+static int recordLength(int type) {
+    switch (type) {
+    case 'K':
+        return 25;
+    case 'D':
+        return 10;
+    case 'B':
+        return 8;
+    case 'E':
+        return 11;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Given a reader (@param reader) and a buffer of MAX_RECORD bytes (@param record), reads the next record. Bytes that
+ * cannot start a record are skipped, so the decoder finds its way back after a damaged stretch.
+ * @Returns [length of the record, 0 at the end of the file]
+ */
+static int readRecord(LogReader *reader, unsigned char *record) {
+    while (true) {
+        int type = readByte(reader);
+        if (type < 0) {
+            return 0;
+        }
+        int length = recordLength(type);
+        if (length == 0) {
+            stats.skipped++;
+            continue;
+        }
+
+        record[0] = type;
+        for (int i = 1; i < length; i++) {
+            int value = readByte(reader);
+            if (value < 0) {
+                stats.truncated = true;
+                return 0;
+            }
+            record[i] = value;
+        }
+        return length;
+    }
+}
+
+/*
+ * Given a record (@param record) and a position in it (@param at), reads a little endian field.
+ * @Returns [the field's value]
+ */
+static unsigned int readUnsigned(const unsigned char *record, int at, int bytes) {
+    unsigned int value = 0;
+    for (int i = bytes - 1; i >= 0; i--) {
+        value = value << 8 | record[at + i];
+    }
+    return value;
+}
+
+static int readShort(const unsigned char *record, int at) {
+    return (short)readUnsigned(record, at, 2);
+}
+
+/*
+ * Given a call (@param call), fills in its replayed outcome and the difference between a replayed command (@param left,
+ * @param right) and the one recorded in a sample (@param frame).
+ */
+static void compareCommands(Call *call, float left, float right, const Frame &frame) {
+    // Recorded commands are truncated to whole percents
+    float difference = (fabs((signed char)left - frame.left) + fabs((signed char)right - frame.right)) / 2;
+    call->compared++;
+    call->commandTotal += difference;
+    if (difference > call->commandMax) {
+        call->commandMax = difference;
+    }
+}
+
+/*
+ * Given a time (@param time, ms), encoder counts (@param fl, @param br) and the sample they lead up to (@param frame),
+ * makes them what the hardware and the sensor snapshot read.
+ */
+static void setSensors(unsigned int time, int fl, int br, const Frame &frame) {
+    replayNow = time;
+    simSetEncoders(fl, br);
+    sensors.time = time;
+    sensors.flCounts = fl;
+    sensors.brCounts = br;
+    sensors.cds = frame.cds;
+}
+
+/*
+ * Given a sample (@param frame), makes its RPS pose the pose snapshot. The log holds the filtered pose, not when
+ * packets came in, so a pose that changed counts as a new packet and a valid one is always fresh.
+ */
+static void setPose(const Frame &frame) {
+    PoseSample *pose = &sensors.pose;
+    if (!frame.valid) {
+        pose->valid = false;
+        return;
+    }
+    if (!pose->valid || frame.x != pose->x || frame.y != pose->y || frame.heading != pose->heading) {
+        pose->sequence++;
+    }
+    pose->x = frame.x;
+    pose->y = frame.y;
+    pose->heading = frame.heading;
+    pose->timestamp = frame.time;
+    pose->valid = true;
+}
+
+/*
+ * Given a sample (@param frame), gives the estimator the directions of the commands recorded with it: those are what
+ * turned the wheels, whatever the replay commands.
+ */
+static void setSigns(const Frame &frame) {
+    if (frame.left != 0) {
+        driveLeftSign = frame.left > 0 ? 1 : -1;
+    }
+    if (frame.right != 0) {
+        driveRightSign = frame.right > 0 ? 1 : -1;
+    }
+}
+
+/*
+ * Given a sample (@param frame), gives the drive the commands recorded in it.
+ */
+static void followCommands(const Frame &frame) {
+    if (frame.left == 0 && frame.right == 0) {
+        stopDrive();
+    } else {
+        setDrive(frame.left, frame.right);
+    }
+}
+
+/*
+ * Given a sample (@param frame) outside the replayed calls, feeds it to the estimator with its recorded commands.
+ */
+static void followFrame(const Frame &frame) {
+    setSensors(frame.time, frame.fl, frame.br, frame);
+    setPose(frame);
+    followCommands(frame);
+    updateEstimate();
+    lastFed = frame;
+}
+
+/*
+ * Given an RPS correction primitive (@param primitive), fills in the axis (@param axis) and facing (@param facing)
+ * its wrapper passes to RPS_Axis.
+ * @Returns [the primitive is an RPS correction]
+ */
+static bool correctionAxis(int primitive, int *axis, int *facing) {
+    switch (primitive) {
+    case PRIM_XINC:
+    case PRIM_X_INC_ABS:
+        *axis = AXIS_X;
+        *facing = 1;
+        return true;
+    case PRIM_XINC_REV:
+    case PRIM_XDEC:
+    case PRIM_X_DEC_ABS:
+        *axis = AXIS_X;
+        *facing = -1;
+        return true;
+    case PRIM_YINC:
+    case PRIM_Y_INC_ABS:
+        *axis = AXIS_Y;
+        *facing = 1;
+        return true;
+    case PRIM_YDEC:
+    case PRIM_Y_DEC_ABS:
+        *axis = AXIS_Y;
+        *facing = -1;
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*
+ * @Returns [calls of the primitive (@param primitive) are replayed]
+ */
+static bool replayable(int primitive) {
+    int axis, facing;
+    return primitive == PRIM_FORWARD || primitive == PRIM_BACKWARD || primitive == PRIM_HEADING
+            || correctionAxis(primitive, &axis, &facing);
+}
+
+/*
+ * Given a call (@param call) being replayed and whether RPS_Angle is still waiting for a resting pose
+ * (@param waiting), runs one control step at the current sensor snapshot, as the estimator and control jobs do.
+ */
+static void replayStep(Call *call, const Frame &frame, bool *waiting) {
+    // Steps before the call started belong to what ran before it
+    if ((int)(replayNow - call->start) <= 0) {
+        return;
+    }
+    setSigns(frame);
+    updateEstimate();
+
+    // RPS_Angle waits for a heading taken at rest, and returns at once if it is already within tolerance
+    if (*waiting && (poseAtRest() || replayNow - call->start >= TURN_MEASURE_TIMEOUT)) {
+        *waiting = false;
+        if (poseAtRest() && fabs(wrapAngle(call->target - sensors.pose.heading)) <= param(P_HEADING_TOLERANCE)) {
+            call->replayEnded = true;
+            call->replayStatus = MOTION_OK;
+            call->replayDuration = replayNow - call->start;
+            return;
+        }
+        submitHeading(call->target);
+    }
+    if (*waiting || call->replayEnded) {
+        return;
+    }
+
+    call->replayIterations++;
+    controlMotion();
+    if (motion.type == MOTION_NONE) {
+        call->replayEnded = true;
+        call->replayStatus = motion.status;
+        call->replayDuration = replayNow - call->start;
+    }
+}
+
+/*
+ * Replays the buffered call (calls[bufferedCall]) through this build's controllers on its recorded samples.
+ * A drive is given the highest average power recorded during it as its cruise percent.
+ */
+static void replayCall() {
+    Call *call = &calls[bufferedCall];
+    buffering = false;
+    replayNow = call->start;
+
+    int axis, facing;
+    bool waiting = false;
+    if (call->primitive == PRIM_FORWARD || call->primitive == PRIM_BACKWARD) {
+        int percent = 0;
+        for (size_t i = 0; i < buffered.size(); i++) {
+            int power = (int)(fabs(buffered[i].left + buffered[i].right) / 2 + 0.5);
+            if (power > percent) {
+                percent = power;
+            }
+        }
+        if (percent == 0) {
+            for (size_t i = 0; i < buffered.size(); i++) {
+                followFrame(buffered[i]);
+            }
+            return;
+        }
+        submitDrive(call->primitive == PRIM_FORWARD ? 1 : -1, percent, call->target);
+        // The drive starts from reset encoders
+        lastFed.time = call->start;
+        lastFed.fl = 0;
+        lastFed.br = 0;
+    } else if (correctionAxis(call->primitive, &axis, &facing)) {
+        float tolerance = param(call->primitive == PRIM_Y_INC_ABS ? P_Y_TOLERANCE : P_AXIS_TOLERANCE);
+        submitAxis(call->primitive, axis, facing, call->target, tolerance);
+    } else {
+        waiting = true;
+    }
+
+    call->replayed = true;
+    call->replayStatus = -1;
+    Frame before = lastFed;
+    for (size_t i = 0; i < buffered.size(); i++) {
+        const Frame &frame = buffered[i];
+        unsigned int from = lastFed.time;
+        for (unsigned int time = from + CONTROL_PERIOD; (int)(frame.time - time) > 0; time += CONTROL_PERIOD) {
+            float fraction = (float)(time - from) / (frame.time - from);
+            setSensors(time, lastFed.fl + (int)((frame.fl - lastFed.fl) * fraction),
+                    lastFed.br + (int)((frame.br - lastFed.br) * fraction), frame);
+            replayStep(call, frame, &waiting);
+        }
+
+        // A sample is recorded after the control step of the same tick, so it holds the commands that step gave
+        setSensors(frame.time, frame.fl, frame.br, frame);
+        setPose(frame);
+        if (waiting) {
+            // Until RPS_Angle starts its motion, the robot does what was recorded
+            followCommands(frame);
+        }
+        replayStep(call, frame, &waiting);
+        if (!waiting) {
+            compareCommands(call, driveLeftPercent, driveRightPercent, frame);
+        }
+        before = lastFed;
+        lastFed = frame;
+    }
+
+    // The call ended after its last sample: carry on to its end with the counts going on at their last rate, and
+    // a sample period over, since counts interpolated between samples change later than the real ones did
+    unsigned int end = call->start + call->duration + LOG_PERIOD;
+    float span = lastFed.time - before.time;
+    float leftRate = span > 0 ? (lastFed.fl - before.fl) / span : 0;
+    float rightRate = span > 0 ? (lastFed.br - before.br) / span : 0;
+    for (unsigned int time = lastFed.time + CONTROL_PERIOD; (int)(end - time) >= 0 && !call->replayEnded;
+            time += CONTROL_PERIOD) {
+        float elapsed = time - lastFed.time;
+        setSensors(time, lastFed.fl + (int)(leftRate * elapsed), lastFed.br + (int)(rightRate * elapsed), lastFed);
+        replayStep(call, lastFed, &waiting);
+    }
+
+    // The recorded call ended first: stop the replayed one where it is
+    if (motion.type != MOTION_NONE) {
+        endMotion(MOTION_OK);
+    }
+}
+
+/*
+ * Given a sample (@param frame), adds it to the plotted path and feeds it to the replay.
+ */
+static void addFrame(const Frame &frame) {
+    if (!haveFrame) {
+        stats.firstTime = frame.time;
+    }
+    stats.lastTime = frame.time;
+    lastFrame = frame;
+    haveFrame = true;
+
+    if (!frame.valid) {
+        pathBroken = true;
+    } else if (pathBroken || plotted.back().task != frame.task
+            || hypot(frame.x - plotted.back().x, frame.y - plotted.back().y) >= SVG_STEP) {
+        PathPoint point;
+        point.x = frame.x;
+        point.y = frame.y;
+        point.task = frame.task;
+        point.joined = !pathBroken;
+        plotted.push_back(point);
+        pathBroken = false;
+    }
+
+    if (!replaying) {
+        return;
+    }
+    if (buffering) {
+        buffered.push_back(frame);
+    } else {
+        followFrame(frame);
+    }
+}
+
+/*
+ * Stops buffering a call that will not be replayed after all, and feeds its samples on as recorded.
+ */
+static void abandonReplay() {
+    buffering = false;
+    for (size_t i = 0; i < buffered.size(); i++) {
+        followFrame(buffered[i]);
+    }
+}
+
+/*
+ * Given a primitive (@param primitive), its start time (@param time, ms) and its target (@param target), opens a call.
+ */
+static void beginCall(int primitive, unsigned int time, float target) {
+    Call call;
+    memset(&call, 0, sizeof(call));
+    call.primitive = primitive;
+    call.depth = openCalls.size();
+    call.task = haveFrame ? lastFrame.task : 255;
+    call.start = time;
+    call.target = target;
+    if (!plotted.empty()) {
+        call.x = plotted.back().x;
+        call.y = plotted.back().y;
+        call.located = true;
+    }
+    call.status = -1;
+
+    if (replaying && !buffering && replayable(primitive)) {
+        buffering = true;
+        bufferedCall = calls.size();
+        buffered.clear();
+    }
+    openCalls.push_back(calls.size());
+    calls.push_back(call);
+}
+
+/*
+ * Given the end record's fields, closes the innermost open call of that primitive. Calls opened inside it whose end
+ * records were dropped stay without an end.
+ */
+static void endCall(int primitive, unsigned int duration, float error, unsigned int iterations, unsigned int idle,
+        int status) {
+    int open = openCalls.size() - 1;
+    while (open >= 0 && calls[openCalls[open]].primitive != primitive) {
+        open--;
+    }
+    if (open < 0) {
+        stats.unmatchedEnds++;
+        return;
+    }
+
+    size_t index = openCalls[open];
+    if (buffering && bufferedCall > index) {
+        abandonReplay();
+    }
+    openCalls.resize(open);
+
+    Call *call = &calls[index];
+    call->ended = true;
+    call->duration = duration;
+    call->error = error;
+    call->iterations = iterations;
+    call->idle = idle;
+    call->status = status;
+    if (buffering && bufferedCall == index) {
+        replayCall();
+    }
+}
+
+/*
+ * Given a reader (@param reader) on a log, decodes every record in it.
+ */
+static void decodeLog(LogReader *reader) {
+    // Last frame in the units it is stored in, which deltas add to
+    unsigned int time = 0;
+    unsigned short fl = 0;
+    unsigned short br = 0;
+    short x = 0;
+    short y = 0;
+    int heading = 0;
+    Frame frame;
+    bool keyed = false;
+
+    unsigned char record[MAX_RECORD];
+    while (readRecord(reader, record) > 0) {
+        switch (record[0]) {
+        case 'K':
+            stats.records[0]++;
+            time = readUnsigned(record, 1, 4);
+            fl = readUnsigned(record, 5, 2);
+            br = readUnsigned(record, 7, 2);
+            x = readShort(record, 9);
+            y = readShort(record, 11);
+            heading = readShort(record, 13);
+            frame.cds = record[15] / 64.0;
+            frame.battery = readUnsigned(record, 16, 2) / 1000.0;
+            frame.left = (signed char)record[18];
+            frame.right = (signed char)record[19];
+            frame.lever = record[20];
+            frame.token = record[21];
+            frame.task = record[22];
+            frame.step = record[23];
+            frame.valid = record[24] & 1;
+            keyed = true;
+            break;
+        case 'D':
+            stats.records[1]++;
+            if (!keyed) {
+                stats.orphanDeltas++;
+                continue;
+            }
+            time += record[1];
+            fl += (signed char)record[2];
+            br += (signed char)record[3];
+            x += (signed char)record[4];
+            y += (signed char)record[5];
+            heading += (signed char)record[6];
+            if (heading < 0) {
+                heading += 2880;
+            } else if (heading >= 2880) {
+                heading -= 2880;
+            }
+            frame.cds = record[7] / 64.0;
+            frame.left = (signed char)record[8];
+            frame.right = (signed char)record[9];
+            break;
+        case 'B':
+            stats.records[2]++;
+            beginCall(record[1], readUnsigned(record, 2, 4), readShort(record, 6) / 32.0);
+            continue;
+        default:
+            stats.records[3]++;
+            endCall(record[1], readUnsigned(record, 2, 2), readShort(record, 4) / 32.0, readUnsigned(record, 6, 2),
+                    readUnsigned(record, 8, 2), record[10]);
+            continue;
+        }
+
+        frame.time = time;
+        frame.fl = fl;
+        frame.br = br;
+        frame.x = x / 32.0;
+        frame.y = y / 32.0;
+        frame.heading = heading / 8.0;
+        addFrame(frame);
+    }
+}
+
+/*
+ * Given a status (@param status), returns its name.
+ * @Returns [status name, "-" if there is none]
+ */
+static const char *statusName(int status) {
+    if (status < 0) {
+        return "-";
+    } else if (status >= (int)(sizeof(statusNames) / sizeof(statusNames[0]))) {
+        return "?";
+    }
+    return statusNames[status];
+}
+
+/*
+ * Given a primitive (@param primitive), returns its name.
+ * @Returns [primitive name]
+ */
+static const char *primitiveName(int primitive) {
+    return primitive < PRIM_COUNT ? primitiveNames[primitive] : "?";
+}
+
+/*
+ * Prints what was decoded, the calls of each primitive and the longest calls.
+ */
+static void printReport() {
+    unsigned long frames = stats.records[0] + stats.records[1] - stats.orphanDeltas;
+    printf("%lu samples over %.1f s, %lu keyframes, %zu calls\n", frames,
+           haveFrame ? (stats.lastTime - stats.firstTime) / 1000.0 : 0.0, stats.records[0], calls.size());
+    size_t unended = 0;
+    for (size_t i = 0; i < calls.size(); i++) {
+        unended += calls[i].ended ? 0 : 1;
+    }
+    if (stats.skipped > 0 || stats.orphanDeltas > 0 || stats.unmatchedEnds > 0 || unended > 0 || stats.truncated) {
+        printf("damage: %lu skipped bytes, %lu deltas before a keyframe, %lu ends without a begin, %zu calls without "
+               "an end%s\n", stats.skipped, stats.orphanDeltas, stats.unmatchedEnds, unended,
+               stats.truncated ? ", last record cut short" : "");
+    }
+
+    printf("\n%-14s %5s %9s %8s %8s %9s %7s %8s %6s\n", "primitive", "calls", "total s", "mean ms", "max ms",
+           "mean|err|", "iters", "idle ms", "not ok");
+    for (int primitive = 0; primitive < PRIM_COUNT; primitive++) {
+        int count = 0;
+        int notOk = 0;
+        double total = 0;
+        double error = 0;
+        unsigned long iterations = 0;
+        unsigned long idle = 0;
+        unsigned int longest = 0;
+        for (size_t i = 0; i < calls.size(); i++) {
+            const Call &call = calls[i];
+            if (call.primitive != primitive || !call.ended) {
+                continue;
+            }
+            count++;
+            notOk += call.status != MOTION_OK ? 1 : 0;
+            total += call.duration;
+            error += fabs(call.error);
+            iterations += call.iterations;
+            idle += call.idle;
+            if (call.duration > longest) {
+                longest = call.duration;
+            }
+        }
+        if (count > 0) {
+            printf("%-14s %5d %9.2f %8.0f %8u %9.2f %7lu %8lu %6d\n", primitiveNames[primitive], count, total / 1000,
+                   total / count, longest, error / count, iterations, idle, notOk);
+        }
+    }
+
+    // The ten longest innermost calls: the time a call spends in calls inside it is already theirs
+    std::vector<size_t> longest;
+    for (size_t i = 0; i < calls.size(); i++) {
+        bool inner = i + 1 == calls.size() || calls[i + 1].depth <= calls[i].depth;
+        if (calls[i].ended && inner) {
+            longest.push_back(i);
+        }
+    }
+    for (size_t i = 0; i < longest.size() && i < 10; i++) {
+        for (size_t j = i + 1; j < longest.size(); j++) {
+            if (calls[longest[j]].duration > calls[longest[i]].duration) {
+                size_t swap = longest[i];
+                longest[i] = longest[j];
+                longest[j] = swap;
+            }
+        }
+    }
+    printf("\nlongest calls:\n");
+    for (size_t i = 0; i < longest.size() && i < 10; i++) {
+        const Call &call = calls[longest[i]];
+        printf("  %8.3f s %-14s target %7.2f %6u ms error %6.2f %4u iters %5u ms idle %s\n", call.start / 1000.0,
+               primitiveName(call.primitive), call.target, call.duration, call.error, call.iterations, call.idle,
+               statusName(call.status));
+    }
+}
+
+/*
+ * Prints how the replayed calls compare with the recorded ones, per primitive.
+ */
+static void printReplay() {
+    printf("\n%-14s %8s %7s %10s %9s %9s %9s\n", "replay", "replayed", "same", "mean dt ms", "iters", "mean dcmd",
+           "max dcmd");
+    int replayed = 0;
+    int same = 0;
+    for (int primitive = 0; primitive < PRIM_COUNT; primitive++) {
+        int count = 0;
+        int agreed = 0;
+        double timeDifference = 0;
+        long iterationDifference = 0;
+        int compared = 0;
+        double commandTotal = 0;
+        float commandMax = 0;
+        for (size_t i = 0; i < calls.size(); i++) {
+            const Call &call = calls[i];
+            if (call.primitive != primitive || !call.replayed) {
+                continue;
+            }
+            count++;
+            agreed += call.replayStatus == call.status ? 1 : 0;
+            if (call.replayEnded) {
+                timeDifference += fabs((double)call.replayDuration - call.duration);
+            }
+            iterationDifference += (long)call.replayIterations - (long)call.iterations;
+            compared += call.compared;
+            commandTotal += call.commandTotal;
+            if (call.commandMax > commandMax) {
+                commandMax = call.commandMax;
+            }
+        }
+        if (count > 0) {
+            printf("%-14s %8d %7d %10.0f %+9ld %9.2f %9.1f\n", primitiveNames[primitive], count, agreed,
+                   timeDifference / count, iterationDifference, compared > 0 ? commandTotal / compared : 0.0,
+                   commandMax);
+        }
+        replayed += count;
+        same += agreed;
+    }
+    printf("%d calls replayed, %d ended the same way\n", replayed, same);
+}
+
+/*
+ * Given a path (@param path), writes one line per call.
+ * @Returns [the file was written]
+ */
+static bool writeCsv(const char *path) {
+    FILE *file = fopen(path, "w");
+    if (file == 0) {
+        return false;
+    }
+    fprintf(file, "call,depth,primitive,task,start_s,target,duration_ms,error,iterations,idle_ms,status");
+    if (replaying) {
+        fprintf(file, ",replay_status,replay_ms,replay_iterations,command_mean,command_max");
+    }
+    fprintf(file, "\n");
+
+    for (size_t i = 0; i < calls.size(); i++) {
+        const Call &call = calls[i];
+        fprintf(file, "%zu,%d,%s,%d,%.3f,%.3f", i, call.depth, primitiveName(call.primitive), call.task,
+                call.start / 1000.0, call.target);
+        if (call.ended) {
+            fprintf(file, ",%u,%.3f,%u,%u,%s", call.duration, call.error, call.iterations, call.idle,
+                    statusName(call.status));
+        } else {
+            fprintf(file, ",,,,,");
+        }
+        if (replaying && call.replayed) {
+            fprintf(file, ",%s,", statusName(call.replayStatus));
+            if (call.replayEnded) {
+                fprintf(file, "%u", call.replayDuration);
+            }
+            fprintf(file, ",%u,%.2f,%.1f", call.replayIterations,
+                    call.compared > 0 ? call.commandTotal / call.compared : 0.0, call.commandMax);
+        } else if (replaying) {
+            fprintf(file, ",,,,,");
+        }
+        fprintf(file, "\n");
+    }
+    return fclose(file) == 0;
+}
+
+/*
+ * Given a path (@param svgPath), draws the RPS path in the RPS frame, X to the right and Y up, with a 6 inch grid,
+ * a line per stretch of one task and a dot where each call started. Hovering a dot names the call.
+ * @Returns [the file was written]
+ */
+static bool writeSvg(const char *svgPath) {
+    FILE *file = fopen(svgPath, "w");
+    if (file == 0) {
+        return false;
+    }
+
+    float minX = 0, maxX = 36, minY = 0, maxY = 72;
+    for (size_t i = 0; i < plotted.size(); i++) {
+        minX = fmin(minX, plotted[i].x);
+        maxX = fmax(maxX, plotted[i].x);
+        minY = fmin(minY, plotted[i].y);
+        maxY = fmax(maxY, plotted[i].y);
+    }
+    minX -= SVG_MARGIN;
+    minY -= SVG_MARGIN;
+    maxX += SVG_MARGIN;
+    maxY += SVG_MARGIN;
+    int width = (int)((maxX - minX) * SVG_SCALE);
+    int height = (int)((maxY - minY) * SVG_SCALE);
+    fprintf(file, "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%d\" height=\"%d\">\n", width, height);
+    fprintf(file, "<rect width=\"100%%\" height=\"100%%\" fill=\"white\"/>\n");
+    // RPS inches to pixels, Y up
+    fprintf(file, "<g transform=\"translate(%.1f %.1f) scale(%d %d)\" stroke-linecap=\"round\">\n",
+            -minX * SVG_SCALE, maxY * SVG_SCALE, SVG_SCALE, -SVG_SCALE);
+
+    for (int line = (int)ceil(minX / 6) * 6; line <= maxX; line += 6) {
+        fprintf(file, "<line x1=\"%d\" y1=\"%.1f\" x2=\"%d\" y2=\"%.1f\" stroke=\"#ddd\" stroke-width=\"0.05\"/>\n",
+                line, minY, line, maxY);
+    }
+    for (int line = (int)ceil(minY / 6) * 6; line <= maxY; line += 6) {
+        fprintf(file, "<line x1=\"%.1f\" y1=\"%d\" x2=\"%.1f\" y2=\"%d\" stroke=\"#ddd\" stroke-width=\"0.05\"/>\n",
+                minX, line, maxX, line);
+    }
+
+    for (size_t i = 0; i < plotted.size();) {
+        // A line runs from a point that is not joined, or of another task, to the next one
+        size_t end = i + 1;
+        while (end < plotted.size() && plotted[end].joined && plotted[end].task == plotted[i].task) {
+            end++;
+        }
+        int task = plotted[i].task < SIM_TASKS ? plotted[i].task : SIM_TASKS;
+        fprintf(file, "<polyline fill=\"none\" stroke=\"%s\" stroke-width=\"0.25\" points=\"", taskColours[task]);
+        // Start from the last point of the line before, so a change of task does not leave a gap
+        size_t first = i > 0 && plotted[i].joined ? i - 1 : i;
+        for (size_t j = first; j < end; j++) {
+            fprintf(file, "%s%.2f,%.2f", j == first ? "" : " ", plotted[j].x, plotted[j].y);
+        }
+        fprintf(file, "\"/>\n");
+        i = end;
+    }
+
+    for (size_t i = 0; i < calls.size(); i++) {
+        const Call &call = calls[i];
+        if (!call.located) {
+            continue;
+        }
+        fprintf(file, "<circle cx=\"%.2f\" cy=\"%.2f\" r=\"0.35\" fill=\"%s\"><title>%.3f s %s %.2f: ", call.x, call.y,
+                call.ended && call.status != MOTION_OK ? "black" : "white", call.start / 1000.0,
+                primitiveName(call.primitive), call.target);
+        if (call.ended) {
+            fprintf(file, "%u ms, error %.2f, %s", call.duration, call.error, statusName(call.status));
+        } else {
+            fprintf(file, "no end");
+        }
+        fprintf(file, "</title></circle>\n");
+    }
+    fprintf(file, "</g>\n</svg>\n");
+    return fclose(file) == 0;
+}
+
+/*
+ * Given a directory with the SD card files (@param sdDirectory, 0 for none), sets up main.cpp to be replayed into:
+ * a bench run with the wheels held, so only the replay moves the encoders, on the log's clock, with the card's
+ * parameters and geometry. Hardware calls still spend virtual time, so the run limit is lifted for long logs.
+ * @Returns [the card could be read]
+ */
+static bool setUpReplay(const char *sdDirectory) {
+    if (sdDirectory != 0 && !simSdLoad(sdDirectory)) {
+        return false;
+    }
+    SimVariation variation;
+    simNominal(&variation);
+    simBench(variation, 1);
+    simHoldWheels(true);
+    simLiftRunLimit();
+    loadParams();
+    loadGeometry();
+    schedulerClock = replayClock;
+    replaying = true;
+    return true;
+}
+
+#undef main
+int main(int argc, char **argv) {
+    const char *logPath = 0;
+    const char *csvPath = 0;
+    const char *svgPath = 0;
+    const char *sdDirectory = 0;
+    bool replay = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--csv") == 0 && i + 1 < argc) {
+            csvPath = argv[++i];
+        } else if (strcmp(argv[i], "--svg") == 0 && i + 1 < argc) {
+            svgPath = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0) {
+            replay = true;
+        } else if (strcmp(argv[i], "--sd") == 0 && i + 1 < argc) {
+            sdDirectory = argv[++i];
+        } else if (argv[i][0] != '-' && logPath == 0) {
+            logPath = argv[i];
+        } else {
+            logPath = 0;
+            break;
+        }
+    }
+    if (logPath == 0) {
+        fprintf(stderr, "usage: %s FILE [--csv FILE] [--svg FILE] [--replay] [--sd DIR]\n", argv[0]);
+        return 1;
+    }
+
+    static LogReader reader;
+    reader.file = fopen(logPath, "r");
+    if (reader.file == 0) {
+        fprintf(stderr, "cannot read %s\n", logPath);
+        return 1;
+    }
+    reader.high = -1;
+    if (replay && !setUpReplay(sdDirectory)) {
+        fprintf(stderr, "cannot read %s\n", sdDirectory);
+        return 1;
+    }
+
+    struct timeval start, end;
+    gettimeofday(&start, 0);
+    decodeLog(&reader);
+    if (buffering) {
+        abandonReplay();
+    }
+    gettimeofday(&end, 0);
+    fclose(reader.file);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+    fprintf(stderr, "read %.1f MB in %.2f s (%.1f MB/s)\n", reader.characters / 1e6, seconds,
+            seconds > 0 ? reader.characters / 1e6 / seconds : 0.0);
+    if (reader.bad > 0) {
+        printf("%lu characters that are not hex\n", reader.bad);
+    }
+
+    printReport();
+    if (replaying) {
+        printReplay();
+    }
+    if (csvPath != 0 && !writeCsv(csvPath)) {
+        fprintf(stderr, "cannot write %s\n", csvPath);
+        return 1;
+    }
+    if (svgPath != 0 && !writeSvg(svgPath)) {
+        fprintf(stderr, "cannot write %s\n", svgPath);
+        return 1;
+    }
+    return 0;
+}
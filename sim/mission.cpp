@@ -0,0 +1,140 @@
+// main.cpp is compiled into this file so the script goes through its own parser.
+#include "../main.cpp"
+
+#include <string.h>
+#include <string>
+
+#include "world.h"
+
+/*
+ * Mission script check: loads a mission script onto the simulated SD card, parses it with main.cpp's loadMission,
+ * the way the robot does at startup, and reports what the robot would run, without driving anything.
+ *
+ *   mission FILE
+ *
+ * It prints the steps of each task section and the SET values, then every line the parser rejects with its line
+ * number in the file. A script with any rejected line is not run at all on the robot, so the exit status is 1 then.
+ */
+
+/*
+ * Given the file name (@param path), reads it whole.
+ * @Returns [the contents, empty if the file could not be read]
+ */
+static std::string readFile(const char *path) {
+    std::string contents;
+    FILE *file = fopen(path, "rb");
+    if (file == 0) {
+        return contents;
+    }
+    char block[4096];
+    size_t count;
+    while ((count = fread(block, 1, sizeof(block), file)) > 0) {
+        contents.append(block, count);
+    }
+    fclose(file);
+    return contents;
+}
+
+/*
+ * Prints the task sections and SET values loadMission parsed.
+ */
+static void printMission() {
+    for (int i = 0; i < MISSION_TASKS; i++) {
+        if (missionTaskStart[i] < 0) {
+            printf("  %-10s built-in\n", missionTaskNames[i]);
+        } else {
+            printf("  %-10s %d steps\n", missionTaskNames[i], missionTaskEnd[i] - missionTaskStart[i]);
+        }
+    }
+    for (int i = 0; i < MISSION_VARS; i++) {
+        if (missionSetUsed[i]) {
+            printf("  SET %s %.3f\n", missionVarNames[i], missionSetValues[i]);
+        }
+    }
+}
+
+/*
+ * Given the script (@param contents), parses it again a line at a time with parseMissionLine, as loadMission does,
+ * and prints every line it rejects.
+ * @Returns [number of lines rejected, plus one if an IF is left open]
+ */
+static int printRejected(const std::string &contents) {
+    missionStepCount = 0;
+    for (int i = 0; i < MISSION_TASKS; i++) {
+        missionTaskStart[i] = -1;
+        missionTaskEnd[i] = -1;
+    }
+    int ifStack[MAX_MISSION_DEPTH];
+    int depth = 0;
+    int task = -1;
+    int rejected = 0;
+
+    size_t start = 0;
+    int lineNumber = 0;
+    while (start < contents.size()) {
+        size_t end = contents.find('\n', start);
+        if (end == std::string::npos) {
+            end = contents.size();
+        }
+        std::string text = contents.substr(start, end - start);
+        start = end + 1;
+        lineNumber++;
+
+        // loadMission skips leading blanks and takes at most MAX_MISSION_LINE - 1 characters of the rest
+        size_t first = text.find_first_not_of(" \t\r");
+        if (first == std::string::npos) {
+            continue;
+        }
+        const char *reason = 0;
+        char line[MAX_MISSION_LINE];
+        if (text.size() - first > MAX_MISSION_LINE - 1) {
+            reason = "longer than MAX_MISSION_LINE - 1";
+        } else {
+            strcpy(line, text.c_str() + first);
+            if (!parseMissionLine(line, ifStack, &depth, &task)) {
+                reason = "rejected";
+            }
+        }
+        if (reason != 0) {
+            printf("  line %d %s: %s\n", lineNumber, reason, text.c_str() + first);
+            rejected++;
+        }
+    }
+    if (depth != 0) {
+        printf("  %d IFRED/IFBLUE left without ENDIF\n", depth);
+        rejected++;
+    }
+    return rejected;
+}
+
+#undef main
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s FILE\n", argv[0]);
+        return 2;
+    }
+    std::string contents = readFile(argv[1]);
+    if (contents.empty()) {
+        fprintf(stderr, "cannot read %s\n", argv[1]);
+        return 2;
+    }
+
+    SimVariation variation;
+    simNominal(&variation);
+    simBench(variation, 1);
+    simSdWrite(MISSION_FILE, contents.c_str());
+    loadMission();
+    int errors = missionErrors;
+
+    printf("%s:\n", argv[1]);
+    if (errors == 0) {
+        printMission();
+        printf("  %d steps, no errors\n", missionStepCount);
+        return 0;
+    }
+    printRejected(contents);
+    // loadMission counts the lines it reads, which skips the blank ones
+    printf("  %d errors, the robot shows the first as line %d (blank lines not counted) and runs the built-in tasks\n",
+           errors, missionErrorLine);
+    return 1;
+}
@@ -0,0 +1,285 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "world.h"
+
+/*
+ * Monte Carlo benchmark: runs main.cpp on many randomized robots and courses (simRandomize) across all cores and
+ * reports the course time distribution, the time of each task and the failure rate.
+ *
+ *   montecarlo [--runs N] [--seed N] [--jobs N] [--sd DIR] [--save FILE] [--compare FILE]
+ *
+ * A seed gives the same runs on every host and for any number of jobs. --sd takes params.txt from a directory.
+ * --save writes one line per run to a file; --compare reads such a file, from another build run with the same seed
+ * and number of runs, and shows the two builds side by side, with the course time difference over the runs both
+ * completed.
+ */
+
+/*
+ * One run as saved: its seed, whether it succeeded, the course time (s) and main.cpp's task times (ms).
+ */
+struct Run {
+    uint64_t seed;
+    bool succeeded;
+    float courseTime;
+    unsigned int taskTimes[SIM_TASKS];
+};
+
+/*
+ * The distribution of a set of runs.
+ */
+struct Summary {
+    int runs;
+    int failed;
+    float course[3];            // p50, p95 and p99 course time (s) of the runs that succeeded
+    float tasks[SIM_TASKS][3];  // The same for each task (s)
+};
+
+static const float percentiles[3] = { 0.50, 0.95, 0.99 };
+
+/*
+ * Given some runs (@param runs), works out their distribution (@param summary).
+ */
+static void summarize(const std::vector<Run> &runs, Summary *summary) {
+    std::vector<float> course;
+    std::vector<float> tasks[SIM_TASKS];
+    summary->runs = runs.size();
+    summary->failed = 0;
+    for (size_t i = 0; i < runs.size(); i++) {
+        if (!runs[i].succeeded) {
+            summary->failed++;
+            continue;
+        }
+        course.push_back(runs[i].courseTime);
+        for (int task = 0; task < SIM_TASKS; task++) {
+            tasks[task].push_back(runs[i].taskTimes[task] / 1000.0);
+        }
+    }
+
+    std::sort(course.begin(), course.end());
+    for (int p = 0; p < 3; p++) {
+        summary->course[p] = simPercentile(course.data(), course.size(), percentiles[p]);
+    }
+    for (int task = 0; task < SIM_TASKS; task++) {
+        std::sort(tasks[task].begin(), tasks[task].end());
+        for (int p = 0; p < 3; p++) {
+            summary->tasks[task][p] = simPercentile(tasks[task].data(), tasks[task].size(), percentiles[p]);
+        }
+    }
+}
+
+/*
+ * Given a summary (@param summary), prints it.
+ */
+static void printSummary(const Summary &summary) {
+    printf("failed: %d of %d (%.1f%%)\n", summary.failed, summary.runs,
+           summary.runs > 0 ? 100.0 * summary.failed / summary.runs : 0.0);
+    printf("%-12s %8s %8s %8s\n", "", "p50", "p95", "p99");
+    printf("%-12s %8.2f %8.2f %8.2f\n", "course", summary.course[0], summary.course[1], summary.course[2]);
+    for (int task = 0; task < SIM_TASKS; task++) {
+        printf("  %-10s %8.2f %8.2f %8.2f\n", simTaskNames[task], summary.tasks[task][0], summary.tasks[task][1],
+               summary.tasks[task][2]);
+    }
+}
+
+/*
+ * Given this build's and the other build's runs (@param runs, @param other) and where the other came from
+ * (@param name), prints the two side by side, then the course time difference over the seeds both completed.
+ */
+static void printComparison(const std::vector<Run> &runs, const std::vector<Run> &other, const char *name) {
+    Summary mine;
+    Summary theirs;
+    summarize(runs, &mine);
+    summarize(other, &theirs);
+
+    printf("%-12s %26s   %26s\n", "", "this build", name);
+    printf("%-12s %8s %8s %8s   %8s %8s %8s\n", "", "p50", "p95", "p99", "p50", "p95", "p99");
+    printf("%-12s %8.2f %8.2f %8.2f   %8.2f %8.2f %8.2f\n", "course", mine.course[0], mine.course[1], mine.course[2],
+           theirs.course[0], theirs.course[1], theirs.course[2]);
+    for (int task = 0; task < SIM_TASKS; task++) {
+        printf("  %-10s %8.2f %8.2f %8.2f   %8.2f %8.2f %8.2f\n", simTaskNames[task], mine.tasks[task][0],
+               mine.tasks[task][1], mine.tasks[task][2], theirs.tasks[task][0], theirs.tasks[task][1],
+               theirs.tasks[task][2]);
+    }
+    printf("%-12s %25.1f%%   %25.1f%%\n", "failed", mine.runs > 0 ? 100.0 * mine.failed / mine.runs : 0.0,
+           theirs.runs > 0 ? 100.0 * theirs.failed / theirs.runs : 0.0);
+
+    // Same seed, same robot and course: the difference is the builds'
+    std::vector<float> differences;
+    int onlyMine = 0;
+    int onlyTheirs = 0;
+    for (size_t i = 0; i < runs.size(); i++) {
+        for (size_t j = 0; j < other.size(); j++) {
+            if (other[j].seed != runs[i].seed) {
+                continue;
+            }
+            if (runs[i].succeeded && other[j].succeeded) {
+                differences.push_back(runs[i].courseTime - other[j].courseTime);
+            } else if (runs[i].succeeded) {
+                onlyMine++;
+            } else if (other[j].succeeded) {
+                onlyTheirs++;
+            }
+            break;
+        }
+    }
+    std::sort(differences.begin(), differences.end());
+    printf("same seeds: %d both succeeded, %d only this build, %d only %s\n", (int)differences.size(), onlyMine,
+           onlyTheirs, name);
+    if (!differences.empty()) {
+        printf("course time difference (this - %s): p5 %+.2f p50 %+.2f p95 %+.2f s\n", name,
+               simPercentile(differences.data(), differences.size(), 0.05),
+               simPercentile(differences.data(), differences.size(), 0.50),
+               simPercentile(differences.data(), differences.size(), 0.95));
+    }
+}
+
+/*
+ * Given a path (@param path) and runs (@param runs), writes one line per run.
+ * @Returns [the file was written]
+ */
+static bool saveRuns(const char *path, const std::vector<Run> &runs) {
+    FILE *file = fopen(path, "w");
+    if (file == 0) {
+        return false;
+    }
+    fprintf(file, "# seed succeeded course");
+    for (int task = 0; task < SIM_TASKS; task++) {
+        fprintf(file, " %s", simTaskNames[task]);
+    }
+    fprintf(file, "\n");
+    for (size_t i = 0; i < runs.size(); i++) {
+        fprintf(file, "%llu %d %.3f", (unsigned long long)runs[i].seed, runs[i].succeeded ? 1 : 0, runs[i].courseTime);
+        for (int task = 0; task < SIM_TASKS; task++) {
+            fprintf(file, " %u", runs[i].taskTimes[task]);
+        }
+        fprintf(file, "\n");
+    }
+    return fclose(file) == 0;
+}
+
+/*
+ * Given a path (@param path), reads runs written by saveRuns into @param runs.
+ * @Returns [the file was read]
+ */
+static bool loadRuns(const char *path, std::vector<Run> *runs) {
+    FILE *file = fopen(path, "r");
+    if (file == 0) {
+        return false;
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), file) != 0) {
+        if (line[0] == '#') {
+            continue;
+        }
+        Run run;
+        unsigned long long seed;
+        int succeeded;
+        if (sscanf(line, "%llu %d %f %u %u %u %u %u", &seed, &succeeded, &run.courseTime, &run.taskTimes[0],
+                   &run.taskTimes[1], &run.taskTimes[2], &run.taskTimes[3], &run.taskTimes[4]) == 3 + SIM_TASKS) {
+            run.seed = seed;
+            run.succeeded = succeeded != 0;
+            runs->push_back(run);
+        }
+    }
+    fclose(file);
+    return true;
+}
+
+/*
+ * Given a directory (@param directory), reads its params.txt into @param params.
+ * @Returns [the file was read]
+ */
+static bool loadParamsFile(const char *directory, std::string *params) {
+    std::string path = std::string(directory) + "/params.txt";
+    FILE *file = fopen(path.c_str(), "r");
+    if (file == 0) {
+        return false;
+    }
+    char block[4096];
+    size_t count;
+    while ((count = fread(block, 1, sizeof(block), file)) > 0) {
+        params->append(block, count);
+    }
+    fclose(file);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    SimBatch batch;
+    batch.runs = 1000;
+    batch.jobs = 0;
+    batch.seed = 1;
+    batch.params = 0;
+    std::string params;
+    const char *savePath = 0;
+    const char *comparePath = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+            batch.runs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            batch.seed = strtoull(argv[++i], 0, 10);
+        } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            batch.jobs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--sd") == 0 && i + 1 < argc) {
+            if (!loadParamsFile(argv[++i], &params)) {
+                fprintf(stderr, "cannot read %s/params.txt\n", argv[i]);
+                return 1;
+            }
+            batch.params = params.c_str();
+        } else if (strcmp(argv[i], "--save") == 0 && i + 1 < argc) {
+            savePath = argv[++i];
+        } else if (strcmp(argv[i], "--compare") == 0 && i + 1 < argc) {
+            comparePath = argv[++i];
+        } else {
+            fprintf(stderr, "usage: %s [--runs N] [--seed N] [--jobs N] [--sd DIR] [--save FILE] [--compare FILE]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (batch.runs < 1) {
+        fprintf(stderr, "--runs must be at least 1\n");
+        return 1;
+    }
+    std::vector<Run> other;
+    if (comparePath != 0 && !loadRuns(comparePath, &other)) {
+        fprintf(stderr, "cannot read %s\n", comparePath);
+        return 1;
+    }
+
+    std::vector<SimResult> results(batch.runs);
+    struct timeval start, end;
+    gettimeofday(&start, 0);
+    simBatch(batch, results.data());
+    gettimeofday(&end, 0);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+
+    std::vector<Run> runs(batch.runs);
+    for (int i = 0; i < batch.runs; i++) {
+        runs[i].seed = simRunSeed(batch.seed, i);
+        runs[i].succeeded = simSucceeded(results[i]);
+        runs[i].courseTime = results[i].courseTime;
+        memcpy(runs[i].taskTimes, results[i].taskTimes, sizeof(runs[i].taskTimes));
+    }
+    printf("%d runs from seed %llu in %.1f s (%.0f runs/s)\n", batch.runs, (unsigned long long)batch.seed, seconds,
+           batch.runs / seconds);
+
+    if (comparePath != 0) {
+        printComparison(runs, other, comparePath);
+    } else {
+        Summary summary;
+        summarize(runs, &summary);
+        printSummary(summary);
+    }
+    if (savePath != 0 && !saveRuns(savePath, runs)) {
+        fprintf(stderr, "cannot write %s\n", savePath);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,517 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "world.h"
+
+/*
+ * Searches main.cpp's tuned parameters for the lowest expected course time that still succeeds often enough, with
+ * CMA-ES over randomized batches on the simulator (simBatch), then writes the best parameter sets and a report of
+ * how much each parameter moves the course time.
+ *
+ *   optimize [--space FILE] [--runs N] [--seed N] [--jobs N] [--generations N] [--min-success F]
+ *            [--validate N] [--keep N] [--out DIR]
+ *
+ * The space file (space.txt) lists the parameters to search. Every candidate is run on the same --runs seeds, so
+ * candidates are compared on the same robots and courses. Its cost is the mean course time of the runs that
+ * succeeded, plus a penalty for every point of success rate under --min-success. The best --keep candidates and the
+ * start point are then run again on --validate fresh seeds and ranked; DIR gets params-1.txt (the best) onward, in
+ * params.txt format, ranking.txt and sensitivity.txt. The sensitivity report moves each parameter of the best set by
+ * its step either way, on the validation seeds.
+ */
+
+// Seconds of cost per unit of success rate under the minimum, so a run lost is worth more than any time saved.
+#define SUCCESS_PENALTY 400.0
+
+/*
+ * A searched parameter: its name in params.txt, where the search starts, its initial step and its bounds.
+ */
+struct Dimension {
+    std::string name;
+    double start;
+    double step;
+    double low;
+    double high;
+};
+
+/*
+ * How a parameter set did on a batch.
+ */
+struct Score {
+    double cost;
+    double success;     // Fraction of runs that succeeded
+    double mean;        // Mean and p95 course time (s) of the runs that succeeded
+    double p95;
+};
+
+/*
+ * A parameter set that was evaluated during the search.
+ */
+struct Candidate {
+    std::vector<double> values;
+    Score score;
+};
+
+static std::vector<Dimension> space;
+static SimBatch batch;
+static double minSuccess = 0.8;
+static int evaluations;
+
+/*
+ * Given a path (@param path), reads the search space.
+ * @Returns [the file was read and lists at least one parameter]
+ */
+static bool loadSpace(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == 0) {
+        return false;
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), file) != 0) {
+        char name[64];
+        Dimension dimension;
+        if (line[0] != '#' && sscanf(line, "%63s %lf %lf %lf %lf", name, &dimension.start, &dimension.step,
+                                     &dimension.low, &dimension.high) == 5) {
+            dimension.name = name;
+            space.push_back(dimension);
+        }
+    }
+    fclose(file);
+    return !space.empty();
+}
+
+/*
+ * Given values (@param values), one per dimension, writes them in params.txt format.
+ * @Returns [the file contents]
+ */
+static std::string paramsText(const std::vector<double> &values) {
+    std::string text;
+    char line[96];
+    for (size_t i = 0; i < space.size(); i++) {
+        snprintf(line, sizeof(line), "%s %g\n", space[i].name.c_str(), values[i]);
+        text += line;
+    }
+    return text;
+}
+
+/*
+ * Given values (@param values), a batch seed and size (@param seed, @param runs), runs the batch with them.
+ * @Returns [how they did]
+ */
+static Score evaluate(const std::vector<double> &values, uint64_t seed, int runs) {
+    std::string params = paramsText(values);
+    SimBatch run = batch;
+    run.seed = seed;
+    run.runs = runs;
+    run.params = params.c_str();
+    std::vector<SimResult> results(runs);
+    simBatch(run, results.data());
+    evaluations++;
+
+    std::vector<float> times;
+    double total = 0;
+    for (int i = 0; i < runs; i++) {
+        if (simSucceeded(results[i])) {
+            times.push_back(results[i].courseTime);
+            total += results[i].courseTime;
+        }
+    }
+    std::sort(times.begin(), times.end());
+    Score score;
+    score.success = (double)times.size() / runs;
+    score.mean = times.empty() ? SIM_COURSE_LIMIT : total / times.size();
+    score.p95 = times.empty() ? SIM_COURSE_LIMIT : simPercentile(times.data(), times.size(), 0.95);
+    score.cost = score.mean + SUCCESS_PENALTY * std::max(0.0, minSuccess - score.success);
+    return score;
+}
+
+/*
+ * Given a symmetric matrix (@param a, n by n, destroyed), finds its eigenvalues (@param values) and eigenvectors
+ * (@param vectors, one per column) with Jacobi rotations.
+ */
+static void eigen(std::vector<double> &a, int n, std::vector<double> &values, std::vector<double> &vectors) {
+    vectors.assign(n * n, 0);
+    for (int i = 0; i < n; i++) {
+        vectors[i * n + i] = 1;
+    }
+    for (int sweep = 0; sweep < 100; sweep++) {
+        double off = 0;
+        for (int p = 0; p < n; p++) {
+            for (int q = p + 1; q < n; q++) {
+                off += a[p * n + q] * a[p * n + q];
+            }
+        }
+        if (off < 1e-22) {
+            break;
+        }
+        for (int p = 0; p < n; p++) {
+            for (int q = p + 1; q < n; q++) {
+                if (fabs(a[p * n + q]) < 1e-300) {
+                    continue;
+                }
+                double theta = (a[q * n + q] - a[p * n + p]) / (2 * a[p * n + q]);
+                double t = (theta >= 0 ? 1 : -1) / (fabs(theta) + sqrt(theta * theta + 1));
+                double c = 1 / sqrt(t * t + 1);
+                double s = t * c;
+                for (int k = 0; k < n; k++) {
+                    double kp = a[k * n + p];
+                    double kq = a[k * n + q];
+                    a[k * n + p] = c * kp - s * kq;
+                    a[k * n + q] = s * kp + c * kq;
+                }
+                for (int k = 0; k < n; k++) {
+                    double pk = a[p * n + k];
+                    double qk = a[q * n + k];
+                    a[p * n + k] = c * pk - s * qk;
+                    a[q * n + k] = s * pk + c * qk;
+                }
+                for (int k = 0; k < n; k++) {
+                    double kp = vectors[k * n + p];
+                    double kq = vectors[k * n + q];
+                    vectors[k * n + p] = c * kp - s * kq;
+                    vectors[k * n + q] = s * kp + c * kq;
+                }
+            }
+        }
+    }
+    values.resize(n);
+    for (int i = 0; i < n; i++) {
+        values[i] = a[i * n + i];
+    }
+}
+
+/*
+ * Given a point of the search (@param y, in steps from the start), returns the parameter values, inside their
+ * bounds, and moves y onto them so the search learns from what was actually run.
+ */
+static std::vector<double> toValues(std::vector<double> &y) {
+    std::vector<double> values(space.size());
+    for (size_t i = 0; i < space.size(); i++) {
+        double value = space[i].start + space[i].step * y[i];
+        value = std::min(space[i].high, std::max(space[i].low, value));
+        y[i] = (value - space[i].start) / space[i].step;
+        values[i] = value;
+    }
+    return values;
+}
+
+/*
+ * CMA-ES (Hansen's (mu/mu_w, lambda) with rank-one and rank-mu updates) over the space, in units of each
+ * parameter's step, starting at the start values with a spread of one step.
+ * Given the number of generations (@param generations) and a random stream (@param random), adds every candidate it
+ * evaluates to @param archive.
+ */
+static void search(int generations, SimRandom *random, std::vector<Candidate> *archive) {
+    int n = space.size();
+    int lambda = 4 + (int)(3 * log((double)n));
+    int mu = lambda / 2;
+    std::vector<double> weights(mu);
+    double sum = 0;
+    for (int i = 0; i < mu; i++) {
+        weights[i] = log(mu + 0.5) - log(i + 1.0);
+        sum += weights[i];
+    }
+    double squares = 0;
+    for (int i = 0; i < mu; i++) {
+        weights[i] /= sum;
+        squares += weights[i] * weights[i];
+    }
+    double mueff = 1 / squares;
+    double cc = (4 + mueff / n) / (n + 4 + 2 * mueff / n);
+    double cs = (mueff + 2) / (n + mueff + 5);
+    double c1 = 2 / ((n + 1.3) * (n + 1.3) + mueff);
+    double cmu = std::min(1 - c1, 2 * (mueff - 2 + 1 / mueff) / ((n + 2) * (n + 2) + mueff));
+    double damps = 1 + 2 * std::max(0.0, sqrt((mueff - 1) / (n + 1)) - 1) + cs;
+    double chiN = sqrt((double)n) * (1 - 1.0 / (4 * n) + 1.0 / (21.0 * n * n));
+
+    std::vector<double> mean(n, 0), pc(n, 0), ps(n, 0), C(n * n, 0);
+    for (int i = 0; i < n; i++) {
+        C[i * n + i] = 1;
+    }
+    double sigma = 1;
+
+    for (int generation = 0; generation < generations; generation++) {
+        // C = B diag(D^2) B'
+        std::vector<double> work = C, D, B;
+        eigen(work, n, D, B);
+        for (int i = 0; i < n; i++) {
+            D[i] = sqrt(std::max(D[i], 1e-20));
+        }
+
+        std::vector<std::vector<double> > ys(lambda, std::vector<double>(n));
+        std::vector<Candidate> candidates(lambda);
+        for (int k = 0; k < lambda; k++) {
+            std::vector<double> z(n);
+            for (int i = 0; i < n; i++) {
+                z[i] = D[i] * simGaussian(random);
+            }
+            for (int i = 0; i < n; i++) {
+                double step = 0;
+                for (int j = 0; j < n; j++) {
+                    step += B[i * n + j] * z[j];
+                }
+                ys[k][i] = mean[i] + sigma * step;
+            }
+            candidates[k].values = toValues(ys[k]);
+            candidates[k].score = evaluate(candidates[k].values, batch.seed, batch.runs);
+            archive->push_back(candidates[k]);
+        }
+
+        std::vector<int> order(lambda);
+        for (int k = 0; k < lambda; k++) {
+            order[k] = k;
+        }
+        for (int a = 0; a < lambda; a++) {
+            for (int b = a + 1; b < lambda; b++) {
+                if (candidates[order[b]].score.cost < candidates[order[a]].score.cost) {
+                    std::swap(order[a], order[b]);
+                }
+            }
+        }
+        const Score &best = candidates[order[0]].score;
+        printf("generation %d: best %.2f s, %.0f%% succeeded (cost %.2f), sigma %.3f\n", generation + 1, best.mean,
+               best.success * 100, best.cost, sigma);
+        fflush(stdout);
+
+        std::vector<double> old = mean;
+        for (int i = 0; i < n; i++) {
+            mean[i] = 0;
+            for (int k = 0; k < mu; k++) {
+                mean[i] += weights[k] * ys[order[k]][i];
+            }
+        }
+
+        // ps follows C^-1/2 (mean - old) / sigma, with C^-1/2 = B diag(1/D) B'
+        std::vector<double> shift(n), rotated(n, 0);
+        for (int i = 0; i < n; i++) {
+            shift[i] = (mean[i] - old[i]) / sigma;
+        }
+        for (int j = 0; j < n; j++) {
+            for (int i = 0; i < n; i++) {
+                rotated[j] += B[i * n + j] * shift[i];
+            }
+            rotated[j] /= D[j];
+        }
+        double norm = 0;
+        for (int i = 0; i < n; i++) {
+            double whitened = 0;
+            for (int j = 0; j < n; j++) {
+                whitened += B[i * n + j] * rotated[j];
+            }
+            ps[i] = (1 - cs) * ps[i] + sqrt(cs * (2 - cs) * mueff) * whitened;
+            norm += ps[i] * ps[i];
+        }
+        norm = sqrt(norm);
+        bool hsig = norm / sqrt(1 - pow(1 - cs, 2.0 * (generation + 1))) / chiN < 1.4 + 2.0 / (n + 1);
+        for (int i = 0; i < n; i++) {
+            pc[i] = (1 - cc) * pc[i] + (hsig ? sqrt(cc * (2 - cc) * mueff) : 0) * shift[i];
+        }
+
+        for (int i = 0; i < n; i++) {
+            for (int j = 0; j < n; j++) {
+                double rankMu = 0;
+                for (int k = 0; k < mu; k++) {
+                    rankMu += weights[k] * (ys[order[k]][i] - old[i]) * (ys[order[k]][j] - old[j]);
+                }
+                C[i * n + j] = (1 - c1 - cmu) * C[i * n + j]
+                        + c1 * (pc[i] * pc[j] + (hsig ? 0 : cc * (2 - cc) * C[i * n + j]))
+                        + cmu * rankMu / (sigma * sigma);
+            }
+        }
+        sigma *= exp(cs / damps * (norm / chiN - 1));
+    }
+}
+
+/*
+ * Given a path (@param path) and its contents (@param text), writes the file.
+ * @Returns [it was written]
+ */
+static bool writeFile(const std::string &path, const std::string &text) {
+    FILE *file = fopen(path.c_str(), "w");
+    if (file == 0) {
+        return false;
+    }
+    fputs(text.c_str(), file);
+    return fclose(file) == 0;
+}
+
+/*
+ * Given the validated candidates (@param ranked, best first), the validation seed and size (@param seed,
+ * @param runs) and where to write (@param directory), moves each parameter of the best set one step either way
+ * and writes how the course time and success rate follow, the parameters that matter most first.
+ * @Returns [the report was written]
+ */
+static bool writeSensitivity(const std::vector<Candidate> &ranked, uint64_t seed, int runs,
+                             const std::string &directory) {
+    struct Effect {
+        int dimension;
+        Score low;
+        Score high;
+        double slope;   // Seconds of mean course time per step
+    };
+    const std::vector<double> &best = ranked[0].values;
+    std::vector<Effect> effects;
+    for (size_t i = 0; i < space.size(); i++) {
+        Effect effect;
+        effect.dimension = i;
+        std::vector<double> values = best;
+        values[i] = std::max(space[i].low, best[i] - space[i].step);
+        double low = values[i];
+        effect.low = evaluate(values, seed, runs);
+        values[i] = std::min(space[i].high, best[i] + space[i].step);
+        double high = values[i];
+        effect.high = evaluate(values, seed, runs);
+        // A side where every run failed has no course time to compare; the success columns show it instead
+        bool timed = effect.low.success > 0 && effect.high.success > 0 && high > low;
+        effect.slope = timed ? (effect.high.mean - effect.low.mean) * space[i].step / (high - low) : 0;
+        effects.push_back(effect);
+        printf("sensitivity %s: %+.2f s per step, %.0f%% to %.0f%% succeeded\n", space[i].name.c_str(),
+               effect.slope, effect.low.success * 100, effect.high.success * 100);
+        fflush(stdout);
+    }
+    for (size_t a = 0; a < effects.size(); a++) {
+        for (size_t b = a + 1; b < effects.size(); b++) {
+            if (fabs(effects[b].slope) > fabs(effects[a].slope)) {
+                std::swap(effects[a], effects[b]);
+            }
+        }
+    }
+
+    std::string text;
+    char line[512];
+    snprintf(line, sizeof(line), "# Best set (params-1.txt): %.2f s mean, %.0f%% succeeded, over %d runs.\n"
+             "# Each parameter moved one step down and up from it; slope is seconds of mean course time per step\n"
+             "# (0 if every run on one side failed).\n"
+             "# %-18s %9s %9s %8s %9s %9s %9s %9s\n", ranked[0].score.mean, ranked[0].score.success * 100, runs,
+             "name", "value", "step", "slope", "mean-", "mean+", "success-", "success+");
+    text += line;
+    for (size_t i = 0; i < effects.size(); i++) {
+        const Effect &effect = effects[i];
+        const Dimension &dimension = space[effect.dimension];
+        snprintf(line, sizeof(line), "%-20s %9g %9g %+8.2f %9.2f %9.2f %8.0f%% %8.0f%%\n", dimension.name.c_str(),
+                 best[effect.dimension], dimension.step, effect.slope, effect.low.mean, effect.high.mean,
+                 effect.low.success * 100, effect.high.success * 100);
+        text += line;
+    }
+    return writeFile(directory + "/sensitivity.txt", text);
+}
+
+int main(int argc, char **argv) {
+    const char *spacePath = "space.txt";
+    const char *directory = "build/optimize";
+    int generations = 20;
+    int validate = 200;
+    int keep = 5;
+    batch.runs = 40;
+    batch.jobs = 0;
+    batch.seed = 1;
+    batch.params = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--space") == 0 && i + 1 < argc) {
+            spacePath = argv[++i];
+        } else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+            batch.runs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            batch.seed = strtoull(argv[++i], 0, 10);
+        } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            batch.jobs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--generations") == 0 && i + 1 < argc) {
+            generations = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--min-success") == 0 && i + 1 < argc) {
+            minSuccess = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--validate") == 0 && i + 1 < argc) {
+            validate = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--keep") == 0 && i + 1 < argc) {
+            keep = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+            directory = argv[++i];
+        } else {
+            fprintf(stderr, "usage: %s [--space FILE] [--runs N] [--seed N] [--jobs N] [--generations N] "
+                    "[--min-success F] [--validate N] [--keep N] [--out DIR]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (batch.runs < 1 || validate < 1 || keep < 1) {
+        fprintf(stderr, "--runs, --validate and --keep must be at least 1\n");
+        return 1;
+    }
+    if (!loadSpace(spacePath)) {
+        fprintf(stderr, "cannot read %s\n", spacePath);
+        return 1;
+    }
+
+    std::vector<Candidate> archive;
+    Candidate start;
+    for (size_t i = 0; i < space.size(); i++) {
+        start.values.push_back(space[i].start);
+    }
+    start.score = evaluate(start.values, batch.seed, batch.runs);
+    printf("start: %.2f s, %.0f%% succeeded (cost %.2f)\n", start.score.mean, start.score.success * 100,
+           start.score.cost);
+    SimRandom random;
+    simSeed(&random, batch.seed);
+    search(generations, &random, &archive);
+
+    // The best candidates of the search and the start, run again on seeds the search never saw
+    for (size_t a = 0; a < archive.size(); a++) {
+        for (size_t b = a + 1; b < archive.size(); b++) {
+            if (archive[b].score.cost < archive[a].score.cost) {
+                std::swap(archive[a], archive[b]);
+            }
+        }
+    }
+    std::vector<Candidate> ranked;
+    ranked.push_back(start);
+    for (int i = 0; i < keep && i < (int)archive.size(); i++) {
+        ranked.push_back(archive[i]);
+    }
+    uint64_t validationSeed = batch.seed + 1;
+    for (size_t i = 0; i < ranked.size(); i++) {
+        ranked[i].score = evaluate(ranked[i].values, validationSeed, validate);
+    }
+    int startIndex = 0;
+    for (size_t a = 0; a < ranked.size(); a++) {
+        for (size_t b = a + 1; b < ranked.size(); b++) {
+            if (ranked[b].score.cost < ranked[a].score.cost) {
+                std::swap(ranked[a], ranked[b]);
+            }
+        }
+    }
+    for (size_t i = 0; i < ranked.size(); i++) {
+        if (ranked[i].values == start.values) {
+            startIndex = i;
+        }
+    }
+
+    std::string out = directory;
+    std::string ranking = "# rank file mean p95 success cost, on the validation runs\n";
+    char line[160];
+    for (size_t i = 0; i < ranked.size(); i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "params-%d.txt", (int)i + 1);
+        if (!writeFile(out + "/" + name, paramsText(ranked[i].values))) {
+            fprintf(stderr, "cannot write %s/%s\n", directory, name);
+            return 1;
+        }
+        snprintf(line, sizeof(line), "%d %s %.2f %.2f %.1f%% %.2f%s\n", (int)i + 1, name, ranked[i].score.mean,
+                 ranked[i].score.p95, ranked[i].score.success * 100, ranked[i].score.cost,
+                 (int)i == startIndex ? " (start)" : "");
+        ranking += line;
+    }
+    if (!writeFile(out + "/ranking.txt", ranking)) {
+        fprintf(stderr, "cannot write %s/ranking.txt\n", directory);
+        return 1;
+    }
+    printf("%s", ranking.c_str());
+    if (!writeSensitivity(ranked, validationSeed, validate, out)) {
+        fprintf(stderr, "cannot write %s/sensitivity.txt\n", directory);
+        return 1;
+    }
+    printf("%d batches run, results in %s\n", evaluations, directory);
+    return 0;
+}
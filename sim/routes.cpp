@@ -0,0 +1,506 @@
+// main.cpp is compiled into this file so the planner reads its course map and the legs run through its controllers.
+#include "../main.cpp"
+
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "world.h"
+
+/*
+ * Route planner: plans every route of main.cpp's courseRoutes over its course map and prints the table in source form,
+ * ready to paste back. The exit status is 2 if the table in main.cpp is not the plan, so a map changed without
+ * replanning shows up.
+ *
+ *   routes [--time] [--svg FILE]
+ *
+ * The planner works on the robot center. Every obstacle is grown by its clearance and the walls by WALL_CLEARANCE;
+ * the corners of the grown boxes are the nodes of a visibility graph, and a shortest path search over pairs of nodes
+ * (where the robot is and where it came from) prices each route as followRoute drives it: the turn in place out of
+ * the start heading, the straight runs at ROUTE_PERCENT, the slowing down at every corner and the turn in place into
+ * the goal heading.
+ *
+ * --time drives every leg on the simulator, from a nominal robot at rest on the start location, twice: along its route
+ * with followRoute, and with the hand-written sequence that drove it before. It prints how long each took and how far
+ * from the goal it ended. --svg draws the map, the grown obstacles, the planned routes and the driven paths.
+ */
+
+// Grown box corners are pushed this much further out (in inches), so the paths between them clear the boxes.
+#define PLAN_MARGIN 0.1
+#define MAX_NODES (2 + 4 * OBSTACLE_COUNT)
+// Time (in seconds) of a turn in place: stopping and settling, plus the turn at POSE_TURN_PERCENT. Pure pursuit
+// slows down in a corner for about half the time the same turn in place would take, without the stop.
+#define PLAN_TURN_BASE 0.3
+#define PLAN_CORNER_FRACTION 0.5
+// Pixels per inch of the plot.
+#define SVG_SCALE 10
+
+/*
+ * A planned route, in robot center positions: the start, the corners and the goal.
+ */
+struct Plan {
+    Waypoint points[MAX_ROUTE_CORNERS + 2];
+    int count;
+    float cost;
+};
+
+/*
+ * How one leg ended when driven: its time (in seconds), how far the QR code and heading ended from the goal, and
+ * whether every call returned MOTION_OK. Shared with the child process that drives it.
+ */
+struct LegResult {
+    float time;
+    float distance;
+    float heading;
+    bool ok;
+    double start;
+    double end;
+};
+
+static Plan plans[ROUTE_COUNT];
+static LegResult *results;
+static FILE *traces[ROUTE_COUNT][2];
+
+/*
+ * Given a location (@param location) and a point to fill in (@param center), gives where the robot center is when
+ * its QR code is on the location.
+ */
+static void locationCenter(int location, Waypoint *center) {
+    const CoursePose &pose = courseLocations[location];
+    center->x = pose.x - QR_OFFSET * cos(pose.heading * PI / 180);
+    center->y = pose.y - QR_OFFSET * sin(pose.heading * PI / 180);
+}
+
+/*
+ * Given an obstacle (@param obstacle), how much more to grow it (@param margin) and a box to fill in (@param grown),
+ * gives the box the robot center has to stay out of.
+ */
+static void growObstacle(const CourseBox &obstacle, float margin, CourseBox *grown) {
+    *grown = obstacle;
+    grown->left -= obstacle.clearance + margin;
+    grown->bottom -= obstacle.clearance + margin;
+    grown->right += obstacle.clearance + margin;
+    grown->top += obstacle.clearance + margin;
+}
+
+/*
+ * @Returns [the point (@param point) is on the course with the robot clear of the walls]
+ */
+static bool insideWalls(const Waypoint &point) {
+    return point.x >= WALL_CLEARANCE && point.x <= COURSE_WIDTH - WALL_CLEARANCE && point.y >= WALL_CLEARANCE
+            && point.y <= COURSE_LENGTH - WALL_CLEARANCE;
+}
+
+/*
+ * Given a segment (@param a, @param b), clips it against every grown obstacle.
+ * @Returns [no part of the segment is inside a grown obstacle]
+ */
+static bool segmentClear(const Waypoint &a, const Waypoint &b) {
+    for (int i = 0; i < OBSTACLE_COUNT; i++) {
+        CourseBox box;
+        growObstacle(courseObstacles[i], 0, &box);
+        float from[2] = { a.x, a.y };
+        float delta[2] = { b.x - a.x, b.y - a.y };
+        float low[2] = { box.left, box.bottom };
+        float high[2] = { box.right, box.top };
+        float enter = 0;
+        float leave = 1;
+        for (int axis = 0; axis < 2 && enter < leave; axis++) {
+            if (fabs(delta[axis]) < 1e-6) {
+                if (from[axis] <= low[axis] || from[axis] >= high[axis]) {
+                    leave = -1;
+                }
+                continue;
+            }
+            float t0 = (low[axis] - from[axis]) / delta[axis];
+            float t1 = (high[axis] - from[axis]) / delta[axis];
+            enter = fmax(enter, fmin(t0, t1));
+            leave = fmin(leave, fmax(t0, t1));
+        }
+        if (leave - enter > 1e-4) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * @Returns [direction (in degrees) from one point (@param a) to another (@param b)]
+ */
+static float bearing(const Waypoint &a, const Waypoint &b) {
+    return atan2(b.y - a.y, b.x - a.x) * 180 / PI;
+}
+
+/*
+ * @Returns [time (in seconds) of a turn in place of some degrees (@param degrees); followRoute and goToPose leave
+ * turns of up to POSE_TURN_ANGLE to the path]
+ */
+static float turnTime(float degrees) {
+    float rate = POSE_TURN_PERCENT / 100.0 * FULL_SPEED_COUNTS / COUNTS_PER_REV * 2 * PI * WHEEL_RADIUS / ROBOT_RADIUS
+            * 180 / PI;
+    degrees = fabs(degrees);
+    return degrees > POSE_TURN_ANGLE ? PLAN_TURN_BASE + degrees / rate : degrees / rate * PLAN_CORNER_FRACTION;
+}
+
+/*
+ * Given a route (@param route), plans it and fills in its plan (@param plan).
+ * @Returns [a route was found]
+ */
+static bool planRoute(const Route &route, Plan *plan) {
+    Waypoint nodes[MAX_NODES];
+    int count = 2;
+    locationCenter(route.from, &nodes[0]);
+    locationCenter(route.to, &nodes[1]);
+    for (int i = 0; i < OBSTACLE_COUNT; i++) {
+        CourseBox box;
+        growObstacle(courseObstacles[i], PLAN_MARGIN, &box);
+        Waypoint corners[4] = { { box.left, box.bottom }, { box.right, box.bottom }, { box.right, box.top },
+                                { box.left, box.top } };
+        for (int j = 0; j < 4; j++) {
+            if (insideWalls(corners[j])) {
+                nodes[count++] = corners[j];
+            }
+        }
+    }
+
+    float speed = ROUTE_PERCENT / 100.0 * FULL_SPEED_COUNTS / COUNTS_PER_REV * 2 * PI * WHEEL_RADIUS;
+    float startHeading = courseLocations[route.from].heading;
+    float goalHeading = courseLocations[route.to].heading;
+
+    // Cheapest time to reach each node coming from each other node; the start comes from itself
+    float cost[MAX_NODES][MAX_NODES];
+    int previous[MAX_NODES][MAX_NODES];
+    bool done[MAX_NODES][MAX_NODES];
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < count; j++) {
+            cost[i][j] = 1e9;
+            done[i][j] = false;
+        }
+    }
+    cost[0][0] = 0;
+    previous[0][0] = -1;
+
+    float best = 1e9;
+    int bestFrom = -1;
+    while (true) {
+        int node = -1;
+        int from = -1;
+        for (int i = 0; i < count; i++) {
+            for (int j = 0; j < count; j++) {
+                if (!done[i][j] && cost[i][j] < 1e9 && (node < 0 || cost[i][j] < cost[node][from])) {
+                    node = i;
+                    from = j;
+                }
+            }
+        }
+        if (node < 0) {
+            break;
+        }
+        done[node][from] = true;
+        if (node == 1) {
+            float total = cost[node][from] + turnTime(wrapAngle(goalHeading - bearing(nodes[from], nodes[1])));
+            if (total < best) {
+                best = total;
+                bestFrom = from;
+            }
+            continue;
+        }
+
+        float heading = node == 0 ? startHeading : bearing(nodes[from], nodes[node]);
+        for (int next = 1; next < count; next++) {
+            if (next == node || !segmentClear(nodes[node], nodes[next])) {
+                continue;
+            }
+            float turn = wrapAngle(bearing(nodes[node], nodes[next]) - heading);
+            float length = hypot(nodes[next].x - nodes[node].x, nodes[next].y - nodes[node].y);
+            float time = node == 0 ? turnTime(turn) : fabs(turn) / 180 * turnTime(180) * PLAN_CORNER_FRACTION;
+            float total = cost[node][from] + time + length / speed;
+            if (total < cost[next][node]) {
+                cost[next][node] = total;
+                previous[next][node] = from;
+            }
+        }
+    }
+    if (bestFrom < 0) {
+        return false;
+    }
+
+    // Walk back from the goal
+    int reversed[MAX_NODES];
+    int length = 0;
+    int node = 1;
+    int from = bestFrom;
+    while (node != 0) {
+        reversed[length++] = node;
+        int before = previous[node][from];
+        node = from;
+        from = before;
+    }
+    reversed[length++] = 0;
+    if (length > MAX_ROUTE_CORNERS + 2) {
+        return false;
+    }
+    plan->count = length;
+    for (int i = 0; i < length; i++) {
+        plan->points[i] = nodes[reversed[length - 1 - i]];
+    }
+    plan->cost = best;
+    return true;
+}
+
+/*
+ * Prints the planned routes as main.cpp's courseRoutes.
+ * @Returns [the table in main.cpp has the same corners, to 0.01 inch]
+ */
+static bool printTable() {
+    bool same = true;
+    printf("const Route courseRoutes[ROUTE_COUNT] = {\n");
+    for (int i = 0; i < ROUTE_COUNT; i++) {
+        const Route &route = courseRoutes[i];
+        const Plan &plan = plans[i];
+        int corners = plan.count - 2;
+        printf("    { %s, %s, %d, {", courseLocations[route.from].name, courseLocations[route.to].name, corners);
+        for (int j = 0; j < corners; j++) {
+            printf("%s { %.2f, %.2f }", j == 0 ? "" : ",", plan.points[j + 1].x, plan.points[j + 1].y);
+            same = same && j < route.count && fabs(route.corners[j].x - plan.points[j + 1].x) < 0.01
+                    && fabs(route.corners[j].y - plan.points[j + 1].y) < 0.01;
+        }
+        printf(" } }%s\n", i + 1 < ROUTE_COUNT ? "," : "");
+        same = same && route.count == corners;
+    }
+    printf("};\n");
+    return same;
+}
+
+/*
+ * The hand-written sequences the routes replaced, with the parameters they had (leverReverse, leverTurn, leverPercent,
+ * leverDrive, leverDrive2, finishTurn and finishDrive), for --time.
+ */
+static void handToLever() {
+    move_backward(60, 6.8);
+    turnRight(40, 20.0);
+    waitMs(100);
+    move_backward(40, 1.2);
+    waitMs(100);
+    turnRight(60, 45.0);
+    RPS_Angle(param(P_LEVER_HEADING));
+    move_backward(80, 5.5);
+}
+
+static void handToToken() {
+    move_forward(50, 3.7);
+    turnRight(70, 76.0);
+    waitMs(50);
+    RPS_Angle(230.0);
+    move_forward(90, 13.0);
+    turnLeft(70, 28.0);
+    RPS_Angle(270.0);
+    move_forward(90, 8.8);
+    RPS_Angle(270.0);
+    RPS_Y_dec_abs(bumpY + 0.5);
+}
+
+static void handToFinish() {
+    move_forward(70, 10.0);
+    turnLeft(60, 92.0);
+    move_forward(80, 20.0);
+    RPS_Angle(270.0);
+}
+
+static void (*const handLegs[ROUTE_COUNT])() = { handToLever, handToToken, handToFinish };
+
+/*
+ * @Returns [primitive calls so far that stalled, timed out or gave up oscillating]
+ */
+static int primitiveFailures() {
+    int failures = 0;
+    for (int i = 0; i < PRIM_COUNT; i++) {
+        failures += stallEvents[i] + timeoutEvents[i] + oscillationEvents[i];
+    }
+    return failures;
+}
+
+/*
+ * Given a leg (@param leg: a route, and 0 to drive it with followRoute or 1 with the hand-written sequence), sets up a
+ * nominal robot at rest on the start location, with bumpY as the operator stores it in calibrate(), drives the leg
+ * and fills in its result, writing the true path to the leg's trace.
+ */
+static void driveLeg(int leg) {
+    const Route &route = courseRoutes[leg / 2];
+    bool hand = leg % 2 == 1;
+    SimVariation variation;
+    simNominal(&variation);
+    simBench(variation, 1);
+    loadParams();
+    loadTurnModel();
+    setLever(90);
+    setToken(85);
+    bumpY = 36.0;
+    Waypoint center;
+    locationCenter(route.from, &center);
+    simPlace(center.x, center.y, courseLocations[route.from].heading);
+    startScheduler();
+    waitMs(1500);
+
+    const CoursePose &goal = courseLocations[route.to];
+    float goalY = route.to == LOC_TOKEN_SQUARE ? bumpY + 0.5 : goal.y;
+    LegResult *result = &results[leg];
+    result->start = simMicros() / 1e6;
+    simTraceOut = traces[leg / 2][leg % 2];
+    int failures = primitiveFailures();
+    if (hand) {
+        handLegs[leg / 2]();
+    } else {
+        followRoute(route.from, route.to, goal.x, goalY, goal.heading);
+    }
+    simTraceOut = 0;
+    result->end = simMicros() / 1e6;
+    result->time = result->end - result->start;
+
+    float x, y, heading;
+    simPose(&x, &y, &heading);
+    result->distance = hypot(x - goal.x, y - goalY);
+    result->heading = wrapAngle(heading - goal.heading);
+    result->ok = primitiveFailures() == failures;
+}
+
+/*
+ * Drives every leg both ways, each in its own process, and prints the times and end errors.
+ */
+static void timeLegs() {
+    results = (LegResult *)mmap(0, 2 * ROUTE_COUNT * sizeof(LegResult), PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    printf("\n%-34s %8s %8s %8s %8s %8s %8s\n", "leg", "planned", "route s", "hand s", "route in", "hand in",
+           "route deg");
+    for (int leg = 0; leg < 2 * ROUTE_COUNT; leg++) {
+        traces[leg / 2][leg % 2] = tmpfile();
+        fflush(stdout);
+        pid_t child = fork();
+        if (child == 0) {
+            driveLeg(leg);
+            fflush(0);
+            _exit(0);
+        }
+        int status;
+        waitpid(child, &status, 0);
+    }
+    float routeTotal = 0;
+    float handTotal = 0;
+    for (int i = 0; i < ROUTE_COUNT; i++) {
+        const LegResult &route = results[2 * i];
+        const LegResult &hand = results[2 * i + 1];
+        char name[40];
+        snprintf(name, sizeof(name), "%s-%s", courseLocations[courseRoutes[i].from].name + 4,
+                 courseLocations[courseRoutes[i].to].name + 4);
+        printf("%-34s %8.2f %8.2f %8.2f %8.2f %8.2f %+8.1f%s\n", name, plans[i].cost, route.time, hand.time,
+               route.distance, hand.distance, route.heading, route.ok && hand.ok ? "" : "  not ok");
+        routeTotal += route.time;
+        handTotal += hand.time;
+    }
+    printf("%-34s %8s %8.2f %8.2f\n", "total", "", routeTotal, handTotal);
+}
+
+/*
+ * Given a path (@param svgPath), draws the course in the RPS frame, X to the right and Y up: the walls, the obstacles
+ * and their grown outlines, the locations with a tick the way the robot faces, the planned routes in blue and, after
+ * --time, the true paths of the robot center along the routes in green and along the hand-written legs in grey.
+ * @Returns [the file was written]
+ */
+static bool writeSvg(const char *svgPath) {
+    FILE *file = fopen(svgPath, "w");
+    if (file == 0) {
+        return false;
+    }
+    fprintf(file, "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%d\" height=\"%d\">\n",
+            (int)((COURSE_WIDTH + 2) * SVG_SCALE), (int)((COURSE_LENGTH + 2) * SVG_SCALE));
+    fprintf(file, "<rect width=\"100%%\" height=\"100%%\" fill=\"white\"/>\n");
+    fprintf(file, "<g transform=\"translate(%d %d) scale(%d %d)\" fill=\"none\" stroke-linecap=\"round\">\n",
+            SVG_SCALE, (int)((COURSE_LENGTH + 1) * SVG_SCALE), SVG_SCALE, -SVG_SCALE);
+    fprintf(file, "<rect width=\"%.1f\" height=\"%.1f\" stroke=\"black\" stroke-width=\"0.2\"/>\n", COURSE_WIDTH,
+            COURSE_LENGTH);
+    fprintf(file, "<rect x=\"%.1f\" y=\"%.1f\" width=\"%.1f\" height=\"%.1f\" stroke=\"#999\" stroke-width=\"0.1\" "
+            "stroke-dasharray=\"0.5\"/>\n", WALL_CLEARANCE, WALL_CLEARANCE, COURSE_WIDTH - 2 * WALL_CLEARANCE,
+            COURSE_LENGTH - 2 * WALL_CLEARANCE);
+    for (int i = 0; i < OBSTACLE_COUNT; i++) {
+        const CourseBox &box = courseObstacles[i];
+        CourseBox grown;
+        growObstacle(box, 0, &grown);
+        fprintf(file, "<rect x=\"%.2f\" y=\"%.2f\" width=\"%.2f\" height=\"%.2f\" fill=\"#ccc\"><title>%s</title>"
+                "</rect>\n", box.left, box.bottom, box.right - box.left, box.top - box.bottom, box.name);
+        fprintf(file, "<rect x=\"%.2f\" y=\"%.2f\" width=\"%.2f\" height=\"%.2f\" stroke=\"#999\" stroke-width=\"0.1\" "
+                "stroke-dasharray=\"0.5\"/>\n", grown.left, grown.bottom, grown.right - grown.left,
+                grown.top - grown.bottom);
+    }
+
+    for (int i = 0; i < ROUTE_COUNT; i++) {
+        for (int way = 1; way >= 0; way--) {
+            FILE *trace = traces[i][way];
+            if (trace == 0) {
+                continue;
+            }
+            rewind(trace);
+            fprintf(file, "<polyline stroke=\"%s\" stroke-width=\"0.15\" points=\"", way == 0 ? "#2ca02c" : "#999");
+            float time, x, y;
+            char rest[200];
+            while (fscanf(trace, "%f %f %f%199[^\n]", &time, &x, &y, rest) == 4) {
+                fprintf(file, "%.2f,%.2f ", x, y);
+            }
+            fprintf(file, "\"/>\n");
+        }
+        const Plan &plan = plans[i];
+        fprintf(file, "<polyline stroke=\"#1f77b4\" stroke-width=\"0.2\" points=\"");
+        for (int j = 0; j < plan.count; j++) {
+            fprintf(file, "%.2f,%.2f ", plan.points[j].x, plan.points[j].y);
+        }
+        fprintf(file, "\"/>\n");
+    }
+
+    for (int i = 0; i < LOCATION_COUNT; i++) {
+        const CoursePose &pose = courseLocations[i];
+        Waypoint center;
+        locationCenter(i, &center);
+        fprintf(file, "<circle cx=\"%.2f\" cy=\"%.2f\" r=\"0.4\" fill=\"black\"><title>%s</title></circle>\n",
+                center.x, center.y, pose.name);
+        fprintf(file, "<line x1=\"%.2f\" y1=\"%.2f\" x2=\"%.2f\" y2=\"%.2f\" stroke=\"black\" stroke-width=\"0.2\"/>\n",
+                center.x, center.y, pose.x, pose.y);
+    }
+    fprintf(file, "</g>\n</svg>\n");
+    return fclose(file) == 0;
+}
+
+#undef main
+int main(int argc, char **argv) {
+    const char *svgPath = 0;
+    bool time = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--svg") == 0 && i + 1 < argc) {
+            svgPath = argv[++i];
+        } else if (strcmp(argv[i], "--time") == 0) {
+            time = true;
+        } else {
+            fprintf(stderr, "usage: %s [--time] [--svg FILE]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < ROUTE_COUNT; i++) {
+        if (!planRoute(courseRoutes[i], &plans[i])) {
+            fprintf(stderr, "no route from %s to %s\n", courseLocations[courseRoutes[i].from].name,
+                    courseLocations[courseRoutes[i].to].name);
+            return 1;
+        }
+    }
+    bool same = printTable();
+    if (time) {
+        timeLegs();
+    }
+    if (svgPath != 0 && !writeSvg(svgPath)) {
+        fprintf(stderr, "cannot write %s\n", svgPath);
+        return 1;
+    }
+    if (!same) {
+        printf("courseRoutes in main.cpp differs from the plan\n");
+    }
+    return same ? 0 : 2;
+}
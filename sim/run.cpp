@@ -0,0 +1,35 @@
+#include <string.h>
+
+#include "world.h"
+
+/*
+ * Runs main.cpp on the simulator. main.cpp is built with its main() renamed to robotMain, and its run timing globals
+ * are read back once it returns.
+ */
+
+int robotMain();
+
+// main.cpp globals: when the run started, how long each task took and the task it is in.
+extern unsigned int missionStartTime;
+extern unsigned int taskTimes[SIM_TASKS];
+extern int currentTask;
+
+void simRun(const SimVariation &variation, uint64_t seed, SimResult *result) {
+    memset(result, 0, sizeof(*result));
+    simStart(variation, seed);
+    try {
+        robotMain();
+        result->finished = true;
+    } catch (...) {
+        result->finished = false;
+    }
+    simFinish(result);
+
+    result->tasksRun = currentTask + 1;
+    for (int i = 0; i < SIM_TASKS; i++) {
+        result->taskTimes[i] = taskTimes[i];
+    }
+    if (result->finished) {
+        result->missionTime = taskTimes[0] + taskTimes[1] + taskTimes[2] + taskTimes[3] + taskTimes[4];
+    }
+}
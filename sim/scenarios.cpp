@@ -0,0 +1,1502 @@
+// main.cpp is compiled into this file so the checks can call its functions and read its state.
+#include "../main.cpp"
+
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "world.h"
+
+/*
+ * Scenario checks: each one sets up the simulated robot for one behaviour of main.cpp, calls the functions
+ * involved directly and checks what came out against what the change that added the behaviour promised.
+ *
+ *   scenarios NAME
+ *
+ * Each check prints what it measured and exits 0 if it passed. main.cpp's globals are not reset between checks,
+ * so every check runs in its own process; without a name the checks are listed.
+ */
+
+/*
+ * Given the robot (@param variation), starts a bench run and sets up the way initialize() does before the light:
+ * parameters and turn model from their defaults, the arm and token servos raised, and the ambient light read.
+ */
+static void setUp(const SimVariation &variation) {
+    simBench(variation, 1);
+    simPlaceStart();
+    loadParams();
+    loadTurnModel();
+    setLever(90);
+    setToken(85);
+    Sleep(200);
+    ambient = cds.Value();
+}
+
+/*
+ * Given the robot (@param variation) and where to put its center (@param x, @param y, @param heading), sets up as
+ * for the run and starts the scheduler, then waits for the pose estimate to settle on the robot: its median and
+ * jump gate see the robot put down as a jump, and the fused estimate takes about a second to come within 0.1 inch.
+ */
+static void setUpDriving(const SimVariation &variation, float x, float y, float heading) {
+    setUp(variation);
+    simPlace(x, y, heading);
+    startScheduler();
+    waitMs(1500);
+}
+
+static const char *statusNames[] = { "OK", "STALLED", "TIMEOUT", "OSCILLATING", "NO_POSE" };
+
+/*
+ * Given what was called (@param call), how it ended (@param status), when it started (@param start, in virtual
+ * microseconds) and the status it should have ended with (@param expected), prints the outcome.
+ * @Returns [it ended with the expected status]
+ */
+static bool report(const char *call, MotionStatus status, uint64_t start, MotionStatus expected) {
+    printf("  %-28s %-11s %.2f s\n", call, statusNames[status], (simMicros() - start) / 1e6);
+    return status == expected;
+}
+
+// Side speed (in/s) under which both sides have to drop for the robot to count as stopped. The motors coast down
+// between primitives, so the next one often starts before they reach zero.
+#define STOP_SPEED 0.5
+
+/*
+ * Given a trace (@param trace, as simTraceOut writes it), counts the times the robot came to a stop after moving.
+ * Going from a drive into a pivot keeps one side turning, so only a real pause counts.
+ * @Returns [number of stops]
+ */
+static int countStops(FILE *trace) {
+    rewind(trace);
+    int stops = 0;
+    bool moving = false;
+    float time, x, y, heading, left, right;
+    char rest[100];
+    while (fscanf(trace, "%f %f %f %f %f %f%99[^\n]", &time, &x, &y, &heading, &left, &right, rest) == 7) {
+        if (fabs(left) < STOP_SPEED && fabs(right) < STOP_SPEED) {
+            if (moving) {
+                stops++;
+            }
+            moving = false;
+        } else {
+            moving = true;
+        }
+    }
+    return stops;
+}
+
+/*
+ * Given the robot (@param variation) and whether the CdS cell is shaded for a moment first (@param shadow), turns
+ * the start light on half a second after waitForLight starts looking and checks how soon it triggers.
+ * @Returns [waitForLight triggered on the light, within 15 ms]
+ */
+static bool checkStartLight(const SimVariation &variation, bool shadow) {
+    setUp(variation);
+    uint64_t on = simMicros() + (shadow ? 1300000 : 500000);
+    simLightAt(on);
+    if (shadow) {
+        // A passing hand: 0.2 V for 20 ms, a second before the light
+        simShadow(simMicros() + 300000, 20, 0.2);
+    }
+    waitForLight();
+
+    uint64_t now = simMicros();
+    if (now < on) {
+        printf("start light: triggered %.1f ms before the light came on\n", (on - now) / 1000.0);
+        return false;
+    }
+    float latency = (now - on) / 1000.0;
+    printf("start light: triggered %.1f ms after the light came on, %u ms after the onset, redDiff %.2f V\n",
+           latency, startTriggerTime - startOnsetTime, redDiff);
+    return !startTimedOut && latency <= 15;
+}
+
+/*
+ * The start light through a cell with a 15 ms time constant.
+ */
+static bool startLight() {
+    SimVariation variation;
+    simNominal(&variation);
+    variation.cdsLag = 0.015;
+    return checkStartLight(variation, false);
+}
+
+/*
+ * The same, after a 20 ms shadow the detector has to ignore.
+ */
+static bool startShadow() {
+    SimVariation variation;
+    simNominal(&variation);
+    variation.cdsLag = 0.015;
+    return checkStartLight(variation, true);
+}
+
+/*
+ * With the wheels held, a drive, an RPS correction and an RPS_Angle each have to give up as stalled, well inside
+ * their time budgets: after the stall grace and the first stall window, plus a little. RPS_Angle first waits for a
+ * pose taken at rest, up to one more RPS packet.
+ * @Returns [all three ended MOTION_STALLED within 0.8 s, RPS_Angle within 0.9 s]
+ */
+static bool stallHeld() {
+    SimVariation variation;
+    simNominal(&variation);
+    setUpDriving(variation, 18, 45, 0);
+    simHoldWheels(true);
+
+    bool passed = true;
+    uint64_t start = simMicros();
+    passed = report("move_forward(60, 10)", move_forward(60, 10), start, MOTION_STALLED) && passed;
+    passed = simMicros() - start <= 800000 && passed;
+    start = simMicros();
+    passed = report("RPS_X_inc_abs(x + 5)", RPS_X_inc_abs(estimate.x + 5).status, start, MOTION_STALLED) && passed;
+    passed = simMicros() - start <= 800000 && passed;
+    start = simMicros();
+    passed = report("RPS_Angle(45)", RPS_Angle(45), start, MOTION_STALLED) && passed;
+    passed = simMicros() - start <= 900000 && passed;
+    return passed;
+}
+
+/*
+ * Free drives, turns and corrections from 20% to 90% power must not trip the stall monitor.
+ * @Returns [every call ended MOTION_OK]
+ */
+static bool stallFree() {
+    SimVariation variation;
+    simNominal(&variation);
+    setUpDriving(variation, 18, 45, 0);
+
+    static const int percents[] = { 20, 50, 90 };
+    bool passed = true;
+    for (int i = 0; i < 3; i++) {
+        int percent = percents[i];
+        char call[32];
+        uint64_t start = simMicros();
+        snprintf(call, sizeof(call), "move_forward(%d, 6)", percent);
+        passed = report(call, move_forward(percent, 6), start, MOTION_OK) && passed;
+        start = simMicros();
+        snprintf(call, sizeof(call), "move_backward(%d, 6)", percent);
+        passed = report(call, move_backward(percent, 6), start, MOTION_OK) && passed;
+        start = simMicros();
+        snprintf(call, sizeof(call), "turnLeft(%d, 45)", percent);
+        passed = report(call, turnLeft(percent, 45), start, MOTION_OK) && passed;
+        start = simMicros();
+        snprintf(call, sizeof(call), "turnRight(%d, 45)", percent);
+        passed = report(call, turnRight(percent, 45), start, MOTION_OK) && passed;
+    }
+    uint64_t start = simMicros();
+    passed = report("RPS_Angle(0)", RPS_Angle(0), start, MOTION_OK) && passed;
+    start = simMicros();
+    passed = report("RPS_X_inc_abs(x + 4)", RPS_X_inc_abs(estimate.x + 4).status, start, MOTION_OK) && passed;
+    start = simMicros();
+    passed = report("RPS_X_inc_abs(x - 4)", RPS_X_inc_abs(estimate.x - 4).status, start, MOTION_OK) && passed;
+    return passed;
+}
+
+/*
+ * The RPS_X and RPS_Y corrections: each wrapper's axis, which way driving forward moves along it, and whether its
+ * target is given from a start point (1 for start plus inches, -1 for start minus inches) or absolute (0).
+ */
+struct Correction {
+    const char *name;
+    int axis;
+    int facing;
+    int relative;
+};
+
+static const Correction corrections[] = {
+    { "RPS_Xinc", AXIS_X, 1, 1 },
+    { "RPS_Xinc_rev", AXIS_X, -1, 1 },
+    { "RPS_Xdec", AXIS_X, -1, -1 },
+    { "RPS_Yinc", AXIS_Y, 1, 1 },
+    { "RPS_Ydec", AXIS_Y, -1, -1 },
+    { "RPS_X_inc_abs", AXIS_X, 1, 0 },
+    { "RPS_X_dec_abs", AXIS_X, -1, 0 },
+    { "RPS_Y_inc_abs", AXIS_Y, 1, 0 },
+    { "RPS_Y_dec_abs", AXIS_Y, -1, 0 },
+};
+
+#define CORRECTIONS (int)(sizeof(corrections) / sizeof(corrections[0]))
+
+/*
+ * Given a correction (@param index, into corrections) and the position it should end at (@param target), calls its
+ * wrapper. The relative ones are given a start point 3 inches back from the target.
+ * @Returns [how the correction ended]
+ */
+static AxisResult runCorrection(int index, float target) {
+    float start = target - corrections[index].relative * 3;
+    switch (index) {
+    case 0: return RPS_Xinc(start, 3);
+    case 1: return RPS_Xinc_rev(start, 3);
+    case 2: return RPS_Xdec(start, 3);
+    case 3: return RPS_Yinc(start, 3);
+    case 4: return RPS_Ydec(start, 3);
+    case 5: return RPS_X_inc_abs(target);
+    case 6: return RPS_X_dec_abs(target);
+    case 7: return RPS_Y_inc_abs(target);
+    default: return RPS_Y_dec_abs(target);
+    }
+}
+
+/*
+ * Given a check (@param check) and which case of it to run (@param index), runs it in a child process, so it starts
+ * from main.cpp's initial state.
+ * @Returns [the case passed]
+ */
+static bool inChild(bool (*check)(int), int index) {
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0) {
+        bool passed = check(index);
+        fflush(stdout);
+        _exit(passed ? 0 : 1);
+    }
+    int status;
+    return waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Where each correction starts the QR code along its axis, in inches from the target.
+static const float correctionOffsets[] = { -4, -0.5, 0.5, 4 };
+
+#define CORRECTION_OFFSETS (int)(sizeof(correctionOffsets) / sizeof(correctionOffsets[0]))
+
+/*
+ * Given a case (@param index: a correction and a start offset), runs the correction in the open middle of the
+ * course, facing along its axis.
+ * @Returns [it ended MOTION_OK with the QR code truly within 0.2 inches of the target]
+ */
+static bool checkCorrection(int index) {
+    const Correction &correction = corrections[index / CORRECTION_OFFSETS];
+    float offset = correctionOffsets[index % CORRECTION_OFFSETS];
+    bool alongX = correction.axis == AXIS_X;
+    float target = alongX ? 18 : 45;
+    float heading = alongX ? (correction.facing > 0 ? 0 : 180) : (correction.facing > 0 ? 90 : 270);
+    // The center sits QR_OFFSET behind the QR code
+    float center = target + offset - correction.facing * QR_OFFSET;
+    SimVariation variation;
+    simNominal(&variation);
+    setUpDriving(variation, alongX ? center : 18, alongX ? 45 : center, heading);
+
+    uint64_t start = simMicros();
+    AxisResult result = runCorrection(index / CORRECTION_OFFSETS, target);
+    float x, y, trueHeading;
+    simPose(&x, &y, &trueHeading);
+    float error = (alongX ? x : y) - target;
+    char call[40];
+    snprintf(call, sizeof(call), "%s from %+.1f", correction.name, offset);
+    bool passed = report(call, result.status, start, MOTION_OK);
+    printf("  %-28s ends %+.2f in\n", "", error);
+    return passed && fabs(error) <= 0.2;
+}
+
+/*
+ * Every RPS_X and RPS_Y wrapper from 4 and 0.5 inches either side of its target.
+ * @Returns [every case passed checkCorrection]
+ */
+static bool axisMatrix() {
+    bool passed = true;
+    for (int i = 0; i < CORRECTIONS * CORRECTION_OFFSETS; i++) {
+        passed = inChild(checkCorrection, i) && passed;
+    }
+    return passed;
+}
+
+// goToPose targets for the QR code from a robot at (18, 45) facing 0 degrees: ahead, off to the side, across, and
+// at the heading of the DDR approach.
+static const float poseTargets[][3] = {
+    { 28, 45, 0 },
+    { 26, 51, 45 },
+    { 20, 55, 90 },
+    { 10, 38, 225 },
+    { 24, 42, 351 },
+};
+
+#define POSE_TARGETS (int)(sizeof(poseTargets) / sizeof(poseTargets[0]))
+
+/*
+ * Given the true pose after a move (@param endX, @param endY, @param endHeading) and its target (@param target: x, y
+ * and heading), prints how far the QR code ended from it.
+ * The path stops as soon as it is within PATH_END_TOLERANCE of its end and the final RPS_Angle pivots on top of that,
+ * so the QR code is allowed 0.1 inch more.
+ * @Returns [the QR code ended within PATH_END_TOLERANCE + 0.1 inches of the target, heading within the heading
+ * tolerance plus 1 degree]
+ */
+static bool reportPose(float endX, float endY, float endHeading, const float *target) {
+    float distance = hypot(endX - target[0], endY - target[1]);
+    float headingError = wrapAngle(endHeading - target[2]);
+    printf("  %-28s ends %.2f in, %+.1f deg off\n", "", distance, headingError);
+    return distance <= PATH_END_TOLERANCE + 0.1 && fabs(headingError) <= param(P_HEADING_TOLERANCE) + 1;
+}
+
+// Stops of each goToPose target and of the same target driven as a chain, shared with the child processes that drive
+// them: goToPose first, the chain after
+static int *poseStops;
+
+/*
+ * Given a target (@param index, into poseTargets), drives a nominal robot to it with goToPose.
+ * @Returns [goToPose ended MOTION_OK and passed reportPose]
+ */
+static bool checkPose(int index) {
+    const float *target = poseTargets[index];
+    SimVariation variation;
+    simNominal(&variation);
+    setUpDriving(variation, 18, 45, 0);
+    FILE *trace = tmpfile();
+    simTraceOut = trace;
+
+    uint64_t start = simMicros();
+    MotionStatus status = goToPose(target[0], target[1], target[2]);
+    char call[40];
+    snprintf(call, sizeof(call), "goToPose(%.0f, %.0f, %.0f)", target[0], target[1], target[2]);
+    bool passed = report(call, status, start, MOTION_OK);
+    waitMs(300);
+    simTraceOut = 0;
+    float x, y, heading;
+    simPose(&x, &y, &heading);
+    poseStops[index] = countStops(trace);
+    fclose(trace);
+    return reportPose(x, y, heading, target) && passed;
+}
+
+/*
+ * Given a target (@param index, into poseTargets), drives a nominal robot to it the way mission code did before
+ * goToPose: a turn toward it, RPS_Angle, move_forward, an axis correction along the axis closest to the drive, then a
+ * turn to the target heading and RPS_Angle. Only the stops are compared, so the chain has to end MOTION_OK but not
+ * land as close as goToPose.
+ * @Returns [every step ended MOTION_OK]
+ */
+static bool checkPoseChain(int index) {
+    const float *target = poseTargets[index];
+    SimVariation variation;
+    simNominal(&variation);
+    setUpDriving(variation, 18, 45, 0);
+    FILE *trace = tmpfile();
+    simTraceOut = trace;
+
+    // The robot center stops where the QR code is at the target once the robot faces the target heading, and while
+    // it still faces the drive the QR code is QR_OFFSET further along it
+    uint64_t start = simMicros();
+    float endX = target[0] - QR_OFFSET * cos(target[2] * PI / 180);
+    float endY = target[1] - QR_OFFSET * sin(target[2] * PI / 180);
+    float centerX = fromFixed(estimate.centerX);
+    float centerY = fromFixed(estimate.centerY);
+    float bearing = atan2(endY - centerY, endX - centerX) * 180 / PI;
+    float turn = wrapAngle(bearing - estimate.heading);
+    bool ok = true;
+    if (turn > 1) {
+        ok = turnLeft(POSE_TURN_PERCENT, turn) == MOTION_OK && ok;
+    } else if (turn < -1) {
+        ok = turnRight(POSE_TURN_PERCENT, -turn) == MOTION_OK && ok;
+    }
+    ok = RPS_Angle(bearing) == MOTION_OK && ok;
+    ok = move_forward(POSE_PERCENT, hypot(endX - fromFixed(estimate.centerX), endY - fromFixed(estimate.centerY)))
+         == MOTION_OK && ok;
+    float driveX = cos(bearing * PI / 180);
+    float driveY = sin(bearing * PI / 180);
+    AxisResult axis;
+    if (fabs(driveX) >= fabs(driveY)) {
+        float qrX = endX + QR_OFFSET * driveX;
+        axis = driveX > 0 ? RPS_X_inc_abs(qrX) : RPS_X_dec_abs(qrX);
+    } else {
+        float qrY = endY + QR_OFFSET * driveY;
+        axis = driveY > 0 ? RPS_Y_inc_abs(qrY) : RPS_Y_dec_abs(qrY);
+    }
+    ok = axis.status == MOTION_OK && ok;
+    turn = wrapAngle(target[2] - estimate.heading);
+    if (turn > 1) {
+        ok = turnLeft(POSE_TURN_PERCENT, turn) == MOTION_OK && ok;
+    } else if (turn < -1) {
+        ok = turnRight(POSE_TURN_PERCENT, -turn) == MOTION_OK && ok;
+    }
+    ok = RPS_Angle(target[2]) == MOTION_OK && ok;
+    printf("  %-28s %-11s %.2f s\n", "turn/drive chain", ok ? "OK" : "FAILED", (simMicros() - start) / 1e6);
+    waitMs(300);
+    simTraceOut = 0;
+    poseStops[POSE_TARGETS + index] = countStops(trace);
+    fclose(trace);
+    return ok;
+}
+
+/*
+ * goToPose to targets in every direction from the robot, each also driven as the turn/drive chain it replaces.
+ * @Returns [every target passed checkPose and checkPoseChain, and goToPose stopped fewer times than the chain]
+ */
+static bool poseReach() {
+    poseStops = (int *)mmap(0, 2 * POSE_TARGETS * sizeof(int), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                            -1, 0);
+    bool passed = true;
+    for (int i = 0; i < POSE_TARGETS; i++) {
+        passed = inChild(checkPose, i) && passed;
+        passed = inChild(checkPoseChain, i) && passed;
+        int stops = poseStops[i];
+        int chainStops = poseStops[POSE_TARGETS + i];
+        printf("  %-28s goToPose stopped %d times, the chain %d\n", "", stops, chainStops);
+        passed = stops < chainStops && passed;
+    }
+    return passed;
+}
+
+/*
+ * A target 8 inches straight behind the robot, at the heading it already has: goToPose should back up to it without
+ * turning. The heading is followed through a trace of the move.
+ * @Returns [goToPose ended MOTION_OK, passed reportPose and never turned more than 10 degrees]
+ */
+static bool poseBehind() {
+    SimVariation variation;
+    simNominal(&variation);
+    setUpDriving(variation, 18, 45, 0);
+    float x, y, heading;
+    simPose(&x, &y, &heading);
+    float target[3] = { x - 8, y, 0 };
+
+    simTraceOut = tmpfile();
+    uint64_t start = simMicros();
+    MotionStatus status = goToPose(target[0], target[1], target[2]);
+    bool passed = report("goToPose(x - 8, y, 0)", status, start, MOTION_OK);
+    simPose(&x, &y, &heading);
+    passed = reportPose(x, y, heading, target) && passed;
+
+    // Trace lines: time, center x and y, heading, ...
+    float turned = 0;
+    float time, centerX, centerY, traceHeading;
+    rewind(simTraceOut);
+    char line[160];
+    while (fgets(line, sizeof(line), simTraceOut) != 0) {
+        if (sscanf(line, "%f %f %f %f", &time, &centerX, &centerY, &traceHeading) == 4
+                && fabs(wrapAngle(traceHeading)) > turned) {
+            turned = fabs(wrapAngle(traceHeading));
+        }
+    }
+    fclose(simTraceOut);
+    simTraceOut = 0;
+    printf("  %-28s turned at most %.1f deg\n", "", turned);
+    return passed && turned <= 10;
+}
+
+/*
+ * With every RPS packet lost there is no pose estimate: goToPose has to return MOTION_NO_POSE at once instead of
+ * waiting out its path budget, and leave the robot where it was.
+ * @Returns [goToPose ended MOTION_NO_POSE within 0.5 s and the robot did not move]
+ */
+static bool poseLost() {
+    SimVariation variation;
+    simNominal(&variation);
+    variation.rpsLoss = 1;
+    setUpDriving(variation, 18, 45, 0);
+    float x, y, heading;
+    simPose(&x, &y, &heading);
+
+    uint64_t start = simMicros();
+    bool passed = report("goToPose(28, 45, 0)", goToPose(28, 45, 0), start, MOTION_NO_POSE);
+    passed = simMicros() - start <= 500000 && passed;
+    float endX, endY, endHeading;
+    simPose(&endX, &endY, &endHeading);
+    return passed && hypot(endX - x, endY - y) < 0.05;
+}
+
+// Left side gains for the straight drive checks, against a right side at the model's speed.
+static const float driftGains[] = { 0.9, 0.8 };
+
+/*
+ * Given a case (@param index: a left side gain, forward or backward, and with or without the heading hold), drives
+ * 25 inches at 80% up the open middle of the course, facing 90 degrees. Without the hold (holdKp and holdKi zeroed)
+ * the case only shows what the hold is correcting.
+ * @Returns [the drive ended MOTION_OK and, with the hold, the center drifted at most 1.5 inches sideways and the
+ * heading ended within 2 degrees]
+ */
+static bool checkDrift(int index) {
+    float gain = driftGains[index / 4];
+    bool forward = index % 4 / 2 == 0;
+    bool hold = index % 2 == 0;
+    SimVariation variation;
+    simNominal(&variation);
+    variation.leftGain = gain;
+    setUpDriving(variation, 18, forward ? 15 : 45, 90);
+    if (!hold) {
+        params[P_HOLD_KP].value = 0;
+        params[P_HOLD_KI].value = 0;
+    }
+    float x, y, heading;
+    simPose(&x, &y, &heading);
+
+    uint64_t start = simMicros();
+    char call[40];
+    snprintf(call, sizeof(call), "%s L%.0f%%%s", forward ? "move_forward" : "move_backward", gain * 100,
+             hold ? "" : " no hold");
+    bool passed = report(call, forward ? move_forward(80, 25) : move_backward(80, 25), start, MOTION_OK);
+    float endX, endY, endHeading;
+    simPose(&endX, &endY, &endHeading);
+    // Facing 90 degrees, sideways is along x
+    float drift = endX - x;
+    float headingError = wrapAngle(endHeading - heading);
+    printf("  %-28s drifts %+.2f in, heading %+.1f deg\n", "", drift, headingError);
+    return passed && (!hold || (fabs(drift) <= 1.5 && fabs(headingError) <= 2));
+}
+
+/*
+ * Straight drives with a weak left side, forward and backward, with the heading hold and without it.
+ * @Returns [every case passed checkDrift]
+ */
+static bool driveDrift() {
+    bool passed = true;
+    for (int i = 0; i < (int)(sizeof(driftGains) / sizeof(driftGains[0])) * 4; i++) {
+        passed = inChild(checkDrift, i) && passed;
+    }
+    return passed;
+}
+
+// Resting pack voltages for the battery compensation check, fresh to flat.
+static const float batteryPacks[] = { 12.6, 12.0, 11.4, 10.8, 10.2 };
+
+#define BATTERY_PACKS (int)(sizeof(batteryPacks) / sizeof(batteryPacks[0]))
+
+// Distance each battery case drove, shared with the child processes that run them.
+static float *batteryDistances;
+
+/*
+ * Given a case (@param index: a pack, and whether setDrive compensates for it), swaps the pack in before the
+ * scheduler starts and gives the filtered voltage 3 s to settle on it, then drives 1 s at 70% open loop and lets the
+ * robot coast to a stop. Without compensation the four motors are set directly, as setDrive did before.
+ * @Returns [the drive ended with the robot moved forward]
+ */
+static bool checkBattery(int index) {
+    float volts = batteryPacks[index / 2];
+    bool compensated = index % 2 == 0;
+    SimVariation variation;
+    simNominal(&variation);
+    setUp(variation);
+    simSetBattery(volts);
+    simPlace(18, 15, 90);
+    startScheduler();
+    waitMs(3000);
+    float x, y, heading;
+    simPose(&x, &y, &heading);
+
+    if (compensated) {
+        setDrive(70, 70);
+    } else {
+        bl_motor.SetPercent(70);
+        fr_motor.SetPercent(-70);
+        fl_motor.SetPercent(70);
+        br_motor.SetPercent(-70);
+    }
+    float scale = batteryScale;
+    waitMs(1000);
+    stopDrive();
+    waitMs(500);
+
+    float endX, endY, endHeading;
+    simPose(&endX, &endY, &endHeading);
+    batteryDistances[index] = endY - y;
+    printf("  %.1f V %-14s scale %.3f %6.2f in\n", volts, compensated ? "compensated" : "uncompensated",
+           compensated ? scale : 1.0, endY - y);
+    return endY > y;
+}
+
+/*
+ * The same 1 s open-loop drive at 70% on packs from 12.6 V to 10.2 V, with and without the battery compensation.
+ * @Returns [with compensation, the distances are within 0.25 inches of each other]
+ */
+static bool batteryDrive() {
+    batteryDistances = (float *)mmap(0, 2 * BATTERY_PACKS * sizeof(float), PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    bool passed = true;
+    for (int i = 0; i < 2 * BATTERY_PACKS; i++) {
+        passed = inChild(checkBattery, i) && passed;
+    }
+
+    float spread[2];
+    for (int mode = 0; mode < 2; mode++) {
+        float least = batteryDistances[mode];
+        float most = least;
+        for (int i = 1; i < BATTERY_PACKS; i++) {
+            least = fmin(least, batteryDistances[2 * i + mode]);
+            most = fmax(most, batteryDistances[2 * i + mode]);
+        }
+        spread[mode] = most - least;
+        printf("  %-14s %.2f to %.2f in, spread %.2f in\n", mode == 0 ? "compensated" : "uncompensated",
+               least, most, spread[mode]);
+    }
+    return passed && spread[0] <= 0.25;
+}
+
+/*
+ * Given a case (@param index: 0 for the robot standing still, 1 for a whole run), checks main.cpp against an RPS
+ * without noise, which sends the same values in every packet while the robot stands still. Standing, the pose has to
+ * stay fresh and at rest, so RPS_Angle finds the heading already within tolerance without waiting for a packet.
+ * @Returns [standing, the pose was at rest at every read after the first 200 ms and RPS_Angle returned within
+ * 20 ms; the whole run, it scored every feature in time]
+ */
+static bool checkStill(int index) {
+    SimVariation variation;
+    simNominal(&variation);
+    variation.rpsNoise = 0;
+    variation.rpsHeadingNoise = 0;
+    if (index == 1) {
+        SimResult result;
+        simRun(variation, 1, &result);
+        printf("  %-28s %-11s %.2f s\n", "nominal run", simSucceeded(result) ? "OK" : "FAILED", result.courseTime);
+        return simSucceeded(result);
+    }
+
+    setUpDriving(variation, 18, 45, 0);
+    int reads = 0;
+    int fresh = 0;
+    int resting = 0;
+    for (int ms = 0; ms < 3000; ms += POSE_PERIOD) {
+        waitMs(POSE_PERIOD);
+        if (ms >= 200) {
+            reads++;
+            fresh += poseFresh();
+            resting += poseAtRest();
+        }
+    }
+    printf("  %-28s fresh %d/%d, at rest %d/%d\n", "standing 3 s", fresh, reads, resting, reads);
+
+    uint64_t start = simMicros();
+    bool passed = report("RPS_Angle(0)", RPS_Angle(0), start, MOTION_OK);
+    return passed && simMicros() - start <= 20000 && fresh == reads && resting == reads;
+}
+
+/*
+ * The robot standing still and a whole nominal run, with an RPS without noise.
+ * @Returns [both cases passed checkStill]
+ */
+static bool rpsStill() {
+    bool passed = inChild(checkStill, 0);
+    return inChild(checkStill, 1) && passed;
+}
+
+// Reference trajectory for the estimator check: left and right drive percent and how long (in ms) to hold them.
+// Straight, an arc, a turn in place, straight back, then standing longer than ESTIMATE_STALE_TIME.
+static const int trackSegments[][3] = {
+    { 60, 60, 1500 },
+    { 40, 70, 1500 },
+    { -50, 50, 800 },
+    { 0, 0, 500 },
+    { -60, -60, 1200 },
+    { 0, 0, 3000 },
+};
+
+#define TRACK_SEGMENTS (int)(sizeof(trackSegments) / sizeof(trackSegments[0]))
+
+/*
+ * Given a case (@param index: 0 for the nominal RPS, 1 for one without noise), drives the reference trajectory and
+ * compares the fused estimate with where the QR code and heading truly are every 20 ms, printing the errors every
+ * 0.5 s. An RPS without noise sends the same values while the robot stands, which must still keep the estimate valid.
+ * @Returns [the estimate stayed valid, its position was within 1.5 inches and its heading within 5 degrees at every
+ * sample, and within 0.25 inches and 1 degree at the end]
+ */
+static bool checkTrack(int index) {
+    SimVariation variation;
+    simNominal(&variation);
+    if (index == 1) {
+        variation.rpsNoise = 0;
+        variation.rpsHeadingNoise = 0;
+    }
+    setUpDriving(variation, 18, 15, 90);
+    printf("  %s RPS\n", index == 0 ? "nominal" : "noise-free");
+
+    int samples = 0;
+    int invalid = 0;
+    float sumPosition = 0, sumHeading = 0, maxPosition = 0, maxHeading = 0;
+    float position = 0, headingError = 0;
+    int ms = 0;
+    for (int i = 0; i < TRACK_SEGMENTS; i++) {
+        setDrive(trackSegments[i][0], trackSegments[i][1]);
+        for (int t = 0; t < trackSegments[i][2]; t += 20, ms += 20) {
+            waitMs(20);
+            float x, y, heading;
+            simPose(&x, &y, &heading);
+            position = hypot(estimate.x - x, estimate.y - y);
+            headingError = fabs(wrapAngle(estimate.heading - heading));
+            invalid += !estimate.valid;
+            samples++;
+            sumPosition += position * position;
+            sumHeading += headingError * headingError;
+            maxPosition = fmax(maxPosition, position);
+            maxHeading = fmax(maxHeading, headingError);
+            if ((ms + 20) % 500 == 0) {
+                printf("  %5.1f s  %5.2f in %5.2f deg%s\n", (ms + 20) / 1000.0, position, headingError,
+                       estimate.valid ? "" : "  invalid");
+            }
+        }
+    }
+    stopDrive();
+    printf("  rms %.2f in %.2f deg, max %.2f in %.2f deg, end %.2f in %.2f deg, invalid %d/%d\n",
+           sqrt(sumPosition / samples), sqrt(sumHeading / samples), maxPosition, maxHeading, position, headingError,
+           invalid, samples);
+    return invalid == 0 && maxPosition <= 1.5 && maxHeading <= 5 && position <= 0.25 && headingError <= 1;
+}
+
+/*
+ * The fused estimate against the true trajectory, with the nominal RPS and one without noise.
+ * @Returns [both cases passed checkTrack]
+ */
+static bool estimateTrack() {
+    bool passed = inChild(checkTrack, 0);
+    return inChild(checkTrack, 1) && passed;
+}
+
+// Corners of the route for the path check: robot center positions up the open middle of the course, from a start at
+// (18, 15) facing 90 degrees.
+static const float pathCorners[][2] = { { 18, 24 }, { 26, 32 }, { 26, 42 }, { 18, 50 } };
+
+#define PATH_CORNERS (int)(sizeof(pathCorners) / sizeof(pathCorners[0]))
+
+/*
+ * How a way of driving the route went: its time (in seconds), how far the robot center ended from the last corner and
+ * how often the robot stopped. Shared with the child processes that drive it.
+ */
+struct ChainResult {
+    float time;
+    float error;
+    int stops;
+    bool ok;
+};
+
+static ChainResult *chainResults;
+
+/*
+ * Given a case (@param index: 0 for followPath through the corners, 1 for the segment chain mission code used
+ * before, a turn, RPS_Angle and move_forward per segment), drives the route at ROUTE_PERCENT and fills in its result.
+ * The path moves each corner QR_OFFSET along the way into it, as followRoute does, since the QR code follows it.
+ * @Returns [every call ended MOTION_OK]
+ */
+static bool checkChain(int index) {
+    SimVariation variation;
+    simNominal(&variation);
+    setUpDriving(variation, 18, 15, 90);
+    FILE *trace = tmpfile();
+    simTraceOut = trace;
+
+    uint64_t start = simMicros();
+    bool ok = true;
+    float lastX = fromFixed(estimate.centerX);
+    float lastY = fromFixed(estimate.centerY);
+    if (index == 0) {
+        Waypoint points[PATH_CORNERS];
+        for (int i = 0; i < PATH_CORNERS; i++) {
+            float bearing = atan2(pathCorners[i][1] - lastY, pathCorners[i][0] - lastX);
+            points[i].x = pathCorners[i][0] + QR_OFFSET * cos(bearing);
+            points[i].y = pathCorners[i][1] + QR_OFFSET * sin(bearing);
+            lastX = pathCorners[i][0];
+            lastY = pathCorners[i][1];
+        }
+        ok = followPath(points, PATH_CORNERS, 1, ROUTE_PERCENT, true) == MOTION_OK;
+    } else {
+        for (int i = 0; i < PATH_CORNERS; i++) {
+            float centerX = fromFixed(estimate.centerX);
+            float centerY = fromFixed(estimate.centerY);
+            float bearing = atan2(pathCorners[i][1] - centerY, pathCorners[i][0] - centerX) * 180 / PI;
+            float turn = wrapAngle(bearing - estimate.heading);
+            if (turn > 1) {
+                ok = turnLeft(POSE_TURN_PERCENT, turn) == MOTION_OK && ok;
+            } else if (turn < -1) {
+                ok = turnRight(POSE_TURN_PERCENT, -turn) == MOTION_OK && ok;
+            }
+            ok = RPS_Angle(bearing) == MOTION_OK && ok;
+            float length = hypot(pathCorners[i][0] - fromFixed(estimate.centerX),
+                                 pathCorners[i][1] - fromFixed(estimate.centerY));
+            ok = move_forward(ROUTE_PERCENT, length) == MOTION_OK && ok;
+        }
+    }
+    ChainResult *result = &chainResults[index];
+    result->time = (simMicros() - start) / 1e6;
+    waitMs(300);
+    simTraceOut = 0;
+
+    float x, y, heading;
+    simPose(&x, &y, &heading);
+    float centerX = x - QR_OFFSET * cos(heading * PI / 180);
+    float centerY = y - QR_OFFSET * sin(heading * PI / 180);
+    result->error = hypot(centerX - pathCorners[PATH_CORNERS - 1][0], centerY - pathCorners[PATH_CORNERS - 1][1]);
+    result->stops = countStops(trace);
+    result->ok = ok;
+    printf("  %-28s %-11s %.2f s, ends %.2f in off, %d stops\n", index == 0 ? "followPath" : "segment chain",
+           ok ? "OK" : "FAILED", result->time, result->error, result->stops);
+    return ok;
+}
+
+/*
+ * A route of four corners driven with followPath and as a chain of stop-start segments.
+ * @Returns [both ended MOTION_OK, and followPath stopped once, at the end, took less time than the chain and ended
+ * no farther from the last corner]
+ */
+static bool pathChain() {
+    chainResults = (ChainResult *)mmap(0, 2 * sizeof(ChainResult), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                                       -1, 0);
+    bool passed = inChild(checkChain, 0);
+    passed = inChild(checkChain, 1) && passed;
+    const ChainResult &path = chainResults[0];
+    const ChainResult &chain = chainResults[1];
+    printf("  followPath takes %.2f s less, %d stop instead of %d\n", chain.time - path.time, path.stops, chain.stops);
+    return passed && path.stops == 1 && path.time < chain.time && path.error <= chain.error;
+}
+
+// Jobs of the scheduler check: their periods (ms), how long the check ticks for (ms) and how long the stalling job
+// holds the scheduler once (ms) and on which of its runs.
+static const unsigned int testPeriods[] = { SAMPLE_PERIOD, CONTROL_PERIOD, LOG_PERIOD };
+
+#define TEST_JOBS 3
+#define SCHEDULE_TIME 1000
+#define STALL_TIME 23
+#define STALL_RUN 10
+#define MAX_JOB_RUNS 2000
+
+/*
+ * One run of a test job: which job, the scheduler tick it ran in and the time it started.
+ */
+struct JobRun {
+    int job;
+    int tick;
+    unsigned int time;
+};
+
+static JobRun jobRuns[MAX_JOB_RUNS];
+static int jobRunCount;
+static int tickCount;
+static bool stallJob;
+
+/*
+ * Given a test job (@param job), records that it ran. The last job holds the scheduler for STALL_TIME on its
+ * STALL_RUNth run when stallJob is set.
+ */
+static void testJob(int job) {
+    if (jobRunCount < MAX_JOB_RUNS) {
+        JobRun &run = jobRuns[jobRunCount++];
+        run.job = job;
+        run.tick = tickCount;
+        run.time = schedulerClock();
+    }
+    if (stallJob && job == TEST_JOBS - 1 && jobs[job].runs + 1 == STALL_RUN) {
+        Sleep(STALL_TIME);
+    }
+}
+
+static void testJob0() { testJob(0); }
+static void testJob1() { testJob(1); }
+static void testJob2() { testJob(2); }
+
+/*
+ * Given whether the last job stalls once (@param stall), runs the test jobs on the scheduler for SCHEDULE_TIME of
+ * virtual time and checks their timing: runs and gaps between runs as their periods, at most one tick late, and jobs
+ * due in the same tick run in the order they were added. A stall long enough for a job to miss a whole period makes
+ * it count one overrun and run once when the stall ends, instead of catching up, and then run at its period again
+ * from there. A job only due once during the stall is late but keeps its schedule.
+ * @Returns [the timing was as above]
+ */
+static bool checkSchedule(int stall) {
+    SimVariation variation;
+    simNominal(&variation);
+    simBench(variation, 1);
+    stallJob = stall != 0;
+    jobCount = 0;
+    addJob("Job 0", testJob0, testPeriods[0]);
+    addJob("Job 1", testJob1, testPeriods[1]);
+    addJob("Job 2", testJob2, testPeriods[2]);
+    nextTick = schedulerClock();
+    unsigned int start = schedulerClock();
+    while (schedulerClock() - start < SCHEDULE_TIME) {
+        schedulerTick();
+        tickCount++;
+    }
+
+    // The tick the stall ended in, if any
+    int stallTick = -1;
+    for (int i = 1; i < jobRunCount; i++) {
+        if (jobRuns[i].time - jobRuns[i - 1].time >= STALL_TIME) {
+            stallTick = jobRuns[i].tick;
+            break;
+        }
+    }
+
+    bool passed = true;
+    for (int job = 0; job < TEST_JOBS; job++) {
+        unsigned int period = testPeriods[job];
+        unsigned int last = 0, minGap = SCHEDULE_TIME, maxGap = 0;
+        int runs = 0, runsAfterStall = 0;
+        bool ordered = true;
+        for (int i = 0; i < jobRunCount; i++) {
+            const JobRun &run = jobRuns[i];
+            if (i > 0 && jobRuns[i - 1].tick == run.tick && jobRuns[i - 1].job >= run.job) {
+                ordered = false;
+            }
+            if (run.job != job) {
+                continue;
+            }
+            if (runs > 0 && (stallTick < 0 || run.tick != stallTick)) {
+                unsigned int gap = run.time - last;
+                minGap = gap < minGap ? gap : minGap;
+                maxGap = gap > maxGap ? gap : maxGap;
+            }
+            if (run.tick == stallTick) {
+                runsAfterStall++;
+            }
+            last = run.time;
+            runs++;
+        }
+        const Job &state = jobs[job];
+        printf("  period %2u ms: %3d runs, gaps %u-%u ms, worst jitter %2u ms, %d overruns%s\n", period, state.runs,
+               minGap, maxGap, state.maxJitter, state.overruns, ordered ? "" : ", out of order");
+
+        // The gap into the stall's end is left out. A job late without an overrun keeps its schedule, so the gap after
+        // a late run is short by how late it was
+        bool spanned = stall && 2 * period <= STALL_TIME;
+        passed = passed && ordered && minGap + state.maxJitter + SCHEDULER_TICK > period
+                && maxGap < period + SCHEDULER_TICK;
+        if (stall) {
+            passed = passed && stallTick >= 0 && runsAfterStall <= 1 && state.overruns == (spanned ? 1 : 0);
+        } else {
+            passed = passed && state.overruns == 0 && state.maxJitter < SCHEDULER_TICK
+                    && abs(state.runs - (int)(SCHEDULE_TIME / period)) <= 1;
+        }
+    }
+    return passed;
+}
+
+/*
+ * The scheduler on the simulator clock, running test jobs at the sample, control and log periods: once on time,
+ * once with the slowest job holding it for STALL_TIME.
+ * @Returns [checkSchedule passed for both]
+ */
+static bool schedulerTiming() {
+    bool passed = inChild(checkSchedule, 0);
+    printf("  stalling %d ms once:\n", STALL_TIME);
+    return inChild(checkSchedule, 1) && passed;
+}
+
+// Synthetic DDR light traces: the ambient CdS level and the red drop measured off the start light (volts), the noise
+// of a raw read, the chance of a read glitching to a rail, the spread of the true light level around the expected
+// one, the trials of each trace and the most decision samples a trial gets before it counts as undecided.
+#define TRACE_AMBIENT 2.4
+#define TRACE_RED_DROP 1.6
+#define TRACE_READ_NOISE 0.1
+#define TRACE_GLITCH 0.02
+#define TRACE_LEVEL_SPREAD 0.05
+#define TRACE_TRIALS 20000
+#define TRACE_MAX_SAMPLES 100
+
+/*
+ * Given a random source (@param random), the light level (@param level) and whether reads glitch (@param glitches),
+ * fills a burst of DDR_OVERSAMPLE raw reads (@param reads).
+ */
+static void traceBurst(SimRandom *random, float level, bool glitches, float *reads) {
+    for (int i = 0; i < DDR_OVERSAMPLE; i++) {
+        reads[i] = level + TRACE_READ_NOISE * simGaussian(random);
+        if (glitches && simUniform(random) < TRACE_GLITCH) {
+            reads[i] = simUniform(random) < 0.5 ? 0 : 3.3;
+        }
+    }
+}
+
+/*
+ * Given a random source (@param random), the light level (@param red: 1 for the classifier's red level, 0 for its
+ * blue level, 0.5 for exactly halfway) and where to put the number of decision samples (@param samples), runs one
+ * noisy trace through the classifier. Red and blue levels are off by TRACE_LEVEL_SPREAD.
+ * @Returns [the colour it decided, LIGHT_UNDECIDED after TRACE_MAX_SAMPLES]
+ */
+static int classifyTrace(SimRandom *random, float red, int *samples) {
+    LightClassifier classifier;
+    classifierInit(&classifier, TRACE_AMBIENT, TRACE_RED_DROP);
+    float level = red * classifier.redLevel + (1 - red) * classifier.blueLevel;
+    if (red != 0.5) {
+        level += TRACE_LEVEL_SPREAD * simGaussian(random);
+    }
+    int color = LIGHT_UNDECIDED;
+    while (color == LIGHT_UNDECIDED && classifier.samples < TRACE_MAX_SAMPLES) {
+        float reads[DDR_OVERSAMPLE];
+        traceBurst(random, level, true, reads);
+        color = classifierStep(&classifier, reads, DDR_OVERSAMPLE);
+    }
+    *samples = classifier.samples;
+    return color;
+}
+
+/*
+ * Given a name (@param name) and a list of bursts (@param levels, @param count, each burst's reads all at that level),
+ * runs a clean trace through the classifier and prints what it decided.
+ * @Returns [the colour it decided and the sample it decided at]
+ */
+static int cleanTrace(const char *name, const float *levels, int count, int *samples) {
+    LightClassifier classifier;
+    classifierInit(&classifier, TRACE_AMBIENT, TRACE_RED_DROP);
+    int color = LIGHT_UNDECIDED;
+    for (int i = 0; i < count && color == LIGHT_UNDECIDED; i++) {
+        float reads[DDR_OVERSAMPLE];
+        for (int j = 0; j < DDR_OVERSAMPLE; j++) {
+            reads[j] = levels[i];
+        }
+        color = classifierStep(&classifier, reads, DDR_OVERSAMPLE);
+    }
+    static const char *colorNames[] = { "undecided", "red", "blue" };
+    printf("  %-28s %-9s after %d samples, confidence %.3f\n", name, colorNames[color], classifier.samples,
+           classifierConfidence(classifier));
+    *samples = classifier.samples;
+    return color;
+}
+
+/*
+ * The DDR light classifier on synthetic traces. Clean red and blue traces, and a blue one whose second burst reads
+ * all red, must decide right within 4 samples. Noisy red and blue traces, with glitching reads and the light level
+ * off by TRACE_LEVEL_SPREAD, must be wrong no more than 1 - DDR_CONFIDENCE of the time. A trace halfway between the
+ * colours has no evidence either way: it must take longer to decide, with no bias to either colour. It still ends
+ * up at DDR_CONFIDENCE, since each sample's evidence is capped but not scaled down for the read noise.
+ * @Returns [all of the above held]
+ */
+static bool ddrClassifier() {
+    float red = TRACE_AMBIENT - TRACE_RED_DROP;
+    float blue = red + DDR_BLUE_SEPARATION;
+    float cleanRed[] = { red, red, red, red, red, red };
+    float cleanBlue[] = { blue, blue, blue, blue, blue, blue };
+    float glitchedBlue[] = { blue, red, blue, blue, blue, blue };
+    int samples;
+    bool passed = cleanTrace("clean red", cleanRed, 6, &samples) == LIGHT_RED && samples <= 4;
+    passed = cleanTrace("clean blue", cleanBlue, 6, &samples) == LIGHT_BLUE && samples <= 4 && passed;
+    passed = cleanTrace("blue, one burst at red", glitchedBlue, 6, &samples) == LIGHT_BLUE && samples <= 4 && passed;
+
+    SimRandom random;
+    simSeed(&random, 1);
+    static const char *traceNames[] = { "noisy red", "noisy blue", "halfway" };
+    static const float traceLevels[] = { 1, 0, 0.5 };
+    float meanSamples[3];
+    for (int trace = 0; trace < 3; trace++) {
+        int decided[3] = { 0, 0, 0 };
+        long totalSamples = 0;
+        for (int trial = 0; trial < TRACE_TRIALS; trial++) {
+            decided[classifyTrace(&random, traceLevels[trace], &samples)]++;
+            totalSamples += samples;
+        }
+        meanSamples[trace] = (float)totalSamples / TRACE_TRIALS;
+        printf("  %-28s red %5.2f%%  blue %5.2f%%  undecided %5.2f%%  %.1f samples\n", traceNames[trace],
+               100.0 * decided[LIGHT_RED] / TRACE_TRIALS, 100.0 * decided[LIGHT_BLUE] / TRACE_TRIALS,
+               100.0 * decided[LIGHT_UNDECIDED] / TRACE_TRIALS, meanSamples[trace]);
+        float maxWrong = (1 - DDR_CONFIDENCE) * TRACE_TRIALS;
+        if (trace == 0) {
+            passed = passed && decided[LIGHT_BLUE] + decided[LIGHT_UNDECIDED] <= maxWrong;
+        } else if (trace == 1) {
+            passed = passed && decided[LIGHT_RED] + decided[LIGHT_UNDECIDED] <= maxWrong;
+        } else {
+            float bias = (float)(decided[LIGHT_RED] - decided[LIGHT_BLUE]) / TRACE_TRIALS;
+            passed = passed && fabs(bias) < 0.05;
+        }
+    }
+    return passed && meanSamples[2] > 1.5 * meanSamples[0] && meanSamples[2] > 1.5 * meanSamples[1];
+}
+
+// Largest errors the fixed point math may make against double: sin and cos (1 degree table), atan2 (degrees, 1/32
+// table), and hypot, mul and div (in fixed point steps, 1/65536).
+#define SIN_TOLERANCE 1e-4
+#define ATAN_TOLERANCE 0.01
+#define STEP_TOLERANCE 1.0
+
+/*
+ * Given the errors seen so far (@param worst) and a new one (@param error), keeps the largest.
+ */
+static void keepWorst(double *worst, double error) {
+    if (fabs(error) > *worst) {
+        *worst = fabs(error);
+    }
+}
+
+/*
+ * @Returns [host nanoseconds from a monotonic clock]
+ */
+static double hostNanos() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+// Calls per function timed by the fixed point microbenchmark.
+#define BENCH_CALLS 1000000
+
+// Keeps the benchmarked results from being optimized away.
+static volatile double benchSink;
+
+/*
+ * Times the fixed point functions against their double versions on this host and prints the nanoseconds per call.
+ * Only the ratio means anything: the Proteus has no double precision hardware and the host has.
+ */
+static void benchFixed() {
+    fixed fixedSum = 0;
+    double doubleSum = 0;
+    double start = hostNanos();
+    for (int i = 0; i < BENCH_CALLS; i++) {
+        fixedSum += fixedSin(i * 37);
+    }
+    double fixedTime = hostNanos() - start;
+    start = hostNanos();
+    for (int i = 0; i < BENCH_CALLS; i++) {
+        doubleSum += sin(i * 37 / 65536.0 * PI / 180);
+    }
+    double doubleTime = hostNanos() - start;
+    printf("  %-28s %6.1f ns  double %6.1f ns\n", "fixedSin", fixedTime / BENCH_CALLS, doubleTime / BENCH_CALLS);
+
+    start = hostNanos();
+    for (int i = 0; i < BENCH_CALLS; i++) {
+        fixedSum += fixedAtan2(i & 0xFFFFF, 0x80000 - (i & 0x3FFFF));
+    }
+    fixedTime = hostNanos() - start;
+    start = hostNanos();
+    for (int i = 0; i < BENCH_CALLS; i++) {
+        doubleSum += atan2(i & 0xFFFFF, 0x80000 - (i & 0x3FFFF)) * 180 / PI;
+    }
+    doubleTime = hostNanos() - start;
+    printf("  %-28s %6.1f ns  double %6.1f ns\n", "fixedAtan2", fixedTime / BENCH_CALLS, doubleTime / BENCH_CALLS);
+
+    start = hostNanos();
+    for (int i = 0; i < BENCH_CALLS; i++) {
+        fixedSum += fixedHypot(i & 0x3FFFFF, 0x200000 - (i & 0xFFFFF));
+    }
+    fixedTime = hostNanos() - start;
+    start = hostNanos();
+    for (int i = 0; i < BENCH_CALLS; i++) {
+        doubleSum += hypot((i & 0x3FFFFF) / 65536.0, (0x200000 - (i & 0xFFFFF)) / 65536.0);
+    }
+    doubleTime = hostNanos() - start;
+    printf("  %-28s %6.1f ns  double %6.1f ns\n", "fixedHypot", fixedTime / BENCH_CALLS, doubleTime / BENCH_CALLS);
+
+    start = hostNanos();
+    for (int i = 0; i < BENCH_CALLS; i++) {
+        fixedSum += fixedDiv(fixedMul(i, 0x18000), 0x10000 + (i & 0xFFFF));
+    }
+    fixedTime = hostNanos() - start;
+    start = hostNanos();
+    for (int i = 0; i < BENCH_CALLS; i++) {
+        doubleSum += i / 65536.0 * 1.5 / (1 + (i & 0xFFFF) / 65536.0);
+    }
+    doubleTime = hostNanos() - start;
+    printf("  %-28s %6.1f ns  double %6.1f ns\n", "fixedMul + fixedDiv", fixedTime / BENCH_CALLS,
+           doubleTime / BENCH_CALLS);
+    benchSink = fixedSum + doubleSum;
+}
+
+/*
+ * The Q16.16 fixed point math against double: sin and cos every 0.01 degree from -720 to 720, atan2 and hypot on
+ * circles of 0.25 to 128 inches every 0.1 degree, and mul and div over the values the robot works with. Then times
+ * them with benchFixed.
+ * @Returns [every error was within its tolerance]
+ */
+static bool fixedPoint() {
+    double sinWorst = 0, atanWorst = 0, hypotWorst = 0, mulWorst = 0, divWorst = 0;
+    for (int i = -72000; i <= 72000; i++) {
+        fixed degrees = FIXED(i / 100.0);
+        double radians = fromFixed(degrees) * PI / 180;
+        keepWorst(&sinWorst, fromFixed(fixedSin(degrees)) - sin(radians));
+        keepWorst(&sinWorst, fromFixed(fixedCos(degrees)) - cos(radians));
+    }
+    for (double radius = 0.25; radius <= 128; radius *= 2) {
+        for (int i = -1799; i <= 1800; i++) {
+            double angle = i / 10.0;
+            fixed x = FIXED(radius * cos(angle * PI / 180));
+            fixed y = FIXED(radius * sin(angle * PI / 180));
+            double exactAngle = atan2((double)y, (double)x) * 180 / PI;
+            keepWorst(&atanWorst, wrapAngle(fromFixed(fixedAtan2(y, x)) - exactAngle));
+            keepWorst(&hypotWorst, fixedHypot(x, y) - hypot((double)x, (double)y));
+        }
+    }
+    // Products up to 128 * 128 would pass the 16 bits of integer part, so the factors stay within 100
+    for (int i = -400; i <= 400; i++) {
+        for (int j = -400; j <= 400; j++) {
+            fixed a = FIXED(i * 0.2497);
+            fixed b = FIXED(j * 0.2503);
+            keepWorst(&mulWorst, fixedMul(a, b) - (double)a * b / 65536);
+            if (b != 0) {
+                keepWorst(&divWorst, fixedDiv(a, b) - (double)a / b * 65536);
+            }
+        }
+    }
+
+    printf("  %-28s %.2e (tolerance %.0e)\n", "fixedSin, fixedCos", sinWorst, SIN_TOLERANCE);
+    printf("  %-28s %.2e deg (tolerance %.2f)\n", "fixedAtan2", atanWorst, ATAN_TOLERANCE);
+    printf("  %-28s %.4f steps (tolerance %.0f)\n", "fixedHypot", hypotWorst, STEP_TOLERANCE);
+    printf("  %-28s %.4f steps (tolerance %.0f)\n", "fixedMul", mulWorst, STEP_TOLERANCE);
+    printf("  %-28s %.4f steps (tolerance %.0f)\n", "fixedDiv", divWorst, STEP_TOLERANCE);
+    benchFixed();
+    return sinWorst <= SIN_TOLERANCE && atanWorst <= ATAN_TOLERANCE && hypotWorst <= STEP_TOLERANCE
+            && mulWorst <= STEP_TOLERANCE && divWorst <= STEP_TOLERANCE;
+}
+
+// Drives for the profile check: distances (inches) and powers, each driven with the trapezoidal profile and with
+// the bang-bang drive it replaced.
+static const float profileDistances[] = { 3, 12, 24 };
+static const int profilePercents[] = { 40, 70, 90 };
+
+#define PROFILE_DISTANCES (int)(sizeof(profileDistances) / sizeof(profileDistances[0]))
+#define PROFILE_PERCENTS (int)(sizeof(profilePercents) / sizeof(profilePercents[0]))
+#define PROFILE_CASES (PROFILE_DISTANCES * PROFILE_PERCENTS * 2)
+
+/*
+ * How a drive went: the time (in seconds) until the robot was at rest and how far past the distance it ended
+ * (inches, negative short). Shared with the child processes that drive it.
+ */
+struct DriveResult {
+    float time;
+    float error;
+};
+
+static DriveResult *driveResults;
+
+/*
+ * Given a power (@param percent) and a distance (@param inches), drives forward the way move_forward did before the
+ * profile: full power until both encoders reach the counts, then stop.
+ */
+static void bangBangDrive(int percent, float inches) {
+    int counts = theoreticalCounts(inches);
+    fl_encoder.ResetCounts();
+    br_encoder.ResetCounts();
+    setDrive(percent, percent);
+    while (fl_encoder.Counts() < counts || br_encoder.Counts() < counts) {
+        Sleep(1);
+    }
+    stopDrive();
+}
+
+/*
+ * Given a trace (@param trace, as simTraceOut writes it), finds the last time the robot was moving.
+ * @Returns [the time (in seconds) of the last trace line with a side at STOP_SPEED or more, 0 if there is none]
+ */
+static float lastMoving(FILE *trace) {
+    rewind(trace);
+    float last = 0;
+    float time, x, y, heading, left, right;
+    char rest[100];
+    while (fscanf(trace, "%f %f %f %f %f %f%99[^\n]", &time, &x, &y, &heading, &left, &right, rest) == 7) {
+        if (fabs(left) >= STOP_SPEED || fabs(right) >= STOP_SPEED) {
+            last = time;
+        }
+    }
+    return last;
+}
+
+/*
+ * Given a case (@param index: the distance, power and drive, bang-bang for odd indices), drives a nominal robot
+ * straight up the flat middle of the course and fills in its result.
+ * @Returns [true]
+ */
+static bool checkDrive(int index) {
+    float inches = profileDistances[index / 2 / PROFILE_PERCENTS];
+    int percent = profilePercents[index / 2 % PROFILE_PERCENTS];
+    bool bangBang = index % 2 == 1;
+
+    SimVariation variation;
+    simNominal(&variation);
+    setUpDriving(variation, 18, 6, 90);
+    FILE *trace = tmpfile();
+    simTraceOut = trace;
+
+    float x, y, heading;
+    simPose(&x, &y, &heading);
+    float start = simMicros() / 1e6;
+    if (bangBang) {
+        bangBangDrive(percent, inches);
+    } else {
+        move_forward(percent, inches);
+    }
+    waitMs(500);
+    simTraceOut = 0;
+
+    float endX, endY, endHeading;
+    simPose(&endX, &endY, &endHeading);
+    DriveResult &result = driveResults[index];
+    result.time = lastMoving(trace) - start;
+    result.error = (endX - x) * cos(heading * PI / 180) + (endY - y) * sin(heading * PI / 180) - inches;
+    return true;
+}
+
+/*
+ * Straight drives with the trapezoidal profile against the bang-bang drive it replaced.
+ * @Returns [the profile ended closer to the distance than bang-bang on average, never more than 0.5 inches off, and
+ * took no more than 10% longer in total]
+ */
+static bool driveProfile() {
+    driveResults = (DriveResult *)mmap(0, PROFILE_CASES * sizeof(DriveResult), PROT_READ | PROT_WRITE,
+                                       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    for (int i = 0; i < PROFILE_CASES; i++) {
+        inChild(checkDrive, i);
+    }
+
+    bool passed = true;
+    float errors[2] = { 0, 0 };
+    float times[2] = { 0, 0 };
+    printf("  %-28s %18s %18s\n", "", "profile", "bang-bang");
+    for (int i = 0; i < PROFILE_CASES; i += 2) {
+        const DriveResult &profile = driveResults[i];
+        const DriveResult &bangBang = driveResults[i + 1];
+        char call[40];
+        snprintf(call, sizeof(call), "move_forward(%d, %.0f)", profilePercents[i / 2 % PROFILE_PERCENTS],
+                 profileDistances[i / 2 / PROFILE_PERCENTS]);
+        printf("  %-28s %5.2f s %+6.2f in  %5.2f s %+6.2f in\n", call, profile.time, profile.error, bangBang.time,
+               bangBang.error);
+        errors[0] += fabs(profile.error);
+        errors[1] += fabs(bangBang.error);
+        times[0] += profile.time;
+        times[1] += bangBang.time;
+        passed = passed && fabs(profile.error) <= 0.5;
+    }
+    int drives = PROFILE_CASES / 2;
+    printf("  %-28s %5.2f s %6.2f in  %5.2f s %6.2f in\n", "mean", times[0] / drives, errors[0] / drives,
+           times[1] / drives, errors[1] / drives);
+    return passed && errors[0] < errors[1] && times[0] <= times[1] * 1.1;
+}
+
+#define MAX_SEQUENCE_TURNS 4
+
+/*
+ * A chain of hand-written turns from the mission code: its turn power, the heading it starts from, the turns as
+ * written before the turn model (padded for the old open-loop turns coming up short) and now, each the turn meant
+ * (positive left, in degrees), and the drives between them (inches, negative backward).
+ */
+struct TurnSequence {
+    const char *name;
+    int percent;
+    float start;
+    int count;
+    float padded[MAX_SEQUENCE_TURNS];
+    float tuned[MAX_SEQUENCE_TURNS];
+    float drives[MAX_SEQUENCE_TURNS - 1];
+};
+
+static const TurnSequence turnSequences[] = {
+    { "red DDR approach", 40, 351, 3, { -20, -30, -40 }, { -18, -27, -36 }, { -1.0, 1.5 } },
+    { "red DDR exit", 40, 270, 1, { 80 }, { 88 }, { } },
+    { "blue DDR exit", 60, 270, 1, { 80 }, { 88 }, { } },
+    { "turn to the ramp", 60, 20, 1, { 65 }, { 68 }, { } },
+    { "foosball approach", 70, 90, 4, { -38, -24, -15, -10 }, { -38, -26, -18, -10 }, { -2.3, 1.5, 1.5 } }
+};
+
+#define TURN_SEQUENCES (int)(sizeof(turnSequences) / sizeof(turnSequences[0]))
+
+// Turn powers the model is trained at before the sequences run, one per speed bin, and the rounds of training.
+static const int trainingPercents[] = { 40, 60, 70 };
+
+#define TRAINING_ROUNDS 4
+
+/*
+ * Given a sequence (@param sequence) and whether to drive its padded turns (@param padded), squares the robot to
+ * its start heading and drives it, letting the robot settle after each turn to measure it against the turn meant.
+ * @Returns [the worst miss of a turn, in degrees]
+ */
+static float driveSequence(const TurnSequence &sequence, bool padded) {
+    RPS_Angle(sequence.start);
+    waitMs(300);
+    float worst = 0;
+    for (int i = 0; i < sequence.count; i++) {
+        float x, y, before, after;
+        simPose(&x, &y, &before);
+        float turn = padded ? sequence.padded[i] : sequence.tuned[i];
+        if (turn > 0) {
+            turnLeft(sequence.percent, turn);
+        } else {
+            turnRight(sequence.percent, -turn);
+        }
+        waitMs(300);
+        simPose(&x, &y, &after);
+        float miss = wrapAngle(after - before) - sequence.tuned[i];
+        if (fabs(miss) > fabs(worst)) {
+            worst = miss;
+        }
+        if (i + 1 < sequence.count) {
+            float drive = sequence.drives[i];
+            if (drive > 0) {
+                move_forward(60, drive);
+            } else {
+                move_backward(60, -drive);
+            }
+        }
+    }
+    return worst;
+}
+
+/*
+ * Trains the turn model of a nominal robot, as a few runs would, then drives every sequence padded and tuned.
+ * @Returns [no tuned turn missed by more than TURN_SEQUENCE_TOLERANCE, and each sequence's worst tuned miss was less
+ * than its padded one]
+ */
+#define TURN_SEQUENCE_TOLERANCE 3.0
+
+static bool checkTurnSequences(int) {
+    SimVariation variation;
+    simNominal(&variation);
+    setUpDriving(variation, 18, 44, 90);
+    for (int round = 0; round < TRAINING_ROUNDS; round++) {
+        for (int percent : trainingPercents) {
+            turnLeft(percent, 90);
+            waitMs(300);
+            turnRight(percent, 90);
+            waitMs(300);
+            turnLeft(percent, 30);
+            waitMs(300);
+            turnRight(percent, 30);
+            waitMs(300);
+        }
+    }
+
+    bool passed = true;
+    printf("  %-28s %8s %8s  (worst turn miss)\n", "", "padded", "tuned");
+    for (int i = 0; i < TURN_SEQUENCES; i++) {
+        const TurnSequence &sequence = turnSequences[i];
+        float padded = driveSequence(sequence, true);
+        float tuned = driveSequence(sequence, false);
+        printf("  %-28s %+7.1f  %+7.1f  deg\n", sequence.name, padded, tuned);
+        passed = passed && fabs(tuned) <= TURN_SEQUENCE_TOLERANCE && fabs(tuned) < fabs(padded);
+    }
+    return passed;
+}
+
+/*
+ * The hand-written turn chains of the mission code, as written for the old open-loop turns and retuned for the
+ * turn model, on a robot whose model has learned.
+ * @Returns [checkTurnSequences passed]
+ */
+static bool turnSequencesCheck() {
+    return inChild(checkTurnSequences, 0);
+}
+
+struct Scenario {
+    const char *name;
+    bool (*run)();
+};
+
+static const Scenario scenarios[] = {
+    { "start-light", startLight },
+    { "start-shadow", startShadow },
+    { "stall-held", stallHeld },
+    { "stall-free", stallFree },
+    { "axis-matrix", axisMatrix },
+    { "pose-reach", poseReach },
+    { "pose-behind", poseBehind },
+    { "pose-lost", poseLost },
+    { "drive-drift", driveDrift },
+    { "battery-drive", batteryDrive },
+    { "rps-still", rpsStill },
+    { "estimate-track", estimateTrack },
+    { "path-chain", pathChain },
+    { "turn-literals", turnSequencesCheck },
+    { "drive-profile", driveProfile },
+    { "fixed-point", fixedPoint },
+    { "ddr-classifier", ddrClassifier },
+    { "scheduler", schedulerTiming },
+};
+
+#define SCENARIOS (int)(sizeof(scenarios) / sizeof(scenarios[0]))
+
+#undef main
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        for (int i = 0; i < SCENARIOS; i++) {
+            printf("%s\n", scenarios[i].name);
+        }
+        return 0;
+    }
+    for (int i = 0; i < SCENARIOS; i++) {
+        if (strcmp(argv[1], scenarios[i].name) == 0) {
+            bool passed = scenarios[i].run();
+            printf("%s: %s\n", scenarios[i].name, passed ? "ok" : "failed");
+            return passed ? 0 : 2;
+        }
+    }
+    fprintf(stderr, "no scenario %s\n", argv[1]);
+    return 1;
+}
@@ -0,0 +1,908 @@
+#include "world.h"
+
+#include <math.h>
+#include <string.h>
+
+/*
+ * Robot and course model behind the stub FEH libraries. See world.h.
+ * The course frame is the RPS frame: inches, x to the right of the start and y up the course,
+ * headings in degrees counterclockwise from +x.
+ */
+
+#define PI 3.14159265358979
+
+// Wiring of main.cpp: Motor0 (bl) and Motor1 (fl) drive the left side, Motor2 (br) and Motor3 (fr) the right side
+// and are mounted backwards. The left encoder is on P1_1, the right on P2_0, the CdS cell on P0_4.
+#define LEFT 0
+#define RIGHT 1
+static const int motorSide[4] = { LEFT, LEFT, RIGHT, RIGHT };
+static const int motorSign[4] = { 1, 1, -1, -1 };
+#define LEFT_ENCODER_PIN 9
+#define RIGHT_ENCODER_PIN 16
+#define CDS_PIN 4
+#define LEVER_SERVO 6
+#define TOKEN_SERVO 0
+#define SERVOS 8
+
+// Robot body. The body is a circle for collisions; the QR code, CdS cell, lever arm tip and token chute are
+// at fixed distances ahead of the center (negative is behind it).
+#define BODY_RADIUS 5.0
+#define QR_FORWARD 2.0
+#define CDS_FORWARD 2.5
+#define ARM_FORWARD 4.5
+#define TOKEN_FORWARD -3.0
+#define NOMINAL_WHEEL_RADIUS 1.375
+#define NOMINAL_TURN_RADIUS 5.4
+#define COUNTS_PER_REV 48
+
+// Drive: wheel speed (in/s) of a side at 100% on a BATTERY_NOMINAL pack, the part of the command lost to friction,
+// and the motor time constant (s).
+#define FULL_SPEED 20.0
+#define BATTERY_NOMINAL 11.5
+#define DEADBAND 0.05
+#define MOTOR_LAG 0.06
+// While pushing against a wall a side still turns this fraction of its free speed. Sliding along a wall loses up to
+// WALL_FRICTION times how far the wall pushed the robot back.
+#define BLOCKED_SLIP 0.3
+#define WALL_FRICTION 0.5
+// A turn counts as driving (not turning in place) when the center moves at least this fraction of the turn's arc.
+#define PIVOT_FRACTION 0.2
+
+// Pack: volts lost with both sides at full power, and volts drained per second at full power.
+#define BATTERY_SAG 0.5
+#define BATTERY_DRAIN 0.004
+
+// Servos slew at this many degrees per second.
+#define SERVO_RATE 300.0
+
+// RPS: packet period and its jitter, and how old a pose is when its packet arrives (all in microseconds).
+#define RPS_PERIOD 100000
+#define RPS_JITTER 15000
+#define RPS_LATENCY 40000
+
+// CdS cell: nominal time constant (s), the radius (inches) a light covers fully and how fast it falls off outside that.
+#define CDS_LAG 0.01
+#define LIGHT_RADIUS 0.6
+#define LIGHT_FALLOFF 0.7
+
+// Operator: how long a press lasts, when the robot is placed after a press and when the next press comes (ms).
+#define TOUCH_HOLD 150
+#define TOUCH_FIRST 2000
+#define TOUCH_PLACE 1000
+#define TOUCH_NEXT 2500
+#define TOUCH_REPORT 1000
+
+// Ramps, as speed factors on the drive: climbing in +y is slower, going down slightly faster.
+#define RAMP_CLIMB 0.25
+#define RAMP_DESCENT 0.1
+
+/*
+ * An axis-aligned rectangle of the course, in inches.
+ */
+struct Box {
+    double left;
+    double bottom;
+    double right;
+    double top;
+};
+
+/*
+ * A position and heading (in degrees) on the course.
+ */
+struct Place {
+    double x;
+    double y;
+    double heading;
+};
+
+// Outer walls and the DDR machine; the robot cannot enter these.
+static const Box course = { 0, 0, 36, 72 };
+static const Box ddrMachine = { 16, 0, 34, 2 };
+static const Box ramps[2] = { { 24, 16, 36, 34 }, { 0, 16, 12, 34 } };
+
+// Where the robot starts (its center) and the QR positions the operator stores in calibrate(): POS1 to POS4 give
+// startingPointY, ddrLightX, foosballDistY and bumpY.
+static const Place startPlace = { 14.0, 9.0, 45.0 };
+static const Place calibrationPlaces[4] = {
+    { 20.0, 10.5, 351.0 },
+    { 23.0, 10.5, 351.0 },
+    { 30.0, 61.0, 90.0 },
+    { 10.0, 36.0, 270.0 }
+};
+
+// Lights, under the CdS cell at the start and at the DDR approach pose.
+static const double startLight[2] = { 15.77, 10.77 };
+static const double ddrLight[2] = { 22.7, 8.5 };
+
+// Task features: the DDR buttons the robot body presses, the RPS button and the lever the arm tip presses down,
+// the row of foosball counters the gripping arm slides toward -x, the token slot under the chute and the final button.
+static const double redButton[2] = { 20.4, 2.0 };
+static const double blueButton[2] = { 27.0, 2.0 };
+static const double rpsButton[2] = { 33.1, 9.0 };
+static const Box foosballRow = { 24.0, 57.2, 36.0, 59.2 };
+static const double leverPoint[2] = { 15.6, 59.9 };
+static const double tokenSlot[2] = { 16.9, 38.2 };
+static const double finalButton[2] = { 3.5, 2.5 };
+// How close (in inches) the body has to come to a button, and the arm tip or chute to its feature.
+#define PRESS_MARGIN 0.35
+#define ARM_REACH 1.0
+#define TOKEN_REACH 1.0
+// Time (in ms) a DDR or RPS button has to be held, and how far (in inches) the counters have to slide.
+#define BUTTON_HOLD 5000
+#define WRONG_BUTTON_HOLD 500
+#define FOOSBALL_SLIDE 7.0
+// Lever arm angles (degrees) that press down and grip.
+#define ARM_DOWN 20.0
+#define ARM_GRIP 150.0
+#define TOKEN_DROP 160.0
+
+const char *simTaskNames[SIM_TASKS] = { "ddr", "foosball", "lever", "token", "finish" };
+const char *simFeatureNames[SIM_FEATURES] = { "ddr", "rps", "foosball", "lever", "token", "final" };
+
+FILE *simLcdOut;
+FILE *simEventOut;
+FILE *simTraceOut;
+
+/*
+ * Everything that changes during a run.
+ */
+struct World {
+    SimVariation variation;
+    SimRandom random;
+
+    uint64_t now;
+    uint64_t stepTime;
+    uint64_t lightTime;
+    bool stopping;
+    bool unlimited;
+    unsigned long clockReads;
+
+    // Robot: center and heading (radians), side speeds (in/s), encoder counts and the CdS cell voltage
+    double x;
+    double y;
+    double heading;
+    double speed[2];
+    double wheel[2];
+    double cds;
+    uint64_t shadowStart;
+    uint64_t shadowEnd;
+    double shadowDrop;
+    double voc;
+    double volts;
+    bool contact;
+    bool wheelsHeld;
+    double contactTime;
+    float motor[4];
+    float servoTarget[SERVOS];
+    float servo[SERVOS];
+
+    // RPS: next capture, the captured packet waiting out its latency and the last published one
+    uint64_t nextCapture;
+    uint64_t publishTime;
+    bool pending;
+    float pendingPose[3];
+    float rps[3];
+
+    // Operator
+    int touches;
+    uint64_t pressStart;
+    bool bench;
+    bool placing;
+    uint64_t placeTime;
+    int placeIndex;
+
+    // Scoring
+    bool scored[SIM_FEATURES];
+    double scoreTime[SIM_FEATURES];
+    uint64_t holdStart[SIM_FEATURES];
+    uint64_t wrongStart;
+    bool wrongButton;
+    double foosball;
+    bool gripping;
+    double armX;
+};
+
+static World world;
+
+void simSeed(SimRandom *random, uint64_t seed) {
+    random->state = seed;
+}
+
+uint64_t simNext(SimRandom *random) {
+    uint64_t z = (random->state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/*
+ * @Returns [uniform random number in [0, 1)]
+ */
+double simUniform(SimRandom *random) {
+    return (simNext(random) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ * @Returns [standard normal random number]
+ */
+double simGaussian(SimRandom *random) {
+    double u = simUniform(random);
+    double v = simUniform(random);
+    return sqrt(-2 * log(u + 1e-300)) * cos(2 * PI * v);
+}
+
+bool simSucceeded(const SimResult &result) {
+    for (int i = 0; i < SIM_FEATURES; i++) {
+        if (!result.scored[i]) {
+            return false;
+        }
+    }
+    return result.courseTime >= 0 && result.courseTime <= SIM_COURSE_LIMIT;
+}
+
+/*
+ * Given a variation to fill in (@param variation), sets the nominal robot with a red DDR light: the model's geometry,
+ * a pack at its nominal voltage, no slip and no placement error. The RPS and CdS keep the little noise the real ones
+ * have; the rps-still scenario checks the robot without it.
+ */
+void simNominal(SimVariation *variation) {
+    variation->battery = BATTERY_NOMINAL + 0.3;
+    variation->leftGain = 1.0;
+    variation->rightGain = 1.0;
+    variation->wheelRadius = NOMINAL_WHEEL_RADIUS;
+    variation->turnRadius = NOMINAL_TURN_RADIUS;
+    variation->slip = 0;
+    variation->rpsNoise = 0.02;
+    variation->rpsHeadingNoise = 0.1;
+    variation->rpsGlitch = 0;
+    variation->rpsLoss = 0;
+    variation->placement = 0;
+    variation->placementHeading = 0;
+    variation->ambient = 2.4;
+    variation->redDrop = 1.6;
+    variation->blueDrop = 0.96;
+    variation->cdsNoise = 0.005;
+    variation->cdsLag = CDS_LAG;
+    variation->red = true;
+    variation->lightDelay = 2000;
+}
+
+/*
+ * Given a variation to fill in (@param variation) and a seed (@param seed), draws a robot, pack, course and operator:
+ * motor and wheel mismatch, slip, RPS noise and glitches, placement error, light levels and the DDR light colour.
+ */
+void simRandomize(SimVariation *variation, uint64_t seed) {
+    SimRandom random;
+    simSeed(&random, seed ^ 0x5EED5EED5EED5EEDULL);
+    simNominal(variation);
+
+    variation->battery = 11.0 + 1.6 * simUniform(&random);
+    variation->leftGain = 1 + 0.03 * simGaussian(&random);
+    variation->rightGain = 1 + 0.03 * simGaussian(&random);
+    variation->wheelRadius = NOMINAL_WHEEL_RADIUS * (1 + 0.01 * simGaussian(&random));
+    variation->turnRadius = NOMINAL_TURN_RADIUS * (1 + 0.03 * simGaussian(&random));
+    variation->slip = 0.02 + 0.03 * simUniform(&random);
+    variation->rpsNoise = 0.03 + 0.07 * simUniform(&random);
+    variation->rpsHeadingNoise = 0.2 + 0.6 * simUniform(&random);
+    variation->rpsGlitch = 0.01 * simUniform(&random);
+    variation->rpsLoss = 0.02 * simUniform(&random);
+    variation->placement = 0.2;
+    variation->placementHeading = 1.5;
+    variation->ambient = 2.2 + 0.4 * simUniform(&random);
+    variation->redDrop = 1.3 + 0.5 * simUniform(&random);
+    variation->blueDrop = variation->redDrop - 0.64 + 0.1 * simGaussian(&random);
+    variation->cdsNoise = 0.005 + 0.02 * simUniform(&random);
+    variation->red = simUniform(&random) < 0.5;
+    variation->lightDelay = 1500 + (unsigned int)(2500 * simUniform(&random));
+}
+
+/*
+ * Given a course event (@param format ...), writes it with the run time to the event stream.
+ */
+static void event(const char *format, const char *name, double value) {
+    if (simEventOut == 0) {
+        return;
+    }
+    fprintf(simEventOut, "%9.3f ", world.now / 1e6);
+    fprintf(simEventOut, format, name, value);
+    fprintf(simEventOut, "\n");
+}
+
+/*
+ * Given a distance ahead of the robot center (@param forward), fills in that point of the robot (@param point).
+ */
+static void robotPoint(double forward, double *point) {
+    point[0] = world.x + forward * cos(world.heading);
+    point[1] = world.y + forward * sin(world.heading);
+}
+
+static double distance(const double *a, const double *b) {
+    return hypot(a[0] - b[0], a[1] - b[1]);
+}
+
+static double wrapRadians(double radians) {
+    radians = fmod(radians, 2 * PI);
+    return radians < 0 ? radians + 2 * PI : radians;
+}
+
+static double wrapDegrees(double degrees) {
+    degrees = fmod(degrees, 360.0);
+    return degrees < 0 ? degrees + 360.0 : degrees;
+}
+
+/*
+ * Given a place for the QR code (@param place) and the standard deviations of the error (@param error, @param
+ * headingError), puts the robot down there at rest.
+ */
+static void placeRobot(const Place &place, double error, double headingError) {
+    world.heading = (place.heading + headingError * simGaussian(&world.random)) * PI / 180;
+    world.x = place.x - QR_FORWARD * cos(world.heading) + error * simGaussian(&world.random);
+    world.y = place.y - QR_FORWARD * sin(world.heading) + error * simGaussian(&world.random);
+    world.speed[LEFT] = 0;
+    world.speed[RIGHT] = 0;
+}
+
+void simStart(const SimVariation &variation, uint64_t seed) {
+    memset(&world, 0, sizeof(world));
+    world.variation = variation;
+    simSeed(&world.random, seed);
+
+    world.voc = variation.battery;
+    world.volts = variation.battery;
+    world.cds = variation.ambient;
+    for (int i = 0; i < SERVOS; i++) {
+        world.servo[i] = 90;
+        world.servoTarget[i] = 90;
+    }
+    world.rps[0] = world.rps[1] = world.rps[2] = -1;
+    world.nextCapture = RPS_PERIOD;
+    world.pressStart = TOUCH_FIRST * 1000ULL;
+
+    // The robot sits at the start while it boots
+    world.heading = startPlace.heading * PI / 180;
+    world.x = startPlace.x;
+    world.y = startPlace.y;
+}
+
+void simBench(const SimVariation &variation, uint64_t seed) {
+    simStart(variation, seed);
+    world.bench = true;
+}
+
+void simPlace(float x, float y, float heading) {
+    world.x = x;
+    world.y = y;
+    world.heading = wrapRadians(heading * PI / 180);
+    world.speed[LEFT] = 0;
+    world.speed[RIGHT] = 0;
+}
+
+void simPlaceStart() {
+    simPlace(startPlace.x, startPlace.y, startPlace.heading);
+}
+
+void simPose(float *x, float *y, float *heading) {
+    double qr[2];
+    robotPoint(QR_FORWARD, qr);
+    *x = qr[0];
+    *y = qr[1];
+    *heading = wrapDegrees(world.heading * 180 / PI);
+}
+
+void simSetBattery(float volts) {
+    world.voc = volts;
+    world.volts = volts;
+}
+
+void simHoldWheels(bool held) {
+    world.wheelsHeld = held;
+}
+
+void simLiftRunLimit() {
+    world.unlimited = true;
+}
+
+void simSetEncoders(int left, int right) {
+    world.wheel[LEFT] = left;
+    world.wheel[RIGHT] = right;
+}
+
+void simLightAt(uint64_t micros) {
+    world.lightTime = micros;
+}
+
+void simShadow(uint64_t micros, unsigned int ms, float drop) {
+    world.shadowStart = micros;
+    world.shadowEnd = micros + ms * 1000ULL;
+    world.shadowDrop = drop;
+}
+
+uint64_t simMicros() {
+    return world.now;
+}
+
+uint64_t simLightTime() {
+    return world.lightTime;
+}
+
+/*
+ * Given a point (@param point) and a light position (@param light), returns how much of the light the cell sees there.
+ * @Returns [fraction between 0 and 1]
+ */
+static double lightExposure(const double *point, const double *light) {
+    double d = distance(point, light);
+    if (d <= LIGHT_RADIUS) {
+        return 1;
+    }
+    double outside = (d - LIGHT_RADIUS) / LIGHT_FALLOFF;
+    return exp(-outside * outside);
+}
+
+/*
+ * Given a wall's normal (@param nx, @param ny) and how far it pushed the robot back (@param depth), takes friction off
+ * the robot's sliding along the wall since (@param fromX, @param fromY).
+ */
+static void slide(double nx, double ny, double depth, double fromX, double fromY) {
+    double along = -(world.x - fromX) * ny + (world.y - fromY) * nx;
+    double lost = WALL_FRICTION * depth;
+    if (lost > fabs(along)) {
+        lost = fabs(along);
+    }
+    if (along < 0) {
+        lost = -lost;
+    }
+    world.x += ny * lost;
+    world.y -= nx * lost;
+}
+
+/*
+ * Pushes the robot out of a box it overlaps (@param box, walls inside or outside it depending on @param inside),
+ * with friction on the sliding along the wall.
+ * @Returns [the robot touches the box]
+ */
+static bool collide(const Box &box, bool inside, double fromX, double fromY) {
+    if (inside) {
+        // Keep the body inside the box: check each wall
+        double overlaps[4] = { box.left + BODY_RADIUS - world.x, world.x + BODY_RADIUS - box.right,
+                box.bottom + BODY_RADIUS - world.y, world.y + BODY_RADIUS - box.top };
+        double normals[4][2] = { { 1, 0 }, { -1, 0 }, { 0, 1 }, { 0, -1 } };
+        bool touching = false;
+        for (int i = 0; i < 4; i++) {
+            if (overlaps[i] > 0) {
+                world.x += normals[i][0] * overlaps[i];
+                world.y += normals[i][1] * overlaps[i];
+                slide(normals[i][0], normals[i][1], overlaps[i], fromX, fromY);
+                touching = true;
+            }
+        }
+        return touching;
+    }
+
+    // Keep the body outside the box: nearest point of the box to the center
+    double cx = world.x < box.left ? box.left : (world.x > box.right ? box.right : world.x);
+    double cy = world.y < box.bottom ? box.bottom : (world.y > box.top ? box.top : world.y);
+    double d = hypot(world.x - cx, world.y - cy);
+    if (d >= BODY_RADIUS || d == 0) {
+        return false;
+    }
+    double nx = (world.x - cx) / d;
+    double ny = (world.y - cy) / d;
+    double depth = BODY_RADIUS - d;
+    world.x += nx * depth;
+    world.y += ny * depth;
+    slide(nx, ny, depth, fromX, fromY);
+    return true;
+}
+
+/*
+ * Given a feature (@param feature), marks it scored now.
+ */
+static void score(int feature) {
+    if (world.scored[feature]) {
+        return;
+    }
+    world.scored[feature] = true;
+    world.scoreTime[feature] = world.lightTime == 0 ? 0 : (world.now - world.lightTime) / 1e6;
+    event("scored %s (%.0f)", simFeatureNames[feature], world.scoreTime[feature]);
+}
+
+/*
+ * Given a feature (@param feature), whether its condition holds (@param held) and how long it has to hold (@param ms),
+ * scores it once the condition has held that long.
+ */
+static void scoreHeld(int feature, bool held, unsigned int ms) {
+    if (!held) {
+        world.holdStart[feature] = 0;
+        return;
+    }
+    if (world.holdStart[feature] == 0) {
+        world.holdStart[feature] = world.now;
+    }
+    if (world.now - world.holdStart[feature] >= ms * 1000ULL) {
+        score(feature);
+    }
+}
+
+/*
+ * Scores the tasks from where the robot and its actuators are.
+ */
+static void updateScoring() {
+    if (world.lightTime == 0) {
+        return;
+    }
+    double center[2] = { world.x, world.y };
+    double arm[2];
+    double chute[2];
+    robotPoint(ARM_FORWARD, arm);
+    robotPoint(TOKEN_FORWARD, chute);
+    float lever = world.servo[LEVER_SERVO];
+
+    // DDR: hold the button of the light's colour, never the other one
+    const double *right = world.variation.red ? redButton : blueButton;
+    const double *wrong = world.variation.red ? blueButton : redButton;
+    scoreHeld(SIM_DDR, !world.wrongButton && distance(center, right) < BODY_RADIUS + PRESS_MARGIN, BUTTON_HOLD);
+    if (distance(center, wrong) < BODY_RADIUS + PRESS_MARGIN) {
+        if (world.wrongStart == 0) {
+            world.wrongStart = world.now;
+        } else if (!world.wrongButton && world.now - world.wrongStart >= WRONG_BUTTON_HOLD * 1000ULL) {
+            world.wrongButton = true;
+            event("pressed the wrong DDR button%s", "", 0);
+        }
+    } else {
+        world.wrongStart = 0;
+    }
+
+    scoreHeld(SIM_RPS_BUTTON, lever <= ARM_DOWN && distance(arm, rpsButton) < ARM_REACH, BUTTON_HOLD);
+
+    // Foosball: while the gripping arm is in the row of counters, they slide along with it toward -x
+    bool gripping = lever >= ARM_GRIP && arm[0] >= foosballRow.left && arm[0] <= foosballRow.right
+            && arm[1] >= foosballRow.bottom && arm[1] <= foosballRow.top;
+    if (gripping && world.gripping && arm[0] < world.armX) {
+        world.foosball += world.armX - arm[0];
+    }
+    world.gripping = gripping;
+    world.armX = arm[0];
+    if (world.foosball >= FOOSBALL_SLIDE) {
+        score(SIM_FOOSBALL);
+    }
+
+    scoreHeld(SIM_LEVER, lever <= ARM_DOWN && distance(arm, leverPoint) < ARM_REACH, 200);
+    scoreHeld(SIM_TOKEN, world.servo[TOKEN_SERVO] >= TOKEN_DROP && distance(chute, tokenSlot) < TOKEN_REACH, 300);
+    if (distance(center, finalButton) < BODY_RADIUS + PRESS_MARGIN) {
+        score(SIM_FINAL_BUTTON);
+    }
+}
+
+/*
+ * Operator: presses the screen when the program asks for it and moves the robot between the calibration places.
+ * Press 1 leaves the CdS screen, presses 2 to 5 store POS1 to POS4 (the robot is moved to the next place after each),
+ * press 6 starts the run and the start light comes on lightDelay later. After that the operator keeps tapping
+ * through the report screens.
+ */
+static void updateOperator() {
+    uint64_t pressEnd = world.pressStart + TOUCH_HOLD * 1000ULL;
+    if (world.now >= pressEnd) {
+        world.touches++;
+        if (world.touches <= 5) {
+            world.placing = true;
+            world.placeTime = pressEnd + TOUCH_PLACE * 1000ULL;
+            world.placeIndex = world.touches - 1;
+            world.pressStart = pressEnd + TOUCH_NEXT * 1000ULL;
+        } else if (world.touches == 6) {
+            // main.cpp only reads the screen again for the reports after the run
+            world.lightTime = pressEnd + world.variation.lightDelay * 1000ULL;
+            world.pressStart = world.lightTime + TOUCH_REPORT * 1000ULL;
+        } else {
+            world.pressStart = pressEnd + TOUCH_REPORT * 1000ULL;
+        }
+    }
+
+    if (world.placing && world.now >= world.placeTime) {
+        world.placing = false;
+        if (world.placeIndex < 4) {
+            placeRobot(calibrationPlaces[world.placeIndex], world.variation.placement, world.variation.placementHeading);
+        } else {
+            Place start = startPlace;
+            start.x += QR_FORWARD * cos(start.heading * PI / 180);
+            start.y += QR_FORWARD * sin(start.heading * PI / 180);
+            placeRobot(start, world.variation.placement, world.variation.placementHeading);
+        }
+    }
+}
+
+/*
+ * RPS: captures a noisy pose of the QR code every RPS_PERIOD (with jitter) and publishes it RPS_LATENCY later.
+ */
+static void updateRps() {
+    if (world.pending && world.now >= world.publishTime) {
+        world.pending = false;
+        memcpy(world.rps, world.pendingPose, sizeof(world.rps));
+    }
+    if (world.now < world.nextCapture) {
+        return;
+    }
+    const SimVariation &v = world.variation;
+    world.nextCapture += RPS_PERIOD + (int64_t)((simUniform(&world.random) * 2 - 1) * RPS_JITTER);
+
+    double qr[2];
+    robotPoint(QR_FORWARD, qr);
+    float *pose = world.pendingPose;
+    if (simUniform(&world.random) < v.rpsLoss) {
+        pose[0] = pose[1] = pose[2] = -1;
+    } else {
+        pose[0] = qr[0] + v.rpsNoise * simGaussian(&world.random);
+        pose[1] = qr[1] + v.rpsNoise * simGaussian(&world.random);
+        pose[2] = wrapDegrees(world.heading * 180 / PI + v.rpsHeadingNoise * simGaussian(&world.random));
+        if (simUniform(&world.random) < v.rpsGlitch) {
+            pose[simUniform(&world.random) < 0.5 ? 0 : 1] += (simUniform(&world.random) < 0.5 ? -1 : 1)
+                    * (3 + 3 * simUniform(&world.random));
+        }
+        // RPS never reports a negative position for a robot on the course
+        if (pose[0] < 0) {
+            pose[0] = 0;
+        }
+        if (pose[1] < 0) {
+            pose[1] = 0;
+        }
+    }
+    world.pending = true;
+    world.publishTime = world.now + RPS_LATENCY;
+}
+
+/*
+ * Given a point (@param x, @param y), returns the ramp speed factor for a robot moving in direction (@param dy) along y.
+ */
+static double rampFactor(double x, double y, double dy) {
+    for (int i = 0; i < 2; i++) {
+        const Box &ramp = ramps[i];
+        if (x >= ramp.left && x <= ramp.right && y >= ramp.bottom && y <= ramp.top) {
+            return dy > 0 ? 1 - RAMP_CLIMB * dy : 1 - RAMP_DESCENT * dy;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Steps the pack, the drive, the sensors and the servos by SIM_STEP.
+ */
+static void step() {
+    const SimVariation &v = world.variation;
+    double dt = SIM_STEP / 1e6;
+
+    // Pack sags with the load and slowly drains
+    double command[2] = { 0, 0 };
+    for (int i = 0; i < 4; i++) {
+        command[motorSide[i]] += motorSign[i] * world.motor[i] / 2;
+    }
+    double load = (fabs(command[LEFT]) + fabs(command[RIGHT])) / 200;
+    world.voc -= BATTERY_DRAIN * load * dt;
+    world.volts = world.voc - BATTERY_SAG * load;
+
+    // Each side follows its command through the motor lag, slowed by friction and ramps
+    double travel = (world.speed[LEFT] + world.speed[RIGHT]) / 2;
+    double dy = travel >= 0 ? sin(world.heading) : -sin(world.heading);
+    double ramp = rampFactor(world.x, world.y, dy);
+    double gains[2] = { v.leftGain, v.rightGain };
+    for (int side = 0; side < 2; side++) {
+        double fraction = command[side] / 100 * world.volts / BATTERY_NOMINAL;
+        double magnitude = fabs(fraction) > DEADBAND ? (fabs(fraction) - DEADBAND) / (1 - DEADBAND) : 0;
+        double target = (fraction < 0 ? -1 : 1) * magnitude * FULL_SPEED * gains[side] * ramp;
+        world.speed[side] += (target - world.speed[side]) * dt / MOTOR_LAG;
+        if (world.wheelsHeld) {
+            // The motors strain, but nothing turns
+            world.speed[side] = 0;
+        }
+    }
+
+    // Skid steer: the robot turns about the wider effective radius
+    double fromX = world.x;
+    double fromY = world.y;
+    double fromHeading = world.heading;
+    double forward = (world.speed[LEFT] + world.speed[RIGHT]) / 2 * dt;
+    double turn = (world.speed[RIGHT] - world.speed[LEFT]) / (2 * v.turnRadius) * dt;
+    double angle = world.heading + turn / 2;
+    world.x += forward * cos(angle);
+    world.y += forward * sin(angle);
+    world.heading = wrapRadians(fromHeading + turn);
+
+    bool contact = collide(course, true, fromX, fromY);
+    contact = collide(ddrMachine, false, fromX, fromY) || contact;
+    if (contact != world.contact) {
+        event("%s wall contact", contact ? "start of" : "end of", 0);
+    }
+    world.contact = contact;
+
+    // Against a wall the wheels turn only as far as the robot moves, plus some spinning in place. A robot that
+    // drives or pivots into the wall cannot turn either: its square front digs in. Turning in place still works
+    double moved = (world.x - fromX) * cos(angle) + (world.y - fromY) * sin(angle);
+    double blocked = 1;
+    double spin = (world.speed[RIGHT] - world.speed[LEFT]) / 2;
+    if (contact) {
+        world.contactTime += dt;
+        blocked = fabs(forward) > 1e-9 ? moved / forward : 1;
+        if (blocked < 0) {
+            blocked = 0;
+        } else if (blocked > 1) {
+            blocked = 1;
+        }
+        bool pivoting = fabs(forward) > PIVOT_FRACTION * fabs(turn) * v.turnRadius;
+        if (pivoting) {
+            world.heading = wrapRadians(fromHeading + turn * blocked);
+        }
+        blocked += (1 - blocked) * BLOCKED_SLIP;
+        if (pivoting) {
+            spin *= blocked;
+        }
+    }
+
+    // Encoders count the wheel turning, whichever way, slip included
+    double inchesPerCount = 2 * PI * v.wheelRadius / COUNTS_PER_REV;
+    double drive = (world.speed[LEFT] + world.speed[RIGHT]) / 2 * blocked;
+    double sides[2] = { drive - spin, drive + spin };
+    for (int side = 0; side < 2; side++) {
+        double wheel = fabs(sides[side]) * dt * (1 + fabs(v.slip * simGaussian(&world.random)));
+        world.wheel[side] += wheel / inchesPerCount;
+    }
+
+    // CdS cell over the lights
+    double cell[2];
+    robotPoint(CDS_FORWARD, cell);
+    double level = v.ambient;
+    if (world.lightTime != 0 && world.now >= world.lightTime) {
+        level -= v.redDrop * lightExposure(cell, startLight);
+        level -= (v.red ? v.redDrop : v.blueDrop) * lightExposure(cell, ddrLight);
+    }
+    if (world.now >= world.shadowStart && world.now < world.shadowEnd) {
+        level -= world.shadowDrop;
+    }
+    world.cds += (level - world.cds) * dt / v.cdsLag;
+
+    for (int i = 0; i < SERVOS; i++) {
+        double change = world.servoTarget[i] - world.servo[i];
+        double most = SERVO_RATE * dt;
+        world.servo[i] += change > most ? most : (change < -most ? -most : change);
+    }
+
+    updateRps();
+    if (!world.bench) {
+        updateOperator();
+    }
+    updateScoring();
+
+    if (simTraceOut != 0 && world.now % 20000 < SIM_STEP) {
+        fprintf(simTraceOut, "%.3f %.3f %.3f %.2f %.2f %.2f %.0f %.0f %d\n", world.now / 1e6, world.x, world.y,
+                world.heading * 180 / PI, world.speed[LEFT], world.speed[RIGHT], world.servo[LEVER_SERVO],
+                world.servo[TOKEN_SERVO], world.contact ? 1 : 0);
+    }
+}
+
+/*
+ * Thrown out of the program when the run reaches SIM_RUN_LIMIT.
+ */
+struct SimStop {
+};
+
+void simSpend(unsigned int microseconds) {
+    world.now += microseconds;
+    while (world.stepTime <= world.now) {
+        world.stepTime += SIM_STEP;
+        step();
+    }
+    if (world.now >= SIM_RUN_LIMIT && !world.stopping && !world.unlimited) {
+        // Destructors run while unwinding read the clock again, so only stop once
+        world.stopping = true;
+        throw SimStop();
+    }
+}
+
+void simSetMotor(int port, float percent) {
+    simSpend(SIM_COST_MOTOR);
+    if (port >= 0 && port < 4) {
+        world.motor[port] = percent > 100 ? 100 : (percent < -100 ? -100 : percent);
+    }
+}
+
+int simEncoderCounts(int pin) {
+    simSpend(SIM_COST_ENCODER);
+    if (pin == LEFT_ENCODER_PIN) {
+        return (int)world.wheel[LEFT];
+    } else if (pin == RIGHT_ENCODER_PIN) {
+        return (int)world.wheel[RIGHT];
+    }
+    return 0;
+}
+
+void simResetEncoder(int pin) {
+    simSpend(SIM_COST_ENCODER);
+    // The encoder keeps its phase between counts
+    if (pin == LEFT_ENCODER_PIN) {
+        world.wheel[LEFT] -= floor(world.wheel[LEFT]);
+    } else if (pin == RIGHT_ENCODER_PIN) {
+        world.wheel[RIGHT] -= floor(world.wheel[RIGHT]);
+    }
+}
+
+float simAnalog(int pin) {
+    simSpend(SIM_COST_ADC);
+    if (pin != CDS_PIN) {
+        return 0;
+    }
+    double value = world.cds + world.variation.cdsNoise * simGaussian(&world.random);
+    return value < 0 ? 0 : (value > 3.3 ? 3.3 : value);
+}
+
+void simSetServo(int port, float degree) {
+    simSpend(SIM_COST_SERVO);
+    if (port >= 0 && port < SERVOS) {
+        world.servoTarget[port] = degree < 0 ? 0 : (degree > 180 ? 180 : degree);
+    }
+}
+
+float simRpsX() {
+    simSpend(SIM_COST_RPS);
+    return world.rps[0];
+}
+
+float simRpsY() {
+    simSpend(SIM_COST_RPS);
+    return world.rps[1];
+}
+
+float simRpsHeading() {
+    simSpend(SIM_COST_RPS);
+    return world.rps[2];
+}
+
+float simBattery() {
+    simSpend(SIM_COST_BATTERY);
+    return world.volts + 0.02 * simGaussian(&world.random);
+}
+
+bool simTouch(float *x, float *y) {
+    simSpend(SIM_COST_TOUCH);
+    bool pressed = world.now >= world.pressStart && world.now < world.pressStart + TOUCH_HOLD * 1000ULL;
+    if (pressed) {
+        // Middle of the calibration button
+        *x = 155;
+        *y = 120;
+    }
+    return pressed;
+}
+
+void simLcdText(const char *text, bool newline) {
+    simSpend(SIM_COST_LCD_CALL + SIM_COST_LCD_CHAR * strlen(text));
+    if (simLcdOut != 0) {
+        fprintf(simLcdOut, newline ? "%s\n" : "%s", text);
+    }
+}
+
+void simLcdClear() {
+    simSpend(SIM_COST_LCD_CLEAR);
+    if (simLcdOut != 0) {
+        fprintf(simLcdOut, "\n--- %.3f\n", world.now / 1e6);
+    }
+}
+
+/*
+ * Given the run's result to fill in (@param result), takes the simulator's side of it.
+ */
+void simFinish(SimResult *result) {
+    result->red = world.variation.red;
+    result->stopped = world.stopping;
+    for (int i = 0; i < SIM_FEATURES; i++) {
+        result->scored[i] = world.scored[i];
+        result->scoreTime[i] = world.scored[i] ? world.scoreTime[i] : -1;
+    }
+    result->courseTime = world.scored[SIM_FINAL_BUTTON] ? world.scoreTime[SIM_FINAL_BUTTON] : -1;
+    double qr[2];
+    robotPoint(QR_FORWARD, qr);
+    result->x = qr[0];
+    result->y = qr[1];
+    result->heading = wrapDegrees(world.heading * 180 / PI);
+    result->contactTime = world.contactTime;
+    result->clockReads = world.clockReads;
+}
+
+void simCountClockRead() {
+    world.clockReads++;
+}
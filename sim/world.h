@@ -0,0 +1,209 @@
+#ifndef SIM_WORLD_H
+#define SIM_WORLD_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Host course simulator. main.cpp is built unchanged against the stub FEH headers in sim/feh, whose calls land here.
+ * Time is a virtual clock in microseconds: every clock read and hardware access advances it by what that access costs
+ * on the Proteus (SIM_COST_*), and the robot and course are stepped every SIM_STEP of virtual time as the clock passes.
+ * The robot's own computation is free, so only time spent waiting, polling and talking to hardware shows up.
+ *
+ * The robot is a skid-steer differential drive: each side follows its motor command through a first-order lag, the
+ * robot turns about a wider effective radius than the wheel track (the scrub the turn model learns), and each side's
+ * encoder counts the wheel turning, slip included. The RPS sends noisy, delayed packets at its own rate, the CdS cell
+ * sees the start and DDR lights, and the pack sags under load. An operator does the touches and the calibration
+ * placements. The course is approximate: only the outer walls and the DDR machine block the robot, and each task is a
+ * spot the right actuator has to reach, placed where the tuned program does that task in the nominal run (simNominal).
+ */
+
+// Simulation step and the longest run (in virtual microseconds from power on) before it is stopped.
+#define SIM_STEP 1000
+#define SIM_RUN_LIMIT 400000000ULL
+// Course time limit in seconds; a run over it counts as failed.
+#define SIM_COURSE_LIMIT 120.0
+
+// Virtual time (in microseconds) each kind of access costs.
+#define SIM_COST_CLOCK 5
+#define SIM_COST_ENCODER 2
+#define SIM_COST_ADC 15
+#define SIM_COST_RPS 2
+#define SIM_COST_MOTOR 5
+#define SIM_COST_SERVO 5
+#define SIM_COST_BATTERY 15
+#define SIM_COST_LCD_CALL 100
+#define SIM_COST_LCD_CHAR 60
+#define SIM_COST_LCD_CLEAR 15000
+#define SIM_COST_LCD_SHAPE 2000
+#define SIM_COST_TOUCH 200
+#define SIM_COST_SD_OPEN 15000
+#define SIM_COST_SD_CLOSE 20000
+#define SIM_COST_SD_CALL 200
+#define SIM_COST_SD_CHAR 5
+
+// Tasks of main.cpp, in the order main() runs them.
+#define SIM_TASKS 5
+
+// Things on the course the run is scored on.
+enum SimFeature {
+    SIM_DDR,
+    SIM_RPS_BUTTON,
+    SIM_FOOSBALL,
+    SIM_LEVER,
+    SIM_TOKEN,
+    SIM_FINAL_BUTTON,
+    SIM_FEATURES
+};
+
+extern const char *simTaskNames[SIM_TASKS];
+extern const char *simFeatureNames[SIM_FEATURES];
+
+/*
+ * How one simulated robot, pack, course setup and operator differ from the nominal ones.
+ */
+struct SimVariation {
+    float battery;          // Pack voltage at rest when the run starts
+    float leftGain;         // Speed of each drive side relative to the model
+    float rightGain;
+    float wheelRadius;      // True wheel radius (inches)
+    float turnRadius;       // Effective turning radius of the skid steer (inches)
+    float slip;             // Standard deviation of the extra wheel turning per step, as a fraction of the step
+    float rpsNoise;         // Standard deviation of RPS positions (inches) and headings (degrees)
+    float rpsHeadingNoise;
+    float rpsGlitch;        // Chance of a packet being several inches off, and of a lost packet
+    float rpsLoss;
+    float placement;        // Standard deviation of each operator placement (inches) and its heading (degrees)
+    float placementHeading;
+    float ambient;          // CdS volts with no light, and the drop under the red and blue lights
+    float redDrop;
+    float blueDrop;
+    float cdsNoise;
+    float cdsLag;           // CdS cell time constant (s)
+    bool red;               // Colour of the DDR light
+    unsigned int lightDelay;// Time (in ms) from the last touch to the start light
+};
+
+/*
+ * Simple random number stream (splitmix64), so a seed gives the same run on every host.
+ */
+struct SimRandom {
+    uint64_t state;
+};
+
+void simSeed(SimRandom *random, uint64_t seed);
+uint64_t simNext(SimRandom *random);
+double simUniform(SimRandom *random);
+double simGaussian(SimRandom *random);
+
+/*
+ * Outcome of a run. Task times and the mission time are main.cpp's own measurements; everything else is the simulator's.
+ */
+struct SimResult {
+    bool finished;                  // main() returned
+    bool stopped;                   // stopped at SIM_RUN_LIMIT instead
+    bool red;
+    float courseTime;               // Seconds from the start light to the final button, -1 if never pressed
+    unsigned int missionTime;       // ms, main.cpp's total from the start light
+    unsigned int taskTimes[SIM_TASKS];
+    int tasksRun;                   // Tasks main.cpp started
+    bool scored[SIM_FEATURES];
+    float scoreTime[SIM_FEATURES];  // Seconds from the start light
+    float x;                        // Final position of the QR code and heading, in the RPS frame
+    float y;
+    float heading;
+    float contactTime;              // Seconds the robot spent pushing against a wall
+    unsigned long clockReads;
+};
+
+// @Returns [the run scored every feature within SIM_COURSE_LIMIT]
+bool simSucceeded(const SimResult &result);
+
+void simNominal(SimVariation *variation);
+void simRandomize(SimVariation *variation, uint64_t seed);
+
+// Starts a new run: resets the clock, the robot, the course and the operator.
+void simStart(const SimVariation &variation, uint64_t seed);
+// Fills in the simulator's side of a result: what was scored and where the robot ended up.
+void simFinish(SimResult *result);
+// Runs main.cpp's main() once on a fresh simStart and fills in the result. Only one run per process:
+// main.cpp's globals are not reset between runs.
+void simRun(const SimVariation &variation, uint64_t seed, SimResult *result);
+
+/*
+ * A batch of randomized runs (simRandomize), spread over worker processes. Every run gets its own seed, drawn from the
+ * batch seed, so a batch seed gives the same runs whatever the number of workers. Workers take the next run from a
+ * shared counter as they finish one, and each run is a child process of its worker, since main.cpp's globals are not
+ * reset between runs. A run that crashes comes back as not finished and not scored.
+ */
+struct SimBatch {
+    int runs;
+    int jobs;               // Worker processes, 0 for one per online core
+    uint64_t seed;
+    const char *params;     // Contents for params.txt on every run's SD card, 0 for main.cpp's defaults
+};
+
+// @Returns [the seed of a run (@param run) of a batch with a seed (@param seed)]
+uint64_t simRunSeed(uint64_t seed, int run);
+// Runs a batch and fills in a result for each run (@param results, batch.runs of them).
+void simBatch(const SimBatch &batch, SimResult *results);
+// Given values (@param values, sorted ascending, @param count of them) and a fraction, returns the nearest-rank
+// percentile (0 if there are none).
+float simPercentile(const float *values, int count, float fraction);
+
+// Scenario checks call main.cpp's functions directly instead of running main(). simBench starts such a run: like
+// simStart, but nobody touches the screen or moves the robot, and the start light stays off until simLightAt.
+void simBench(const SimVariation &variation, uint64_t seed);
+// Puts the robot down at rest: its center and heading, or where the operator puts it at the start.
+void simPlace(float x, float y, float heading);
+void simPlaceStart();
+// Gives where the QR code truly is and the true heading (in degrees), in the RPS frame.
+void simPose(float *x, float *y, float *heading);
+// Swaps in a pack with a resting voltage (in volts).
+void simSetBattery(float volts);
+// Holds the wheels still, as against a wall they cannot climb, or lets them go again.
+void simHoldWheels(bool held);
+// Sets both encoder counts, as a log replay does on a robot with its wheels held.
+void simSetEncoders(int left, int right);
+// Lets a bench run go on past SIM_RUN_LIMIT, for a log replay longer than any run.
+void simLiftRunLimit();
+// Turns the start light on at a virtual time (in microseconds).
+void simLightAt(uint64_t micros);
+// Shades the CdS cell by a drop (in volts) from a virtual time (in microseconds) for a while (in ms).
+void simShadow(uint64_t micros, unsigned int ms, float drop);
+
+// Streams for LCD text, course events and a 20 ms trace (each 0 for none). A trace line is the time (s), the true
+// center and heading, the left and right side speeds (in/s), the lever and token servo angles and wall contact.
+extern FILE *simLcdOut;
+extern FILE *simEventOut;
+extern FILE *simTraceOut;
+
+// Virtual clock.
+void simSpend(unsigned int microseconds);
+uint64_t simMicros();
+void simCountClockRead();
+// Time (in microseconds) the start light came on, 0 before that.
+uint64_t simLightTime();
+
+// Hardware, called by the stub FEH libraries.
+void simSetMotor(int port, float percent);
+int simEncoderCounts(int pin);
+void simResetEncoder(int pin);
+float simAnalog(int pin);
+void simSetServo(int port, float degree);
+float simRpsX();
+float simRpsY();
+float simRpsHeading();
+float simBattery();
+bool simTouch(float *x, float *y);
+void simLcdText(const char *text, bool newline);
+void simLcdClear();
+
+// SD card: files in memory for the run, loaded from and saved to a host directory.
+bool simSdLoad(const char *directory);
+bool simSdSave(const char *directory);
+// Given a file name, returns its contents (0 if there is no such file).
+const char *simSdFile(const char *name);
+void simSdWrite(const char *name, const char *contents);
+
+#endif // SIM_WORLD_H